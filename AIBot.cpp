@@ -7,6 +7,9 @@ Copyright Nicholas Chapman 2023 -
 
 #include "Weather.h"
 #include "VolumeControl.h"
+#include "AudioRingBuffer.h"
+#include "StreamingTranscriber.h"
+#include "WhisperTests.h"
 #include <whisper.cpp/whisper.h>
 #include <maths/mathstypes.h>
 #include <webserver/Escaping.h>
@@ -22,6 +25,7 @@ Copyright Nicholas Chapman 2023 -
 #include <utils/Timer.h>
 #include <utils/Parser.h>
 #include <utils/ComObHandle.h>
+#include <utils/MemMappedFile.h>
 #include <SDL.h> // Simple DirectMedia Layer header
 #include <sapi.h> // Microsoft Speech API header
 #include <sphelper.h> // NOTE: You will need ATL installed for this header file. ("C++ ATL for latest xx build tools" in Visual Studio Installer).  TODO: remove use of this.
@@ -40,19 +44,20 @@ static void audioCallback(
 	int len
 )
 {
-	std::vector<float>* audio_data_ptr = (std::vector<float>*)userdata;
+	// NOTE: This is called on the SDL audio thread, so must not allocate or block.
+	AudioRingBuffer* audio_buffer = (AudioRingBuffer*)userdata;
 
-	std::vector<float>& audio_data = *audio_data_ptr;
+	const size_t num_samples = len / sizeof(float);
+	audio_buffer->write((const float*)stream, num_samples);
+}
 
-	const int num_samples = len / sizeof(float);
-	const size_t write_i = audio_data.size();
-	audio_data.resize(audio_data.size() + num_samples);
 
-	const float* data = (const float*)stream;
-	for(size_t i=0; i<num_samples; ++i)
-	{
-		audio_data[write_i + i] = data[i];
-	}
+// Called by Whisper for each new segment of text, including partial hypotheses while still recording.
+static void whisperNewSegmentCallback(struct whisper_context* /*ctx*/, struct whisper_state* state, int n_new, void* /*user_data*/)
+{
+	const int n_segments = whisper_full_n_segments_from_state(state);
+	for(int i = n_segments - n_new; i < n_segments; ++i)
+		conPrint("[whisper] " + std::string(whisper_full_get_segment_text_from_state(state, i)));
 }
 
 
@@ -131,12 +136,28 @@ struct ChatMessage
 };
 
 
+// Frees the VAD state when it goes out of scope, so it is released however main() exits.
+struct VADStateHolder
+{
+	VADStateHolder(struct whisper_vad_state* state_) : state(state_) {}
+	~VADStateHolder() { if(state) whisper_vad_free(state); }
+
+	struct whisper_vad_state* state;
+private:
+	VADStateHolder(const VADStateHolder&);
+	VADStateHolder& operator = (const VADStateHolder&);
+};
+
+
 struct VoiceCommandContext
 {
 	SDL_AudioDeviceID audio_dev_id;
 	const SDL_AudioSpec* obtained_spec;
-	std::vector<float>* audio_data;
+	AudioRingBuffer* audio_buffer; // Filled by the audio callback.
+	std::vector<float>* audio_data; // Recorded samples, drained from audio_buffer on the main thread.
+	struct whisper_vad_state* vad_state; // For detecting when the user has stopped speaking.
 	struct whisper_context* whisper_ctx;
+	StreamingTranscriber* transcriber; // Transcribes audio while it is being recorded.
 	std::string openai_api_key;
 	ISpVoice* voice;
 	std::string current_weather;
@@ -150,52 +171,58 @@ struct VoiceCommandContext
 void doVoiceCommand(VoiceCommandContext& context)
 {
 #if 1
-	// Record a few seconds of audio
-	// TODO: Record until user stops speaking.
+	// Record until the user stops speaking (or the maximum recording length is reached).
 	context.audio_data->clear();
+	context.audio_buffer->clear();
+	context.audio_buffer->resetNumDroppedSamples();
+	whisper_vad_reset(context.vad_state);
+	context.transcriber->reset();
 	SDL_PauseAudioDevice(context.audio_dev_id, /*pause_on=*/SDL_FALSE); // Start recording
 
 	conPrint("-----------------------Recording, please speak a question... -----------------------");
 
-	const double desired_num_secs = 4;
-	while(context.audio_data->size() < context.obtained_spec->freq * desired_num_secs)
+	size_t num_vad_processed = 0;
+	while(1)
 	{
+		context.audio_buffer->readAppend(*context.audio_data);
+
+		// Run voice activity detection on the newly recorded samples.
+		const int vad_event = whisper_vad_process(context.vad_state, context.audio_data->data() + num_vad_processed, (int)(context.audio_data->size() - num_vad_processed));
+		num_vad_processed = context.audio_data->size();
+
+		if(vad_event == WHISPER_VAD_END_OF_SPEECH || vad_event == WHISPER_VAD_MAX_LENGTH)
+			break;
+
+		// Hand the new audio to the transcriber.  It transcribes on its own thread once the user has started speaking, so this doesn't wait for Whisper.
+		context.transcriber->update(context.audio_data->data(), context.audio_data->size(), whisper_vad_speech_end(context.vad_state));
+
 		PlatformUtils::Sleep(1);
 	}
 
 	SDL_PauseAudioDevice(context.audio_dev_id, /*pause_on=*/SDL_TRUE); // Pause recording
-	conPrint("-----------------------Recording stopped.-----------------------");
+	conPrint("-----------------------Recording stopped (" + doubleToStringNDecimalPlaces((double)context.audio_data->size() / context.obtained_spec->freq, 2) + " s).-----------------------");
 
-	conPrint("Processing speech (doing Whisper inference)...");
+	if(context.audio_buffer->getNumDroppedSamples() > 0)
+		conPrint("Warning: " + toString((uint64)context.audio_buffer->getNumDroppedSamples()) + " audio samples were dropped.");
 
-	struct whisper_full_params whisper_params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-	whisper_params.n_threads = 8; // myMax(1u, PlatformUtils::getNumLogicalProcessors()); // NOTE: Whisper multithreading has serious problems, use an artifically low number of threads.  See https://github.com/ggerganov/whisper.cpp/issues/200#issuecomment-1484025515
-	whisper_params.print_special = false;
-	whisper_params.suppress_blank = true;
-	//whisper_params.duration_ms = 1000;
-	//whisper_params.speed_up = true;
+	conPrint("Processing speech (doing Whisper inference)...");
 
 	Timer timer;
 
-	if(whisper_full(context.whisper_ctx, whisper_params, context.audio_data->data(), (int)context.audio_data->size()) != 0) {
-	//if(whisper_full_parallel(context.whisper_ctx, whisper_params, context.audio_data->data(), (int)context.audio_data->size(), whisper_params.n_threads) != 0) {  // This is buggy, doesn't seem to recoginise any words at all.
-		throw glare::Exception("failed to process audio");
-	}
+	// The transcriber has usually committed the speech during the VAD hangover already, otherwise this finishes the last window.
+	const int64_t speech_end = whisper_vad_speech_end(context.vad_state);
+	const std::string combined_text = context.transcriber->finalise(context.audio_data->data(), context.audio_data->size(), speech_end);
 
-	conPrint("Whisper inference took " + timer.elapsedString());
-
-	std::string combined_text = "";
-
-	const int n_segments = whisper_full_n_segments(context.whisper_ctx);
-	for (int i = 0; i < n_segments; ++i)
+	// Time to final text, from the end of the speech: the audio recorded after it until the endpoint was detected, plus the time finalise() took.
+	const double finalise_time = timer.elapsed();
+	if(speech_end >= 0)
 	{
-		std::string segment_text = whisper_full_get_segment_text(context.whisper_ctx, i);
-		conPrint(segment_text);
-
-		combined_text += segment_text;
-		if(i + 1 < n_segments)
-			combined_text += " ";
+		const double endpoint_time = (double)((int64_t)context.audio_data->size() - speech_end) / context.obtained_spec->freq;
+		conPrint("Time to final text: " + doubleToStringNDecimalPlaces((endpoint_time + finalise_time) * 1000, 0) + " ms (endpointing " +
+			doubleToStringNDecimalPlaces(endpoint_time * 1000, 0) + " ms, finalising " + doubleToStringNDecimalPlaces(finalise_time * 1000, 0) + " ms" +
+			(context.transcriber->finaliseRanPass() ? ", ran a Whisper pass)" : ")"));
 	}
+	conPrint(combined_text);
 #else
 	//std::string combined_text = "What is one plus two?";
 	std::string combined_text = "Set the volume to 0.1";
@@ -315,11 +342,28 @@ void doVoiceCommand(VoiceCommandContext& context)
 }
 
 
-int main(int /*argc*/, char** /*argv*/)
+int main(int argc, char** argv)
 {
 	Clock::init();
 	Networking::init();
 
+#if BUILD_TESTS
+	if(argc >= 2 && std::string(argv[1]) == "--test")
+	{
+		try
+		{
+			WhisperTests::test(PlatformUtils::getCurrentWorkingDirPath() + "/ggml-base.en.bin");
+			conPrint("All tests passed.");
+		}
+		catch(glare::Exception& e)
+		{
+			conPrint(e.what());
+			return 1;
+		}
+		return 0;
+	}
+#endif
+
 	try
 	{
 		const std::string current_weather = getCurrentWeather();
@@ -333,8 +377,12 @@ int main(int /*argc*/, char** /*argv*/)
 
 
 		//----------------------------- Initialise whisper ------------------------------------
+		// The model file is memory mapped instead of read, so the weights are paged in from the file cache and shared between aibot processes.
+		// This needs a model with aligned tensor data (run 'whisper_quantize model.bin model-aligned.bin align' once), otherwise the weights are copied.
+		// The mapping has to outlive whisper_ctx.
 		const std::string whisper_params_path = PlatformUtils::getCurrentWorkingDirPath() + "/ggml-base.en.bin";
-		struct whisper_context* whisper_ctx = whisper_init_from_file(whisper_params_path.c_str());
+		MemMappedFile whisper_params_file(whisper_params_path);
+		struct whisper_context* whisper_ctx = whisper_init_from_mapped_buffer(whisper_params_file.fileData(), whisper_params_file.fileSize());
 		if(whisper_ctx == NULL)
 			throw glare::Exception("Failed to load Whisper parameters from '" + whisper_params_path + "'.");
 
@@ -356,7 +404,12 @@ int main(int /*argc*/, char** /*argv*/)
 		conPrint("Using device " + std::string(dev_name));
 
 		
+		// Allocate all audio storage up-front, so the audio callback never allocates.
+		const size_t max_recording_secs = 30;
+		AudioRingBuffer audio_buffer(/*min_capacity=*/16000 * 8); // Needs to hold the audio recorded while a Whisper transcription pass is running.
 		std::vector<float> audio_data;
+		audio_data.reserve(16000 * max_recording_secs);
+
 		const int audio_num_samples = 256;
 
 		SDL_AudioSpec desired_spec;
@@ -365,7 +418,7 @@ int main(int /*argc*/, char** /*argv*/)
 		desired_spec.channels = 1;
 		desired_spec.samples = audio_num_samples;
 		desired_spec.callback = audioCallback;
-		desired_spec.userdata = &audio_data;
+		desired_spec.userdata = &audio_buffer;
 		SDL_AudioSpec obtained_spec;
 		SDL_AudioDeviceID audio_dev_id = SDL_OpenAudioDevice(dev_name, /*is capture=*/SDL_TRUE, &desired_spec, &obtained_spec, /*allowed changes=*/SDL_TRUE);
 		if(audio_dev_id == 0)
@@ -378,6 +431,26 @@ int main(int /*argc*/, char** /*argv*/)
 		printVar(obtained_spec.channels);
 		printVar(obtained_spec.samples);
 
+		// Voice activity detection, used to stop recording when the user stops speaking.
+		struct whisper_vad_params vad_params = whisper_vad_default_params();
+		vad_params.sample_rate = obtained_spec.freq;
+		vad_params.hangover_ms = 250; // Short enough for the ~300 ms time-to-final-text target.  The transcriber commits after 150 ms of silence, so the text is usually ready when the VAD ends the utterance.
+		vad_params.max_length_ms = 15000; // Should be less than max_recording_secs.
+		VADStateHolder vad_state(whisper_vad_init(vad_params));
+		if(vad_state.state == NULL)
+			throw glare::Exception("Failed to initialise voice activity detection.");
+
+		struct whisper_full_params whisper_params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+		whisper_params.n_threads = 0; // Let Whisper choose: about the number of physical cores (at most 8), leaving one for audio capture.  Using all logical processors used to make performance collapse, see https://github.com/ggerganov/whisper.cpp/issues/200#issuecomment-1484025515
+		whisper_params.print_special = false;
+		whisper_params.suppress_blank = true;
+		whisper_params.audio_ctx_auto = true; // Our queries are much shorter than Whisper's 30 s window, so only encode the audio we have.
+		whisper_params.new_segment_callback = whisperNewSegmentCallback;
+		//whisper_params.duration_ms = 1000;
+		//whisper_params.speed_up = true;
+
+		StreamingTranscriber transcriber(whisper_ctx, whisper_params, obtained_spec.freq);
+
 
 		//----------------------------- Initialise speech API (for text to speech) ------------------------------------
 		if(FAILED(::CoInitialize(NULL)))
@@ -440,8 +513,11 @@ int main(int /*argc*/, char** /*argv*/)
 		VoiceCommandContext context;
 		context.audio_dev_id = audio_dev_id;
 		context.obtained_spec = &obtained_spec;
+		context.audio_buffer = &audio_buffer;
 		context.audio_data = &audio_data;
+		context.vad_state = vad_state.state;
 		context.whisper_ctx = whisper_ctx;
+		context.transcriber = &transcriber;
 		context.openai_api_key = openai_api_key;
 		context.voice = voice;
 		context.current_weather = current_weather;
@@ -0,0 +1,151 @@
+/*=====================================================================
+AudioRingBuffer.h
+-----------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+#pragma once
+
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+
+/*=====================================================================
+AudioRingBuffer
+---------------
+Single-producer, single-consumer ring buffer of float audio samples.
+
+The producer is the SDL audio callback thread, the consumer is the main thread.
+All memory is allocated up-front in the constructor, so the producer never allocates,
+locks or blocks.  If the buffer is full, incoming samples are dropped and counted
+(see getNumDroppedSamples()).
+
+Capacity is rounded up to a power of two so that indices can be masked.
+The read and write indices are monotonically increasing counters, each on its own cache line
+to avoid false sharing between the two threads.
+=====================================================================*/
+class AudioRingBuffer
+{
+public:
+	AudioRingBuffer(size_t min_capacity)
+	{
+		capacity = 1;
+		while(capacity < min_capacity)
+			capacity *= 2;
+		mask = capacity - 1;
+		buffer.resize(capacity);
+
+		write_index.store(0, std::memory_order_relaxed);
+		read_index.store(0, std::memory_order_relaxed);
+		num_dropped.store(0, std::memory_order_relaxed);
+	}
+
+	size_t getCapacity() const { return capacity; }
+
+
+	//------------------------------------- Producer side -------------------------------------
+
+	// Appends as many of the given samples as will fit.  Returns the number of samples written.
+	// Never allocates or blocks, so is safe to call from the audio thread.
+	size_t write(const float* data, size_t num_samples)
+	{
+		const size_t w = write_index.load(std::memory_order_relaxed);
+		const size_t r = read_index.load(std::memory_order_acquire);
+
+		const size_t free_space = capacity - (w - r);
+		const size_t n = num_samples < free_space ? num_samples : free_space;
+
+		const size_t start = w & mask;
+		const size_t first_chunk = (capacity - start) < n ? (capacity - start) : n;
+		memcpy(buffer.data() + start, data, first_chunk * sizeof(float));
+		memcpy(buffer.data(), data + first_chunk, (n - first_chunk) * sizeof(float));
+
+		write_index.store(w + n, std::memory_order_release);
+
+		if(n < num_samples)
+			num_dropped.fetch_add(num_samples - n, std::memory_order_relaxed);
+
+		return n;
+	}
+
+
+	//------------------------------------- Consumer side -------------------------------------
+
+	// Number of samples available for reading.
+	size_t size() const
+	{
+		return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_relaxed);
+	}
+
+	bool empty() const { return size() == 0; }
+
+	// A contiguous region of samples in the buffer.
+	struct Span
+	{
+		const float* data;
+		size_t size;
+	};
+
+	// Get the currently readable samples without copying them.
+	// Because the data may wrap around the end of the buffer, it is returned as up to two spans.  span_b.size will be zero if the data doesn't wrap.
+	// The spans remain valid until consume() is called for them.
+	// Returns the total number of readable samples.
+	size_t getReadSpans(Span& span_a, Span& span_b) const
+	{
+		const size_t r = read_index.load(std::memory_order_relaxed);
+		const size_t avail = write_index.load(std::memory_order_acquire) - r;
+
+		const size_t start = r & mask;
+		const size_t first_chunk = (capacity - start) < avail ? (capacity - start) : avail;
+
+		span_a.data = buffer.data() + start;
+		span_a.size = first_chunk;
+		span_b.data = buffer.data();
+		span_b.size = avail - first_chunk;
+		return avail;
+	}
+
+	// Mark num_samples samples as read, freeing up space for the producer.
+	void consume(size_t num_samples)
+	{
+		const size_t r = read_index.load(std::memory_order_relaxed);
+		assert(num_samples <= write_index.load(std::memory_order_acquire) - r);
+		read_index.store(r + num_samples, std::memory_order_release);
+	}
+
+	// Copy all readable samples onto the end of data_out, and consume them.
+	// data_out should have sufficient capacity reserved so that this does not allocate.
+	size_t readAppend(std::vector<float>& data_out)
+	{
+		Span a, b;
+		const size_t n = getReadSpans(a, b);
+		data_out.insert(data_out.end(), a.data, a.data + a.size);
+		data_out.insert(data_out.end(), b.data, b.data + b.size);
+		consume(n);
+		return n;
+	}
+
+	// Discard all readable samples.  Should only be called from the consumer thread.
+	void clear()
+	{
+		read_index.store(write_index.load(std::memory_order_acquire), std::memory_order_release);
+	}
+
+	size_t getNumDroppedSamples() const { return num_dropped.load(std::memory_order_relaxed); }
+	void resetNumDroppedSamples() { num_dropped.store(0, std::memory_order_relaxed); }
+
+private:
+	AudioRingBuffer(const AudioRingBuffer&);
+	AudioRingBuffer& operator = (const AudioRingBuffer&);
+
+	std::vector<float> buffer;
+	size_t capacity;
+	size_t mask;
+
+	alignas(64) std::atomic<size_t> write_index; // Written by producer only.
+	alignas(64) std::atomic<size_t> read_index; // Written by consumer only.
+	alignas(64) std::atomic<size_t> num_dropped;
+};
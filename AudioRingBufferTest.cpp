@@ -0,0 +1,151 @@
+/*=====================================================================
+AudioRingBufferTest.cpp
+-----------------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+// Stress test for AudioRingBuffer.
+//
+// This is a separate program rather than part of aibot --test, because it replaces the global operator new to count
+// the allocations made on the producer thread, and that must not be linked into aibot.
+//
+// Usage: audio_ring_buffer_test              Streams ten minutes of audio, taking about 12 s.
+//        audio_ring_buffer_test --hours 2    Streams two hours of audio, taking about 2.5 minutes.
+
+
+#include "AudioRingBuffer.h"
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Counts the allocations made by threads that have set count_allocations, so the test can check that the producer never allocates.
+static thread_local bool count_allocations = false;
+static std::atomic<size_t> num_counted_allocations(0);
+
+
+void* operator new(size_t size)
+{
+	if(count_allocations)
+		num_counted_allocations.fetch_add(1, std::memory_order_relaxed);
+
+	void* p = malloc(size > 0 ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+
+#define CHECK(expr) if(!(expr)) { fprintf(stderr, "FAIL %s:%d %s\n", __FILE__, __LINE__, #expr); exit(1); }
+
+
+// Sample i of the simulated stream.  Floats represent integers exactly up to 2^24, so the pattern repeats every 17 minutes or so.
+static inline float streamSample(uint64_t i)
+{
+	return (float)(i & 0xFFFFFF);
+}
+
+
+int main(int argc, char** argv)
+{
+	double stream_hours = 10.0 / 60;
+	if(argc == 3 && strcmp(argv[1], "--hours") == 0 && atof(argv[2]) > 0)
+		stream_hours = atof(argv[2]);
+	else if(argc != 1)
+	{
+		fprintf(stderr, "Usage: %s [--hours h]\n", argv[0]);
+		return 1;
+	}
+
+	// Check that allocations are actually counted.
+	{
+		count_allocations = true;
+		const size_t num_before = num_counted_allocations.load();
+		void* volatile p = ::operator new(16); // Called directly, as new expressions may be optimised away.
+		::operator delete(p);
+		CHECK(num_counted_allocations.load() == num_before + 1);
+		count_allocations = false;
+		num_counted_allocations.store(0);
+	}
+
+	// Stream the audio through the buffer at 16 kHz in 256-sample blocks, as the SDL audio callback delivers it, at 50x real time.
+	// The buffer and consumer are set up as in AIBot.  Ten minutes of audio wrap around the buffer about 70 times.
+	const int sample_rate = 16000;
+	const size_t block_size = 256;
+	const uint64_t num_blocks = (uint64_t)(sample_rate * 3600 * stream_hours) / block_size;
+	const double speedup = 50; // The buffer then holds 160 ms of the stream, so the consumer thread may not be descheduled for longer than that.
+	const std::chrono::nanoseconds block_period((int64_t)(1.0e9 * block_size / sample_rate / speedup));
+
+	AudioRingBuffer buffer(/*min_capacity=*/sample_rate * 8);
+
+	std::vector<float> data;
+	data.reserve(buffer.getCapacity());
+	const float* const data_storage = data.data();
+
+	std::atomic<bool> producer_done(false);
+
+	std::thread producer([&]()
+	{
+		count_allocations = true;
+
+		float block[block_size];
+		const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+		for(uint64_t b=0; b<num_blocks; ++b)
+		{
+			for(size_t i=0; i<block_size; ++i)
+				block[i] = streamSample(b * block_size + i);
+
+			while(std::chrono::steady_clock::now() < start_time + block_period * (int64_t)b)
+				std::this_thread::yield();
+
+			buffer.write(block, block_size);
+		}
+
+		count_allocations = false;
+		producer_done = true;
+	});
+
+	uint64_t num_read = 0;
+	bool in_order = true;
+	while(1)
+	{
+		const bool done = producer_done; // Read before draining, so that all samples written before done was set are drained.
+
+		data.clear();
+		buffer.readAppend(data);
+
+		for(size_t i=0; i<data.size(); ++i)
+			in_order = in_order && (data[i] == streamSample(num_read + i));
+		num_read += data.size();
+
+		if(done)
+			break;
+
+		std::this_thread::yield();
+	}
+
+	producer.join();
+
+	printf("Streamed %llu samples, %llu dropped, %llu allocations on the producer thread.\n", (unsigned long long)num_read,
+		(unsigned long long)buffer.getNumDroppedSamples(), (unsigned long long)num_counted_allocations.load());
+
+	CHECK(buffer.getNumDroppedSamples() == 0);
+	CHECK(num_read == num_blocks * block_size);
+	CHECK(in_order);
+	CHECK(num_counted_allocations.load() == 0);
+	CHECK(data.data() == data_storage); // The consumer did not reallocate either.
+
+	printf("AudioRingBuffer test passed.\n");
+	return 0;
+}
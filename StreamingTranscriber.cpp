@@ -0,0 +1,276 @@
+/*=====================================================================
+StreamingTranscriber.cpp
+------------------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+#include "StreamingTranscriber.h"
+
+
+#include <utils/Exception.h>
+#include <algorithm>
+
+
+static const int trailing_pad_ms = 100; // Audio after the end of the speech that is transcribed with it, as the VAD works in whole frames.
+static const int max_window_ms = 25000; // Whisper transcribes at most 30 s at once.  A window without a segment boundary is cut here.
+
+
+StreamingTranscriber::StreamingTranscriber(struct whisper_context* whisper_ctx_, const struct whisper_full_params& params_, int sample_rate_)
+:	step_ms(1000),
+	window_ms(5000),
+	pause_ms(150),
+	whisper_ctx(whisper_ctx_),
+	params(params_),
+	sample_rate(sample_rate_)
+{
+	state = whisper_init_state(whisper_ctx);
+	if(!state)
+		throw glare::Exception("Failed to create Whisper state.");
+
+	// Let Whisper split the window into timestamped segments, so it can be committed at a segment boundary.
+	// The text context is managed by us, see runPass().
+	params.no_context = false;
+	params.single_segment = false;
+
+	audio.reserve(sample_rate * 30);
+
+	clearState(); // The worker thread hasn't been started yet, so the mutex isn't needed.
+
+	worker_thread = std::thread(&StreamingTranscriber::workerThreadFunc, this);
+}
+
+
+StreamingTranscriber::~StreamingTranscriber()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	work_cond.notify_one();
+	worker_thread.join();
+
+	whisper_free_state(state);
+}
+
+
+void StreamingTranscriber::reset()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	done_cond.wait(lock, [this]() { return !pass_running; });
+
+	clearState();
+}
+
+
+void StreamingTranscriber::clearState()
+{
+	audio.clear();
+	speech_end = -1;
+	finalising = false;
+	final_done = false;
+	final_pass_run = false;
+	pass_running = false;
+	pass_failed = false;
+	window_begin = 0;
+	last_pass_end = 0;
+	partial_valid = false;
+	committed_context.clear();
+	partial_context.clear();
+	committed_text.clear();
+	partial_text.clear();
+}
+
+
+void StreamingTranscriber::appendAudio(const float* samples, size_t num_samples, int64_t speech_end_)
+{
+	if(num_samples > audio.size())
+		audio.insert(audio.end(), samples + audio.size(), samples + num_samples);
+	speech_end = speech_end_;
+}
+
+
+void StreamingTranscriber::update(const float* samples, size_t num_samples, int64_t speech_end_)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		appendAudio(samples, num_samples, speech_end_);
+	}
+	work_cond.notify_one();
+}
+
+
+std::string StreamingTranscriber::finalise(const float* samples, size_t num_samples, int64_t speech_end_)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	appendAudio(samples, num_samples, speech_end_);
+	finalising = true;
+	work_cond.notify_one();
+
+	done_cond.wait(lock, [this]() { return final_done || pass_failed; });
+	if(pass_failed)
+		throw glare::Exception("failed to process audio");
+
+	return committed_text;
+}
+
+
+bool StreamingTranscriber::hasWork() const
+{
+	if(quit)
+		return true;
+	if(pass_failed)
+		return false;
+	if(finalising)
+		return !final_done;
+
+	// Only transcribe once there is speech in the window.
+	if(speech_end <= (int64_t)window_begin)
+		return false;
+
+	const size_t pause_samples = (size_t)sample_rate * pause_ms / 1000;
+	const size_t step_samples  = (size_t)sample_rate * step_ms / 1000;
+
+	return audio.size() >= (size_t)speech_end + pause_samples || // The speaker has paused: commit the window.
+		audio.size() >= last_pass_end + step_samples; // Update the partial hypothesis.
+}
+
+
+static void appendText(std::string& text, const std::string& s)
+{
+	if(!text.empty() && !s.empty())
+		text += " ";
+	text += s;
+}
+
+
+void StreamingTranscriber::workerThreadFunc()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while(1)
+	{
+		work_cond.wait(lock, [this]() { return hasWork(); });
+		if(quit)
+			return;
+
+		const size_t pad_samples   = (size_t)sample_rate * std::min(trailing_pad_ms, pause_ms) / 1000;
+		const size_t pause_samples = (size_t)sample_rate * pause_ms / 1000;
+
+		const size_t speech_window_end = std::min(audio.size(), (size_t)std::max<int64_t>(speech_end, 0) + pad_samples);
+
+		if(finalising)
+		{
+			if(speech_end > (int64_t)window_begin)
+			{
+				if(partial_valid && last_pass_end >= speech_window_end)
+				{
+					// The last partial hypothesis already covers all of the speech, so commit it as it is.
+					appendText(committed_text, partial_text);
+					committed_context = partial_context;
+					window_begin = last_pass_end;
+				}
+				else
+				{
+					final_pass_run = true;
+					runPass(lock, speech_window_end, /*commit_all=*/true);
+				}
+			}
+
+			final_done = true;
+			done_cond.notify_all();
+		}
+		else if(audio.size() >= (size_t)speech_end + pause_samples)
+			runPass(lock, speech_window_end, /*commit_all=*/true);
+		else
+			runPass(lock, audio.size(), /*commit_all=*/false);
+	}
+}
+
+
+void StreamingTranscriber::runPass(std::unique_lock<std::mutex>& lock, size_t end, bool commit_all)
+{
+	const size_t begin = window_begin;
+
+	window.assign(audio.begin() + begin, audio.begin() + end);
+	pass_running = true;
+
+	lock.unlock();
+
+	// Whisper ignores input shorter than a second, so pad short windows with silence.
+	if(window.size() < (size_t)sample_rate)
+		window.resize(sample_rate, 0.f);
+
+	// Condition on the text committed so far, so partial hypotheses of the current window don't accumulate in the context.
+	// committed_context is only changed by this thread, or by reset() which waits for the pass to finish.
+	whisper_full_set_prompt_past_from_state(state, committed_context.data(), (int)committed_context.size());
+
+	const bool ok = whisper_full_with_state(whisper_ctx, state, params, window.data(), (int)window.size()) == 0;
+
+	lock.lock();
+
+	pass_running = false;
+	done_cond.notify_all();
+
+	last_pass_end = end;
+	partial_valid = false;
+
+	if(!ok)
+	{
+		pass_failed = true;
+		return;
+	}
+
+	const int n_segments = whisper_full_n_segments_from_state(state);
+
+	// Work out how much of the window to commit.  It is only cut at the end of a segment, unless it gets too long for Whisper.
+	int n_commit = 0;
+	size_t commit_end = begin;
+	if(commit_all || end - begin >= (size_t)sample_rate * max_window_ms / 1000)
+	{
+		n_commit = n_segments;
+		commit_end = end;
+	}
+	else if(end - begin >= (size_t)sample_rate * window_ms / 1000 && n_segments >= 2)
+	{
+		const int64_t t1 = whisper_full_get_segment_t1_from_state(state, n_segments - 2); // In units of 10 ms.
+		commit_end = std::min(end, begin + (size_t)(t1 * sample_rate / 100));
+		if(commit_end > begin)
+			n_commit = n_segments - 1;
+	}
+
+	std::string text;
+	for(int i=0; i<n_commit; ++i)
+		appendText(text, whisper_full_get_segment_text_from_state(state, i));
+
+	std::string rest;
+	for(int i=n_commit; i<n_segments; ++i)
+		appendText(rest, whisper_full_get_segment_text_from_state(state, i));
+
+	if(commit_end > begin)
+	{
+		// Advance the text context to include the committed segments.
+		if(n_commit == n_segments)
+		{
+			const int n_context = whisper_full_get_prompt_past_from_state(state, NULL, 0);
+			committed_context.resize(n_context);
+			whisper_full_get_prompt_past_from_state(state, committed_context.data(), n_context);
+		}
+		else
+		{
+			for(int i=0; i<n_commit; ++i)
+				for(int j=0; j<whisper_full_n_tokens_from_state(state, i); ++j)
+					committed_context.push_back(whisper_full_get_token_id_from_state(state, i, j));
+		}
+
+		appendText(committed_text, text);
+		window_begin = commit_end;
+	}
+	else
+	{
+		// Nothing was committed, keep the result so that finalise() can commit it if no more speech arrives.
+		const int n_context = whisper_full_get_prompt_past_from_state(state, NULL, 0);
+		partial_context.resize(n_context);
+		whisper_full_get_prompt_past_from_state(state, partial_context.data(), n_context);
+		partial_valid = true;
+	}
+
+	partial_text = rest;
+}
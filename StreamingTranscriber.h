@@ -0,0 +1,106 @@
+/*=====================================================================
+StreamingTranscriber.h
+----------------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+#pragma once
+
+
+#include <whisper.cpp/whisper.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/*=====================================================================
+StreamingTranscriber
+--------------------
+Transcribes an utterance with Whisper while it is still being recorded.
+
+The Whisper passes run on a worker thread, so update(), which is called from the capture / VAD loop, never waits for inference.
+
+While the user is speaking, the worker re-transcribes the current (uncommitted) window every step_ms of new audio, giving
+partial hypotheses (through params.new_segment_callback, called on the worker thread).
+Audio is committed - its text is appended to the final text, and the Whisper text context (prompt_past) is advanced so that
+the next window is conditioned on it - only where no word is cut:
+  * At a pause: once there has been pause_ms of silence after the last speech, the window up to the end of the speech is
+    transcribed and committed.
+  * At a segment boundary: once the window is longer than window_ms, all but the last of the segments Whisper found in it
+    are committed.
+
+pause_ms should be less than the VAD hangover, so that the window is usually committed while the VAD is still waiting for
+the end of the utterance.  finalise() then returns the text without running another pass.  Otherwise it reuses the last
+partial hypothesis if that covered all of the speech, and only runs a pass over the rest of the window if not.
+
+Uses its own whisper_state, so the whisper_context's default state is not touched.
+=====================================================================*/
+class StreamingTranscriber
+{
+public:
+	StreamingTranscriber(struct whisper_context* whisper_ctx, const struct whisper_full_params& params, int sample_rate);
+	~StreamingTranscriber();
+
+	// Start a new utterance.  Waits for any pass still running for the previous one.
+	void reset();
+
+	// samples is all the audio recorded for the utterance so far.  speech_end is the end of the speech detected so far,
+	// as a sample index (see whisper_vad_speech_end()), or -1 if no speech has been detected.
+	// Copies the new samples and wakes the worker thread.  Does not wait for any transcription.
+	void update(const float* samples, size_t num_samples, int64_t speech_end);
+
+	// Recording has stopped: waits until all of the speech has been transcribed, and returns the complete text of the utterance.
+	std::string finalise(const float* samples, size_t num_samples, int64_t speech_end);
+
+	// True if the last finalise() call had to run a Whisper pass, rather than returning text that was already transcribed.
+	bool finaliseRanPass() const { return final_pass_run; }
+
+	int step_ms;
+	int window_ms;
+	int pause_ms;
+
+private:
+	StreamingTranscriber(const StreamingTranscriber&);
+	StreamingTranscriber& operator = (const StreamingTranscriber&);
+
+	void clearState(); // Clears the utterance state.  The caller must hold the mutex, or be the constructor.
+	void appendAudio(const float* samples, size_t num_samples, int64_t speech_end);
+	void workerThreadFunc();
+	bool hasWork() const;
+	void runPass(std::unique_lock<std::mutex>& lock, size_t end, bool commit_all); // Unlocks the mutex during the pass.
+
+	struct whisper_context* whisper_ctx;
+	struct whisper_state* state;
+	struct whisper_full_params params;
+	int sample_rate;
+
+	std::thread worker_thread;
+
+	mutable std::mutex mutex;
+	std::condition_variable work_cond; // Signalled when there is new audio, or finalise() or the destructor has been called.
+	std::condition_variable done_cond; // Signalled when a pass has finished.
+
+	// Protected by mutex:
+	std::vector<float> audio; // All audio of the utterance so far.
+	int64_t speech_end = -1;
+	bool finalising = false;
+	bool final_done = false;
+	bool final_pass_run = false;
+	bool pass_running = false;
+	bool pass_failed = false;
+	bool quit = false;
+
+	size_t window_begin = 0; // Index of the first sample of the current uncommitted window.
+	size_t last_pass_end = 0; // Number of samples there were at the last pass.
+
+	bool partial_valid = false; // The last pass transcribed [window_begin, last_pass_end) without committing any of it.
+
+	std::vector<whisper_token> committed_context; // prompt_past after the last commit.
+	std::vector<whisper_token> partial_context; // prompt_past after the last partial pass, for committing it in finalise().
+	std::string committed_text;
+	std::string partial_text; // Hypothesis for the window of the last partial pass.
+
+	// Only used by the worker thread during a pass:
+	std::vector<float> window;
+};
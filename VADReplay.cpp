@@ -0,0 +1,204 @@
+/*=====================================================================
+VADReplay.cpp
+-------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+// Offline tool to replay recordings through the voice activity detection used by aibot, see whisper_vad_process(), and
+// report the endpointing latency and truncation rate.
+//
+// dir should contain the recordings (16 bit PCM or 32 bit float WAV files) and a file ends.txt with a line per recording:
+// the file name and the time the speech ends in it, in ms, e.g.
+//     weather.wav 1830
+//     volume.wav 2410
+// Each recording is fed to the VAD in 256-sample blocks, as the audio callback delivers it in aibot, until the VAD ends
+// the utterance.  The latency is the time from the end of the speech until then.  The utterance is truncated if recording
+// stopped before the end of the speech, because the VAD ended it early or it hit the maximum length.
+//
+// Usage: vad_replay dir [hangover_ms [max_length_ms]]
+
+
+#include <whisper.cpp/whisper.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static uint32_t readLE(const unsigned char* p, int num_bytes)
+{
+	uint32_t x = 0;
+	for(int i=0; i<num_bytes; ++i)
+		x |= (uint32_t)p[i] << (8 * i);
+	return x;
+}
+
+
+// Reads the first channel of a 16 bit PCM or 32 bit float WAV file.  Returns false on failure.
+static bool readWAV(const std::string& path, std::vector<float>& samples_out, int& sample_rate_out)
+{
+	FILE* f = fopen(path.c_str(), "rb");
+	if(!f)
+		return false;
+	std::vector<unsigned char> data;
+	unsigned char buf[65536];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	fclose(f);
+
+	if(data.size() < 12 || memcmp(data.data(), "RIFF", 4) != 0 || memcmp(data.data() + 8, "WAVE", 4) != 0)
+		return false;
+
+	int format = 0, num_channels = 0, bits_per_sample = 0;
+	sample_rate_out = 0;
+	for(size_t pos = 12; pos + 8 <= data.size(); )
+	{
+		const unsigned char* chunk = data.data() + pos;
+		const size_t chunk_size = std::min<size_t>(readLE(chunk + 4, 4), data.size() - pos - 8);
+
+		if(memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16)
+		{
+			format          = (int)readLE(chunk + 8, 2);
+			num_channels    = (int)readLE(chunk + 10, 2);
+			sample_rate_out = (int)readLE(chunk + 12, 4);
+			bits_per_sample = (int)readLE(chunk + 22, 2);
+			if(format == 0xFFFE && chunk_size >= 26) // WAVE_FORMAT_EXTENSIBLE: the format is the start of the sub-format GUID.
+				format = (int)readLE(chunk + 32, 2);
+		}
+		else if(memcmp(chunk, "data", 4) == 0 && num_channels > 0)
+		{
+			const unsigned char* src = chunk + 8;
+			if(format == 1 && bits_per_sample == 16)
+			{
+				const size_t num_frames = chunk_size / (2 * num_channels);
+				samples_out.resize(num_frames);
+				for(size_t i=0; i<num_frames; ++i)
+					samples_out[i] = (int16_t)readLE(src + i * 2 * num_channels, 2) / 32768.f;
+				return sample_rate_out > 0;
+			}
+			else if(format == 3 && bits_per_sample == 32)
+			{
+				const size_t num_frames = chunk_size / (4 * num_channels);
+				samples_out.resize(num_frames);
+				for(size_t i=0; i<num_frames; ++i)
+					memcpy(&samples_out[i], src + i * 4 * num_channels, 4);
+				return sample_rate_out > 0;
+			}
+			return false;
+		}
+
+		pos += 8 + chunk_size + (chunk_size & 1); // Chunks are padded to an even size.
+	}
+	return false;
+}
+
+
+static double percentile(std::vector<double> v, double p)
+{
+	if(v.empty())
+		return 0;
+	std::sort(v.begin(), v.end());
+	return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc < 2 || argc > 4)
+	{
+		fprintf(stderr, "Usage: %s dir [hangover_ms [max_length_ms]]\n", argv[0]);
+		fprintf(stderr, "  dir should contain the WAV files and ends.txt, with a line 'file.wav speech_end_ms' for each\n");
+		return 1;
+	}
+
+	const std::string dir = argv[1];
+
+	// The same settings as aibot by default.
+	struct whisper_vad_params params = whisper_vad_default_params();
+	params.hangover_ms = argc >= 3 ? atoi(argv[2]) : 250;
+	params.max_length_ms = argc >= 4 ? atoi(argv[3]) : 15000;
+
+	const int block_size = 256; // Samples per audio callback in aibot.
+
+	FILE* ends_file = fopen((dir + "/ends.txt").c_str(), "r");
+	if(!ends_file)
+	{
+		fprintf(stderr, "Failed to open '%s/ends.txt'.\n", dir.c_str());
+		return 1;
+	}
+
+	std::vector<double> latencies; // For the recordings that were not truncated.
+	int num_recordings = 0;
+	int num_truncated = 0;
+
+	char name[1024];
+	double speech_end_ms;
+	while(fscanf(ends_file, "%1023s %lf", name, &speech_end_ms) == 2)
+	{
+		std::vector<float> samples;
+		int sample_rate;
+		if(!readWAV(dir + "/" + name, samples, sample_rate))
+		{
+			fprintf(stderr, "Failed to read '%s', only 16 bit PCM and 32 bit float WAV files are supported.\n", name);
+			fclose(ends_file);
+			return 1;
+		}
+
+		params.sample_rate = sample_rate;
+		struct whisper_vad_state* state = whisper_vad_init(params);
+		if(!state)
+		{
+			fclose(ends_file);
+			return 1;
+		}
+
+		int event = WHISPER_VAD_WAITING;
+		size_t num_fed = 0;
+		while(num_fed < samples.size() && event != WHISPER_VAD_END_OF_SPEECH && event != WHISPER_VAD_MAX_LENGTH)
+		{
+			const size_t n = std::min<size_t>(block_size, samples.size() - num_fed);
+			event = whisper_vad_process(state, samples.data() + num_fed, (int)n);
+			num_fed += n;
+		}
+		const int64_t detected_end = whisper_vad_speech_end(state);
+		whisper_vad_free(state);
+
+		const double stopped_ms = 1000.0 * num_fed / sample_rate;
+		const double latency_ms = stopped_ms - speech_end_ms;
+		const bool truncated = latency_ms < 0;
+
+		const char* event_str =
+			event == WHISPER_VAD_END_OF_SPEECH ? "end of speech" :
+			event == WHISPER_VAD_MAX_LENGTH    ? "max length" :
+			event == WHISPER_VAD_SPEECH        ? "no endpoint" : "no speech";
+
+		printf("%-32s %-13s  speech end %8.1f ms, detected %8.1f ms, stopped %8.1f ms, latency %8.1f ms%s\n", name, event_str,
+			speech_end_ms, detected_end >= 0 ? 1000.0 * detected_end / sample_rate : -1.0, stopped_ms, latency_ms, truncated ? ", TRUNCATED" : "");
+
+		num_recordings++;
+		if(truncated)
+			num_truncated++;
+		else
+			latencies.push_back(latency_ms);
+	}
+	fclose(ends_file);
+
+	if(num_recordings == 0)
+	{
+		fprintf(stderr, "No recordings listed in '%s/ends.txt'.\n", dir.c_str());
+		return 1;
+	}
+
+	double mean = 0;
+	for(size_t i=0; i<latencies.size(); ++i)
+		mean += latencies[i] / latencies.size();
+
+	printf("\n%d recordings, hangover %d ms, max length %d ms\n", num_recordings, params.hangover_ms, params.max_length_ms);
+	printf("latency: mean %.1f ms, median %.1f ms, p90 %.1f ms, max %.1f ms\n", mean, percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 1.0));
+	printf("truncated: %d (%.1f%%)\n", num_truncated, 100.0 * num_truncated / num_recordings);
+
+	return 0;
+}
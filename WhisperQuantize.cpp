@@ -0,0 +1,68 @@
+/*=====================================================================
+WhisperQuantize.cpp
+-------------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+// Offline tool to convert a Whisper ggml model (F32 or F16) to one with block-quantized weights,
+// or to just align the tensor data of a model so that it can be memory mapped, see whisper_init_from_mapped_buffer().
+// The result can be loaded with whisper_init_from_file() like any other model.
+//
+// Usage: whisper_quantize ggml-base.en.bin ggml-base.en-q5_0.bin q5_0
+//        whisper_quantize ggml-base.en.bin ggml-base.en-aligned.bin align
+
+
+#include <whisper.cpp/whisper.h>
+#include <stdio.h>
+#include <string.h>
+
+
+struct QuantType
+{
+	const char* name;
+	whisper_ftype ftype;
+};
+
+static const QuantType quant_types[] = {
+	{ "q4_0", WHISPER_FTYPE_MOSTLY_Q4_0 },
+	{ "q4_1", WHISPER_FTYPE_MOSTLY_Q4_1 },
+	{ "q5_0", WHISPER_FTYPE_MOSTLY_Q5_0 },
+	{ "q5_1", WHISPER_FTYPE_MOSTLY_Q5_1 },
+	{ "q8_0", WHISPER_FTYPE_MOSTLY_Q8_0 }
+};
+
+
+int main(int argc, char** argv)
+{
+	if(argc != 4)
+	{
+		fprintf(stderr, "Usage: %s model-f16.bin model-quant.bin type\n", argv[0]);
+		fprintf(stderr, "  type is one of: q4_0, q4_1, q5_0, q5_1, q8_0, or align to keep the weights unchanged\n");
+		return 1;
+	}
+
+	if(strcmp(argv[3], "align") == 0)
+	{
+		if(whisper_model_align(argv[1], argv[2]) != 0)
+		{
+			fprintf(stderr, "Failed to align '%s'.\n", argv[1]);
+			return 1;
+		}
+		return 0;
+	}
+
+	for(size_t i=0; i<sizeof(quant_types) / sizeof(quant_types[0]); ++i)
+	{
+		if(strcmp(argv[3], quant_types[i].name) == 0)
+		{
+			if(whisper_model_quantize(argv[1], argv[2], quant_types[i].ftype) != 0)
+			{
+				fprintf(stderr, "Failed to quantize '%s'.\n", argv[1]);
+				return 1;
+			}
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Unknown quantization type '%s'.\n", argv[3]);
+	return 1;
+}
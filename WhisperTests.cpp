@@ -0,0 +1,122 @@
+/*=====================================================================
+WhisperTests.cpp
+----------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+#include "WhisperTests.h"
+
+
+#if BUILD_TESTS
+
+
+#include <whisper.cpp/whisper.h>
+#include <utils/TestUtils.h>
+#include <utils/ConPrint.h>
+#include <utils/FileUtils.h>
+#include <utils/PlatformUtils.h>
+#include <utils/MemMappedFile.h>
+#include <cmath>
+#include <string.h>
+#include <vector>
+
+
+// Encode a few seconds of a synthetic chirp and decode two tokens.  Returns the logits for the last token.
+static std::vector<float> computeLogits(struct whisper_context* ctx)
+{
+	std::vector<float> pcm(WHISPER_SAMPLE_RATE * 4);
+	for(size_t i=0; i<pcm.size(); ++i)
+		pcm[i] = 0.3f * std::sin(i * 0.05f + 1.0e-6f * i * i);
+
+	testAssert(whisper_pcm_to_mel(ctx, pcm.data(), (int)pcm.size(), /*n_threads=*/1) == 0);
+	testAssert(whisper_encode(ctx, /*offset=*/0, /*n_threads=*/1) == 0);
+
+	const whisper_token tokens[] = { whisper_token_sot(ctx), whisper_token_not(ctx) };
+	testAssert(whisper_decode(ctx, tokens, /*n_tokens=*/2, /*n_past=*/0, /*n_threads=*/1) == 0);
+
+	const float* logits = whisper_get_logits(ctx);
+	return std::vector<float>(logits, logits + whisper_n_vocab(ctx));
+}
+
+
+// An aligned model in a read-only mapping is used in place.  Loading it must not write to the mapping (which would fault),
+// and must give the same results as loading the model normally, also when the same mapping is loaded again.
+static void testLoadFromReadOnlyMapping(const std::string& model_path)
+{
+	const std::string aligned_path = PlatformUtils::getTempDirPath() + "/aibot_whisper_test_aligned.bin";
+	testAssert(whisper_model_align(model_path.c_str(), aligned_path.c_str()) == 0);
+
+	// Reference: the weights are copied into the context.
+	struct whisper_context* ref_ctx = whisper_init_from_file(model_path.c_str());
+	testAssert(ref_ctx != NULL);
+	const std::vector<float> ref_logits = computeLogits(ref_ctx);
+	whisper_free(ref_ctx);
+
+	{
+		MemMappedFile file(aligned_path); // Mapped read-only.
+		const std::vector<char> file_copy((const char*)file.fileData(), (const char*)file.fileData() + file.fileSize());
+
+		for(int i=0; i<2; ++i)
+		{
+			struct whisper_context* ctx = whisper_init_from_mapped_buffer(file.fileData(), file.fileSize());
+			testAssert(ctx != NULL);
+			const std::vector<float> logits = computeLogits(ctx);
+			whisper_free(ctx);
+
+			testAssert(logits.size() == ref_logits.size());
+			for(size_t z=0; z<logits.size(); ++z)
+				testAssert(std::fabs(logits[z] - ref_logits[z]) < 1.0e-3f);
+		}
+
+		testAssert(memcmp(file_copy.data(), file.fileData(), file.fileSize()) == 0);
+	}
+
+	FileUtils::deleteFile(aligned_path);
+}
+
+
+// whisper_pcm_to_mel() computes the spectrum with a real FFT and the filterbank in single precision.  Checks it against a double precision DFT.
+static void testMelSpectrogram(const std::string& model_path)
+{
+	struct whisper_context* ctx = whisper_init_from_file(model_path.c_str());
+	testAssert(ctx != NULL);
+	const int result = whisper_bench_pcm_to_mel(ctx, /*n_threads=*/4);
+	whisper_free(ctx);
+	testAssert(result == 0);
+}
+
+
+// The encoder convolutions, with the kernel in rows and packed, over the shapes of all the models.  Checks them against a double precision convolution.
+static void testConvolution()
+{
+	testAssert(whisper_bench_ggml_conv_1d(/*n_threads=*/4) == 0);
+}
+
+
+// Checks that the compute buffer of each model size is smaller than the scratch buffers it replaced.
+static void testComputeMemory()
+{
+	testAssert(whisper_bench_memory(/*n_threads=*/4) == 0);
+}
+
+
+void WhisperTests::test(const std::string& model_path)
+{
+	conPrint("WhisperTests::test()");
+
+	testConvolution(); // Doesn't need a model.
+	testComputeMemory(); // Doesn't need a model either.
+
+	if(!FileUtils::fileExists(model_path))
+	{
+		conPrint("Skipping the Whisper model tests, model '" + model_path + "' not found.");
+		return;
+	}
+
+	testLoadFromReadOnlyMapping(model_path);
+	testMelSpectrogram(model_path);
+
+	conPrint("WhisperTests::test() done.");
+}
+
+
+#endif // BUILD_TESTS
@@ -0,0 +1,18 @@
+/*=====================================================================
+WhisperTests.h
+--------------
+Copyright Nicholas Chapman 2023 -
+=====================================================================*/
+#pragma once
+
+
+#include <string>
+
+
+namespace WhisperTests
+{
+
+// model_path is an unaligned ggml Whisper model, e.g. ggml-base.en.bin.
+void test(const std::string& model_path);
+
+}
@@ -68,6 +68,40 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef SRWLOCK            pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    InitializeSRWLock(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    return SleepConditionVariableSRW(cond, mutex, INFINITE, 0) ? 0 : EINVAL;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -1138,255 +1172,1559 @@ inline static void ggml_vec_max_f32(const int n, float * s, const float * x) {
 inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x) { ggml_vec_norm_f32(n, s, x); *s = 1./(*s); }
 
 //
-// logging
+// log-softmax for sampling
+//
+// the exponentials are computed with a polynomial (Cephes expf) - within 2 ulp of expf(), unlike the FP16 table of
+// ggml_compute_forward_soft_max_f32(), which is accurate enough for attention but not for log-probabilities
 //
 
-#if (GGML_DEBUG >= 1)
-#define GGML_PRINT_DEBUG(...) printf(__VA_ARGS__)
-#else
-#define GGML_PRINT_DEBUG(...)
-#endif
+#if defined(__AVX2__)
+// exp(x) for x <= 0, 0 for x < -87.3 (incl. -INFINITY)
+inline static __m256 ggml_v_expf_neg(__m256 x) {
+    const __m256 x_min = _mm256_set1_ps(-87.3f);
+    const __m256 zero  = _mm256_cmp_ps(x, x_min, _CMP_LT_OQ);
 
-#if (GGML_DEBUG >= 5)
-#define GGML_PRINT_DEBUG_5(...) printf(__VA_ARGS__)
-#else
-#define GGML_PRINT_DEBUG_5(...)
-#endif
+    x = _mm256_max_ps(x, x_min);
 
-#if (GGML_DEBUG >= 10)
-#define GGML_PRINT_DEBUG_10(...) printf(__VA_ARGS__)
-#else
-#define GGML_PRINT_DEBUG_10(...)
-#endif
+    // x = n*ln(2) + r, |r| <= ln(2)/2
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
 
-#define GGML_PRINT(...) printf(__VA_ARGS__)
+    // GGML_F32x8_FMA(a, b, c) = a + b*c, fused only if FMA is available (AVX2 doesn't imply it)
+    __m256 r = GGML_F32x8_FMA(x, n, _mm256_set1_ps(-0.693359375f));
+           r = GGML_F32x8_FMA(r, n, _mm256_set1_ps(2.12194440e-4f));
 
-//
-// data types
-//
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = GGML_F32x8_FMA(_mm256_set1_ps(1.3981999507e-3f), y, r);
+    y = GGML_F32x8_FMA(_mm256_set1_ps(8.3334519073e-3f), y, r);
+    y = GGML_F32x8_FMA(_mm256_set1_ps(4.1665795894e-2f), y, r);
+    y = GGML_F32x8_FMA(_mm256_set1_ps(1.6666665459e-1f), y, r);
+    y = GGML_F32x8_FMA(_mm256_set1_ps(5.0000001201e-1f), y, r);
+    y = GGML_F32x8_FMA(_mm256_add_ps(r, _mm256_set1_ps(1.0f)), y, _mm256_mul_ps(r, r));
 
-static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
-    sizeof(int8_t ),
-    sizeof(int16_t),
-    sizeof(int32_t),
-    sizeof(ggml_fp16_t),
-    sizeof(float  ),
-};
+    // y *= 2^n
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
 
-static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
-    "NONE",
+    return _mm256_andnot_ps(zero, _mm256_mul_ps(y, _mm256_castsi256_ps(e)));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+inline static float32x4_t ggml_v_expf_neg(float32x4_t x) {
+    const float32x4_t x_min = vdupq_n_f32(-87.3f);
+    const uint32x4_t  zero  = vcltq_f32(x, x_min);
 
-    "DUP",
-    "ADD",
-    "SUB",
-    "MUL",
-    "DIV",
-    "SQR",
-    "SQRT",
-    "SUM",
-    "MEAN",
-    "REPEAT",
-    "ABS",
-    "SGN",
-    "NEG",
-    "STEP",
-    "RELU",
-    "GELU",
-    "NORM",
+    x = vmaxq_f32(x, x_min);
 
-    "MUL_MAT",
+    const float32x4_t n = vrndnq_f32(vmulq_n_f32(x, 1.44269504088896341f));
 
-    "SCALE",
-    "CPY",
-    "RESHAPE",
-    "VIEW",
-    "PERMUTE",
-    "TRANSPOSE",
-    "GET_ROWS",
-    "DIAG_MASK_INF",
-    "SOFT_MAX",
-    "ROPE",
-    "CONV_1D_1S",
-    "CONV_1D_2S",
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(0.693359375f));
+                r = vfmsq_f32(r, n, vdupq_n_f32(-2.12194440e-4f));
 
-    "FLASH_ATTN",
-    "FLASH_FF",
-};
+    float32x4_t y = vdupq_n_f32(1.9875691500e-4f);
+    y = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), y, r);
+    y = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), y, r);
+    y = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), y, vmulq_f32(r, r));
 
-static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
-    "none",
+    const int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
 
-    "x",
-    "x+y",
-    "x-y",
-    "x*y",
-    "x/y",
-    "x^2",
-    "√x",
-    "Σx",
-    "Σx/n",
-    "repeat(x)",
-    "abs(x)",
-    "sgn(x)",
-    "-x",
-    "step(x)",
-    "relu(x)",
-    "gelu(x)",
-    "norm(x)",
+    return vreinterpretq_f32_u32(vbicq_u32(vreinterpretq_u32_f32(vmulq_f32(y, vreinterpretq_f32_s32(e))), zero));
+}
+#endif
 
-    "X*Y",
+float ggml_log_soft_max_f32(const int n, float * logprobs, float * probs, const float * x) {
+    int i = 0;
 
-    "x*v",
-    "x-\\>y",
-    "reshape(x)",
-    "view(x)",
-    "permute(x)",
-    "transpose(x)",
-    "get_rows(x)",
-    "diag_mask_inf(x)",
-    "soft_max(x)",
-    "rope(x)",
-    "conv_1d_1s(x)",
-    "conv_1d_2s(x)",
+    // max
+    float max = -INFINITY;
+#if defined(__AVX2__)
+    {
+        __m256 vmax = _mm256_set1_ps(-INFINITY);
+        for (; i + 8 <= n; i += 8) {
+            vmax = _mm256_max_ps(vmax, _mm256_loadu_ps(x + i));
+        }
+        __m128 m = _mm_max_ps(_mm256_castps256_ps128(vmax), _mm256_extractf128_ps(vmax, 1));
+        m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+        m = _mm_max_ss(m, _mm_movehdup_ps(m));
+        max = _mm_cvtss_f32(m);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    {
+        float32x4_t vmax = vdupq_n_f32(-INFINITY);
+        for (; i + 4 <= n; i += 4) {
+            vmax = vmaxq_f32(vmax, vld1q_f32(x + i));
+        }
+        max = vmaxvq_f32(vmax);
+    }
+#endif
+    for (; i < n; ++i) {
+        max = MAX(max, x[i]);
+    }
 
-    "flash_attn(x)",
-    "flash_ff(x)",
-};
+    // sum of exp(x - max), with the exponentials kept in probs
+    ggml_float sum = 0.0;
 
-//
-// ggml object
-//
+    i = 0;
+#if defined(__AVX2__)
+    {
+        const __m256 vmax = _mm256_set1_ps(max);
 
-struct ggml_object {
-    size_t offs;
-    size_t size;
+        __m256 vsum = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8) {
+            const __m256 e = ggml_v_expf_neg(_mm256_sub_ps(_mm256_loadu_ps(x + i), vmax));
+            if (probs) {
+                _mm256_storeu_ps(probs + i, e);
+            }
+            vsum = _mm256_add_ps(vsum, e);
+        }
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(vsum), _mm256_extractf128_ps(vsum, 1));
+        s = _mm_hadd_ps(s, s);
+        sum = _mm_cvtss_f32(_mm_hadd_ps(s, s));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    {
+        const float32x4_t vmax = vdupq_n_f32(max);
 
-    struct ggml_object * next;
+        float32x4_t vsum = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4) {
+            const float32x4_t e = ggml_v_expf_neg(vsubq_f32(vld1q_f32(x + i), vmax));
+            if (probs) {
+                vst1q_f32(probs + i, e);
+            }
+            vsum = vaddq_f32(vsum, e);
+        }
+        sum = vaddvq_f32(vsum);
+    }
+#endif
+    for (; i < n; ++i) {
+        const float e = expf(x[i] - max);
+        if (probs) {
+            probs[i] = e;
+        }
+        sum += e;
+    }
 
-    char padding[8];
-};
+    const float lse = max + logf(sum);
 
-static const size_t GGML_OBJECT_SIZE = sizeof(struct ggml_object);
+    if (logprobs) {
+        i = 0;
+#if defined(GGML_SIMD)
+        const GGML_F32_VEC vlse = GGML_F32_VEC_SET1(-lse);
+        for (; i + GGML_F32_EPR <= n; i += GGML_F32_EPR) {
+            GGML_F32_VEC_STORE(logprobs + i, GGML_F32_VEC_ADD(GGML_F32_VEC_LOAD(x + i), vlse));
+        }
+#endif
+        for (; i < n; ++i) {
+            logprobs[i] = x[i] - lse;
+        }
+    }
 
-static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
-static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
+    if (probs) {
+        ggml_vec_scale_f32(n, probs, 1.0f/sum);
+    }
+
+    return lse;
+}
 
 //
-// ggml context
+// quantization
+//
+// weights are quantized in blocks of 32 consecutive values along a row, each block with its own scale
+// the activations (src1 of ggml_mul_mat) are quantized on the fly to Q8_0 / Q8_1, so that the dot products can be
+// computed with integer SIMD instructions
+//
+// within a 4-bit / 5-bit block, the low nibble of qs[j] holds element j and the high nibble holds element j + 16
+// in 5-bit blocks, bit j of qh holds the 5th bit of element j
 //
 
-struct ggml_context {
-    size_t mem_size;
-    void * mem_buffer;
-    bool   mem_buffer_owned;
+#define QK4_0 32
+typedef struct {
+    ggml_fp16_t d;          // delta
+    uint8_t qs[QK4_0 / 2];  // nibbles / quants
+} block_q4_0;
+static_assert(sizeof(block_q4_0) == sizeof(ggml_fp16_t) + QK4_0 / 2, "wrong q4_0 block size/padding");
+
+#define QK4_1 32
+typedef struct {
+    ggml_fp16_t d;          // delta
+    ggml_fp16_t m;          // min
+    uint8_t qs[QK4_1 / 2];  // nibbles / quants
+} block_q4_1;
+static_assert(sizeof(block_q4_1) == 2 * sizeof(ggml_fp16_t) + QK4_1 / 2, "wrong q4_1 block size/padding");
+
+#define QK5_0 32
+typedef struct {
+    ggml_fp16_t d;          // delta
+    uint8_t qh[4];          // 5-th bit of quants
+    uint8_t qs[QK5_0 / 2];  // nibbles / quants
+} block_q5_0;
+static_assert(sizeof(block_q5_0) == sizeof(ggml_fp16_t) + sizeof(uint32_t) + QK5_0 / 2, "wrong q5_0 block size/padding");
+
+#define QK5_1 32
+typedef struct {
+    ggml_fp16_t d;          // delta
+    ggml_fp16_t m;          // min
+    uint8_t qh[4];          // 5-th bit of quants
+    uint8_t qs[QK5_1 / 2];  // nibbles / quants
+} block_q5_1;
+static_assert(sizeof(block_q5_1) == 2 * sizeof(ggml_fp16_t) + sizeof(uint32_t) + QK5_1 / 2, "wrong q5_1 block size/padding");
+
+#define QK8_0 32
+typedef struct {
+    ggml_fp16_t d;          // delta
+    int8_t  qs[QK8_0];      // quants
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(ggml_fp16_t) + QK8_0, "wrong q8_0 block size/padding");
+
+#define QK8_1 32
+typedef struct {
+    float   d;              // delta
+    float   s;              // d * sum(qs[i])
+    int8_t  qs[QK8_1];      // quants
+} block_q8_1;
+static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
+
+// reference implementations - k must be a multiple of the block size
+
+static void quantize_row_q4_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    block_q4_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+        float max  = 0.0f;
+
+        for (int j = 0; j < QK4_0; j++) {
+            const float v = x[i*QK4_0 + j];
+            if (amax < fabsf(v)) {
+                amax = fabsf(v);
+                max  = v;
+            }
+        }
 
-    int n_objects;
+        // the value with the largest magnitude maps to -8, so that its sign gets the extra level
+        const float d  = max / -8;
+        const float id = d ? 1.0f/d : 0.0f;
 
-    struct ggml_object * objects_begin;
-    struct ggml_object * objects_end;
+        y[i].d = GGML_FP32_TO_FP16(d);
 
-    struct ggml_scratch scratch;
-    struct ggml_scratch scratch_save;
-};
+        for (int j = 0; j < QK4_0/2; ++j) {
+            const float x0 = x[i*QK4_0 + 0       + j]*id;
+            const float x1 = x[i*QK4_0 + QK4_0/2 + j]*id;
 
-struct ggml_context_container {
-    bool used;
+            const uint8_t xi0 = MIN(15, (int8_t)(x0 + 8.5f));
+            const uint8_t xi1 = MIN(15, (int8_t)(x1 + 8.5f));
 
-    struct ggml_context context;
-};
+            y[i].qs[j]  = xi0;
+            y[i].qs[j] |= xi1 << 4;
+        }
+    }
+}
 
-//
-// compute types
-//
+static void quantize_row_q4_1(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK4_1 == 0);
+    const int nb = k / QK4_1;
 
-enum ggml_task_type {
-    GGML_TASK_INIT = 0,
-    GGML_TASK_COMPUTE,
-    GGML_TASK_FINALIZE,
-};
+    block_q4_1 * restrict y = vy;
 
-struct ggml_compute_params {
-    enum ggml_task_type type;
+    for (int i = 0; i < nb; i++) {
+        float min =  INFINITY;
+        float max = -INFINITY;
 
-    int ith, nth;
+        for (int j = 0; j < QK4_1; j++) {
+            const float v = x[i*QK4_1 + j];
 
-    // work buffer for all threads
-    size_t wsize;
-    void * wdata;
-};
+            if (v < min) min = v;
+            if (v > max) max = v;
+        }
 
-//
-// ggml state
-//
+        const float d  = (max - min) / ((1 << 4) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
 
-struct ggml_state {
-    struct ggml_context_container contexts[GGML_MAX_CONTEXTS];
-};
+        y[i].d = GGML_FP32_TO_FP16(d);
+        y[i].m = GGML_FP32_TO_FP16(min);
 
-// global state
-static struct ggml_state g_state;
-static atomic_int g_state_barrier = 0;
+        for (int j = 0; j < QK4_1/2; ++j) {
+            const float x0 = (x[i*QK4_1 + 0       + j] - min)*id;
+            const float x1 = (x[i*QK4_1 + QK4_1/2 + j] - min)*id;
 
-// barrier via spin lock
-inline static void ggml_critical_section_start(void) {
-    int processing = atomic_fetch_add(&g_state_barrier, 1);
+            const uint8_t xi0 = MIN(15, (int8_t)(x0 + 0.5f));
+            const uint8_t xi1 = MIN(15, (int8_t)(x1 + 0.5f));
 
-    while (processing > 0) {
-        // wait for other threads to finish
-        atomic_fetch_sub(&g_state_barrier, 1);
-        sched_yield(); // TODO: reconsider this
-        processing = atomic_fetch_add(&g_state_barrier, 1);
+            y[i].qs[j]  = xi0;
+            y[i].qs[j] |= xi1 << 4;
+        }
     }
 }
 
-// TODO: make this somehow automatically executed
-//       some sort of "sentry" mechanism
-inline static void ggml_critical_section_end(void) {
-    atomic_fetch_sub(&g_state_barrier, 1);
-}
+static void quantize_row_q5_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK5_0 == 0);
+    const int nb = k / QK5_0;
 
-////////////////////////////////////////////////////////////////////////////////
+    block_q5_0 * restrict y = vy;
 
-void ggml_print_object(const struct ggml_object * obj) {
-    GGML_PRINT(" - ggml_object: offset = %zu, size = %zu, next = %p\n",
-            obj->offs, obj->size, (const void *) obj->next);
-}
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+        float max  = 0.0f;
 
-void ggml_print_objects(const struct ggml_context * ctx) {
-    struct ggml_object * obj = ctx->objects_begin;
+        for (int j = 0; j < QK5_0; j++) {
+            const float v = x[i*QK5_0 + j];
+            if (amax < fabsf(v)) {
+                amax = fabsf(v);
+                max  = v;
+            }
+        }
 
-    GGML_PRINT("%s: objects in context %p:\n", __func__, (const void *) ctx);
+        const float d  = max / -16;
+        const float id = d ? 1.0f/d : 0.0f;
 
-    while (obj != NULL) {
-        ggml_print_object(obj);
-        obj = obj->next;
-    }
+        y[i].d = GGML_FP32_TO_FP16(d);
 
-    GGML_PRINT("%s: --- end ---\n", __func__);
-}
+        uint32_t qh = 0;
 
-int ggml_nelements(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+        for (int j = 0; j < QK5_0/2; ++j) {
+            const float x0 = x[i*QK5_0 + 0       + j]*id;
+            const float x1 = x[i*QK5_0 + QK5_0/2 + j]*id;
 
-    return tensor->ne[0]*tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
-}
+            const uint8_t xi0 = MIN(31, (int8_t)(x0 + 16.5f));
+            const uint8_t xi1 = MIN(31, (int8_t)(x1 + 16.5f));
 
-int ggml_nrows(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+            y[i].qs[j] = (xi0 & 0x0F) | ((xi1 & 0x0F) << 4);
 
-    return tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+            // get the 5-th bit and store it in qh at the right position
+            qh |= ((xi0 & 0x10) >> 4) << (j + 0);
+            qh |= ((xi1 & 0x10) >> 4) << (j + QK5_0/2);
+        }
+
+        memcpy(&y[i].qh, &qh, sizeof(qh));
+    }
 }
 
-size_t ggml_nbytes(const struct ggml_tensor * tensor) {
-    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+static void quantize_row_q5_1(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK5_1 == 0);
+    const int nb = k / QK5_1;
 
-    return ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type];
-}
+    block_q5_1 * restrict y = vy;
 
-size_t ggml_type_size(enum ggml_type type) {
+    for (int i = 0; i < nb; i++) {
+        float min =  INFINITY;
+        float max = -INFINITY;
+
+        for (int j = 0; j < QK5_1; j++) {
+            const float v = x[i*QK5_1 + j];
+
+            if (v < min) min = v;
+            if (v > max) max = v;
+        }
+
+        const float d  = (max - min) / ((1 << 5) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = GGML_FP32_TO_FP16(d);
+        y[i].m = GGML_FP32_TO_FP16(min);
+
+        uint32_t qh = 0;
+
+        for (int j = 0; j < QK5_1/2; ++j) {
+            const float x0 = (x[i*QK5_1 + 0       + j] - min)*id;
+            const float x1 = (x[i*QK5_1 + QK5_1/2 + j] - min)*id;
+
+            const uint8_t xi0 = MIN(31, (int8_t)(x0 + 0.5f));
+            const uint8_t xi1 = MIN(31, (int8_t)(x1 + 0.5f));
+
+            y[i].qs[j] = (xi0 & 0x0F) | ((xi1 & 0x0F) << 4);
+
+            // get the 5-th bit and store it in qh at the right position
+            qh |= ((xi0 & 0x10) >> 4) << (j + 0);
+            qh |= ((xi1 & 0x10) >> 4) << (j + QK5_1/2);
+        }
+
+        memcpy(&y[i].qh, &qh, sizeof(qh));
+    }
+}
+
+#if defined(__AVX2__)
+// horizontally add 8 floats
+static inline float hsum_float_8(const __m256 x) {
+    __m128 res = _mm256_extractf128_ps(x, 1);
+    res = _mm_add_ps(res, _mm256_castps256_ps128(x));
+    res = _mm_add_ps(res, _mm_movehl_ps(res, res));
+    res = _mm_add_ss(res, _mm_movehdup_ps(res));
+    return _mm_cvtss_f32(res);
+}
+
+// horizontally add 8 int32_t
+static inline int hsum_i32_8(const __m256i a) {
+    const __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extractf128_si256(a, 1));
+    const __m128i hi64   = _mm_unpackhi_epi64(sum128, sum128);
+    const __m128i sum64  = _mm_add_epi32(hi64, sum128);
+    const __m128i hi32   = _mm_shuffle_epi32(sum64, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_cvtsi128_si32(_mm_add_epi32(sum64, hi32));
+}
+
+// quantize 32 floats to int8 with scale 127/amax, returns amax
+// the rounding is to nearest-even, the reference implementation below rounds half away from zero
+static inline float quantize_32_i8_avx2(const float * restrict x, __m256i * q, __m256i * sum) {
+    __m256 v0 = _mm256_loadu_ps(x +  0);
+    __m256 v1 = _mm256_loadu_ps(x +  8);
+    __m256 v2 = _mm256_loadu_ps(x + 16);
+    __m256 v3 = _mm256_loadu_ps(x + 24);
+
+    // compute max(abs(x)) for the block
+    const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+    __m256 max_abs = _mm256_andnot_ps(sign_bit, v0);
+    max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v1));
+    max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v2));
+    max_abs = _mm256_max_ps(max_abs, _mm256_andnot_ps(sign_bit, v3));
+
+    __m128 max4 = _mm_max_ps(_mm256_extractf128_ps(max_abs, 1), _mm256_castps256_ps128(max_abs));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+    const float amax = _mm_cvtss_f32(max4);
+
+    const __m256 mul = _mm256_set1_ps(amax != 0.0f ? 127.0f/amax : 0.0f);
+
+    v0 = _mm256_round_ps(_mm256_mul_ps(v0, mul), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    v1 = _mm256_round_ps(_mm256_mul_ps(v1, mul), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    v2 = _mm256_round_ps(_mm256_mul_ps(v2, mul), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    v3 = _mm256_round_ps(_mm256_mul_ps(v3, mul), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+
+    __m256i i0 = _mm256_cvtps_epi32(v0);
+    __m256i i1 = _mm256_cvtps_epi32(v1);
+    __m256i i2 = _mm256_cvtps_epi32(v2);
+    __m256i i3 = _mm256_cvtps_epi32(v3);
+
+    if (sum) {
+        *sum = _mm256_add_epi32(_mm256_add_epi32(i0, i1), _mm256_add_epi32(i2, i3));
+    }
+
+    // convert int32 to int16 and then to int8 - the packs interleave the 128-bit lanes, so fix the order afterwards
+    i0 = _mm256_packs_epi32(i0, i1); // 0, 1, 2, 3,  8, 9, 10, 11,  4, 5, 6, 7, 12, 13, 14, 15
+    i2 = _mm256_packs_epi32(i2, i3); // 16, 17, 18, 19,  24, 25, 26, 27,  20, 21, 22, 23, 28, 29, 30, 31
+    i0 = _mm256_packs_epi16(i0, i2); // 0..3, 16..19, 8..11, 24..27, 4..7, 20..23, 12..15, 28..31
+
+    *q = _mm256_permutevar8x32_epi32(i0, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+
+    return amax;
+}
+#endif
+
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK8_0 == 0);
+    const int nb = k / QK8_0;
+
+    block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    for (int i = 0; i < nb; i++) {
+        __m256i q;
+        const float amax = quantize_32_i8_avx2(x + i*QK8_0, &q, NULL);
+
+        y[i].d = GGML_FP32_TO_FP16(amax / 127.0f);
+        _mm256_storeu_si256((__m256i *) y[i].qs, q);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int j = 0; j < QK8_0; j++) {
+            amax = MAX(amax, fabsf(x[i*QK8_0 + j]));
+        }
+
+        const float d  = amax / ((1 << 7) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = GGML_FP32_TO_FP16(d);
+
+        for (int j = 0; j < QK8_0; ++j) {
+            y[i].qs[j] = roundf(x[i*QK8_0 + j]*id);
+        }
+    }
+#endif
+}
+
+static void quantize_row_q8_1(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK8_1 == 0);
+    const int nb = k / QK8_1;
+
+    block_q8_1 * restrict y = vy;
+
+#if defined(__AVX2__)
+    for (int i = 0; i < nb; i++) {
+        __m256i q;
+        __m256i sum;
+        const float amax = quantize_32_i8_avx2(x + i*QK8_1, &q, &sum);
+
+        y[i].d = amax / 127.0f;
+        y[i].s = y[i].d * hsum_i32_8(sum);
+        _mm256_storeu_si256((__m256i *) y[i].qs, q);
+    }
+#else
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int j = 0; j < QK8_1; j++) {
+            amax = MAX(amax, fabsf(x[i*QK8_1 + j]));
+        }
+
+        const float d  = amax / ((1 << 7) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        int sum = 0;
+
+        for (int j = 0; j < QK8_1; ++j) {
+            const int v = roundf(x[i*QK8_1 + j]*id);
+
+            y[i].qs[j] = v;
+            sum += v;
+        }
+
+        y[i].s = d*sum;
+    }
+#endif
+}
+
+static void dequantize_row_q4_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK4_0 == 0);
+    const int nb = k / QK4_0;
+
+    const block_q4_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+
+        for (int j = 0; j < QK4_0/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F) - 8;
+            const int x1 = (x[i].qs[j] >>   4) - 8;
+
+            y[i*QK4_0 + j + 0      ] = x0*d;
+            y[i*QK4_0 + j + QK4_0/2] = x1*d;
+        }
+    }
+}
+
+static void dequantize_row_q4_1(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK4_1 == 0);
+    const int nb = k / QK4_1;
+
+    const block_q4_1 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+        const float m = GGML_FP16_TO_FP32(x[i].m);
+
+        for (int j = 0; j < QK4_1/2; ++j) {
+            const int x0 = (x[i].qs[j] & 0x0F);
+            const int x1 = (x[i].qs[j] >>   4);
+
+            y[i*QK4_1 + j + 0      ] = x0*d + m;
+            y[i*QK4_1 + j + QK4_1/2] = x1*d + m;
+        }
+    }
+}
+
+static void dequantize_row_q5_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK5_0 == 0);
+    const int nb = k / QK5_0;
+
+    const block_q5_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int j = 0; j < QK5_0/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int32_t x0 = ((x[i].qs[j] & 0x0F) | xh_0) - 16;
+            const int32_t x1 = ((x[i].qs[j] >>   4) | xh_1) - 16;
+
+            y[i*QK5_0 + j + 0      ] = x0*d;
+            y[i*QK5_0 + j + QK5_0/2] = x1*d;
+        }
+    }
+}
+
+static void dequantize_row_q5_1(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK5_1 == 0);
+    const int nb = k / QK5_1;
+
+    const block_q5_1 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+        const float m = GGML_FP16_TO_FP32(x[i].m);
+
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        for (int j = 0; j < QK5_1/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int x0 = (x[i].qs[j] & 0x0F) | xh_0;
+            const int x1 = (x[i].qs[j] >>   4) | xh_1;
+
+            y[i*QK5_1 + j + 0      ] = x0*d + m;
+            y[i*QK5_1 + j + QK5_1/2] = x1*d + m;
+        }
+    }
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK8_0 == 0);
+    const int nb = k / QK8_0;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = GGML_FP16_TO_FP32(x[i].d);
+
+        for (int j = 0; j < QK8_0; ++j) {
+            y[i*QK8_0 + j] = x[i].qs[j]*d;
+        }
+    }
+}
+
+//
+// quantized dot products
+//
+// x is a row of weights, y is a row of activations quantized to the vec_dot_type of x
+// n must be a multiple of the block size
+//
+// on x86 the blocks are expanded to 32 signed bytes and multiplied with maddubs (unsigned x signed), which is why
+// the signed variants move the sign of x onto y first
+// with AVX-512BW two blocks are processed per iteration
+//
+
+#if defined(__AVX2__)
+#define MM256_SET_M128I(a, b) _mm256_insertf128_si256(_mm256_castsi128_si256(b), (a), 1)
+
+// spread 32 bits to 32 bytes { 0x00, 0xFF }
+static inline __m256i bytes_from_bits_32(const uint8_t * x) {
+    uint32_t x32;
+    memcpy(&x32, x, sizeof(uint32_t));
+    const __m256i shuf_mask = _mm256_set_epi64x(
+            0x0303030303030303, 0x0202020202020202,
+            0x0101010101010101, 0x0000000000000000);
+    __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(x32), shuf_mask);
+    const __m256i bit_mask = _mm256_set1_epi64x(0x7fbfdfeff7fbfdfe);
+    bytes = _mm256_or_si256(bytes, bit_mask);
+    return _mm256_cmpeq_epi8(bytes, _mm256_set1_epi64x(-1));
+}
+
+// unpack 32 4-bit fields into 32 bytes, each in [ 0 .. 15 ]
+// the low nibbles go to the first 16 bytes and the high nibbles to the last 16
+static inline __m256i bytes_from_nibbles_32(const uint8_t * rsi) {
+    const __m128i tmp = _mm_loadu_si128((const __m128i *) rsi);
+    const __m256i bytes = MM256_SET_M128I(_mm_srli_epi16(tmp, 4), tmp);
+    const __m256i low_mask = _mm256_set1_epi8(0xF);
+    return _mm256_and_si256(low_mask, bytes);
+}
+
+// multiply unsigned int8_t ax with signed int8_t sy, add results pairwise twice and return as float vector
+static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
+#if defined(__AVXVNNI__)
+    return _mm256_cvtepi32_ps(_mm256_dpbusd_avx_epi32(_mm256_setzero_si256(), ax, sy));
+#else
+    const __m256i dot = _mm256_maddubs_epi16(ax, sy);
+    return _mm256_cvtepi32_ps(_mm256_madd_epi16(dot, _mm256_set1_epi16(1)));
+#endif
+}
+
+// multiply signed int8_t, add results pairwise twice and return as float vector
+static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
+    const __m256i ax = _mm256_sign_epi8(x, x); // abs(x)
+    const __m256i sy = _mm256_sign_epi8(y, x); // y with the sign of x
+    return mul_sum_us8_pairs_float(ax, sy);
+}
+
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+#define GGML_QDOT_AVX512
+
+// two 256-bit halves into one 512-bit register
+static inline __m512i ggml_m512i_from_m256i(const __m256i lo, const __m256i hi) {
+    return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+}
+
+// broadcast a to the low 8 lanes and b to the high 8 lanes
+static inline __m512 ggml_m512_set2(const float a, const float b) {
+    return _mm512_mask_blend_ps(0xFF00, _mm512_set1_ps(a), _mm512_set1_ps(b));
+}
+
+static inline __m512 mul_sum_us8_pairs_float_512(const __m512i ax, const __m512i sy) {
+#if defined(__AVX512VNNI__)
+    return _mm512_cvtepi32_ps(_mm512_dpbusd_epi32(_mm512_setzero_si512(), ax, sy));
+#else
+    const __m512i dot = _mm512_maddubs_epi16(ax, sy);
+    return _mm512_cvtepi32_ps(_mm512_madd_epi16(dot, _mm512_set1_epi16(1)));
+#endif
+}
+
+// there is no 512-bit sign_epi8, so negate y with a mask instead
+static inline __m512 mul_sum_i8_pairs_float_512(const __m512i x, const __m512i y) {
+    const __m512i ax = _mm512_abs_epi8(x);
+    const __m512i sy = _mm512_mask_sub_epi8(y, _mm512_movepi8_mask(x), _mm512_setzero_si512(), y);
+    return mul_sum_us8_pairs_float_512(ax, sy);
+}
+#endif // __AVX512F__ && __AVX512BW__
+#endif // __AVX2__
+
+#if defined(__ARM_NEON)
+// sum of the products of two pairs of int8x16, in 4 lanes
+static inline int32x4_t ggml_vdotq_s8x2(const int8x16_t x0, const int8x16_t y0, const int8x16_t x1, const int8x16_t y1) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    return vdotq_s32(vdotq_s32(vdupq_n_s32(0), x0, y0), x1, y1);
+#else
+    const int16x8_t p0l = vmull_s8(vget_low_s8 (x0), vget_low_s8 (y0));
+    const int16x8_t p0h = vmull_s8(vget_high_s8(x0), vget_high_s8(y0));
+    const int16x8_t p1l = vmull_s8(vget_low_s8 (x1), vget_low_s8 (y1));
+    const int16x8_t p1h = vmull_s8(vget_high_s8(x1), vget_high_s8(y1));
+
+    return vaddq_s32(vaddq_s32(vpaddlq_s16(p0l), vpaddlq_s16(p0h)),
+                     vaddq_s32(vpaddlq_s16(p1l), vpaddlq_s16(p1h)));
+#endif
+}
+
+// expand the 32 bits of qh to 0x10 / 0x00 bytes, for elements [0, 16) and [16, 32)
+static inline void ggml_q5_high_bits(const uint8_t * qh, uint8x16_t * lo, uint8x16_t * hi) {
+    static const uint8_t k_bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    const uint8x16_t bits = vld1q_u8(k_bits);
+    const uint8x16_t m    = vdupq_n_u8(0x10);
+
+    *lo = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh[0]), vdup_n_u8(qh[1])), bits), m);
+    *hi = vandq_u8(vtstq_u8(vcombine_u8(vdup_n_u8(qh[2]), vdup_n_u8(qh[3])), bits), m);
+}
+#endif // __ARM_NEON
+
+static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    int i = 0;
+    float sumf = 0.0f;
+
+#if defined(__AVX2__)
+#if defined(GGML_QDOT_AVX512)
+    __m512 acc512 = _mm512_setzero_ps();
+
+    for (; i + 1 < nb; i += 2) {
+        const __m512 d = ggml_m512_set2(
+                GGML_FP16_TO_FP32(x[i + 0].d)*GGML_FP16_TO_FP32(y[i + 0].d),
+                GGML_FP16_TO_FP32(x[i + 1].d)*GGML_FP16_TO_FP32(y[i + 1].d));
+
+        const __m512i bx = _mm512_sub_epi8(
+                ggml_m512i_from_m256i(bytes_from_nibbles_32(x[i + 0].qs), bytes_from_nibbles_32(x[i + 1].qs)),
+                _mm512_set1_epi8(8));
+        const __m512i by = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) y[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) y[i + 1].qs));
+
+        acc512 = _mm512_fmadd_ps(d, mul_sum_i8_pairs_float_512(bx, by), acc512);
+    }
+
+    sumf += _mm512_reduce_add_ps(acc512);
+#endif
+    __m256 acc = _mm256_setzero_ps();
+
+    for (; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+
+        // values are in [ 0 .. 15 ], shift them to [ -8 .. 7 ]
+        const __m256i bx = _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs), _mm256_set1_epi8(8));
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = GGML_F32x8_FMA(acc, d, mul_sum_i8_pairs_float(bx, by));
+    }
+
+    sumf += hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (; i < nb; ++i) {
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        const int8x16_t xl = vsubq_s8(vreinterpretq_s8_u8(vandq_u8(v0, vdupq_n_u8(0x0F))), vdupq_n_s8(8));
+        const int8x16_t xh = vsubq_s8(vreinterpretq_s8_u8(vshrq_n_u8(v0, 4)),              vdupq_n_s8(8));
+
+        const int32x4_t p = ggml_vdotq_s8x2(xl, vld1q_s8(y[i].qs), xh, vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    sumf += vaddvq_f32(sumv);
+#endif
+
+    // scalar
+    for (; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK8_0/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F) - 8;
+            const int v1 = (x[i].qs[j] >>   4) - 8;
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + QK8_0/2]);
+        }
+
+        sumf += sumi*GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d);
+    }
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_q4_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK8_1;
+
+    assert(n % QK8_1 == 0);
+
+    const block_q4_1 * restrict x = vx;
+    const block_q8_1 * restrict y = vy;
+
+    int i = 0;
+    float sumf = 0.0f;
+
+    // the min of x contributes m*sum(y) per block
+    float summs = 0.0f;
+
+#if defined(__AVX2__)
+#if defined(GGML_QDOT_AVX512)
+    __m512 acc512 = _mm512_setzero_ps();
+
+    for (; i + 1 < nb; i += 2) {
+        summs += GGML_FP16_TO_FP32(x[i + 0].m)*y[i + 0].s + GGML_FP16_TO_FP32(x[i + 1].m)*y[i + 1].s;
+
+        const __m512 d = ggml_m512_set2(
+                GGML_FP16_TO_FP32(x[i + 0].d)*y[i + 0].d,
+                GGML_FP16_TO_FP32(x[i + 1].d)*y[i + 1].d);
+
+        const __m512i bx = ggml_m512i_from_m256i(bytes_from_nibbles_32(x[i + 0].qs), bytes_from_nibbles_32(x[i + 1].qs));
+        const __m512i by = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) y[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) y[i + 1].qs));
+
+        acc512 = _mm512_fmadd_ps(d, mul_sum_us8_pairs_float_512(bx, by), acc512);
+    }
+
+    sumf += _mm512_reduce_add_ps(acc512);
+#endif
+    __m256 acc = _mm256_setzero_ps();
+
+    for (; i < nb; ++i) {
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*y[i].d);
+
+        const __m256i bx = bytes_from_nibbles_32(x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = GGML_F32x8_FMA(acc, d, mul_sum_us8_pairs_float(bx, by));
+    }
+
+    sumf += hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (; i < nb; ++i) {
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        const int8x16_t xl = vreinterpretq_s8_u8(vandq_u8(v0, vdupq_n_u8(0x0F)));
+        const int8x16_t xh = vreinterpretq_s8_u8(vshrq_n_u8(v0, 4));
+
+        const int32x4_t p = ggml_vdotq_s8x2(xl, vld1q_s8(y[i].qs), xh, vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d)*y[i].d);
+    }
+
+    sumf += vaddvq_f32(sumv);
+#endif
+
+    // scalar
+    for (; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK8_1/2; ++j) {
+            const int v0 = (x[i].qs[j] & 0x0F);
+            const int v1 = (x[i].qs[j] >>   4);
+
+            sumi += (v0 * y[i].qs[j]) + (v1 * y[i].qs[j + QK8_1/2]);
+        }
+
+        sumf  += (GGML_FP16_TO_FP32(x[i].d)*y[i].d)*sumi;
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+    }
+
+    *s = sumf + summs;
+}
+
+static void ggml_vec_dot_q5_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q5_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    int i = 0;
+    float sumf = 0.0f;
+
+#if defined(__AVX2__)
+    // the 5th bit is set by or-ing 0xF0 into the bytes where it is *not* set, which subtracts 16 from them
+    // those where it is set are then already in [ 0 .. 15 ], i.e. the value - 16
+#if defined(GGML_QDOT_AVX512)
+    __m512 acc512 = _mm512_setzero_ps();
+
+    for (; i + 1 < nb; i += 2) {
+        const __m512 d = ggml_m512_set2(
+                GGML_FP16_TO_FP32(x[i + 0].d)*GGML_FP16_TO_FP32(y[i + 0].d),
+                GGML_FP16_TO_FP32(x[i + 1].d)*GGML_FP16_TO_FP32(y[i + 1].d));
+
+        const __m256i bx0 = _mm256_or_si256(bytes_from_nibbles_32(x[i + 0].qs),
+                _mm256_andnot_si256(bytes_from_bits_32(x[i + 0].qh), _mm256_set1_epi8((char) 0xF0)));
+        const __m256i bx1 = _mm256_or_si256(bytes_from_nibbles_32(x[i + 1].qs),
+                _mm256_andnot_si256(bytes_from_bits_32(x[i + 1].qh), _mm256_set1_epi8((char) 0xF0)));
+
+        const __m512i bx = ggml_m512i_from_m256i(bx0, bx1);
+        const __m512i by = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) y[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) y[i + 1].qs));
+
+        acc512 = _mm512_fmadd_ps(d, mul_sum_i8_pairs_float_512(bx, by), acc512);
+    }
+
+    sumf += _mm512_reduce_add_ps(acc512);
+#endif
+    __m256 acc = _mm256_setzero_ps();
+
+    for (; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+
+        const __m256i bx = _mm256_or_si256(bytes_from_nibbles_32(x[i].qs),
+                _mm256_andnot_si256(bytes_from_bits_32(x[i].qh), _mm256_set1_epi8((char) 0xF0)));
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = GGML_F32x8_FMA(acc, d, mul_sum_i8_pairs_float(bx, by));
+    }
+
+    sumf += hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (; i < nb; ++i) {
+        uint8x16_t qhl;
+        uint8x16_t qhh;
+        ggml_q5_high_bits(x[i].qh, &qhl, &qhh);
+
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        const int8x16_t xl = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vandq_u8(v0, vdupq_n_u8(0x0F)), qhl)), vdupq_n_s8(16));
+        const int8x16_t xh = vsubq_s8(vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(v0, 4),              qhh)), vdupq_n_s8(16));
+
+        const int32x4_t p = ggml_vdotq_s8x2(xl, vld1q_s8(y[i].qs), xh, vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    sumf += vaddvq_f32(sumv);
+#endif
+
+    // scalar
+    for (; i < nb; i++) {
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        int sumi = 0;
+
+        for (int j = 0; j < QK8_0/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int32_t x0 = ((x[i].qs[j] & 0x0F) | xh_0) - 16;
+            const int32_t x1 = ((x[i].qs[j] >>   4) | xh_1) - 16;
+
+            sumi += (x0 * y[i].qs[j]) + (x1 * y[i].qs[j + QK8_0/2]);
+        }
+
+        sumf += (GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d))*sumi;
+    }
+
+    *s = sumf;
+}
+
+static void ggml_vec_dot_q5_1_q8_1(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK8_1;
+
+    assert(n % QK8_1 == 0);
+
+    const block_q5_1 * restrict x = vx;
+    const block_q8_1 * restrict y = vy;
+
+    int i = 0;
+    float sumf = 0.0f;
+
+    // the min of x contributes m*sum(y) per block
+    float summs = 0.0f;
+
+#if defined(__AVX2__)
+#if defined(GGML_QDOT_AVX512)
+    __m512 acc512 = _mm512_setzero_ps();
+
+    for (; i + 1 < nb; i += 2) {
+        summs += GGML_FP16_TO_FP32(x[i + 0].m)*y[i + 0].s + GGML_FP16_TO_FP32(x[i + 1].m)*y[i + 1].s;
+
+        const __m512 d = ggml_m512_set2(
+                GGML_FP16_TO_FP32(x[i + 0].d)*y[i + 0].d,
+                GGML_FP16_TO_FP32(x[i + 1].d)*y[i + 1].d);
+
+        const __m256i bx0 = _mm256_or_si256(bytes_from_nibbles_32(x[i + 0].qs),
+                _mm256_and_si256(bytes_from_bits_32(x[i + 0].qh), _mm256_set1_epi8(0x10)));
+        const __m256i bx1 = _mm256_or_si256(bytes_from_nibbles_32(x[i + 1].qs),
+                _mm256_and_si256(bytes_from_bits_32(x[i + 1].qh), _mm256_set1_epi8(0x10)));
+
+        const __m512i bx = ggml_m512i_from_m256i(bx0, bx1);
+        const __m512i by = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) y[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) y[i + 1].qs));
+
+        acc512 = _mm512_fmadd_ps(d, mul_sum_us8_pairs_float_512(bx, by), acc512);
+    }
+
+    sumf += _mm512_reduce_add_ps(acc512);
+#endif
+    __m256 acc = _mm256_setzero_ps();
+
+    for (; i < nb; ++i) {
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*y[i].d);
+
+        const __m256i bx = _mm256_or_si256(bytes_from_nibbles_32(x[i].qs),
+                _mm256_and_si256(bytes_from_bits_32(x[i].qh), _mm256_set1_epi8(0x10)));
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = GGML_F32x8_FMA(acc, d, mul_sum_us8_pairs_float(bx, by));
+    }
+
+    sumf += hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (; i < nb; ++i) {
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+
+        uint8x16_t qhl;
+        uint8x16_t qhh;
+        ggml_q5_high_bits(x[i].qh, &qhl, &qhh);
+
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        const int8x16_t xl = vreinterpretq_s8_u8(vorrq_u8(vandq_u8(v0, vdupq_n_u8(0x0F)), qhl));
+        const int8x16_t xh = vreinterpretq_s8_u8(vorrq_u8(vshrq_n_u8(v0, 4),              qhh));
+
+        const int32x4_t p = ggml_vdotq_s8x2(xl, vld1q_s8(y[i].qs), xh, vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d)*y[i].d);
+    }
+
+    sumf += vaddvq_f32(sumv);
+#endif
+
+    // scalar
+    for (; i < nb; i++) {
+        uint32_t qh;
+        memcpy(&qh, x[i].qh, sizeof(qh));
+
+        int sumi = 0;
+
+        for (int j = 0; j < QK8_1/2; ++j) {
+            const uint8_t xh_0 = ((qh >> (j +  0)) << 4) & 0x10;
+            const uint8_t xh_1 = ((qh >> (j + 12))     ) & 0x10;
+
+            const int32_t x0 = (x[i].qs[j] & 0x0F) | xh_0;
+            const int32_t x1 = (x[i].qs[j] >>   4) | xh_1;
+
+            sumi += (x0 * y[i].qs[j]) + (x1 * y[i].qs[j + QK8_1/2]);
+        }
+
+        sumf  += (GGML_FP16_TO_FP32(x[i].d)*y[i].d)*sumi;
+        summs += GGML_FP16_TO_FP32(x[i].m)*y[i].s;
+    }
+
+    *s = sumf + summs;
+}
+
+static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int nb = n / QK8_0;
+
+    assert(n % QK8_0 == 0);
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+    int i = 0;
+    float sumf = 0.0f;
+
+#if defined(__AVX2__)
+#if defined(GGML_QDOT_AVX512)
+    __m512 acc512 = _mm512_setzero_ps();
+
+    for (; i + 1 < nb; i += 2) {
+        const __m512 d = ggml_m512_set2(
+                GGML_FP16_TO_FP32(x[i + 0].d)*GGML_FP16_TO_FP32(y[i + 0].d),
+                GGML_FP16_TO_FP32(x[i + 1].d)*GGML_FP16_TO_FP32(y[i + 1].d));
+
+        const __m512i bx = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) x[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) x[i + 1].qs));
+        const __m512i by = ggml_m512i_from_m256i(
+                _mm256_loadu_si256((const __m256i *) y[i + 0].qs),
+                _mm256_loadu_si256((const __m256i *) y[i + 1].qs));
+
+        acc512 = _mm512_fmadd_ps(d, mul_sum_i8_pairs_float_512(bx, by), acc512);
+    }
+
+    sumf += _mm512_reduce_add_ps(acc512);
+#endif
+    __m256 acc = _mm256_setzero_ps();
+
+    for (; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+
+        const __m256i bx = _mm256_loadu_si256((const __m256i *) x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = GGML_F32x8_FMA(acc, d, mul_sum_i8_pairs_float(bx, by));
+    }
+
+    sumf += hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (; i < nb; ++i) {
+        const int32x4_t p = ggml_vdotq_s8x2(
+                vld1q_s8(x[i].qs),      vld1q_s8(y[i].qs),
+                vld1q_s8(x[i].qs + 16), vld1q_s8(y[i].qs + 16));
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    sumf += vaddvq_f32(sumv);
+#endif
+
+    // scalar
+    for (; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK8_0; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += sumi*(GGML_FP16_TO_FP32(x[i].d)*GGML_FP16_TO_FP32(y[i].d));
+    }
+
+    *s = sumf;
+}
+
+typedef void (*dequantize_row_q_t)(const void  * restrict x, float * restrict y, int k);
+typedef void (*quantize_row_q_t)  (const float * restrict x, void  * restrict y, int k);
+typedef void (*vec_dot_q_t)       (const int n, float * restrict s, const void * restrict x, const void * restrict y);
+
+typedef struct {
+    dequantize_row_q_t dequantize_row_q; // NULL for Q8_1, which is only used for activations
+    quantize_row_q_t   quantize_row_q;
+    enum ggml_type     vec_dot_type;     // the type src1 is quantized to for vec_dot_q
+    vec_dot_q_t        vec_dot_q;
+} quantize_fns_t;
+
+static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = {
+        .dequantize_row_q = dequantize_row_q4_0,
+        .quantize_row_q   = quantize_row_q4_0,
+        .vec_dot_type     = GGML_TYPE_Q8_0,
+        .vec_dot_q        = ggml_vec_dot_q4_0_q8_0,
+    },
+    [GGML_TYPE_Q4_1] = {
+        .dequantize_row_q = dequantize_row_q4_1,
+        .quantize_row_q   = quantize_row_q4_1,
+        .vec_dot_type     = GGML_TYPE_Q8_1,
+        .vec_dot_q        = ggml_vec_dot_q4_1_q8_1,
+    },
+    [GGML_TYPE_Q5_0] = {
+        .dequantize_row_q = dequantize_row_q5_0,
+        .quantize_row_q   = quantize_row_q5_0,
+        .vec_dot_type     = GGML_TYPE_Q8_0,
+        .vec_dot_q        = ggml_vec_dot_q5_0_q8_0,
+    },
+    [GGML_TYPE_Q5_1] = {
+        .dequantize_row_q = dequantize_row_q5_1,
+        .quantize_row_q   = quantize_row_q5_1,
+        .vec_dot_type     = GGML_TYPE_Q8_1,
+        .vec_dot_q        = ggml_vec_dot_q5_1_q8_1,
+    },
+    [GGML_TYPE_Q8_0] = {
+        .dequantize_row_q = dequantize_row_q8_0,
+        .quantize_row_q   = quantize_row_q8_0,
+        .vec_dot_type     = GGML_TYPE_Q8_0,
+        .vec_dot_q        = ggml_vec_dot_q8_0_q8_0,
+    },
+    [GGML_TYPE_Q8_1] = {
+        .dequantize_row_q = NULL,
+        .quantize_row_q   = quantize_row_q8_1,
+        .vec_dot_type     = GGML_TYPE_Q8_1,
+        .vec_dot_q        = NULL,
+    },
+};
+
+//
+// logging
+//
+
+#if (GGML_DEBUG >= 1)
+#define GGML_PRINT_DEBUG(...) printf(__VA_ARGS__)
+#else
+#define GGML_PRINT_DEBUG(...)
+#endif
+
+#if (GGML_DEBUG >= 5)
+#define GGML_PRINT_DEBUG_5(...) printf(__VA_ARGS__)
+#else
+#define GGML_PRINT_DEBUG_5(...)
+#endif
+
+#if (GGML_DEBUG >= 10)
+#define GGML_PRINT_DEBUG_10(...) printf(__VA_ARGS__)
+#else
+#define GGML_PRINT_DEBUG_10(...)
+#endif
+
+#define GGML_PRINT(...) printf(__VA_ARGS__)
+
+//
+// data types
+//
+
+static const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    1,
+    1,
+    1,
+    1,
+    1,
+    QK4_0,
+    QK4_1,
+    QK5_0,
+    QK5_1,
+    QK8_0,
+    QK8_1,
+};
+static_assert(GGML_TYPE_COUNT == 11, "GGML_BLCK_SIZE is outdated");
+
+// size of one block - for the non-quantized types a block is a single element
+static const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
+    sizeof(int8_t ),
+    sizeof(int16_t),
+    sizeof(int32_t),
+    sizeof(ggml_fp16_t),
+    sizeof(float  ),
+    sizeof(block_q4_0),
+    sizeof(block_q4_1),
+    sizeof(block_q5_0),
+    sizeof(block_q5_1),
+    sizeof(block_q8_0),
+    sizeof(block_q8_1),
+};
+static_assert(GGML_TYPE_COUNT == 11, "GGML_TYPE_SIZE is outdated");
+
+static const char * GGML_TYPE_NAME[GGML_TYPE_COUNT] = {
+    "i8",
+    "i16",
+    "i32",
+    "f16",
+    "f32",
+    "q4_0",
+    "q4_1",
+    "q5_0",
+    "q5_1",
+    "q8_0",
+    "q8_1",
+};
+static_assert(GGML_TYPE_COUNT == 11, "GGML_TYPE_NAME is outdated");
+
+static const bool GGML_IS_QUANTIZED[GGML_TYPE_COUNT] = {
+    false,
+    false,
+    false,
+    false,
+    false,
+    true,
+    true,
+    true,
+    true,
+    true,
+    true,
+};
+static_assert(GGML_TYPE_COUNT == 11, "GGML_IS_QUANTIZED is outdated");
+
+static const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
+    "NONE",
+
+    "DUP",
+    "ADD",
+    "SUB",
+    "MUL",
+    "DIV",
+    "SQR",
+    "SQRT",
+    "SUM",
+    "MEAN",
+    "REPEAT",
+    "ABS",
+    "SGN",
+    "NEG",
+    "STEP",
+    "RELU",
+    "GELU",
+    "NORM",
+
+    "MUL_MAT",
+
+    "SCALE",
+    "CPY",
+    "RESHAPE",
+    "VIEW",
+    "PERMUTE",
+    "TRANSPOSE",
+    "GET_ROWS",
+    "DIAG_MASK_INF",
+    "SOFT_MAX",
+    "ROPE",
+    "CONV_1D_1S",
+    "CONV_1D_2S",
+
+    "FLASH_ATTN",
+    "FLASH_FF",
+};
+
+static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
+    "none",
+
+    "x",
+    "x+y",
+    "x-y",
+    "x*y",
+    "x/y",
+    "x^2",
+    "√x",
+    "Σx",
+    "Σx/n",
+    "repeat(x)",
+    "abs(x)",
+    "sgn(x)",
+    "-x",
+    "step(x)",
+    "relu(x)",
+    "gelu(x)",
+    "norm(x)",
+
+    "X*Y",
+
+    "x*v",
+    "x-\\>y",
+    "reshape(x)",
+    "view(x)",
+    "permute(x)",
+    "transpose(x)",
+    "get_rows(x)",
+    "diag_mask_inf(x)",
+    "soft_max(x)",
+    "rope(x)",
+    "conv_1d_1s(x)",
+    "conv_1d_2s(x)",
+
+    "flash_attn(x)",
+    "flash_ff(x)",
+};
+
+//
+// ggml object
+//
+
+struct ggml_object {
+    size_t offs;
+    size_t size;
+
+    struct ggml_object * next;
+
+    char padding[8];
+};
+
+static const size_t GGML_OBJECT_SIZE = sizeof(struct ggml_object);
+
+static_assert(sizeof(struct ggml_object)%GGML_MEM_ALIGN == 0, "ggml_object size must be a multiple of GGML_MEM_ALIGN");
+static_assert(sizeof(struct ggml_tensor)%GGML_MEM_ALIGN == 0, "ggml_tensor size must be a multiple of GGML_MEM_ALIGN");
+
+//
+// ggml context
+//
+
+struct ggml_context {
+    size_t mem_size;
+    void * mem_buffer;
+    bool   mem_buffer_owned;
+    bool   no_alloc;
+    bool   no_alloc_save;
+
+    int n_objects;
+
+    struct ggml_object * objects_begin;
+    struct ggml_object * objects_end;
+
+    struct ggml_scratch scratch;
+    struct ggml_scratch scratch_save;
+};
+
+struct ggml_context_container {
+    bool used;
+
+    struct ggml_context context;
+};
+
+//
+// compute types
+//
+
+enum ggml_task_type {
+    GGML_TASK_INIT = 0,
+    GGML_TASK_COMPUTE,
+    GGML_TASK_FINALIZE,
+};
+
+struct ggml_compute_params {
+    enum ggml_task_type type;
+
+    int ith, nth;
+
+    // work buffer for all threads
+    size_t wsize;
+    void * wdata;
+};
+
+//
+// ggml state
+//
+
+struct ggml_state {
+    struct ggml_context_container contexts[GGML_MAX_CONTEXTS];
+};
+
+// global state
+static struct ggml_state g_state;
+static atomic_int g_state_barrier = 0;
+
+// barrier via spin lock
+inline static void ggml_critical_section_start(void) {
+    int processing = atomic_fetch_add(&g_state_barrier, 1);
+
+    while (processing > 0) {
+        // wait for other threads to finish
+        atomic_fetch_sub(&g_state_barrier, 1);
+        sched_yield(); // TODO: reconsider this
+        processing = atomic_fetch_add(&g_state_barrier, 1);
+    }
+}
+
+// TODO: make this somehow automatically executed
+//       some sort of "sentry" mechanism
+inline static void ggml_critical_section_end(void) {
+    atomic_fetch_sub(&g_state_barrier, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ggml_print_object(const struct ggml_object * obj) {
+    GGML_PRINT(" - ggml_object: offset = %zu, size = %zu, next = %p\n",
+            obj->offs, obj->size, (const void *) obj->next);
+}
+
+void ggml_print_objects(const struct ggml_context * ctx) {
+    struct ggml_object * obj = ctx->objects_begin;
+
+    GGML_PRINT("%s: objects in context %p:\n", __func__, (const void *) ctx);
+
+    while (obj != NULL) {
+        ggml_print_object(obj);
+        obj = obj->next;
+    }
+
+    GGML_PRINT("%s: --- end ---\n", __func__);
+}
+
+int ggml_nelements(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[0]*tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+}
+
+int ggml_nrows(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return tensor->ne[1]*tensor->ne[2]*tensor->ne[3];
+}
+
+size_t ggml_nbytes(const struct ggml_tensor * tensor) {
+    static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
+
+    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+}
+
+int ggml_blck_size(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
+}
+
+size_t ggml_type_size(enum ggml_type type) {
     return GGML_TYPE_SIZE[type];
 }
 
+float ggml_type_sizef(enum ggml_type type) {
+    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
+}
+
+const char * ggml_type_name(enum ggml_type type) {
+    return GGML_TYPE_NAME[type];
+}
+
+bool ggml_is_quantized(enum ggml_type type) {
+    return GGML_IS_QUANTIZED[type];
+}
+
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n) {
+    GGML_ASSERT(ggml_is_quantized(type) && quantize_fns[type].dequantize_row_q != NULL);
+    GGML_ASSERT(n % GGML_BLCK_SIZE[type] == 0);
+
+    quantize_fns[type].quantize_row_q(src, dst, n);
+
+    return (n/GGML_BLCK_SIZE[type])*GGML_TYPE_SIZE[type];
+}
+
+void ggml_dequantize(enum ggml_type type, const void * src, float * dst, int n) {
+    GGML_ASSERT(ggml_is_quantized(type) && quantize_fns[type].dequantize_row_q != NULL);
+    GGML_ASSERT(n % GGML_BLCK_SIZE[type] == 0);
+
+    quantize_fns[type].dequantize_row_q(src, dst, n);
+}
+
 size_t ggml_element_size(const struct ggml_tensor * tensor) {
     return GGML_TYPE_SIZE[tensor->type];
 }
@@ -1423,7 +2761,7 @@ static inline bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
 
     return
         tensor->nb[0] == GGML_TYPE_SIZE[tensor->type] &&
-        tensor->nb[1] == tensor->nb[0]*tensor->ne[0] &&
+        tensor->nb[1] == (tensor->nb[0]*tensor->ne[0])/GGML_BLCK_SIZE[tensor->type] &&
         tensor->nb[2] == tensor->nb[1]*tensor->ne[1] &&
         tensor->nb[3] == tensor->nb[2]*tensor->ne[2];
 }
@@ -1548,6 +2886,8 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         /*.mem_size         =*/ params.mem_size,
         /*.mem_buffer       =*/ params.mem_buffer ? params.mem_buffer : malloc(params.mem_size),
         /*.mem_buffer_owned =*/ params.mem_buffer ? false : true,
+        /*.no_alloc         =*/ params.no_alloc,
+        /*.no_alloc_save    =*/ params.no_alloc,
         /*.n_objects        =*/ 0,
         /*.objects_begin    =*/ NULL,
         /*.objects_end      =*/ NULL,
@@ -1593,6 +2933,10 @@ void ggml_free(struct ggml_context * ctx) {
     ggml_critical_section_end();
 }
 
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor) + GGML_MEM_ALIGN;
+}
+
 size_t ggml_used_mem(const struct ggml_context * ctx) {
     return ctx->objects_end->offs + ctx->objects_end->size;
 }
@@ -1605,6 +2949,25 @@ size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch)
     return result;
 }
 
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc) {
+    ctx->no_alloc = no_alloc;
+}
+
+// the tensors created between these get memory in the context itself, even with a scratch buffer or no_alloc
+static void ggml_scratch_save(struct ggml_context * ctx) {
+    ctx->no_alloc_save = ctx->no_alloc;
+    ctx->no_alloc      = false;
+
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+}
+
+static void ggml_scratch_load(struct ggml_context * ctx) {
+    ctx->no_alloc = ctx->no_alloc_save;
+
+    ctx->scratch = ctx->scratch_save;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct ggml_tensor * ggml_new_tensor_impl(
@@ -1622,9 +2985,12 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL) {
-        size_needed += GGML_TYPE_SIZE[type];
-        for (int i = 0; i < n_dims; i++) {
+    if (data == NULL && !ctx->no_alloc) {
+        // quantized rows are stored as whole blocks
+        GGML_ASSERT(ne[0] % GGML_BLCK_SIZE[type] == 0);
+
+        size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
+        for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
         }
         // align to GGML_MEM_ALIGN
@@ -1634,7 +3000,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
     char * const mem_buffer = ctx->mem_buffer;
     struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
 
-    if (ctx->scratch.data == NULL || data != NULL) {
+    if (ctx->scratch.data == NULL || data != NULL || ctx->no_alloc) {
         size_needed += sizeof(struct ggml_tensor);
 
         if (cur_end + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
@@ -1706,7 +3072,10 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ data == NULL ? (void *)(result + 1) : data,
+        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
+        /*.view_src     =*/ NULL,
+        /*.view_offs    =*/ 0,
+        /*.layout       =*/ GGML_LAYOUT_ROWS,
         /*.pad          =*/ { 0 },
     };
 
@@ -1717,7 +3086,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
     }
 
     result->nb[0] = GGML_TYPE_SIZE[type];
-    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+    result->nb[1] = result->nb[0]*(result->ne[0]/GGML_BLCK_SIZE[type]);
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
         result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
     }
 
@@ -1772,12 +3142,11 @@ struct ggml_tensor * ggml_new_tensor_4d(
 }
 
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
-    ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ggml_scratch_save(ctx);
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
 
-    ctx->scratch = ctx->scratch_save;
+    ggml_scratch_load(ctx);
 
     ggml_set_i32(result, value);
 
@@ -1785,12 +3154,11 @@ struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
-    ctx->scratch_save = ctx->scratch;
-    ctx->scratch.data = NULL;
+    ggml_scratch_save(ctx);
 
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
 
-    ctx->scratch = ctx->scratch_save;
+    ggml_scratch_load(ctx);
 
     ggml_set_f32(result, value);
 
@@ -1849,6 +3217,12 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1901,6 +3275,12 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1937,6 +3317,12 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1973,6 +3359,12 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2007,6 +3399,12 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2043,6 +3441,12 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2059,10 +3463,24 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
     return (float *)(tensor->data);
 }
 
+// the memory of a view - none yet, if a has not been planned by ggml_graph_alloc()
+static void * ggml_view_data(const struct ggml_tensor * a, size_t offset) {
+    return a->data == NULL ? NULL : (char *) a->data + offset;
+}
+
+static void ggml_set_view_src(struct ggml_tensor * view, const struct ggml_tensor * a, size_t offset) {
+    view->view_src  = a->view_src ? a->view_src : (struct ggml_tensor *) a;
+    view->view_offs = a->view_offs + offset;
+}
+
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+
+    ggml_set_view_src(result, src, 0);
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2108,7 +3526,8 @@ struct ggml_tensor * ggml_add_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    assert(ggml_are_same_shape(a, b));
+    // b is broadcast to the shape of a, so a bias or scale vector can be applied without ggml_repeat()
+    GGML_ASSERT(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
@@ -2116,6 +3535,10 @@ struct ggml_tensor * ggml_add_impl(
         is_node = true;
     }
 
+    if (is_node && !ggml_are_same_shape(a, b)) {
+        GGML_ASSERT(false); // TODO: implement backward for broadcasting
+    }
+
     struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
 
     result->op   = GGML_OP_ADD;
@@ -2186,7 +3609,8 @@ struct ggml_tensor * ggml_mul_impl(
         struct ggml_tensor * a,
         struct ggml_tensor * b,
         bool inplace) {
-    assert(ggml_are_same_shape(a, b));
+    // b is broadcast to the shape of a, so a bias or scale vector can be applied without ggml_repeat()
+    GGML_ASSERT(ggml_can_repeat(b, a));
 
     bool is_node = false;
 
@@ -2194,6 +3618,10 @@ struct ggml_tensor * ggml_mul_impl(
         is_node = true;
     }
 
+    if (is_node && !ggml_are_same_shape(a, b)) {
+        GGML_ASSERT(false); // TODO: implement backward for broadcasting
+    }
+
     if (inplace) {
         assert(is_node == false);
     }
@@ -2652,6 +4080,7 @@ struct ggml_tensor * ggml_mul_mat(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b) {
     assert(ggml_can_mul_mat(a, b));
+    GGML_ASSERT(a->layout != GGML_LAYOUT_CONV_1D && b->layout == GGML_LAYOUT_ROWS);
 
     bool is_node = false;
 
@@ -2773,6 +4202,8 @@ struct ggml_tensor * ggml_reshape(
 
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, b->n_dims, b->ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2799,6 +4230,8 @@ struct ggml_tensor * ggml_reshape_2d(
     const int ne[2] = { ne0, ne1 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2826,6 +4259,38 @@ struct ggml_tensor * ggml_reshape_3d(
     const int ne[3] = { ne0, ne1, ne2 };
     struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, a->data);
 
+    ggml_set_view_src(result, a, 0);
+
+    result->op   = GGML_OP_RESHAPE;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src0 = a;
+    result->src1 = NULL;
+
+    return result;
+}
+
+struct ggml_tensor * ggml_reshape_4d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        int                   ne3) {
+    assert(ggml_is_contiguous(a));
+    assert(ggml_nelements(a) == ne0*ne1*ne2*ne3);
+
+    bool is_node = false;
+
+    if (a->grad) {
+        assert(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    const int ne[4] = { ne0, ne1, ne2, ne3 };
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, a->data);
+
+    ggml_set_view_src(result, a, 0);
+
     result->op   = GGML_OP_RESHAPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
@@ -2845,7 +4310,9 @@ struct ggml_tensor * ggml_view_1d(
         assert(false); // gradient propagation is not supported
     }
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 1, &ne0, ggml_view_data(a, offset));
+
+    ggml_set_view_src(result, a, offset);
 
     result->op   = GGML_OP_VIEW;
     result->grad = NULL;
@@ -2870,7 +4337,9 @@ struct ggml_tensor * ggml_view_2d(
 
     const int ne[GGML_MAX_DIMS] = { ne0, ne1, 1, 1 };
 
-    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, (char *) a->data + offset);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 2, ne, ggml_view_data(a, offset));
+
+    ggml_set_view_src(result, a, offset);
 
     result->nb[1] = nb1;
     result->nb[2] = result->nb[1]*ne1;
@@ -3070,7 +4539,12 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    ggml_scratch_save(ctx);
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
+
+    ggml_scratch_load(ctx);
+
     ((int32_t *) b->data)[0] = n_past;
     ((int32_t *) b->data)[1] = n_dims;
     ((int32_t *) b->data)[2] = mode;
@@ -3092,6 +4566,7 @@ struct ggml_tensor * ggml_conv_1d_1s(
     assert(ggml_is_matrix(b));
     assert(a->ne[1] == b->ne[1]);
     assert(a->ne[3] == 1);
+    GGML_ASSERT(a->layout != GGML_LAYOUT_MUL_MAT && b->layout == GGML_LAYOUT_ROWS);
     bool is_node = false;
 
     if (a->grad || b->grad) {
@@ -3119,6 +4594,7 @@ struct ggml_tensor * ggml_conv_1d_2s(
     assert(ggml_is_matrix(b));
     assert(a->ne[1] == b->ne[1]);
     assert(a->ne[3] == 1);
+    GGML_ASSERT(a->layout != GGML_LAYOUT_MUL_MAT && b->layout == GGML_LAYOUT_ROWS);
     bool is_node = false;
 
     if (a->grad || b->grad) {
@@ -3218,103 +4694,88 @@ static void ggml_compute_forward_dup_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_is_contiguous(dst));
-    assert(ggml_nelements(dst) == ggml_nelements(src0));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
-    const int ne03 = src0->ne[3];
 
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
     const size_t nb02 = src0->nb[2];
     const size_t nb03 = src0->nb[3];
 
+    // the rows of src0 are split between the threads
+    // dst is contiguous, so row ir of src0 goes to dst elements [ir*ne00, (ir + 1)*ne00)
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+        const size_t rs = ne00*GGML_TYPE_SIZE[src0->type];
+
+        if (ir0 < ir1) {
+            memcpy((char *) dst->data + ir0*rs, (char *) src0->data + ir0*rs, (ir1 - ir0)*rs);
+        }
         return;
     }
 
-    if (src0->nb[0] == sizeof(ggml_fp16_t)) {
-        if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            const size_t rs = ne00*nb00;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
-                        char * dst_ptr = (char *) dst->data + id*rs;
-
-                        memcpy(dst_ptr, src0_ptr, rs);
+    if (nb00 == sizeof(ggml_fp16_t) && dst->type == GGML_TYPE_F16) {
+        const size_t rs = ne00*nb00;
 
-                        id++;
-                    }
-                }
-            }
-        } else if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+            const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+            char * dst_ptr = (char *) dst->data + ir*rs;
 
-                            dst_ptr[id] = GGML_FP16_TO_FP32(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
-            }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
+            memcpy(dst_ptr, src0_ptr, rs);
         }
-    } else {
-        //printf("%s: this is not optimal - fix me\n", __func__);
+    } else if (dst->type == GGML_TYPE_F16) {
+        ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
 
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+            for (int i00 = 0; i00 < ne00; i00++) {
+                const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
 
-                            dst_ptr[id] = GGML_FP16_TO_FP32(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
+                dst_ptr[ir*ne00 + i00] = *src0_ptr;
             }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
+        }
+    } else if (dst->type == GGML_TYPE_F32) {
+        float * dst_ptr = (float *) dst->data;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-                            dst_ptr[id] = *src0_ptr;
-                            id++;
-                        }
-                    }
-                }
+            for (int i00 = 0; i00 < ne00; i00++) {
+                const ggml_fp16_t * src0_ptr = (ggml_fp16_t *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+
+                dst_ptr[ir*ne00 + i00] = GGML_FP16_TO_FP32(*src0_ptr);
             }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
         }
+    } else {
+        GGML_ASSERT(false); // TODO: implement
     }
 }
 
@@ -3322,7 +4783,6 @@ static void ggml_compute_forward_dup_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(params->ith == 0);
     GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
@@ -3330,95 +4790,81 @@ static void ggml_compute_forward_dup_f32(
         return;
     }
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
-    const int ne03 = src0->ne[3];
 
     const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
     const size_t nb02 = src0->nb[2];
     const size_t nb03 = src0->nb[3];
 
+    // the rows of src0 are split between the threads
+    // dst is contiguous, so row ir of src0 goes to dst elements [ir*ne00, (ir + 1)*ne00)
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
-        memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
+        const size_t rs = ne00*GGML_TYPE_SIZE[src0->type];
+
+        if (ir0 < ir1) {
+            memcpy((char *) dst->data + ir0*rs, (char *) src0->data + ir0*rs, (ir1 - ir0)*rs);
+        }
         return;
     }
 
-    if (src0->nb[0] == sizeof(float)) {
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            const size_t rs = ne00*nb00;
-
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
-                        char * dst_ptr = (char *) dst->data + id*rs;
-
-                        memcpy(dst_ptr, src0_ptr, rs);
+    if (nb00 == sizeof(float) && dst->type == GGML_TYPE_F32) {
+        const size_t rs = ne00*nb00;
 
-                        id++;
-                    }
-                }
-            }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+            const char * src0_ptr = (char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03;
+            char * dst_ptr = (char *) dst->data + ir*rs;
 
-                            dst_ptr[id] = GGML_FP32_TO_FP16(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
-            }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
+            memcpy(dst_ptr, src0_ptr, rs);
         }
-    } else {
-        //printf("%s: this is not optimal - fix me\n", __func__);
+    } else if (dst->type == GGML_TYPE_F32) {
+        float * dst_ptr = (float *) dst->data;
 
-        if (dst->type == GGML_TYPE_F32) {
-            int id = 0;
-            float * dst_ptr = (float *) dst->data;
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+            for (int i00 = 0; i00 < ne00; i00++) {
+                const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
 
-                            dst_ptr[id] = *src0_ptr;
-                            id++;
-                        }
-                    }
-                }
+                dst_ptr[ir*ne00 + i00] = *src0_ptr;
             }
-        } else if (dst->type == GGML_TYPE_F16) {
-            int id = 0;
-            ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
+        }
+    } else if (dst->type == GGML_TYPE_F16) {
+        ggml_fp16_t * dst_ptr = (ggml_fp16_t *) dst->data;
+
+        for (int ir = ir0; ir < ir1; ir++) {
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = ir - i03*ne02*ne01 - i02*ne01;
 
-            for (int i03 = 0; i03 < ne03; i03++) {
-                for (int i02 = 0; i02 < ne02; i02++) {
-                    for (int i01 = 0; i01 < ne01; i01++) {
-                        for (int i00 = 0; i00 < ne00; i00++) {
-                            const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
+            for (int i00 = 0; i00 < ne00; i00++) {
+                const float * src0_ptr = (float *) ((char *) src0->data + i00*nb00 + i01*nb01 + i02*nb02 + i03*nb03);
 
-                            dst_ptr[id] = GGML_FP32_TO_FP16(*src0_ptr);
-                            id++;
-                        }
-                    }
-                }
+                dst_ptr[ir*ne00 + i00] = GGML_FP32_TO_FP16(*src0_ptr);
             }
-        } else {
-            GGML_ASSERT(false); // TODO: implement
         }
+    } else {
+        GGML_ASSERT(false); // TODO: implement
     }
 }
 
@@ -3438,6 +4884,12 @@ static void ggml_compute_forward_dup(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3452,7 +4904,7 @@ static void ggml_compute_forward_add_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    GGML_ASSERT(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
@@ -3461,40 +4913,64 @@ static void ggml_compute_forward_add_f32(
     const int ith = params->ith;
     const int nth = params->nth;
 
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
 
-    const size_t nb00 = src0->nb[0];
     const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
 
     const size_t nb10 = src1->nb[0];
     const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
 
-    const size_t nb0 = dst->nb[0];
     const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
 
-    GGML_ASSERT( nb0 == sizeof(float));
-    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int nr = ggml_nrows(src0);
 
-    if (nb10 == sizeof(float)) {
-        const int j0 = (n/nth)*ith;
-        const int j1 = ith == nth - 1 ? n : (n/nth)*(ith + 1);
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-        for (int j = j0; j < j1; j++) {
-            ggml_vec_add_f32(nc,
-                    (float *) ((char *) dst->data  + j*nb1),
-                    (float *) ((char *) src0->data + j*nb01),
-                    (float *) ((char *) src1->data + j*nb11));
-        }
-    } else {
-        // src1 is not contiguous
-        for (int j = ith; j < n; j += nth) {
-            float * dst_ptr  = (float *) ((char *) dst->data  + j*nb1);
-            float * src0_ptr = (float *) ((char *) src0->data + j*nb01);
-            for (int i = 0; i < nc; i++) {
-                float * src1_ptr = (float *) ((char *) src1->data + j*nb11 + i*nb10);
-
-                dst_ptr[i] = src0_ptr[i] + *src1_ptr;
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = ir - i03*ne02*ne01 - i02*ne01;
+
+        // src1 is broadcast along the dimensions in which it is smaller than src0 (e.g. a bias row)
+        const int i13 = i03 % ne13;
+        const int i12 = i02 % ne12;
+        const int i11 = i01 % ne11;
+
+        float * dst_ptr  = (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+        float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        float * src1_ptr = (float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
+
+        if (ne10 == ne00 && nb10 == sizeof(float)) {
+            ggml_vec_add_f32(ne00, dst_ptr, src0_ptr, src1_ptr);
+        } else if (ne10 == 1) {
+            const float v = *src1_ptr;
+            for (int i = 0; i < ne00; i++) {
+                dst_ptr[i] = src0_ptr[i] + v;
+            }
+        } else {
+            for (int i = 0; i < ne00; i++) {
+                dst_ptr[i] = src0_ptr[i] + *(float *) ((char *) src1_ptr + (i % ne10)*nb10);
             }
         }
     }
@@ -3514,6 +4990,12 @@ static void ggml_compute_forward_add(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3528,21 +5010,30 @@ static void ggml_compute_forward_sub_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sub_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])),
@@ -3564,6 +5055,12 @@ static void ggml_compute_forward_sub(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3578,25 +5075,75 @@ static void ggml_compute_forward_mul_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-    assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat(src1, src0) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-    assert( dst->nb[0] == sizeof(float));
-    assert(src0->nb[0] == sizeof(float));
-    assert(src1->nb[0] == sizeof(float));
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
 
-    for (int i = 0; i < n; i++) {
-        ggml_vec_mul_f32(nc,
-                (float *) ((char *) dst->data  + i*( dst->nb[1])),
-                (float *) ((char *) src0->data + i*(src0->nb[1])),
-                (float *) ((char *) src1->data + i*(src1->nb[1])));
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const size_t nb01 = src0->nb[1];
+    const size_t nb02 = src0->nb[2];
+    const size_t nb03 = src0->nb[3];
+
+    const size_t nb10 = src1->nb[0];
+    const size_t nb11 = src1->nb[1];
+    const size_t nb12 = src1->nb[2];
+    const size_t nb13 = src1->nb[3];
+
+    const size_t nb1 = dst->nb[1];
+    const size_t nb2 = dst->nb[2];
+    const size_t nb3 = dst->nb[3];
+
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = ir - i03*ne02*ne01 - i02*ne01;
+
+        // src1 is broadcast along the dimensions in which it is smaller than src0 (e.g. a bias row)
+        const int i13 = i03 % ne13;
+        const int i12 = i02 % ne12;
+        const int i11 = i01 % ne11;
+
+        float * dst_ptr  = (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+        float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        float * src1_ptr = (float *) ((char *) src1->data + i11*nb11 + i12*nb12 + i13*nb13);
+
+        if (ne10 == ne00 && nb10 == sizeof(float)) {
+            ggml_vec_mul_f32(ne00, dst_ptr, src0_ptr, src1_ptr);
+        } else if (ne10 == 1) {
+            const float v = *src1_ptr;
+            for (int i = 0; i < ne00; i++) {
+                dst_ptr[i] = src0_ptr[i] * v;
+            }
+        } else {
+            for (int i = 0; i < ne00; i++) {
+                dst_ptr[i] = src0_ptr[i] * *(float *) ((char *) src1_ptr + (i % ne10)*nb10);
+            }
+        }
     }
 }
 
@@ -3614,6 +5161,12 @@ static void ggml_compute_forward_mul(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3628,21 +5181,30 @@ static void ggml_compute_forward_div_f32(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, src1) && ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
     assert(src1->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_div_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])),
@@ -3664,6 +5226,12 @@ static void ggml_compute_forward_div(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3677,20 +5245,29 @@ static void ggml_compute_forward_sqr_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n     = ggml_nrows(src0);
-    const int nc    = src0->ne[0];
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sqr_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3710,6 +5287,12 @@ static void ggml_compute_forward_sqr(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3723,20 +5306,29 @@ static void ggml_compute_forward_sqrt_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
-    const int nc = src0->ne[0];
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sqrt_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3756,6 +5348,12 @@ static void ggml_compute_forward_sqrt(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3769,34 +5367,68 @@ static void ggml_compute_forward_sum_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_is_scalar(dst));
+    assert(src0->nb[0] == sizeof(float));
 
-    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // each thread sums its rows into its own cache line of wdata, the partial sums are added up in FINALIZE
+    GGML_ASSERT(params->wsize >= (size_t) nth*CACHE_LINE_SIZE);
+
+    float * const wdata = (float *) params->wdata;
+
+    if (params->type == GGML_TASK_INIT) {
         return;
     }
 
-    assert(ggml_is_scalar(dst));
-    assert(src0->nb[0] == sizeof(float));
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (ith != 0) {
+            return;
+        }
+
+        ggml_float sum = 0.0;
+        for (int k = 0; k < nth; k++) {
+            sum += wdata[k*CACHE_LINE_SIZE_F32];
+        }
+
+        *(float *) dst->data = sum;
+
+        return;
+    }
 
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
-    const int ne03 = src0->ne[3];
 
     const size_t nb01 = src0->nb[1];
     const size_t nb02 = src0->nb[2];
     const size_t nb03 = src0->nb[3];
 
-    for (int i03 = 0; i03 < ne03; i03++) {
-        for (int i02 = 0; i02 < ne02; i02++) {
-            for (int i01 = 0; i01 < ne01; i01++) {
-                ggml_vec_sum_f32(ne00,
-                        (float *) (dst->data),
-                        (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03));
-            }
-        }
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    ggml_float sum = 0.0;
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = ir - i03*ne02*ne01 - i02*ne01;
+
+        float row_sum = 0.0f;
+        ggml_vec_sum_f32(ne00, &row_sum,
+                (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03));
+
+        sum += row_sum;
     }
+
+    wdata[ith*CACHE_LINE_SIZE_F32] = sum;
 }
 
 static void ggml_compute_forward_sum(
@@ -3812,6 +5444,12 @@ static void ggml_compute_forward_sum(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3825,14 +5463,15 @@ static void ggml_compute_forward_mean_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
-
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
     assert(src0->nb[0] == sizeof(float));
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int ne00 = src0->ne[0];
     const int ne01 = src0->ne[1];
     const int ne02 = src0->ne[2];
@@ -3856,21 +5495,31 @@ static void ggml_compute_forward_mean_f32(
     UNUSED(ne1);
     UNUSED(ne2);
     UNUSED(ne3);
+    UNUSED(ne03);
 
     const size_t nb1 = dst->nb[1];
     const size_t nb2 = dst->nb[2];
     const size_t nb3 = dst->nb[3];
 
-    for (int i03 = 0; i03 < ne03; i03++) {
-        for (int i02 = 0; i02 < ne02; i02++) {
-            for (int i01 = 0; i01 < ne01; i01++) {
-                ggml_vec_sum_f32(ne00,
-                        (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3),
-                        (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03));
+    const int nr = ggml_nrows(src0);
 
-                *(float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3) /= (float) ne00;
-            }
-        }
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ir++) {
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = ir - i03*ne02*ne01 - i02*ne01;
+
+        ggml_vec_sum_f32(ne00,
+                (float *) ((char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3),
+                (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03));
+
+        *(float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3) /= (float) ne00;
     }
 }
 
@@ -3887,6 +5536,12 @@ static void ggml_compute_forward_mean(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3900,7 +5555,6 @@ static void ggml_compute_forward_repeat_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_can_repeat(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -3913,25 +5567,32 @@ static void ggml_compute_forward_repeat_f32(
     assert( dst->ne[2] == 1);
     assert( dst->ne[3] == 1);
 
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc  = dst->ne[0];
     const int nr  = dst->ne[1];
     const int nc0 = src0->ne[0];
     const int nr0 = src0->ne[1];
     const int ncr = nc/nc0; // guaranteed to be an integer due to the check in ggml_can_repeat
-    const int nrr = nr/nr0; // guaranteed to be an integer due to the check in ggml_can_repeat
 
     // TODO: support for transposed / permuted tensors
     assert( dst->nb[0] == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    // TODO: maybe this is not optimal?
-    for (int i = 0; i < nrr; i++) {
+    // the rows of dst are split between the threads
+    const int dr = (nr + nth - 1)/nth;
+
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i = ir0; i < ir1; i++) {
+        const int k = i % nr0;
+
         for (int j = 0; j < ncr; j++) {
-            for (int k = 0; k < nr0; k++) {
-                ggml_vec_cpy_f32(nc0,
-                        (float *) ((char *)  dst->data + (i*nr0 + k)*( dst->nb[1]) + j*nc0*( dst->nb[0])),
-                        (float *) ((char *) src0->data + (        k)*(src0->nb[1])));
-            }
+            ggml_vec_cpy_f32(nc0,
+                    (float *) ((char *)  dst->data + i*( dst->nb[1]) + j*nc0*( dst->nb[0])),
+                    (float *) ((char *) src0->data + k*(src0->nb[1])));
         }
     }
 }
@@ -3949,6 +5610,12 @@ static void ggml_compute_forward_repeat(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3962,20 +5629,29 @@ static void ggml_compute_forward_abs_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_abs_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -3995,6 +5671,12 @@ static void ggml_compute_forward_abs(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4008,20 +5690,29 @@ static void ggml_compute_forward_sgn_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_sgn_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -4041,6 +5732,12 @@ static void ggml_compute_forward_sgn(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4054,20 +5751,29 @@ static void ggml_compute_forward_neg_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_neg_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -4087,6 +5793,12 @@ static void ggml_compute_forward_neg(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4100,20 +5812,29 @@ static void ggml_compute_forward_step_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_step_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -4133,6 +5854,12 @@ static void ggml_compute_forward_step(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4146,20 +5873,29 @@ static void ggml_compute_forward_relu_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
-    assert(params->ith == 0);
     assert(ggml_are_same_shape(src0, dst));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
 
-    const int n  = ggml_nrows(src0);
+    const int ith = params->ith;
+    const int nth = params->nth;
+
     const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
     assert(dst->nb[0]  == sizeof(float));
     assert(src0->nb[0] == sizeof(float));
 
-    for (int i = 0; i < n; i++) {
+    for (int i = ir0; i < ir1; i++) {
         ggml_vec_relu_f32(nc,
                 (float *) ((char *) dst->data  + i*( dst->nb[1])),
                 (float *) ((char *) src0->data + i*(src0->nb[1])));
@@ -4179,6 +5915,12 @@ static void ggml_compute_forward_relu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4242,6 +5984,12 @@ static void ggml_compute_forward_gelu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4324,6 +6072,12 @@ static void ggml_compute_forward_norm(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4340,24 +6094,345 @@ static bool ggml_compute_forward_mul_mat_use_blas(
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
               struct ggml_tensor * dst) {
-    UNUSED(src0);
+    if (src0->layout != GGML_LAYOUT_ROWS) {
+        return false;
+    }
 
     const int ne10 = src1->ne[0];
 
-    const int ne0 = dst->ne[0];
-    const int ne1 = dst->ne[1];
+    const int ne0 = dst->ne[0];
+    const int ne1 = dst->ne[1];
+
+    // TODO: find the optimal values for these
+    if (ggml_is_contiguous(src0) && ggml_is_contiguous(src1) && (
+             (ne0 >= 32 && ne1  >= 32   && ne10 >= 32)
+            )) {
+        //printf("BLAS: %d %d %d\n", ne0, ne1, ne10);
+        return true;
+    }
+
+    return false;
+}
+#endif
+
+// blocked GEMM for the F16 x F32 matrix multiplications with many src1 columns (the encoder, the prompt)
+//
+// dst is computed in tiles of GGML_GEMM_NR0 src0 rows x GGML_GEMM_NR1 src1 columns that are kept in registers over a
+// panel of GGML_GEMM_KC elements of the rows and columns. both operands are packed into panels first, so that the
+// microkernel reads them sequentially: a block of GGML_GEMM_NB1 src1 columns (F32) stays in L2/L3 and a block of
+// GGML_GEMM_NB0 src0 rows (F16) in L2, while the microkernel streams one panel of the src0 block from L2 against one
+// panel of src1 in L1. weights packed with ggml_mul_mat_pack() are already in panels and are read in place
+//
+// the dot product path is still used when src1 has only a few columns (the decoder), since packing does not pay off
+
+#if defined(__AVX512F__)
+
+#define GGML_GEMM_EPR 16
+
+#define GGML_GEMM_VEC         __m512
+#define GGML_GEMM_VEC_ZERO    _mm512_setzero_ps()
+#define GGML_GEMM_VEC_SET1    _mm512_set1_ps
+#define GGML_GEMM_VEC_LOAD    _mm512_loadu_ps
+#define GGML_GEMM_VEC_STORE   _mm512_storeu_ps
+#define GGML_GEMM_VEC_FMA(a, b, c) _mm512_fmadd_ps(b, c, a)
+#define GGML_GEMM_VEC_ADD     _mm512_add_ps
+
+#define GGML_GEMM_VEC_LOAD_F16(p) _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(p)))
+
+#elif defined(GGML_SIMD)
+
+#define GGML_GEMM_EPR GGML_F32_EPR
+
+#define GGML_GEMM_VEC         GGML_F32_VEC
+#define GGML_GEMM_VEC_ZERO    GGML_F32_VEC_ZERO
+#define GGML_GEMM_VEC_SET1    GGML_F32_VEC_SET1
+#define GGML_GEMM_VEC_LOAD    GGML_F32_VEC_LOAD
+#define GGML_GEMM_VEC_STORE   GGML_F32_VEC_STORE
+#define GGML_GEMM_VEC_FMA     GGML_F32_VEC_FMA
+#define GGML_GEMM_VEC_ADD     GGML_F32_VEC_ADD
+
+#if defined(__AVX__)
+#define GGML_GEMM_VEC_LOAD_F16(p) _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(p)))
+#elif defined(__ARM_NEON)
+#define GGML_GEMM_VEC_LOAD_F16(p) vcvt_f32_f16(vld1_f16((const __fp16 *)(p)))
+#else
+inline static GGML_GEMM_VEC ggml_gemm_vec_load_f16(const ggml_fp16_t * p) {
+    float tmp[GGML_GEMM_EPR];
+    for (int i = 0; i < GGML_GEMM_EPR; ++i) {
+        tmp[i] = GGML_FP16_TO_FP32(p[i]);
+    }
+    return GGML_GEMM_VEC_LOAD(tmp);
+}
+#define GGML_GEMM_VEC_LOAD_F16(p) ggml_gemm_vec_load_f16(p)
+#endif
+
+#endif
+
+#if defined(GGML_GEMM_EPR)
+
+#define GGML_GEMM_NR0 (2*GGML_GEMM_EPR) // src0 rows in a tile - 2 registers
+#define GGML_GEMM_NR1 6                 // src1 columns in a tile - 6 broadcasts, 12 accumulators
+#define GGML_GEMM_KC  256               // elements of the rows and columns in a panel
+#define GGML_GEMM_NB0 128               // src0 rows in a block
+#define GGML_GEMM_NB1 384               // src1 columns in a block
+
+// minimum number of src1 columns for the blocked GEMM, unless src0 is packed
+#define GGML_GEMM_MIN_NE11 16
+
+// per-thread work buffer for the packed blocks
+#define GGML_GEMM_WSIZE (GGML_GEMM_KC*(GGML_GEMM_NB0*sizeof(ggml_fp16_t) + GGML_GEMM_NB1*sizeof(float)))
+
+// dst tile [n1][n0] (row stride ldc) = (accumulate ? dst : 0) + a*b over k elements
+// a - k x GGML_GEMM_NR0, b - k x GGML_GEMM_NR1, packed
+static void ggml_gemm_tile(
+        const int k,
+        const ggml_fp16_t * restrict a,
+        const float * restrict b,
+        float * restrict dst,
+        const int ldc,
+        const int n0,
+        const int n1,
+        const bool accumulate) {
+    GGML_GEMM_VEC c00 = GGML_GEMM_VEC_ZERO, c01 = GGML_GEMM_VEC_ZERO;
+    GGML_GEMM_VEC c10 = GGML_GEMM_VEC_ZERO, c11 = GGML_GEMM_VEC_ZERO;
+    GGML_GEMM_VEC c20 = GGML_GEMM_VEC_ZERO, c21 = GGML_GEMM_VEC_ZERO;
+    GGML_GEMM_VEC c30 = GGML_GEMM_VEC_ZERO, c31 = GGML_GEMM_VEC_ZERO;
+    GGML_GEMM_VEC c40 = GGML_GEMM_VEC_ZERO, c41 = GGML_GEMM_VEC_ZERO;
+    GGML_GEMM_VEC c50 = GGML_GEMM_VEC_ZERO, c51 = GGML_GEMM_VEC_ZERO;
+
+    for (int i = 0; i < k; ++i) {
+        const GGML_GEMM_VEC a0 = GGML_GEMM_VEC_LOAD_F16(a);
+        const GGML_GEMM_VEC a1 = GGML_GEMM_VEC_LOAD_F16(a + GGML_GEMM_EPR);
+
+        GGML_GEMM_VEC bj;
+
+        bj = GGML_GEMM_VEC_SET1(b[0]); c00 = GGML_GEMM_VEC_FMA(c00, a0, bj); c01 = GGML_GEMM_VEC_FMA(c01, a1, bj);
+        bj = GGML_GEMM_VEC_SET1(b[1]); c10 = GGML_GEMM_VEC_FMA(c10, a0, bj); c11 = GGML_GEMM_VEC_FMA(c11, a1, bj);
+        bj = GGML_GEMM_VEC_SET1(b[2]); c20 = GGML_GEMM_VEC_FMA(c20, a0, bj); c21 = GGML_GEMM_VEC_FMA(c21, a1, bj);
+        bj = GGML_GEMM_VEC_SET1(b[3]); c30 = GGML_GEMM_VEC_FMA(c30, a0, bj); c31 = GGML_GEMM_VEC_FMA(c31, a1, bj);
+        bj = GGML_GEMM_VEC_SET1(b[4]); c40 = GGML_GEMM_VEC_FMA(c40, a0, bj); c41 = GGML_GEMM_VEC_FMA(c41, a1, bj);
+        bj = GGML_GEMM_VEC_SET1(b[5]); c50 = GGML_GEMM_VEC_FMA(c50, a0, bj); c51 = GGML_GEMM_VEC_FMA(c51, a1, bj);
+
+        a += GGML_GEMM_NR0;
+        b += GGML_GEMM_NR1;
+    }
+
+    GGML_GEMM_VEC c[GGML_GEMM_NR1][2] = {
+        { c00, c01 }, { c10, c11 }, { c20, c21 }, { c30, c31 }, { c40, c41 }, { c50, c51 },
+    };
+
+    if (n0 == GGML_GEMM_NR0) {
+        for (int j = 0; j < n1; ++j) {
+            float * d = dst + j*ldc;
+
+            if (accumulate) {
+                c[j][0] = GGML_GEMM_VEC_ADD(c[j][0], GGML_GEMM_VEC_LOAD(d));
+                c[j][1] = GGML_GEMM_VEC_ADD(c[j][1], GGML_GEMM_VEC_LOAD(d + GGML_GEMM_EPR));
+            }
+
+            GGML_GEMM_VEC_STORE(d,                 c[j][0]);
+            GGML_GEMM_VEC_STORE(d + GGML_GEMM_EPR, c[j][1]);
+        }
+    } else {
+        // partial tile at the end of the src0 rows
+        float tmp[GGML_GEMM_NR0];
+
+        for (int j = 0; j < n1; ++j) {
+            float * d = dst + j*ldc;
+
+            GGML_GEMM_VEC_STORE(tmp,                 c[j][0]);
+            GGML_GEMM_VEC_STORE(tmp + GGML_GEMM_EPR, c[j][1]);
+
+            for (int i = 0; i < n0; ++i) {
+                d[i] = accumulate ? d[i] + tmp[i] : tmp[i];
+            }
+        }
+    }
+}
+
+// packs k elements of n F16 rows (row stride ld) into panels of GGML_GEMM_NR0 interleaved rows, padding the last
+// panel with zeros
+static void ggml_gemm_pack_src0(
+        const int k,
+        const int n,
+        const ggml_fp16_t * restrict x,
+        const int ld,
+        ggml_fp16_t * restrict y) {
+    const ggml_fp16_t zero = GGML_FP32_TO_FP16(0.0f);
+
+    for (int i0 = 0; i0 < n; i0 += GGML_GEMM_NR0) {
+        const int nc = MIN(GGML_GEMM_NR0, n - i0);
+
+        for (int i = 0; i < nc; ++i) {
+            const ggml_fp16_t * xi = x + (i0 + i)*ld;
+
+            for (int l = 0; l < k; ++l) {
+                y[l*GGML_GEMM_NR0 + i] = xi[l];
+            }
+        }
+
+        for (int i = nc; i < GGML_GEMM_NR0; ++i) {
+            for (int l = 0; l < k; ++l) {
+                y[l*GGML_GEMM_NR0 + i] = zero;
+            }
+        }
+
+        y += k*GGML_GEMM_NR0;
+    }
+}
+
+// packs k elements of n F32 or F16 rows (row stride ld) into F32 panels of GGML_GEMM_NR1 interleaved rows, padding
+// the last panel with zeros
+static void ggml_gemm_pack_src1(
+        const int k,
+        const int n,
+        const void * restrict x,
+        const enum ggml_type type,
+        const int ld,
+        float * restrict y) {
+    for (int i0 = 0; i0 < n; i0 += GGML_GEMM_NR1) {
+        const int nc = MIN(GGML_GEMM_NR1, n - i0);
+
+        for (int i = 0; i < nc; ++i) {
+            if (type == GGML_TYPE_F32) {
+                const float * xi = (const float *) x + (i0 + i)*ld;
+
+                for (int l = 0; l < k; ++l) {
+                    y[l*GGML_GEMM_NR1 + i] = xi[l];
+                }
+            } else {
+                const ggml_fp16_t * xi = (const ggml_fp16_t *) x + (i0 + i)*ld;
+
+                for (int l = 0; l < k; ++l) {
+                    y[l*GGML_GEMM_NR1 + i] = GGML_FP16_TO_FP32(xi[l]);
+                }
+            }
+        }
+
+        for (int i = nc; i < GGML_GEMM_NR1; ++i) {
+            for (int l = 0; l < k; ++l) {
+                y[l*GGML_GEMM_NR1 + i] = 0.0f;
+            }
+        }
+
+        y += k*GGML_GEMM_NR1;
+    }
+}
+
+// dst [n1][n0] (row stride ldc) = x [n0][k] * y [n1][k]^T
+// x - F16 rows with row stride ldx, or if packed, the panels of ggml_mul_mat_pack() of the n0 rows (n0 is then a
+//     multiple of GGML_GEMM_NR0, or the rest of the matrix)
+// y - F32 or F16 (ty) rows with row stride ldy
+// wdata - GGML_GEMM_WSIZE bytes
+static void ggml_gemm_f16(
+        const int k,
+        const int n0,
+        const int n1,
+        const ggml_fp16_t * restrict x,
+        const int ldx,
+        const bool packed,
+        const void * restrict y,
+        const enum ggml_type ty,
+        const int ldy,
+        float * restrict dst,
+        const int ldc,
+        void * restrict wdata) {
+    ggml_fp16_t * const xp = (ggml_fp16_t *) wdata;
+    float       * const yp = (float *) ((char *) wdata + GGML_GEMM_KC*GGML_GEMM_NB0*sizeof(ggml_fp16_t));
+
+    for (int j0 = 0; j0 < n1; j0 += GGML_GEMM_NB1) {
+        const int nj = MIN(GGML_GEMM_NB1, n1 - j0);
+
+        for (int l0 = 0; l0 < k; l0 += GGML_GEMM_KC) {
+            const int kc = MIN(GGML_GEMM_KC, k - l0);
+
+            ggml_gemm_pack_src1(kc, nj, (const char *) y + (j0*ldy + l0)*GGML_TYPE_SIZE[ty], ty, ldy, yp);
+
+            for (int i0 = 0; i0 < n0; i0 += GGML_GEMM_NB0) {
+                const int ni = MIN(GGML_GEMM_NB0, n0 - i0);
+
+                // panel i of the block is at xb + i*ks
+                const ggml_fp16_t * xb;
+                int ks;
+
+                if (packed) {
+                    xb = x + i0*k + l0*GGML_GEMM_NR0;
+                    ks = k;
+                } else {
+                    ggml_gemm_pack_src0(kc, ni, x + i0*ldx + l0, ldx, xp);
+                    xb = xp;
+                    ks = kc;
+                }
+
+                for (int j = 0; j < nj; j += GGML_GEMM_NR1) {
+                    for (int i = 0; i < ni; i += GGML_GEMM_NR0) {
+                        ggml_gemm_tile(kc, xb + i*ks, yp + j*kc, dst + (j0 + j)*ldc + i0 + i, ldc,
+                                MIN(GGML_GEMM_NR0, ni - i), MIN(GGML_GEMM_NR1, nj - j), l0 > 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif // GGML_GEMM_EPR
+
+// helper function to determine if the blocked GEMM is used for a F16 x F32 matrix multiplication
+static bool ggml_compute_forward_mul_mat_use_gemm(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    UNUSED(dst);
+
+    if (src0->layout == GGML_LAYOUT_MUL_MAT) {
+        GGML_ASSERT(src1->type == GGML_TYPE_F32 && src1->nb[0] == sizeof(float));
+        return true;
+    }
+
+#if defined(GGML_GEMM_EPR)
+    return src0->type == GGML_TYPE_F16 && src1->type == GGML_TYPE_F32 &&
+        src0->nb[0] == sizeof(ggml_fp16_t) && src0->nb[1] >= src0->nb[0] && src1->nb[0] == sizeof(float) &&
+        src1->ne[1] >= GGML_GEMM_MIN_NE11;
+#else
+    return false;
+#endif
+}
+
+size_t ggml_mul_mat_thread_wsize(void) {
+#if defined(GGML_GEMM_EPR)
+    return GGML_GEMM_WSIZE + CACHE_LINE_SIZE;
+#else
+    return 0;
+#endif
+}
+
+bool ggml_mul_mat_pack(struct ggml_tensor * a) {
+#if defined(GGML_GEMM_EPR)
+    const int ne00 = a->ne[0];
+    const int ne01 = a->ne[1];
 
-    // TODO: find the optimal values for these
-    if (ggml_is_contiguous(src0) && ggml_is_contiguous(src1) && (
-             (ne0 >= 32 && ne1  >= 32   && ne10 >= 32)
-            )) {
-        //printf("BLAS: %d %d %d\n", ne0, ne1, ne10);
-        return true;
+    if (a->type != GGML_TYPE_F16 || a->layout != GGML_LAYOUT_ROWS || !ggml_is_contiguous(a) ||
+        a->ne[2] != 1 || a->ne[3] != 1 || ne01 % GGML_GEMM_NR0 != 0) {
+        return false;
     }
 
+    // panel p, element l, row i: [p][l][i] - each panel has all ne00 elements of its rows
+    ggml_fp16_t * const rows = malloc(ggml_nbytes(a));
+    memcpy(rows, a->data, ggml_nbytes(a));
+
+    ggml_gemm_pack_src0(ne00, ne01, rows, ne00, (ggml_fp16_t *) a->data);
+
+    free(rows);
+
+    a->layout = GGML_LAYOUT_MUL_MAT;
+
+    return true;
+#else
+    UNUSED(a);
+
     return false;
-}
 #endif
+}
 
 static void ggml_compute_forward_mul_mat_f32(
         const struct ggml_compute_params * params,
@@ -4749,6 +6824,61 @@ static void ggml_compute_forward_mul_mat_f16_f32(
     }
 #endif
 
+#if defined(GGML_GEMM_EPR)
+    if (ggml_compute_forward_mul_mat_use_gemm(src0, src1, dst)) {
+        // parallelize by panels of src0 rows using the blocked GEMM, that packs src1 itself
+        if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+            return;
+        }
+
+        const bool packed = src0->layout == GGML_LAYOUT_MUL_MAT;
+
+        // panels of src0 rows in a matrix
+        const int np = (ne01 + GGML_GEMM_NR0 - 1)/GGML_GEMM_NR0;
+
+        // total panels
+        const int nr = np*ne02*ne03;
+
+        // panels per thread
+        const int dr = (nr + nth - 1)/nth;
+
+        // panel range for this thread
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        void * wgemm = (char *) params->wdata + ith*(GGML_GEMM_WSIZE + CACHE_LINE_SIZE);
+
+        GGML_ASSERT((char *) wgemm + GGML_GEMM_WSIZE <= (char *) params->wdata + params->wsize);
+
+        for (int ir = ir0; ir < ir1; ) {
+            // src0 matrix and the panels of it for this thread
+            const int i03 = ir/(ne02*np);
+            const int i02 = (ir - i03*ne02*np)/np;
+            const int ip0 = ir - i03*ne02*np - i02*np;
+            const int ip1 = MIN(np, ip0 + ir1 - ir);
+
+            const int i01 = ip0*GGML_GEMM_NR0;
+            const int n01 = MIN(ne01, ip1*GGML_GEMM_NR0) - i01;
+
+            const int i13 = i03;
+            const int i12 = i02;
+
+            // a packed matrix has the same size, with the rows in panels
+            const ggml_fp16_t * src0_rows = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            const float       * src1_cols = (float       *) ((char *) src1->data + (                i12*nb12 + i13*nb13));
+
+            float * dst_rows = (float *) ((char *) dst->data + (i01*nb0 + 0*nb1 + i02*nb2 + i03*nb3));
+
+            ggml_gemm_f16(ne00, n01, ne11, src0_rows, nb01/sizeof(ggml_fp16_t), packed,
+                    src1_cols, GGML_TYPE_F32, nb11/sizeof(float), dst_rows, nb1/sizeof(float), wgemm);
+
+            ir += ip1 - ip0;
+        }
+
+        return;
+    }
+#endif
+
     if (params->type == GGML_TASK_INIT) {
         if (nb01 >= nb00) {
             ggml_fp16_t * const wdata = params->wdata;
@@ -4769,145 +6899,324 @@ static void ggml_compute_forward_mul_mat_f16_f32(
             return;
         }
 
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-        return;
-    }
-
-    if (params->type == GGML_TASK_FINALIZE) {
-        if (nb01 >= nb00) {
+        // TODO: fix this memset (wsize is overestimated)
+        memset(params->wdata, 0, params->wsize);
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        if (nb01 >= nb00) {
+            return;
+        }
+
+        // TODO: fix this memset (wsize is overestimated)
+        //assert(params->wsize == (ggml_nbytes(dst) + CACHE_LINE_SIZE)*nth);
+
+        ggml_fp16_t * const wdata = params->wdata;
+
+        // cols per thread
+        const int dc = (ne + nth - 1)/nth;
+
+        // col range for this thread
+        const int ic0 = dc*ith;
+        const int ic1 = MIN(ic0 + dc, ne);
+
+        for (int i = ic0; i < ic1; ++i) {
+            ((float *) dst->data)[i] = GGML_FP16_TO_FP32(wdata[i]);
+        }
+
+        for (int k = 1; k < nth; k++) {
+            for (int i = ic0; i < ic1; ++i) {
+                ((float *) dst->data)[i] += GGML_FP16_TO_FP32(wdata[(ne + CACHE_LINE_SIZE_F32)*k + i]);
+            }
+        }
+
+        return;
+    }
+
+    if (nb01 >= nb00) {
+        // fp16 -> half the size, so divide by 2
+        // TODO: do not support transposed src1
+        assert(nb10/2 == sizeof(ggml_fp16_t));
+
+        // parallelize by src0 rows using ggml_vec_dot_f16
+
+        // total rows in src0
+        const int nr = ne01*ne02*ne03;
+
+        // rows per thread
+        const int dr = (nr + nth - 1)/nth;
+
+        // row range for this thread
+        const int ir0 = dr*ith;
+        const int ir1 = MIN(ir0 + dr, nr);
+
+        ggml_fp16_t * wdata = params->wdata;
+
+        for (int ir = ir0; ir < ir1; ++ir) {
+            // src0 indices
+            const int i03 = ir/(ne02*ne01);
+            const int i02 = (ir - i03*ne02*ne01)/ne01;
+            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+            const int i13 = i03;
+            const int i12 = i02;
+
+            const int i0 = i01;
+            const int i2 = i02;
+            const int i3 = i03;
+
+            ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+            ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
+
+            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+
+            for (int ic = 0; ic < ne11; ++ic) {
+                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
+            }
+        }
+    } else {
+        // parallelize by src1 columns using ggml_vec_mad_f16
+        // each thread has its own work data
+        // during FINALIZE we accumulate all work data into dst
+
+        // total columns in src1
+        const int nc = ne10;
+
+        // columns per thread
+        const int dc = (nc + nth - 1)/nth;
+
+        // column range for this thread
+        const int ic0 = dc*ith;
+        const int ic1 = MIN(ic0 + dc, nc);
+
+        // work data for thread
+        const int wo = (ne + CACHE_LINE_SIZE_F32)*ith;
+        ggml_fp16_t * const wdata = params->wdata;
+
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    // dst indices
+                    const int i1 = i11;
+                    const int i2 = i12;
+                    const int i3 = i13;
+
+                    ggml_fp16_t * dst_row = wdata + wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0;
+
+                    for (int ic = ic0; ic < ic1; ++ic) {
+                        // src1 indices
+                        const int i10 = ic;
+
+                        // src0 indices
+                        const int i03 = i13;
+                        const int i02 = i12;
+                        const int i00 = ic;
+
+                        assert(sizeof(ggml_fp16_t)*(wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0 + ne01) <= params->wsize);
+
+                        ggml_fp16_t * src0_col =  (ggml_fp16_t *) ((char *) src0->data + (i00*nb00 + i02*nb02 + i03*nb03));
+                        float         src1_val = *      (float *) ((char *) src1->data + (i10*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+
+                        ggml_vec_mad_f16(ne01, dst_row, src0_col, src1_val);
+                    }
+                }
+            }
+        }
+    }
+
+    //int64_t t1 = ggml_time_us();
+    //static int64_t acc = 0;
+    //acc += t1 - t0;
+    //if (t1 - t0 > 10) {
+    //    printf("\n");
+    //    printf("ne00 = %5d, ne01 = %5d, ne02 = %5d, ne03 = %5d\n", ne00, ne01, ne02, ne03);
+    //    printf("nb00 = %5d, nb01 = %5d, nb02 = %5d, nb03 = %5d\n", nb00, nb01, nb02, nb03);
+    //    printf("ne10 = %5d, ne11 = %5d, ne12 = %5d, ne13 = %5d\n", ne10, ne11, ne12, ne13);
+
+    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
+    //}
+}
+
+static void ggml_compute_forward_mul_mat_q_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne2  == ne12);
+    GGML_ASSERT(ne3  == ne13);
+
+    const enum ggml_type type = src0->type;
+
+    const enum ggml_type vec_dot_type       = quantize_fns[type].vec_dot_type;
+    quantize_row_q_t const quantize_row_q_dot = quantize_fns[vec_dot_type].quantize_row_q;
+    vec_dot_q_t      const vec_dot_q          = quantize_fns[type].vec_dot_q;
+
+    // we don't support permuted src0 or src1
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne02);
+    GGML_ASSERT(ne3 == ne03);
+
+    // nb01 >= nb00 - src0 is not transposed
+    //   compute by src0 rows
+
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        if (params->ith != 0) {
+            return;
+        }
+
+        if (params->type == GGML_TASK_INIT) {
+            return;
+        }
+
+        if (params->type == GGML_TASK_FINALIZE) {
             return;
         }
 
-        // TODO: fix this memset (wsize is overestimated)
-        //assert(params->wsize == (ggml_nbytes(dst) + CACHE_LINE_SIZE)*nth);
-
-        ggml_fp16_t * const wdata = params->wdata;
+        float * const wdata = params->wdata;
+        dequantize_row_q_t const dequantize_row_q = quantize_fns[type].dequantize_row_q;
 
-        // cols per thread
-        const int dc = (ne + nth - 1)/nth;
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                {
+                    int id = 0;
+                    for (int i01 = 0; i01 < ne01; ++i01) {
+                        dequantize_row_q((char *) src0->data + i03*nb03 + i02*nb02 + i01*nb01, wdata + id, ne00);
+                        id += ne00;
+                    }
+                }
 
-        // col range for this thread
-        const int ic0 = dc*ith;
-        const int ic1 = MIN(ic0 + dc, ne);
+                const float * x = wdata;
+                const float * y = (float *) ((char *) src1->data + i02*nb12 + i03*nb13);
 
-        for (int i = ic0; i < ic1; ++i) {
-            ((float *) dst->data)[i] = GGML_FP16_TO_FP32(wdata[i]);
-        }
+                float * d = (float *) ((char *) dst->data + i02*nb2 + i03*nb3);
 
-        for (int k = 1; k < nth; k++) {
-            for (int i = ic0; i < ic1; ++i) {
-                ((float *) dst->data)[i] += GGML_FP16_TO_FP32(wdata[(ne + CACHE_LINE_SIZE_F32)*k + i]);
+                // zT = y * xT
+                cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                        ne11, ne01, ne10,
+                        1.0f,    y, ne10,
+                                 x, ne00,
+                        0.0f,    d, ne01);
             }
         }
 
+        //printf("CBLAS = %f ms, %d x %d x %d x %d\n", (ggml_perf_time_us() - t0)/1000.0, ne0, ne1, ne2, ne3);
+
         return;
     }
+#endif
 
-    if (nb01 >= nb00) {
-        // fp16 -> half the size, so divide by 2
-        // TODO: do not support transposed src1
-        assert(nb10/2 == sizeof(ggml_fp16_t));
-
-        // parallelize by src0 rows using ggml_vec_dot_f16
-
-        // total rows in src0
-        const int nr = ne01*ne02*ne03;
-
-        // rows per thread
-        const int dr = (nr + nth - 1)/nth;
-
-        // row range for this thread
-        const int ir0 = dr*ith;
-        const int ir1 = MIN(ir0 + dr, nr);
-
-        ggml_fp16_t * wdata = params->wdata;
-
-        for (int ir = ir0; ir < ir1; ++ir) {
-            // src0 indices
-            const int i03 = ir/(ne02*ne01);
-            const int i02 = (ir - i03*ne02*ne01)/ne01;
-            const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
+    // size of a src1 row, quantized to vec_dot_type
+    const size_t row_size = ne10*GGML_TYPE_SIZE[vec_dot_type]/GGML_BLCK_SIZE[vec_dot_type];
 
-            const int i13 = i03;
-            const int i12 = i02;
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
 
-            const int i0 = i01;
-            const int i2 = i02;
-            const int i3 = i03;
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    quantize_row_q_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
+                    wdata += row_size;
+                }
+            }
+        }
 
-            ggml_fp16_t * src0_row = (ggml_fp16_t *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
-            ggml_fp16_t * src1_col =                                wdata + (       0 + i12*ne11 + i13*ne12*ne11)*ne00;
+        GGML_ASSERT((size_t) (wdata - (char *) params->wdata) <= params->wsize);
 
-            float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
+        return;
+    }
 
-            assert(ne00 % 32 == 0);
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
 
-            for (int ic = 0; ic < ne11; ++ic) {
-                ggml_vec_dot_f16(ne00, &dst_col[ic*ne0], src0_row, src1_col + ic*ne00);
-            }
-        }
-    } else {
-        // parallelize by src1 columns using ggml_vec_mad_f16
-        // each thread has its own work data
-        // during FINALIZE we accumulate all work data into dst
+    // parallelize by src0 rows using the quantized dot product
 
-        // total columns in src1
-        const int nc = ne10;
+    // total rows in src0
+    const int nr = ne01*ne02*ne03;
 
-        // columns per thread
-        const int dc = (nc + nth - 1)/nth;
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
 
-        // column range for this thread
-        const int ic0 = dc*ith;
-        const int ic1 = MIN(ic0 + dc, nc);
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
 
-        // work data for thread
-        const int wo = (ne + CACHE_LINE_SIZE_F32)*ith;
-        ggml_fp16_t * const wdata = params->wdata;
+    const char * wdata = params->wdata;
 
-        for (int i13 = 0; i13 < ne13; ++i13) {
-            for (int i12 = 0; i12 < ne12; ++i12) {
-                for (int i11 = 0; i11 < ne11; ++i11) {
-                    // dst indices
-                    const int i1 = i11;
-                    const int i2 = i12;
-                    const int i3 = i13;
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src0 indices
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                    ggml_fp16_t * dst_row = wdata + wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0;
+        const int i13 = i03;
+        const int i12 = i02;
 
-                    for (int ic = ic0; ic < ic1; ++ic) {
-                        // src1 indices
-                        const int i10 = ic;
+        const int i0 = i01;
+        const int i2 = i02;
+        const int i3 = i03;
 
-                        // src0 indices
-                        const int i03 = i13;
-                        const int i02 = i12;
-                        const int i00 = ic;
+        const void * src0_row = (const void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+        const char * src1_col = wdata + (i12*ne11 + i13*ne12*ne11)*row_size;
 
-                        assert(sizeof(ggml_fp16_t)*(wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0 + ne01) <= params->wsize);
+        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
-                        ggml_fp16_t * src0_col =  (ggml_fp16_t *) ((char *) src0->data + (i00*nb00 + i02*nb02 + i03*nb03));
-                        float         src1_val = *      (float *) ((char *) src1->data + (i10*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+        assert(ne00 % 32 == 0);
 
-                        ggml_vec_mad_f16(ne01, dst_row, src0_col, src1_val);
-                    }
-                }
-            }
+        for (int ic = 0; ic < ne11; ++ic) {
+            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (const void *) (src1_col + ic*row_size));
         }
     }
-
-    //int64_t t1 = ggml_time_us();
-    //static int64_t acc = 0;
-    //acc += t1 - t0;
-    //if (t1 - t0 > 10) {
-    //    printf("\n");
-    //    printf("ne00 = %5d, ne01 = %5d, ne02 = %5d, ne03 = %5d\n", ne00, ne01, ne02, ne03);
-    //    printf("nb00 = %5d, nb01 = %5d, nb02 = %5d, nb03 = %5d\n", nb00, nb01, nb02, nb03);
-    //    printf("ne10 = %5d, ne11 = %5d, ne12 = %5d, ne13 = %5d\n", ne10, ne11, ne12, ne13);
-
-    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
-    //}
 }
 
 static void ggml_compute_forward_mul_mat(
@@ -4924,9 +7233,18 @@ static void ggml_compute_forward_mul_mat(
             {
                 ggml_compute_forward_mul_mat_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4985,6 +7303,12 @@ static void ggml_compute_forward_scale(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5045,6 +7369,35 @@ static void ggml_compute_forward_transpose(
 
 // ggml_compute_forward_get_rows
 
+static void ggml_compute_forward_get_rows_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    dequantize_row_q_t const dequantize_row_q = quantize_fns[src0->type].dequantize_row_q;
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[src0->type]);
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        dequantize_row_q(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+    }
+}
+
 static void ggml_compute_forward_get_rows_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -5114,9 +7467,18 @@ static void ggml_compute_forward_get_rows(
             {
                 ggml_compute_forward_get_rows_f32(params, src0, src1, dst);
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_get_rows_q(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5176,6 +7538,12 @@ static void ggml_compute_forward_diag_mask_inf(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5267,6 +7635,12 @@ static void ggml_compute_forward_soft_max(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5347,14 +7721,210 @@ static void ggml_compute_forward_rope(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
             } break;
     }
-}
+}
+
+// ggml_compute_forward_conv_1d_1s
+
+bool ggml_conv_1d_pack(struct ggml_tensor * a) {
+    const int ne00 = a->ne[0];
+    const int ne01 = a->ne[1];
+    const int ne02 = a->ne[2];
+
+    if (a->type != GGML_TYPE_F16 || a->layout != GGML_LAYOUT_ROWS || !ggml_is_contiguous(a) || a->ne[3] != 1) {
+        return false;
+    }
+
+    // [i02][i01][i00] -> [i02][i00][i01], so that each tap of the kernel is a contiguous row over the input channels
+    ggml_fp16_t * const src = malloc(ggml_nbytes(a));
+    memcpy(src, a->data, ggml_nbytes(a));
+
+    ggml_fp16_t * const dst = (ggml_fp16_t *) a->data;
+
+    for (int i02 = 0; i02 < ne02; i02++) {
+        for (int i01 = 0; i01 < ne01; i01++) {
+            for (int i00 = 0; i00 < ne00; i00++) {
+                dst[(i02*ne00 + i00)*ne01 + i01] = src[(i02*ne01 + i01)*ne00 + i00];
+            }
+        }
+    }
+
+    free(src);
+
+    a->layout = GGML_LAYOUT_CONV_1D;
+
+    return true;
+}
+
+// the F16 convolutions as an implicit GEMM, dst [ne02][n0] = kernel [ne02][nk*ne01] * x [n0][nk*ne01]^T
+//
+// the source data is transposed into [ne10 + 2*nh][ne01] rows of F16 with a zero halo. the kernel taps are the
+// outermost dimension of the kernel rows, so that row i0 of the im2col matrix x is the nk*ne01 contiguous elements at
+// row s*i0 of the transposed source - the rows of x overlap and are read in place by the GEMM, that packs them itself
+//
+// the kernel is read in place if it is packed with ggml_conv_1d_pack(), otherwise it is rearranged in INIT
+
+#if defined(GGML_GEMM_EPR)
+
+// minimum number of dst time steps for the GEMM
+#define GGML_CONV_1D_GEMM_MIN_NE0 GGML_GEMM_MIN_NE11
+
+// work buffer shared by the threads - the transposed source data and the rearranged kernel
+static size_t ggml_conv_1d_gemm_wsize_shared(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1) {
+    const int nk = src0->ne[0];
+
+    size_t cur = sizeof(ggml_fp16_t)*(2*(nk/2) + src1->ne[0])*src1->ne[1];
+
+    if (src0->layout != GGML_LAYOUT_CONV_1D) {
+        cur += sizeof(ggml_fp16_t)*nk*src0->ne[1]*src0->ne[2];
+    }
+
+    return ggml_up(cur, CACHE_LINE_SIZE);
+}
+
+#endif
+
+// helper function to determine if the implicit GEMM is used for a F16 convolution
+static bool ggml_compute_forward_conv_1d_use_gemm(
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * dst) {
+#if defined(GGML_GEMM_EPR)
+    return src0->type == GGML_TYPE_F16 && src1->type == GGML_TYPE_F32 && dst->ne[0] >= GGML_CONV_1D_GEMM_MIN_NE0;
+#else
+    UNUSED(src0);
+    UNUSED(src1);
+    UNUSED(dst);
+
+    return false;
+#endif
+}
+
+#if defined(GGML_GEMM_EPR)
+static void ggml_compute_forward_conv_1d_gemm_f16_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst,
+        const int s) {
+    GGML_ASSERT(src0->type == GGML_TYPE_F16);
+    GGML_ASSERT(src1->type == GGML_TYPE_F32);
+    GGML_ASSERT( dst->type == GGML_TYPE_F32);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+
+    const int nb11 = src1->nb[1];
+
+    const int ne0 = dst->ne[0];
+    const int nb1 = dst->nb[1];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nk = ne00;
+    const int nh = nk/2;
+
+    // elements of a kernel row and of a row of x
+    const int nkc = nk*ne01;
+
+    const bool packed = src0->layout == GGML_LAYOUT_CONV_1D;
+
+    ggml_fp16_t * const ws = (ggml_fp16_t *) params->wdata;
+    ggml_fp16_t * const wk = packed ? (ggml_fp16_t *) src0->data : ws + (ne10 + 2*nh)*ne01;
+
+    GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
+    GGML_ASSERT(src0->nb[0] == sizeof(ggml_fp16_t));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT(ne11 == ne01);
+    GGML_ASSERT((ne0 - 1)*s + nk <= ne10 + 2*nh);
+
+    if (params->type == GGML_TASK_INIT) {
+        // the halo
+        memset(ws,                    0, nh*ne01*sizeof(ggml_fp16_t));
+        memset(ws + (ne10 + nh)*ne01, 0, nh*ne01*sizeof(ggml_fp16_t));
+
+        // prepare source data (src1)
+        for (int i11 = 0; i11 < ne11; i11++) {
+            const float * const src = (float *)((char *) src1->data + i11*nb11);
+            for (int i10 = 0; i10 < ne10; i10++) {
+                ws[(i10 + nh)*ne01 + i11] = GGML_FP32_TO_FP16(src[i10]);
+            }
+        }
+
+        // prepare kernel data (src0)
+        if (!packed) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                for (int i01 = 0; i01 < ne01; i01++) {
+                    const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
+                    for (int i00 = 0; i00 < ne00; i00++) {
+                        wk[(i02*nk + i00)*ne01 + i01] = src[i00];
+                    }
+                }
+            }
+        }
+
+        return;
+    }
 
-// ggml_compute_forward_conv_1d_1s
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // parallelize by panels of dst time steps, and by blocks of channels if there are fewer panels than threads
+    const int np = (ne0 + GGML_GEMM_NR0 - 1)/GGML_GEMM_NR0;
+
+    const int nc = MAX(1, MIN(nth/np, ne02/GGML_GEMM_NR1));
+    const int nt = nth/nc;
+
+    if (ith >= nt*nc) {
+        return;
+    }
+
+    // panels of time steps for this thread
+    const int dp  = (np + nt - 1)/nt;
+    const int ip0 = dp*(ith/nc);
+    const int ip1 = MIN(ip0 + dp, np);
+
+    // channels for this thread
+    const int dc  = (ne02 + nc - 1)/nc;
+    const int ic0 = dc*(ith%nc);
+    const int ic1 = MIN(ic0 + dc, ne02);
+
+    if (ip0 >= ip1 || ic0 >= ic1) {
+        return;
+    }
+
+    const int i0 = ip0*GGML_GEMM_NR0;
+    const int n0 = MIN(ne0, ip1*GGML_GEMM_NR0) - i0;
+
+    void * wgemm = (char *) params->wdata + ggml_conv_1d_gemm_wsize_shared(src0, src1) + ith*(GGML_GEMM_WSIZE + CACHE_LINE_SIZE);
+
+    GGML_ASSERT((char *) wgemm + GGML_GEMM_WSIZE <= (char *) params->wdata + params->wsize);
+
+    ggml_gemm_f16(nkc, n0, ic1 - ic0, ws + i0*s*ne01, s*ne01, false, wk + ic0*nkc, GGML_TYPE_F16, nkc,
+            (float *) ((char *) dst->data + ic0*nb1) + i0, nb1/sizeof(float), wgemm);
+}
+#endif
 
 static void ggml_compute_forward_conv_1d_1s_f16_f32(
         const struct ggml_compute_params * params,
@@ -5365,6 +7935,13 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
     GGML_ASSERT(src1->type == GGML_TYPE_F32);
     GGML_ASSERT( dst->type == GGML_TYPE_F32);
 
+#if defined(GGML_GEMM_EPR)
+    if (ggml_compute_forward_conv_1d_use_gemm(src0, src1, dst)) {
+        ggml_compute_forward_conv_1d_gemm_f16_f32(params, src0, src1, dst, 1);
+        return;
+    }
+#endif
+
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
@@ -5405,24 +7982,33 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
     const int nk = ne00;
     const int nh = nk/2;
 
-    const int ew0 = ggml_up32(ne01);
+    // a kernel pre-packed with ggml_conv_1d_pack() is already in the [ne02][ne00][ne01] layout
+    const bool packed = src0->layout == GGML_LAYOUT_CONV_1D;
+
+    const int ew0 = packed ? ne01 : ggml_up32(ne01);
+
+    ggml_fp16_t * const wk = packed ? (ggml_fp16_t *) src0->data   : (ggml_fp16_t *) params->wdata;
+    ggml_fp16_t * const ws = packed ? (ggml_fp16_t *) params->wdata : (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
 
     GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
     GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
     GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(!packed || ne11 == ne01);
 
     if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+        if (packed) {
+            // only the halo rows around the source data need to be zero
+            memset(ws,                   0, nh*ew0*sizeof(ggml_fp16_t));
+            memset(ws + (ne10 + nh)*ew0, 0, nh*ew0*sizeof(ggml_fp16_t));
+        } else {
+            // TODO: fix this memset (wsize is overestimated)
+            memset(params->wdata, 0, params->wsize);
 
+            // prepare kernel data (src0)
             for (int i02 = 0; i02 < ne02; i02++) {
                 for (int i01 = 0; i01 < ne01; i01++) {
                     const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
+                    ggml_fp16_t * dst_data = wk + i02*ew0*ne00;
                     for (int i00 = 0; i00 < ne00; i00++) {
                         dst_data[i00*ew0 + i01] = src[i00];
                     }
@@ -5432,7 +8018,7 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
 
         // prepare source data (src1)
         {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+            ggml_fp16_t * const wdata = ws;
 
             for (int i11 = 0; i11 < ne11; i11++) {
                 const float * const src = (float *)((char *) src1->data + i11*nb11);
@@ -5467,8 +8053,8 @@ static void ggml_compute_forward_conv_1d_1s_f16_f32(
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
                 ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
+                        wk + i1*ew0*ne00 +      (nh + k)*ew0,
+                        ws +                (i0 + nh + k)*ew0);
 
                 dst_data[i0] += v;
             }
@@ -5613,6 +8199,12 @@ static void ggml_compute_forward_conv_1d_1s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5631,6 +8223,13 @@ static void ggml_compute_forward_conv_1d_2s_f16_f32(
     GGML_ASSERT(src1->type == GGML_TYPE_F32);
     GGML_ASSERT( dst->type == GGML_TYPE_F32);
 
+#if defined(GGML_GEMM_EPR)
+    if (ggml_compute_forward_conv_1d_use_gemm(src0, src1, dst)) {
+        ggml_compute_forward_conv_1d_gemm_f16_f32(params, src0, src1, dst, 2);
+        return;
+    }
+#endif
+
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
@@ -5644,7 +8243,7 @@ static void ggml_compute_forward_conv_1d_2s_f16_f32(
     //const int ne12 = src1->ne[2];
     //const int ne13 = src1->ne[3];
 
-    //const int ne0  = dst->ne[0];
+    const int ne0  = dst->ne[0];
     //const int ne1  = dst->ne[1];
     //const int ne2  = dst->ne[2];
     //const int ne3  = dst->ne[3];
@@ -5671,24 +8270,33 @@ static void ggml_compute_forward_conv_1d_2s_f16_f32(
     const int nk = ne00;
     const int nh = nk/2;
 
-    const int ew0 = ggml_up32(ne01);
+    // a kernel pre-packed with ggml_conv_1d_pack() is already in the [ne02][ne00][ne01] layout
+    const bool packed = src0->layout == GGML_LAYOUT_CONV_1D;
+
+    const int ew0 = packed ? ne01 : ggml_up32(ne01);
+
+    ggml_fp16_t * const wk = packed ? (ggml_fp16_t *) src0->data   : (ggml_fp16_t *) params->wdata;
+    ggml_fp16_t * const ws = packed ? (ggml_fp16_t *) params->wdata : (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
 
     GGML_ASSERT(ne00 % 2 == 1); // TODO: support even kernel sizes
     GGML_ASSERT(nb00 == sizeof(ggml_fp16_t));
     GGML_ASSERT(nb10 == sizeof(float));
+    GGML_ASSERT(!packed || ne11 == ne01);
 
     if (params->type == GGML_TASK_INIT) {
-        // TODO: fix this memset (wsize is overestimated)
-        memset(params->wdata, 0, params->wsize);
-
-        // prepare kernel data (src0)
-        {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + 0;
+        if (packed) {
+            // only the halo rows around the source data need to be zero
+            memset(ws,                   0, nh*ew0*sizeof(ggml_fp16_t));
+            memset(ws + (ne10 + nh)*ew0, 0, nh*ew0*sizeof(ggml_fp16_t));
+        } else {
+            // TODO: fix this memset (wsize is overestimated)
+            memset(params->wdata, 0, params->wsize);
 
+            // prepare kernel data (src0)
             for (int i02 = 0; i02 < ne02; i02++) {
                 for (int i01 = 0; i01 < ne01; i01++) {
                     const ggml_fp16_t * const src = (ggml_fp16_t *)((char *) src0->data + i02*nb02 + i01*nb01);
-                    ggml_fp16_t * dst_data = wdata + i02*ew0*ne00;
+                    ggml_fp16_t * dst_data = wk + i02*ew0*ne00;
                     for (int i00 = 0; i00 < ne00; i00++) {
                         dst_data[i00*ew0 + i01] = src[i00];
                     }
@@ -5698,7 +8306,7 @@ static void ggml_compute_forward_conv_1d_2s_f16_f32(
 
         // prepare source data (src1)
         {
-            ggml_fp16_t * const wdata = (ggml_fp16_t *) params->wdata + ne02*ew0*ne00;
+            ggml_fp16_t * const wdata = ws;
 
             for (int i11 = 0; i11 < ne11; i11++) {
                 const float * const src = (float *)((char *) src1->data + i11*nb11);
@@ -5728,13 +8336,13 @@ static void ggml_compute_forward_conv_1d_2s_f16_f32(
 
     for (int i1 = ir0; i1 < ir1; i1++) {
         float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; i0 += 2) {
+        for (int i0 = 0; i0 < 2*ne0; i0 += 2) {
             dst_data[i0/2] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
                 ggml_vec_dot_f16(ew0, &v,
-                        (ggml_fp16_t *) params->wdata +   i1*ew0*ne00 +      (nh + k)*ew0,
-                        (ggml_fp16_t *) params->wdata + ne02*ew0*ne00 + (i0 + nh + k)*ew0);
+                        wk + i1*ew0*ne00 +      (nh + k)*ew0,
+                        ws +                (i0 + nh + k)*ew0);
 
                 dst_data[i0/2] += v;
             }
@@ -5764,7 +8372,7 @@ static void ggml_compute_forward_conv_1d_2s_f32(
     //const int ne12 = src1->ne[2];
     //const int ne13 = src1->ne[3];
 
-    //const int ne0  = dst->ne[0];
+    const int ne0  = dst->ne[0];
     //const int ne1  = dst->ne[1];
     //const int ne2  = dst->ne[2];
     //const int ne3  = dst->ne[3];
@@ -5848,7 +8456,7 @@ static void ggml_compute_forward_conv_1d_2s_f32(
 
     for (int i1 = ir0; i1 < ir1; i1++) {
         float * dst_data = (float *)((char *) dst->data + i1*nb1);
-        for (int i0 = 0; i0 < ne10; i0 += 2) {
+        for (int i0 = 0; i0 < 2*ne0; i0 += 2) {
             dst_data[i0/2] = 0;
             for (int k = -nh; k <= nh; k++) {
                 float v = 0.0f;
@@ -5879,6 +8487,12 @@ static void ggml_compute_forward_conv_1d_2s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5888,222 +8502,263 @@ static void ggml_compute_forward_conv_1d_2s(
 
 // ggml_compute_forward_flash_attn
 
-static void ggml_compute_forward_flash_attn_f32(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * q,
-        const struct ggml_tensor * k,
-        const struct ggml_tensor * v,
-        const bool masked,
-             struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+// tiled attention with online softmax
+//
+// each task is a block of GGML_ATTN_BQ query rows of one head, that goes over the keys in blocks of GGML_ATTN_BK. the
+// keys (transposed) and values of a block are converted to F32 in the work buffer, where they stay in L1 for all the
+// query rows, the scores S = Q*K^T of the block are computed with the keys in the SIMD lanes, and the output O and the
+// running max m and sum l of each query row are updated with the block:
+//
+//   m' = max(m, max(S)), P = exp(S - m'), l = l*exp(m - m') + sum(P), O = O*exp(m - m') + P*V
+//
+// so that the scores of all the keys are never stored. dst = O/l after the last block
+//
+// q, k and v can be F16 or F32 with any strides. k is read fastest with the keys contiguous (nb[1] of k is the element
+// size) and v with the values of each key contiguous (nb[1] of v is the element size)
 
-    const int neq0 = q->ne[0];
-    const int neq1 = q->ne[1];
-    const int neq2 = q->ne[2];
-    const int neq3 = q->ne[3];
+#define GGML_ATTN_BQ 32 // query rows in a block
 
-    const int nek0 = k->ne[0];
-    const int nek1 = k->ne[1];
-    //const int nek2 = k->ne[2];
-    //const int nek3 = k->ne[3];
+#if defined(GGML_GEMM_EPR)
+#define GGML_ATTN_BK (4*GGML_GEMM_EPR) // keys in a block - 4 registers
+#else
+#define GGML_ATTN_BK 32
+#endif
 
-    //const int nev0 = v->ne[0];
-    const int nev1 = v->ne[1];
-    //const int nev2 = v->ne[2];
-    //const int nev3 = v->ne[3];
+// per-thread work buffer: Q and O [GGML_ATTN_BQ][D], K^T [D][GGML_ATTN_BK], V [GGML_ATTN_BK][D], S
+// [GGML_ATTN_BQ][GGML_ATTN_BK], m and l [GGML_ATTN_BQ]
+size_t ggml_flash_attn_thread_wsize(int D) {
+    return sizeof(float)*(2*GGML_ATTN_BQ*D + 2*D*GGML_ATTN_BK + GGML_ATTN_BQ*GGML_ATTN_BK + 2*GGML_ATTN_BQ) + CACHE_LINE_SIZE;
+}
 
-    const int ne0  = dst->ne[0];
-    const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
+inline static float ggml_attn_get_f32(const char * x, const bool f16) {
+    return f16 ? GGML_FP16_TO_FP32(*(const ggml_fp16_t *) x) : *(const float *) x;
+}
 
-    const int nbk0 = k->nb[0];
-    const int nbk1 = k->nb[1];
-    const int nbk2 = k->nb[2];
-    const int nbk3 = k->nb[3];
+// y = x for n contiguous F16 or F32 elements
+static void ggml_attn_cvt_row(const int n, const char * restrict x, const bool f16, float * restrict y) {
+    if (!f16) {
+        memcpy(y, x, n*sizeof(float));
+        return;
+    }
 
-    const int nbq0 = q->nb[0];
-    const int nbq1 = q->nb[1];
-    const int nbq2 = q->nb[2];
-    const int nbq3 = q->nb[3];
+    const ggml_fp16_t * xh = (const ggml_fp16_t *) x;
 
-    const int nbv0 = v->nb[0];
-    const int nbv1 = v->nb[1];
-    const int nbv2 = v->nb[2];
-    const int nbv3 = v->nb[3];
+    int i = 0;
+#if defined(GGML_GEMM_EPR)
+    for (; i + GGML_GEMM_EPR <= n; i += GGML_GEMM_EPR) {
+        GGML_GEMM_VEC_STORE(y + i, GGML_GEMM_VEC_LOAD_F16(xh + i));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = GGML_FP16_TO_FP32(xh[i]);
+    }
+}
 
-    const int nb0  = dst->nb[0];
-    const int nb1  = dst->nb[1];
-    const int nb2  = dst->nb[2];
-    const int nb3  = dst->nb[3];
+// s [nq][GGML_ATTN_BK] = q [nq][D] * kt [D][GGML_ATTN_BK]
+static void ggml_attn_qk(const int nq, const int D, const float * restrict q, const float * restrict kt, float * restrict s) {
+    int r = 0;
 
-    const int ith = params->ith;
-    const int nth = params->nth;
+#if defined(GGML_GEMM_EPR)
+    for (; r + 3 <= nq; r += 3) {
+        const float * q0 = q + (r + 0)*D;
+        const float * q1 = q + (r + 1)*D;
+        const float * q2 = q + (r + 2)*D;
 
-    const int D = neq0;
-    const int N = neq1;
-    const int P = nek1 - N;
-    const int M = P + N;
+        GGML_GEMM_VEC c00 = GGML_GEMM_VEC_ZERO, c01 = GGML_GEMM_VEC_ZERO, c02 = GGML_GEMM_VEC_ZERO, c03 = GGML_GEMM_VEC_ZERO;
+        GGML_GEMM_VEC c10 = GGML_GEMM_VEC_ZERO, c11 = GGML_GEMM_VEC_ZERO, c12 = GGML_GEMM_VEC_ZERO, c13 = GGML_GEMM_VEC_ZERO;
+        GGML_GEMM_VEC c20 = GGML_GEMM_VEC_ZERO, c21 = GGML_GEMM_VEC_ZERO, c22 = GGML_GEMM_VEC_ZERO, c23 = GGML_GEMM_VEC_ZERO;
 
-    const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
+        for (int d = 0; d < D; ++d) {
+            const float * kd = kt + d*GGML_ATTN_BK;
 
-    GGML_ASSERT(ne0 == D);
-    GGML_ASSERT(ne1 == N);
-    GGML_ASSERT(P >= 0);
+            const GGML_GEMM_VEC k0 = GGML_GEMM_VEC_LOAD(kd + 0*GGML_GEMM_EPR);
+            const GGML_GEMM_VEC k1 = GGML_GEMM_VEC_LOAD(kd + 1*GGML_GEMM_EPR);
+            const GGML_GEMM_VEC k2 = GGML_GEMM_VEC_LOAD(kd + 2*GGML_GEMM_EPR);
+            const GGML_GEMM_VEC k3 = GGML_GEMM_VEC_LOAD(kd + 3*GGML_GEMM_EPR);
 
-    GGML_ASSERT(nbq0 == sizeof(float));
-    GGML_ASSERT(nbk0 == sizeof(float));
-    GGML_ASSERT(nbv0 == sizeof(float));
+            GGML_GEMM_VEC b;
 
-    GGML_ASSERT(neq0 == D);
-    GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
+            b = GGML_GEMM_VEC_SET1(q0[d]);
+            c00 = GGML_GEMM_VEC_FMA(c00, k0, b); c01 = GGML_GEMM_VEC_FMA(c01, k1, b);
+            c02 = GGML_GEMM_VEC_FMA(c02, k2, b); c03 = GGML_GEMM_VEC_FMA(c03, k3, b);
 
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
-    GGML_ASSERT(nev1 == D);
+            b = GGML_GEMM_VEC_SET1(q1[d]);
+            c10 = GGML_GEMM_VEC_FMA(c10, k0, b); c11 = GGML_GEMM_VEC_FMA(c11, k1, b);
+            c12 = GGML_GEMM_VEC_FMA(c12, k2, b); c13 = GGML_GEMM_VEC_FMA(c13, k3, b);
 
-    // dst cannot be transposed or permuted
-    GGML_ASSERT(nb0 == sizeof(float));
-    GGML_ASSERT(nb0 <= nb1);
-    GGML_ASSERT(nb1 <= nb2);
-    GGML_ASSERT(nb2 <= nb3);
+            b = GGML_GEMM_VEC_SET1(q2[d]);
+            c20 = GGML_GEMM_VEC_FMA(c20, k0, b); c21 = GGML_GEMM_VEC_FMA(c21, k1, b);
+            c22 = GGML_GEMM_VEC_FMA(c22, k2, b); c23 = GGML_GEMM_VEC_FMA(c23, k3, b);
+        }
 
-    if (params->type == GGML_TASK_INIT) {
-        return;
-    }
+        float * s0 = s + (r + 0)*GGML_ATTN_BK;
+        float * s1 = s + (r + 1)*GGML_ATTN_BK;
+        float * s2 = s + (r + 2)*GGML_ATTN_BK;
 
-    if (params->type == GGML_TASK_FINALIZE) {
-        return;
+        GGML_GEMM_VEC_STORE(s0 + 0*GGML_GEMM_EPR, c00); GGML_GEMM_VEC_STORE(s0 + 1*GGML_GEMM_EPR, c01);
+        GGML_GEMM_VEC_STORE(s0 + 2*GGML_GEMM_EPR, c02); GGML_GEMM_VEC_STORE(s0 + 3*GGML_GEMM_EPR, c03);
+        GGML_GEMM_VEC_STORE(s1 + 0*GGML_GEMM_EPR, c10); GGML_GEMM_VEC_STORE(s1 + 1*GGML_GEMM_EPR, c11);
+        GGML_GEMM_VEC_STORE(s1 + 2*GGML_GEMM_EPR, c12); GGML_GEMM_VEC_STORE(s1 + 3*GGML_GEMM_EPR, c13);
+        GGML_GEMM_VEC_STORE(s2 + 0*GGML_GEMM_EPR, c20); GGML_GEMM_VEC_STORE(s2 + 1*GGML_GEMM_EPR, c21);
+        GGML_GEMM_VEC_STORE(s2 + 2*GGML_GEMM_EPR, c22); GGML_GEMM_VEC_STORE(s2 + 3*GGML_GEMM_EPR, c23);
     }
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    for (; r < nq; ++r) {
+        const float * q0 = q + r*D;
 
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
+        GGML_GEMM_VEC c00 = GGML_GEMM_VEC_ZERO, c01 = GGML_GEMM_VEC_ZERO, c02 = GGML_GEMM_VEC_ZERO, c03 = GGML_GEMM_VEC_ZERO;
 
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
+        for (int d = 0; d < D; ++d) {
+            const float * kd = kt + d*GGML_ATTN_BK;
 
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
+            const GGML_GEMM_VEC b = GGML_GEMM_VEC_SET1(q0[d]);
 
-    const float scale = 1.0/sqrt((double) D);
+            c00 = GGML_GEMM_VEC_FMA(c00, GGML_GEMM_VEC_LOAD(kd + 0*GGML_GEMM_EPR), b);
+            c01 = GGML_GEMM_VEC_FMA(c01, GGML_GEMM_VEC_LOAD(kd + 1*GGML_GEMM_EPR), b);
+            c02 = GGML_GEMM_VEC_FMA(c02, GGML_GEMM_VEC_LOAD(kd + 2*GGML_GEMM_EPR), b);
+            c03 = GGML_GEMM_VEC_FMA(c03, GGML_GEMM_VEC_LOAD(kd + 3*GGML_GEMM_EPR), b);
+        }
 
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+        float * s0 = s + r*GGML_ATTN_BK;
 
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+        GGML_GEMM_VEC_STORE(s0 + 0*GGML_GEMM_EPR, c00); GGML_GEMM_VEC_STORE(s0 + 1*GGML_GEMM_EPR, c01);
+        GGML_GEMM_VEC_STORE(s0 + 2*GGML_GEMM_EPR, c02); GGML_GEMM_VEC_STORE(s0 + 3*GGML_GEMM_EPR, c03);
+    }
+#else
+    for (; r < nq; ++r) {
+        float * s0 = s + r*GGML_ATTN_BK;
 
-        float * S = (float *) params->wdata + ith*(Mup + CACHE_LINE_SIZE_F32);
+        for (int j = 0; j < GGML_ATTN_BK; ++j) {
+            s0[j] = 0.0f;
+        }
 
-        for (int i = M; i < Mup; ++i) {
-            S[i] = -INFINITY;
+        for (int d = 0; d < D; ++d) {
+            ggml_vec_mad_f32(GGML_ATTN_BK, s0, kt + d*GGML_ATTN_BK, q[r*D + d]);
         }
+    }
+#endif
+}
 
-        for (int ic = 0; ic < nek1; ++ic) {
-            // k indices
-            const int ik3 = iq3;
-            const int ik2 = iq2;
-            const int ik1 = ic;
+// o [nq][D] += p [nq][GGML_ATTN_BK] * v [nk][D], over the first nk columns of p
+static void ggml_attn_pv(const int nq, const int nk, const int D, const float * restrict p, const float * restrict v, float * restrict o) {
+    int r = 0;
 
-            // S indices
-            const int i1 = ik1;
+#if defined(GGML_GEMM_EPR)
+    // columns of o in registers
+    const int nd = D - D%(4*GGML_GEMM_EPR);
 
-            ggml_vec_dot_f32(neq0,
-                    S + i1,
-                    (float *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                    (float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
-        }
+    for (; r + 3 <= nq; r += 3) {
+        const float * p0 = p + (r + 0)*GGML_ATTN_BK;
+        const float * p1 = p + (r + 1)*GGML_ATTN_BK;
+        const float * p2 = p + (r + 2)*GGML_ATTN_BK;
 
-        // scale
-        ggml_vec_scale_f32(nek1, S, scale);
+        float * o0 = o + (r + 0)*D;
+        float * o1 = o + (r + 1)*D;
+        float * o2 = o + (r + 2)*D;
 
-        if (masked) {
-            for (int i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
-                }
-            }
-        }
+        for (int d0 = 0; d0 < nd; d0 += 4*GGML_GEMM_EPR) {
+            GGML_GEMM_VEC c00 = GGML_GEMM_VEC_LOAD(o0 + d0 + 0*GGML_GEMM_EPR), c01 = GGML_GEMM_VEC_LOAD(o0 + d0 + 1*GGML_GEMM_EPR);
+            GGML_GEMM_VEC c02 = GGML_GEMM_VEC_LOAD(o0 + d0 + 2*GGML_GEMM_EPR), c03 = GGML_GEMM_VEC_LOAD(o0 + d0 + 3*GGML_GEMM_EPR);
+            GGML_GEMM_VEC c10 = GGML_GEMM_VEC_LOAD(o1 + d0 + 0*GGML_GEMM_EPR), c11 = GGML_GEMM_VEC_LOAD(o1 + d0 + 1*GGML_GEMM_EPR);
+            GGML_GEMM_VEC c12 = GGML_GEMM_VEC_LOAD(o1 + d0 + 2*GGML_GEMM_EPR), c13 = GGML_GEMM_VEC_LOAD(o1 + d0 + 3*GGML_GEMM_EPR);
+            GGML_GEMM_VEC c20 = GGML_GEMM_VEC_LOAD(o2 + d0 + 0*GGML_GEMM_EPR), c21 = GGML_GEMM_VEC_LOAD(o2 + d0 + 1*GGML_GEMM_EPR);
+            GGML_GEMM_VEC c22 = GGML_GEMM_VEC_LOAD(o2 + d0 + 2*GGML_GEMM_EPR), c23 = GGML_GEMM_VEC_LOAD(o2 + d0 + 3*GGML_GEMM_EPR);
 
-        // softmax
-        {
-            float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
+            for (int j = 0; j < nk; ++j) {
+                const float * vj = v + j*D + d0;
 
-            float sum = 0.0f;
-            {
-#ifdef GGML_SOFT_MAX_ACCELERATE
-                max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
-#else
-                uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
-                ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
+                const GGML_GEMM_VEC v0 = GGML_GEMM_VEC_LOAD(vj + 0*GGML_GEMM_EPR);
+                const GGML_GEMM_VEC v1 = GGML_GEMM_VEC_LOAD(vj + 1*GGML_GEMM_EPR);
+                const GGML_GEMM_VEC v2 = GGML_GEMM_VEC_LOAD(vj + 2*GGML_GEMM_EPR);
+                const GGML_GEMM_VEC v3 = GGML_GEMM_VEC_LOAD(vj + 3*GGML_GEMM_EPR);
 
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
-                    float * SS = S + i;
+                GGML_GEMM_VEC b;
 
-                    for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
-                        if (SS[j] == -INFINITY) {
-                            SS[j] = 0.0f;
-                        } else {
-                            ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
-                            memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
-                            sump[j] += val;
-                            SS[j] = val;
-                        }
-                    }
-                }
+                b = GGML_GEMM_VEC_SET1(p0[j]);
+                c00 = GGML_GEMM_VEC_FMA(c00, v0, b); c01 = GGML_GEMM_VEC_FMA(c01, v1, b);
+                c02 = GGML_GEMM_VEC_FMA(c02, v2, b); c03 = GGML_GEMM_VEC_FMA(c03, v3, b);
 
-                for (int i = 0; i < GGML_SOFT_MAX_UNROLL; i++) {
-                    sum += sump[i];
-                }
-#endif
-            }
+                b = GGML_GEMM_VEC_SET1(p1[j]);
+                c10 = GGML_GEMM_VEC_FMA(c10, v0, b); c11 = GGML_GEMM_VEC_FMA(c11, v1, b);
+                c12 = GGML_GEMM_VEC_FMA(c12, v2, b); c13 = GGML_GEMM_VEC_FMA(c13, v3, b);
 
-            assert(sum > 0.0f);
+                b = GGML_GEMM_VEC_SET1(p2[j]);
+                c20 = GGML_GEMM_VEC_FMA(c20, v0, b); c21 = GGML_GEMM_VEC_FMA(c21, v1, b);
+                c22 = GGML_GEMM_VEC_FMA(c22, v2, b); c23 = GGML_GEMM_VEC_FMA(c23, v3, b);
+            }
 
-            sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
+            GGML_GEMM_VEC_STORE(o0 + d0 + 0*GGML_GEMM_EPR, c00); GGML_GEMM_VEC_STORE(o0 + d0 + 1*GGML_GEMM_EPR, c01);
+            GGML_GEMM_VEC_STORE(o0 + d0 + 2*GGML_GEMM_EPR, c02); GGML_GEMM_VEC_STORE(o0 + d0 + 3*GGML_GEMM_EPR, c03);
+            GGML_GEMM_VEC_STORE(o1 + d0 + 0*GGML_GEMM_EPR, c10); GGML_GEMM_VEC_STORE(o1 + d0 + 1*GGML_GEMM_EPR, c11);
+            GGML_GEMM_VEC_STORE(o1 + d0 + 2*GGML_GEMM_EPR, c12); GGML_GEMM_VEC_STORE(o1 + d0 + 3*GGML_GEMM_EPR, c13);
+            GGML_GEMM_VEC_STORE(o2 + d0 + 0*GGML_GEMM_EPR, c20); GGML_GEMM_VEC_STORE(o2 + d0 + 1*GGML_GEMM_EPR, c21);
+            GGML_GEMM_VEC_STORE(o2 + d0 + 2*GGML_GEMM_EPR, c22); GGML_GEMM_VEC_STORE(o2 + d0 + 3*GGML_GEMM_EPR, c23);
+        }
 
-#ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
-                assert(!isnan(S[i]));
-                assert(!isinf(S[i]));
+        for (int j = 0; j < nk; ++j) {
+            for (int d = nd; d < D; ++d) {
+                o0[d] += p0[j]*v[j*D + d];
+                o1[d] += p1[j]*v[j*D + d];
+                o2[d] += p2[j]*v[j*D + d];
             }
+        }
+    }
 #endif
+
+    for (; r < nq; ++r) {
+        for (int j = 0; j < nk; ++j) {
+            ggml_vec_mad_f32(D, o + r*D, v + j*D, p[r*GGML_ATTN_BK + j]);
         }
+    }
+}
 
-        for (int ic = 0; ic < nev1; ++ic) {
-            // dst indices
-            const int i1 = iq1;
-            const int i2 = iq2;
-            const int i3 = iq3;
+// s[i] = exp(s[i] - max) for i < n, returns the sum
+static float ggml_attn_exp_sum(const int n, float * s, const float max) {
+    ggml_float sum = 0.0;
+
+    int i = 0;
+#if defined(__AVX2__)
+    {
+        const __m256 vmax = _mm256_set1_ps(max);
+
+        __m256 vsum = _mm256_setzero_ps();
+        for (; i + 8 <= n; i += 8) {
+            const __m256 e = ggml_v_expf_neg(_mm256_sub_ps(_mm256_loadu_ps(s + i), vmax));
+            _mm256_storeu_ps(s + i, e);
+            vsum = _mm256_add_ps(vsum, e);
+        }
+        __m128 t = _mm_add_ps(_mm256_castps256_ps128(vsum), _mm256_extractf128_ps(vsum, 1));
+        t = _mm_hadd_ps(t, t);
+        sum = _mm_cvtss_f32(_mm_hadd_ps(t, t));
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    {
+        const float32x4_t vmax = vdupq_n_f32(max);
 
-            ggml_vec_dot_f32(nek1,
-                    (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                    (float *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                    S);
+        float32x4_t vsum = vdupq_n_f32(0.0f);
+        for (; i + 4 <= n; i += 4) {
+            const float32x4_t e = ggml_v_expf_neg(vsubq_f32(vld1q_f32(s + i), vmax));
+            vst1q_f32(s + i, e);
+            vsum = vaddq_f32(vsum, e);
         }
+        sum = vaddvq_f32(vsum);
+    }
+#endif
+    for (; i < n; ++i) {
+        s[i] = s[i] == -INFINITY ? 0.0f : expf(s[i] - max);
+        sum += s[i];
     }
+
+    return sum;
 }
 
-static void ggml_compute_forward_flash_attn_f16(
+static void ggml_compute_forward_flash_attn(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * q,
         const struct ggml_tensor * k,
         const struct ggml_tensor * v,
         const bool masked,
-             struct ggml_tensor * dst) {
+              struct ggml_tensor * dst) {
     int64_t t0 = ggml_perf_time_us();
     UNUSED(t0);
 
@@ -6114,18 +8769,12 @@ static void ggml_compute_forward_flash_attn_f16(
 
     const int nek0 = k->ne[0];
     const int nek1 = k->ne[1];
-    //const int nek2 = k->ne[2];
-    //const int nek3 = k->ne[3];
 
-    //const int nev0 = v->ne[0];
+    const int nev0 = v->ne[0];
     const int nev1 = v->ne[1];
-    //const int nev2 = v->ne[2];
-    //const int nev3 = v->ne[3];
 
     const int ne0  = dst->ne[0];
     const int ne1  = dst->ne[1];
-    //const int ne2  = dst->ne[2];
-    //const int ne3  = dst->ne[3];
 
     const int nbk0 = k->nb[0];
     const int nbk1 = k->nb[1];
@@ -6155,22 +8804,23 @@ static void ggml_compute_forward_flash_attn_f16(
     const int P = nek1 - N;
     const int M = P + N;
 
-    const int Mup = ggml_up(M, GGML_SOFT_MAX_UNROLL);
+    GGML_ASSERT(q->type == GGML_TYPE_F16 || q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->type == GGML_TYPE_F16 || k->type == GGML_TYPE_F32);
+    GGML_ASSERT(v->type == GGML_TYPE_F16 || v->type == GGML_TYPE_F32);
+    GGML_ASSERT(dst->type == GGML_TYPE_F32);
+
+    const bool q_f16 = q->type == GGML_TYPE_F16;
+    const bool k_f16 = k->type == GGML_TYPE_F16;
+    const bool v_f16 = v->type == GGML_TYPE_F16;
 
     GGML_ASSERT(ne0 == D);
     GGML_ASSERT(ne1 == N);
     GGML_ASSERT(P >= 0);
 
-    GGML_ASSERT(nbq0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbq0 == (int) ggml_element_size(q));
 
-    GGML_ASSERT(neq0 == D);
     GGML_ASSERT(nek0 == D);
-    GGML_ASSERT(nev1 == D);
-
-    GGML_ASSERT(neq1 == N);
-    GGML_ASSERT(nek1 == N + P);
+    GGML_ASSERT(nev0 == M);
     GGML_ASSERT(nev1 == D);
 
     // dst cannot be transposed or permuted
@@ -6187,185 +8837,147 @@ static void ggml_compute_forward_flash_attn_f16(
         return;
     }
 
-    // parallelize by q rows using ggml_vec_dot_f32
+    // parallelize by blocks of q rows of each head
 
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
+    // blocks of q rows in a head
+    const int nqb = (N + GGML_ATTN_BQ - 1)/GGML_ATTN_BQ;
 
-    // rows per thread
+    // total blocks
+    const int nr = nqb*neq2*neq3;
+
+    // blocks per thread
     const int dr = (nr + nth - 1)/nth;
 
-    // row range for this thread
+    // block range for this thread
     const int ir0 = dr*ith;
     const int ir1 = MIN(ir0 + dr, nr);
 
     const float scale = 1.0/sqrt((double) D);
 
-    //printf("P=%d N=%d D=%d ir0=%d ir1=%d scale = %f\n", P, N, D, ir0, ir1, scale);
+    float * const wq = (float *) ((char *) params->wdata + ith*ggml_flash_attn_thread_wsize(D));
+    float * const wo = wq + GGML_ATTN_BQ*D;
+    float * const wk = wo + GGML_ATTN_BQ*D;
+    float * const wv = wk + D*GGML_ATTN_BK;
+    float * const ws = wv + GGML_ATTN_BK*D;
+    float * const wm = ws + GGML_ATTN_BQ*GGML_ATTN_BK;
+    float * const wl = wm + GGML_ATTN_BQ;
+
+    GGML_ASSERT((char *) (wl + GGML_ATTN_BQ) <= (char *) params->wdata + params->wsize);
 
     for (int ir = ir0; ir < ir1; ++ir) {
         // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+        const int iq3 = ir/(neq2*nqb);
+        const int iq2 = (ir - iq3*neq2*nqb)/nqb;
+        const int iq1 = (ir - iq3*neq2*nqb - iq2*nqb)*GGML_ATTN_BQ;
+
+        // q rows in this block
+        const int nq = MIN(GGML_ATTN_BQ, N - iq1);
 
-        float * S = (float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32);
+        const char * q_data = (const char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3);
+        const char * k_data = (const char *) k->data + (            iq2*nbk2 + iq3*nbk3);
+        const char * v_data = (const char *) v->data + (            iq2*nbv2 + iq3*nbv3);
 
-        for (int i = M; i < Mup; ++i) {
-            S[i] = -INFINITY;
+        for (int r = 0; r < nq; ++r) {
+            ggml_attn_cvt_row(D, q_data + r*nbq1, q_f16, wq + r*D);
+            ggml_vec_scale_f32(D, wq + r*D, scale);
         }
 
-        if (GGML_VEC_DOT_UNROLL > 2 || nek1 % GGML_VEC_DOT_UNROLL != 0) {
-            for (int ic = 0; ic < nek1; ++ic) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
+        for (int r = 0; r < nq; ++r) {
+            wm[r] = -INFINITY;
+            wl[r] = 0.0f;
+        }
 
-                // S indices
-                const int i1 = ik1;
+        memset(wo, 0, nq*D*sizeof(float));
 
-                ggml_vec_dot_f16(neq0,
-                        S + i1,
-                        (ggml_fp16_t *) ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
-            }
-        } else {
-            for (int ic = 0; ic < nek1; ic += GGML_VEC_DOT_UNROLL) {
-                // k indices
-                const int ik3 = iq3;
-                const int ik2 = iq2;
-                const int ik1 = ic;
-
-                // S indices
-                const int i1 = ik1;
-
-                ggml_vec_dot_f16_unroll(neq0, nbk1,
-                        S + i1,
-                        ((char *) k->data + (ik1*nbk1 + ik2*nbk2 + ik3*nbk3)),
-                        (ggml_fp16_t *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3)));
-            }
-        }
+        // keys that the last q row of the block can see
+        const int mk = masked ? P + iq1 + nq : M;
 
-        // scale
-        ggml_vec_scale_f32(nek1, S, scale);
+        for (int ik1 = 0; ik1 < mk; ik1 += GGML_ATTN_BK) {
+            // keys in this block
+            const int nk = MIN(GGML_ATTN_BK, mk - ik1);
 
-        if (masked) {
-            for (int i = P; i < M; i++) {
-                if (i > P + iq1) {
-                    S[i] = -INFINITY;
+            // K^T
+            if (nbk1 == (int) ggml_element_size(k)) {
+                for (int d = 0; d < D; ++d) {
+                    ggml_attn_cvt_row(nk, k_data + d*nbk0 + ik1*nbk1, k_f16, wk + d*GGML_ATTN_BK);
+                }
+            } else {
+                for (int j = 0; j < nk; ++j) {
+                    for (int d = 0; d < D; ++d) {
+                        wk[d*GGML_ATTN_BK + j] = ggml_attn_get_f32(k_data + d*nbk0 + (ik1 + j)*nbk1, k_f16);
+                    }
                 }
             }
-        }
-
-        // softmax
-        {
-            float max = -INFINITY;
-            ggml_vec_max_f32(M, &max, S);
-
-            float sum = 0.0f;
-            {
-#ifdef GGML_SOFT_MAX_ACCELERATE
-                max = -max;
-                vDSP_vsadd(S, 1, &max, S, 1, Mup);
-                vvexpf(S, S, &Mup);
-                ggml_vec_sum_f32(Mup, &sum, S);
-#else
-                uint16_t   scvt[GGML_SOFT_MAX_UNROLL];
-                ggml_float sump[GGML_SOFT_MAX_UNROLL] = { 0.0 };
 
-                for (int i = 0; i < Mup; i += GGML_SOFT_MAX_UNROLL) {
-                    float * SS = S + i;
+            for (int d = 0; d < D; ++d) {
+                for (int j = nk; j < GGML_ATTN_BK; ++j) {
+                    wk[d*GGML_ATTN_BK + j] = 0.0f;
+                }
+            }
 
-                    for (int j = 0; j < GGML_SOFT_MAX_UNROLL; ++j) {
-                        if (SS[j] == -INFINITY) {
-                            SS[j] = 0.0f;
-                        } else {
-                            ggml_fp16_t s = GGML_FP32_TO_FP16(SS[j] - max);
-                            memcpy(&scvt[j], &s, sizeof(uint16_t));
-                            const float val = GGML_FP16_TO_FP32(table_exp_f16[scvt[j]]);
-                            sump[j] += val;
-                            SS[j] = val;
-                        }
+            // V
+            if (nbv1 == (int) ggml_element_size(v)) {
+                for (int j = 0; j < nk; ++j) {
+                    ggml_attn_cvt_row(D, v_data + (ik1 + j)*nbv0, v_f16, wv + j*D);
+                }
+            } else if (nbv0 == (int) ggml_element_size(v)) {
+                // the scores are not computed yet, convert the rows of V^T through S
+                for (int d = 0; d < D; ++d) {
+                    ggml_attn_cvt_row(nk, v_data + ik1*nbv0 + d*nbv1, v_f16, ws);
+                    for (int j = 0; j < nk; ++j) {
+                        wv[j*D + d] = ws[j];
                     }
                 }
-
-                for (int i = 0; i < GGML_SOFT_MAX_UNROLL; i++) {
-                    sum += sump[i];
+            } else {
+                for (int d = 0; d < D; ++d) {
+                    for (int j = 0; j < nk; ++j) {
+                        wv[j*D + d] = ggml_attn_get_f32(v_data + (ik1 + j)*nbv0 + d*nbv1, v_f16);
+                    }
                 }
-#endif
             }
 
-            assert(sum > 0.0f);
+            ggml_attn_qk(nq, D, wq, wk, ws);
 
-            sum = 1.0/sum;
-            ggml_vec_scale_f32(M, S, sum);
+            for (int r = 0; r < nq; ++r) {
+                float * s = ws + r*GGML_ATTN_BK;
 
-#ifndef NDEBUG
-            for (int i = 0; i < M; ++i) {
-                assert(!isnan(S[i]));
-                assert(!isinf(S[i]));
-            }
-#endif
-        }
+                if (masked) {
+                    for (int j = MAX(0, P + iq1 + r + 1 - ik1); j < nk; ++j) {
+                        s[j] = -INFINITY;
+                    }
+                }
 
-        ggml_fp16_t * S16 = (ggml_fp16_t *) ((float *) params->wdata + ith*(2*Mup + CACHE_LINE_SIZE_F32) + Mup);
+                float max = -INFINITY;
+                ggml_vec_max_f32(nk, &max, s);
 
-        for (int i = 0; i < M; i++) {
-            S16[i] = GGML_FP32_TO_FP16(S[i]);
-        }
+                const float m = MAX(wm[r], max);
 
-        if (GGML_VEC_DOT_UNROLL == 1 || (nev1 % GGML_VEC_DOT_UNROLL != 0)) {
-            for (int ic = 0; ic < nev1; ++ic) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
+                if (m == -INFINITY) {
+                    // all the keys so far are masked
+                    memset(s, 0, nk*sizeof(float));
+                    continue;
+                }
 
-                ggml_vec_dot_f16(nek1,
-                        (float *)       ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        (ggml_fp16_t *) ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                        S16);
-            }
-        } else {
-            for (int ic = 0; ic < nev1; ic += GGML_VEC_DOT_UNROLL) {
-                // dst indices
-                const int i1 = iq1;
-                const int i2 = iq2;
-                const int i3 = iq3;
+                const float c = expf(wm[r] - m);
 
-                ggml_vec_dot_f16_unroll(nek1, nbv1,
-                        (float *) ((char *) dst->data + (ic*nb0 + i1*nb1  + i2*nb2  + i3*nb3)),
-                        ((char *) v->data   + (         ic*nbv1 + i2*nbv2 + i3*nbv3)),
-                        S16);
+                wl[r] = wl[r]*c + ggml_attn_exp_sum(nk, s, m);
+                wm[r] = m;
+
+                if (c != 1.0f) {
+                    ggml_vec_scale_f32(D, wo + r*D, c);
+                }
             }
+
+            ggml_attn_pv(nq, nk, D, ws, wv, wo);
         }
-    }
-}
 
-static void ggml_compute_forward_flash_attn(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * q,
-        const struct ggml_tensor * k,
-        const struct ggml_tensor * v,
-        const bool masked,
-        struct ggml_tensor * dst) {
-    switch (q->type) {
-        case GGML_TYPE_F16:
-            {
-                ggml_compute_forward_flash_attn_f16(params, q, k, v, masked, dst);
-            } break;
-        case GGML_TYPE_F32:
-            {
-                ggml_compute_forward_flash_attn_f32(params, q, k, v, masked, dst);
-            } break;
-        case GGML_TYPE_I8:
-        case GGML_TYPE_I16:
-        case GGML_TYPE_I32:
-        case GGML_TYPE_COUNT:
-            {
-                assert(false);
-            } break;
+        for (int r = 0; r < nq; ++r) {
+            float * dst_data = (float *) ((char *) dst->data + ((iq1 + r)*nb1 + iq2*nb2 + iq3*nb3));
+
+            for (int d = 0; d < D; ++d) {
+                dst_data[d] = wo[r*D + d]/wl[r];
+            }
+        }
     }
 }
 
@@ -6571,6 +9183,12 @@ static void ggml_compute_forward_flash_ff(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+        case GGML_TYPE_Q8_1:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -7034,621 +9652,979 @@ static void ggml_build_forward_impl(struct ggml_cgraph * cgraph, struct ggml_ten
 
     ggml_visit_parents(cgraph, tensor);
 
-    const int n_new = cgraph->n_nodes - n0;
-    GGML_PRINT_DEBUG("%s: visited %d new nodes\n", __func__, n_new);
+    const int n_new = cgraph->n_nodes - n0;
+    GGML_PRINT_DEBUG("%s: visited %d new nodes\n", __func__, n_new);
+
+    if (n_new > 0) {
+        // the last added node should always be starting point
+        assert(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
+
+        // the new nodes need to be planned
+        cgraph->n_threads_plan = 0;
+    }
+}
+
+void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor) {
+    ggml_build_forward_impl(cgraph, tensor, true);
+}
+
+struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
+    struct ggml_cgraph result = {
+        /*.n_nodes        =*/ 0,
+        /*.n_leafs        =*/ 0,
+        /*.n_threads      =*/ 0,
+        /*.work_size      =*/ 0,
+        /*.work           =*/ NULL,
+        /*.pool           =*/ NULL,
+        /*.n_threads_plan =*/ 0,
+        /*.nodes          =*/ { NULL },
+        /*.grads          =*/ { NULL },
+        /*.leafs          =*/ { NULL },
+        /*.perf_runs      =*/ 0,
+        /*.perf_cycles    =*/ 0,
+        /*.perf_time_us   =*/ 0,
+    };
+
+    ggml_build_forward_impl(&result, tensor, false);
+
+    return result;
+}
+
+struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep) {
+    struct ggml_cgraph result = *gf;
+
+    assert(gf->n_nodes > 0);
+
+    // if we are keeping the gradient graph, we have to detach the gradient nodes from the original graph
+    if (keep) {
+        for (int i = 0; i < gf->n_nodes; i++) {
+            struct ggml_tensor * node = gf->nodes[i];
+
+            if (node->grad) {
+                node->grad = ggml_dup_tensor(ctx, node);
+                gf->grads[i] = node->grad;
+            }
+        }
+    }
+
+    for (int i = gf->n_nodes - 1; i >= 0; i--) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        // because we detached the grad nodes from the original graph, we can afford inplace operations
+        if (node->grad) {
+            ggml_compute_backward(ctx, node, keep);
+        }
+    }
+
+    for (int i = gf->n_nodes - 1; i >= 0; i--) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        if (node->is_param) {
+            GGML_PRINT_DEBUG("%s: found root node %p\n", __func__, (void *) node);
+            ggml_build_forward_impl(&result, node->grad, true);
+        }
+    }
+
+    return result;
+}
+
+//
+// thread data
+//
+// threads are kept in a ggml_threadpool, which can be reused by many graphs
+// within a graph, the threads synchronize between nodes with a barrier that spins for a bounded, adaptively tuned
+// number of iterations and then sleeps on a condition variable. this avoids burning the CPU that the other threads
+// need when there are more threads than free cores, while keeping the wake-up latency low when there are not
+//
+
+typedef pthread_t ggml_thread_t;
+
+#define ggml_thread_create pthread_create
+#define ggml_thread_join   pthread_join
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+#define ggml_cpu_relax() YieldProcessor()
+#elif defined(__x86_64__) || defined(__i386__)
+#define ggml_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define ggml_cpu_relax() __asm__ __volatile__("yield")
+#else
+#define ggml_cpu_relax()
+#endif
+
+// bounds for the number of spin iterations in ggml_barrier() before going to sleep
+#define GGML_BARRIER_SPIN_MIN  16
+#define GGML_BARRIER_SPIN_INIT 1024
+#define GGML_BARRIER_SPIN_MAX  16384
+
+// minimum number of elements for splitting an elementwise op between the threads (see ggml_n_tasks_rows())
+// a node with n_tasks > 1 costs three barriers, which is worth roughly this many elements of elementwise work
+#define GGML_MT_MIN_NELEMENTS (16*1024)
+
+struct ggml_compute_state_shared {
+    struct ggml_cgraph * cgraph;
+
+    int n_threads;
+
+    // barrier
+    atomic_int n_arrived;
+    atomic_int phase;       // incremented each time all threads have arrived
+    atomic_int n_sleeping;  // number of threads waiting on cond
+    atomic_int spin_budget; // number of spin iterations before sleeping
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+};
+
+struct ggml_compute_state {
+    ggml_thread_t thrd;
+
+    int ith;
+
+    struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool;
+};
+
+// persistent worker threads, reused across ggml_graph_compute() calls
+// between graphs the workers sleep on a condition variable
+struct ggml_threadpool {
+    int n_threads; // including the thread calling ggml_graph_compute()
+
+    struct ggml_compute_state_shared shared;
+    struct ggml_compute_state * workers; // n_threads - 1
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    // guarded by mutex
+    int  n_graphs;        // incremented each time a graph is dispatched to the workers
+    int  n_threads_graph; // number of threads used by the current graph
+    bool shutdown;
+};
+
+static void ggml_barrier(struct ggml_compute_state_shared * shared) {
+    const int n_threads = shared->n_threads;
+
+    if (n_threads == 1) {
+        return;
+    }
+
+    const int phase = atomic_load(&shared->phase);
+
+    if (atomic_fetch_add(&shared->n_arrived, 1) == n_threads - 1) {
+        // last thread to arrive - release the others
+        atomic_store(&shared->n_arrived, 0);
+        atomic_fetch_add(&shared->phase, 1);
+
+        if (atomic_load(&shared->n_sleeping) > 0) {
+            pthread_mutex_lock(&shared->mutex);
+            pthread_cond_broadcast(&shared->cond);
+            pthread_mutex_unlock(&shared->mutex);
+        }
+
+        return;
+    }
+
+    const int spin_budget = atomic_load(&shared->spin_budget);
+
+    for (int i = 0; i < spin_budget; i++) {
+        if (atomic_load(&shared->phase) != phase) {
+            // the wait ended while spinning - allow a little more spinning next time
+            if (spin_budget < GGML_BARRIER_SPIN_MAX) {
+                atomic_store(&shared->spin_budget, MIN(GGML_BARRIER_SPIN_MAX, spin_budget + spin_budget/8 + 1));
+            }
+            return;
+        }
+        ggml_cpu_relax();
+    }
+
+    // spinning did not pay off (e.g. the threads we are waiting for are not running) - spin less next time and sleep
+    atomic_store(&shared->spin_budget, MAX(GGML_BARRIER_SPIN_MIN, spin_budget/2));
+
+    pthread_mutex_lock(&shared->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+    while (atomic_load(&shared->phase) == phase) {
+        pthread_cond_wait(&shared->cond, &shared->mutex);
+    }
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+// run the nodes of the graph as thread ith
+// all threads step through all nodes; nodes with a single task are computed by thread 0 only, without synchronization
+static void ggml_graph_compute_nodes(struct ggml_compute_state_shared * shared, int ith) {
+    struct ggml_cgraph * cgraph = shared->cgraph;
+
+    struct ggml_compute_params params = {
+        /*.type  =*/ GGML_TASK_INIT,
+        /*.ith   =*/ ith,
+        /*.nth   =*/ 1,
+        /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+        /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
+    };
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        const int n_tasks = node->n_tasks;
+
+        if (n_tasks == 1 && ith != 0) {
+            continue;
+        }
+
+        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
+
+        // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
+        //if (node->grad == NULL && node->perf_runs > 0) {
+        //    continue;
+        //}
+
+        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
+        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+
+        params.nth = n_tasks;
+
+        // INIT
+        if (ith == 0) {
+            params.type = GGML_TASK_INIT;
+            ggml_compute_forward(&params, node);
+        }
+
+        if (n_tasks > 1) {
+            ggml_barrier(shared);
+        }
+
+        // COMPUTE
+        if (ith < n_tasks) {
+            params.type = GGML_TASK_COMPUTE;
+            ggml_compute_forward(&params, node);
+        }
+
+        if (n_tasks > 1) {
+            ggml_barrier(shared);
+        }
+
+        // FINALIZE
+        if (ith < n_tasks) {
+            params.type = GGML_TASK_FINALIZE;
+            ggml_compute_forward(&params, node);
+        }
+
+        if (n_tasks > 1) {
+            ggml_barrier(shared);
+        }
+
+        // performance stats (node)
+        if (ith == 0) {
+            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
+            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+
+            node->perf_runs++;
+            node->perf_cycles  += perf_cycles_cur;
+            node->perf_time_us += perf_time_us_cur;
+        }
+    }
+}
+
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->pool;
+
+    int n_graphs = 0;
+
+    while (true) {
+        // sleep until there is a new graph to compute
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->n_graphs == n_graphs && !pool->shutdown) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        n_graphs = pool->n_graphs;
+
+        const bool shutdown = pool->shutdown;
+        const bool active   = state->ith < pool->n_threads_graph;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (shutdown) {
+            break;
+        }
+
+        if (active) {
+            ggml_graph_compute_nodes(state->shared, state->ith);
+
+            // make sure no thread is still using the graph when ggml_graph_compute() returns
+            ggml_barrier(state->shared);
+        }
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = 1;
+    }
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+
+    pool->n_threads = n_threads;
+
+    pool->shared.cgraph    = NULL;
+    pool->shared.n_threads = n_threads;
+
+    atomic_store(&pool->shared.n_arrived,   0);
+    atomic_store(&pool->shared.phase,       0);
+    atomic_store(&pool->shared.n_sleeping,  0);
+    atomic_store(&pool->shared.spin_budget, GGML_BARRIER_SPIN_INIT);
+
+    pthread_mutex_init(&pool->shared.mutex, NULL);
+    pthread_cond_init (&pool->shared.cond,  NULL);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond,  NULL);
+
+    pool->n_graphs        = 0;
+    pool->n_threads_graph = 0;
+    pool->shutdown        = false;
+
+    pool->workers = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j + 1,
+            .shared = &pool->shared,
+            .pool   = pool,
+        };
+
+        int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        assert(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        assert(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_mutex_destroy(&pool->shared.mutex);
+    pthread_cond_destroy (&pool->shared.cond);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy (&pool->cond);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+// number of tasks for an op that is split between the threads by the rows of tensor t
+// below GGML_MT_MIN_NELEMENTS the thread synchronization costs more than it saves, so the op is computed by a single thread
+static int ggml_n_tasks_rows(const struct ggml_tensor * t, int n_threads) {
+    if (ggml_nelements(t) < GGML_MT_MIN_NELEMENTS) {
+        return 1;
+    }
+
+    return MIN(n_threads, ggml_nrows(t));
+}
+
+// sets the number of tasks of each node for n_threads threads
+// returns the size of the work buffer that the nodes need, without the padding between the threads
+static size_t ggml_graph_plan_tasks(struct ggml_cgraph * cgraph, int n_threads) {
+    size_t work_size = 0;
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = ggml_n_tasks_rows(node->src0, n_threads);
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = ggml_n_tasks_rows(node, n_threads);
+                } break;
+            case GGML_OP_MEAN:
+                {
+                    node->n_tasks = ggml_n_tasks_rows(node->src0, n_threads);
+                } break;
+            case GGML_OP_SUM:
+                {
+                    node->n_tasks = ggml_n_tasks_rows(node->src0, n_threads);
+
+                    // one partial sum per thread, each in its own cache line
+                    work_size = MAX(work_size, (size_t) CACHE_LINE_SIZE*node->n_tasks);
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    node->n_tasks = n_threads;
+
+                    // TODO: use different scheduling for different matrix sizes
+                    //const int nr0 = ggml_nrows(node->src0);
+                    //const int nr1 = ggml_nrows(node->src1);
+
+                    //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
+
+                    size_t cur = 0;
+
+                    // TODO: better way to determine if the matrix is transposed
+                    if (node->src0->nb[1] < node->src0->nb[0]) {
+                        cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
+                    } else {
+                        if (node->src0->type == GGML_TYPE_F16 &&
+                            node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1; // TODO: this actually is doing nothing
+                                                   //       the threads are still spinning
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                                //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
+                                //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
+                                //printf("cur = %zu\n", cur);
+                            } else
+#endif
+                            if (ggml_compute_forward_mul_mat_use_gemm(node->src0, node->src1, node)) {
+                                // the packed blocks of each thread
+                                cur = ggml_mul_mat_thread_wsize()*node->n_tasks;
+                            } else {
+                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+                            }
+                        } else if (node->src0->type == GGML_TYPE_F32 &&
+                                   node->src1->type == GGML_TYPE_F32) {
+                            cur = 0;
+                        } else if (ggml_is_quantized(node->src0->type) &&
+                                   node->src1->type == GGML_TYPE_F32) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                node->n_tasks = 1;
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else
+#endif
+                            {
+                                // src1 quantized to the type used by the dot product
+                                const enum ggml_type type_q = quantize_fns[node->src0->type].vec_dot_type;
+                                cur = GGML_TYPE_SIZE[type_q]*ggml_nelements(node->src1)/GGML_BLCK_SIZE[type_q];
+                            }
+                        } else {
+                            GGML_ASSERT(false);
+                        }
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+                {
+                    node->n_tasks = ggml_n_tasks_rows(node->src0, n_threads);
+                } break;
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
 
-    if (n_new > 0) {
-        // the last added node should always be starting point
-        assert(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
-    }
-}
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
 
-void ggml_build_forward_expand(struct ggml_cgraph * cgraph, struct ggml_tensor * tensor) {
-    ggml_build_forward_impl(cgraph, tensor, true);
-}
+                    if (ggml_compute_forward_conv_1d_use_gemm(node->src0, node->src1, node)) {
+#if defined(GGML_GEMM_EPR)
+                        cur = ggml_conv_1d_gemm_wsize_shared(node->src0, node->src1) +
+                            node->n_tasks*ggml_mul_mat_thread_wsize();
+#endif
+                    } else if (node->src0->type == GGML_TYPE_F16 &&
+                               node->src1->type == GGML_TYPE_F32 &&
+                               node->src0->layout == GGML_LAYOUT_CONV_1D) {
+                        // the kernel is used in place - only the source data is copied
+                        cur = sizeof(ggml_fp16_t)*(
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F16 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
-    struct ggml_cgraph result = {
-        /*.n_nodes      =*/ 0,
-        /*.n_leafs      =*/ 0,
-        /*.n_threads    =*/ 0,
-        /*.work_size    =*/ 0,
-        /*.work         =*/ NULL,
-        /*.nodes        =*/ { NULL },
-        /*.grads        =*/ { NULL },
-        /*.leafs        =*/ { NULL },
-        /*.perf_runs    =*/ 0,
-        /*.perf_cycles  =*/ 0,
-        /*.perf_time_us =*/ 0,
-    };
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-    ggml_build_forward_impl(&result, tensor, false);
+                    // Q, O, K and V tiles of each thread
+                    const size_t cur = ggml_flash_attn_thread_wsize(node->src0->ne[0])*node->n_tasks;
 
-    return result;
-}
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep) {
-    struct ggml_cgraph result = *gf;
+                    size_t cur = 0;
 
-    assert(gf->n_nodes > 0);
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-    // if we are keeping the gradient graph, we have to detach the gradient nodes from the original graph
-    if (keep) {
-        for (int i = 0; i < gf->n_nodes; i++) {
-            struct ggml_tensor * node = gf->nodes[i];
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-            if (node->grad) {
-                node->grad = ggml_dup_tensor(ctx, node);
-                gf->grads[i] = node->grad;
-            }
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    assert(false);
+                } break;
         }
     }
 
-    for (int i = gf->n_nodes - 1; i >= 0; i--) {
-        struct ggml_tensor * node = gf->nodes[i];
+    return work_size;
+}
 
-        // because we detached the grad nodes from the original graph, we can afford inplace operations
-        if (node->grad) {
-            ggml_compute_backward(ctx, node, keep);
-        }
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    if (cgraph->n_threads <= 0) {
+        cgraph->n_threads = 8;
     }
 
-    for (int i = gf->n_nodes - 1; i >= 0; i--) {
-        struct ggml_tensor * node = gf->nodes[i];
+    // use the caller's pool if there is one, otherwise create one just for this graph
+    struct ggml_threadpool * pool = cgraph->pool;
 
-        if (node->is_param) {
-            GGML_PRINT_DEBUG("%s: found root node %p\n", __func__, (void *) node);
-            ggml_build_forward_impl(&result, node->grad, true);
-        }
+    const bool pool_owned = pool == NULL && cgraph->n_threads > 1;
+    if (pool_owned) {
+        pool = ggml_threadpool_new(cgraph->n_threads);
     }
 
-    return result;
-}
-
-//
-// thread data
-//
-// synchronization is done via busy loops
-// I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
-//
-
-#ifdef __APPLE__
+    const int n_threads = pool ? MIN(cgraph->n_threads, pool->n_threads) : 1;
 
-//#include <os/lock.h>
-//
-//typedef os_unfair_lock ggml_lock_t;
-//
-//#define ggml_lock_init(x)    UNUSED(x)
-//#define ggml_lock_destroy(x) UNUSED(x)
-//#define ggml_lock_lock       os_unfair_lock_lock
-//#define ggml_lock_unlock     os_unfair_lock_unlock
-//
-//#define GGML_LOCK_INITIALIZER OS_UNFAIR_LOCK_INIT
+    // initialize tasks + work buffer, unless the graph has already been planned for as many threads
+    if (cgraph->n_threads_plan != n_threads) {
+        const size_t work_size = ggml_graph_plan_tasks(cgraph, n_threads);
 
-typedef int ggml_lock_t;
+        // more threads than the graph was last planned for - the old work buffer stays in the context
+        if (cgraph->work != NULL && work_size + CACHE_LINE_SIZE*(n_threads - 1) > cgraph->work_size) {
+            cgraph->work = NULL;
+        }
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+        if (work_size > 0 && cgraph->work == NULL) {
+            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
 
-#define GGML_LOCK_INITIALIZER 0
+            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+            ggml_scratch_save(ctx);
+            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            ggml_scratch_load(ctx);
+        }
 
-typedef pthread_t ggml_thread_t;
+        cgraph->n_threads_plan = n_threads;
+    }
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+    const int64_t perf_start_cycles  = ggml_perf_cycles();
+    const int64_t perf_start_time_us = ggml_perf_time_us();
 
-#else
+    if (n_threads > 1) {
+        struct ggml_compute_state_shared * shared = &pool->shared;
 
-//typedef pthread_spinlock_t ggml_lock_t;
+        shared->cgraph    = cgraph;
+        shared->n_threads = n_threads;
 
-//#define ggml_lock_init(x) pthread_spin_init(x, PTHREAD_PROCESS_PRIVATE)
-//#define ggml_lock_destroy pthread_spin_destroy
-//#define ggml_lock_lock    pthread_spin_lock
-//#define ggml_lock_unlock  pthread_spin_unlock
+        // wake up the workers
+        pthread_mutex_lock(&pool->mutex);
+        pool->n_threads_graph = n_threads;
+        pool->n_graphs++;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
 
-typedef int ggml_lock_t;
+        ggml_graph_compute_nodes(shared, 0);
 
-#define ggml_lock_init(x)    UNUSED(x)
-#define ggml_lock_destroy(x) UNUSED(x)
-#define ggml_lock_lock(x)    UNUSED(x)
-#define ggml_lock_unlock(x)  UNUSED(x)
+        // wait until the workers are done with the graph
+        ggml_barrier(shared);
+    } else {
+        struct ggml_compute_state_shared shared;
 
-#define GGML_LOCK_INITIALIZER 0
+        shared.cgraph    = cgraph;
+        shared.n_threads = 1;
 
-typedef pthread_t ggml_thread_t;
+        ggml_graph_compute_nodes(&shared, 0);
+    }
 
-#define ggml_thread_create pthread_create
-#define ggml_thread_join   pthread_join
+    if (pool_owned) {
+        ggml_threadpool_free(pool);
+    }
+    // performance stats (graph)
+    {
+        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
+        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
 
-#endif
+        cgraph->perf_runs++;
+        cgraph->perf_cycles  += perf_cycles_cur;
+        cgraph->perf_time_us += perf_time_us_cur;
 
-struct ggml_compute_state_shared {
-    ggml_lock_t spin;
+        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
+                __func__, cgraph->perf_runs,
+                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
+                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
+                (double) perf_time_us_cur     / 1000.0,
+                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
+    }
+}
 
-    int n_threads;
+////////////////////////////////////////////////////////////////////////////////
 
-    // synchronization primitives
-    atomic_int  n_ready;
-    atomic_bool has_work;
-    atomic_bool stop; // stop all threads
-};
+// static memory planning
 
-struct ggml_compute_state {
-    ggml_thread_t thrd;
+struct ggml_alloc_tensor {
+    const struct ggml_tensor * t;
 
-    struct ggml_compute_params params;
-    struct ggml_tensor * node;
+    bool planned;  // no memory and not a view - gets an offset in the buffer
+    bool consumed; // read by a node of the graph
+    bool written;  // the destination of a copy - not an input, even if it is a leaf
 
-    struct ggml_compute_state_shared * shared;
+    int    state;  // 0 - not allocated yet, 1 - live, 2 - freed
+    int    last;   // the last node that uses the memory, directly or through views
+    size_t offs;
 };
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
-
-    const int n_threads = state->shared->n_threads;
-
-    while (true) {
-        if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
-            atomic_store(&state->shared->has_work, false);
-        } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
-            }
-        }
+struct ggml_alloc_block {
+    size_t offs;
+    size_t size;
+};
 
-        atomic_fetch_sub(&state->shared->n_ready, 1);
+struct ggml_alloc {
+    int n_hash;
+    struct ggml_alloc_tensor * tensors; // open addressing, n_hash is a power of 2
 
-        // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
-        }
+    int n_free;
+    struct ggml_alloc_block * free;     // sorted by offset
 
-        // check if we should stop
-        if (atomic_load(&state->shared->stop)) {
-            break;
-        }
+    size_t top;                         // the end of the memory used so far - the peak
+};
 
-        if (state->node) {
-            if (state->params.ith < state->params.nth) {
-                ggml_compute_forward(&state->params, state->node);
-            }
+static struct ggml_alloc_tensor * ggml_alloc_get(struct ggml_alloc * alloc, const struct ggml_tensor * t) {
+    size_t i = ((uintptr_t) t/GGML_MEM_ALIGN) & (alloc->n_hash - 1);
 
-            state->node = NULL;
-        } else {
-            break;
-        }
+    while (alloc->tensors[i].t != NULL && alloc->tensors[i].t != t) {
+        i = (i + 1) & (alloc->n_hash - 1);
     }
 
-    return 0;
-}
+    struct ggml_alloc_tensor * e = &alloc->tensors[i];
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    if (cgraph->n_threads <= 0) {
-        cgraph->n_threads = 8;
+    if (e->t == NULL) {
+        e->t       = t;
+        e->planned = t->data == NULL && t->view_src == NULL;
+        e->last    = -1;
     }
 
-    const int n_threads = cgraph->n_threads;
+    return e;
+}
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+// the entry of the tensor that owns the memory of t
+static struct ggml_alloc_tensor * ggml_alloc_get_src(struct ggml_alloc * alloc, const struct ggml_tensor * t) {
+    return ggml_alloc_get(alloc, t->view_src ? t->view_src : t);
+}
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
-
-        atomic_store(&state_shared.has_work, true);
-
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
+// best fit from the free blocks, otherwise from the end of the buffer
+static size_t ggml_alloc_block_new(struct ggml_alloc * alloc, size_t size) {
+    int best = -1;
 
-            int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            assert(rc == 0);
-            UNUSED(rc);
+    for (int j = 0; j < alloc->n_free; j++) {
+        if (alloc->free[j].size >= size && (best < 0 || alloc->free[j].size < alloc->free[best].size)) {
+            best = j;
         }
     }
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        node->n_tasks = n_threads;
-
-                        // TODO: use different scheduling for different matrix sizes
-                        //const int nr0 = ggml_nrows(node->src0);
-                        //const int nr1 = ggml_nrows(node->src1);
-
-                        //node->n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                        //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks = %d\n", nr0, nr1, nr0*nr1, node->n_tasks);
-
-                        size_t cur = 0;
-
-                        // TODO: better way to determine if the matrix is transposed
-                        if (node->src0->nb[1] < node->src0->nb[0]) {
-                            cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
-                        } else {
-                            if (node->src0->type == GGML_TYPE_F16 &&
-                                node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    node->n_tasks = 1; // TODO: this actually is doing nothing
-                                                       //       the threads are still spinning
-                                    cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
-                                    //printf("src0: ne0 = %d, ne1 = %d, ne = %d\n", node->src0->ne[0], node->src0->ne[1], node->src0->ne[0]*node->src0->ne[1]);
-                                    //printf("src1: ne0 = %d, ne1 = %d, ne = %d\n", node->src1->ne[0], node->src1->ne[1], node->src1->ne[0]*node->src1->ne[1]);
-                                    //printf("cur = %zu\n", cur);
-                                } else {
-                                    cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-                                }
-#else
-                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-#endif
-                            } else if (node->src0->type == GGML_TYPE_F32 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-                                cur = 0;
-                            } else {
-                                GGML_ASSERT(false);
-                            }
-                        }
-
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
-
-                        if (node->src0->type == GGML_TYPE_F16 &&
-                            node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else if (node->src0->type == GGML_TYPE_F32 &&
-                                   node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
-                        } else {
-                            GGML_ASSERT(false);
-                        }
+    if (best < 0) {
+        size_t offs = alloc->top;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+        // the last free block can be extended
+        if (alloc->n_free > 0) {
+            const struct ggml_alloc_block * b = &alloc->free[alloc->n_free - 1];
+            if (b->offs + b->size == alloc->top) {
+                offs = b->offs;
+                alloc->n_free--;
+            }
+        }
 
-                        size_t cur = 0;
+        alloc->top = offs + size;
 
-                        const int ne11 = ggml_up(node->src1->ne[1], GGML_SOFT_MAX_UNROLL);
+        return offs;
+    }
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+    struct ggml_alloc_block * b = &alloc->free[best];
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*ne11*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*ne11*node->n_tasks; // this is overestimated by x2
-                        }
+    const size_t offs = b->offs;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+    b->offs += size;
+    b->size -= size;
 
-                        size_t cur = 0;
+    if (b->size == 0) {
+        memmove(b, b + 1, (alloc->n_free - best - 1)*sizeof(struct ggml_alloc_block));
+        alloc->n_free--;
+    }
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+    return offs;
+}
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+static void ggml_alloc_block_free(struct ggml_alloc * alloc, size_t offs, size_t size) {
+    int j = 0;
+    while (j < alloc->n_free && alloc->free[j].offs < offs) {
+        j++;
+    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        assert(false);
-                    } break;
-            }
-        }
+    // merge with the neighbouring free blocks
+    const bool merge_prev = j > 0              && alloc->free[j - 1].offs + alloc->free[j - 1].size == offs;
+    const bool merge_next = j < alloc->n_free  && offs + size == alloc->free[j].offs;
 
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            assert(false); // TODO: better handling
-        }
+    if (merge_prev && merge_next) {
+        alloc->free[j - 1].size += size + alloc->free[j].size;
+        memmove(&alloc->free[j], &alloc->free[j + 1], (alloc->n_free - j - 1)*sizeof(struct ggml_alloc_block));
+        alloc->n_free--;
+    } else if (merge_prev) {
+        alloc->free[j - 1].size += size;
+    } else if (merge_next) {
+        alloc->free[j].offs  = offs;
+        alloc->free[j].size += size;
+    } else {
+        memmove(&alloc->free[j + 1], &alloc->free[j], (alloc->n_free - j)*sizeof(struct ggml_alloc_block));
+        alloc->free[j] = (struct ggml_alloc_block) { offs, size };
+        alloc->n_free++;
+    }
+}
 
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+static size_t ggml_alloc_size(size_t size) {
+    return ((size + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+}
 
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
-        }
-    }
+static void ggml_alloc_tensor_new(struct ggml_alloc * alloc, struct ggml_alloc_tensor * e) {
+    e->offs  = ggml_alloc_block_new(alloc, ggml_alloc_size(ggml_nbytes(e->t)));
+    e->state = 1;
+}
 
-    const int64_t perf_start_cycles  = ggml_perf_cycles();
-    const int64_t perf_start_time_us = ggml_perf_time_us();
+// the tensors that a node uses - itself and its sources
+static int ggml_alloc_node_refs(struct ggml_tensor * node, struct ggml_tensor ** refs) {
+    int n = 0;
 
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, i, cgraph->n_nodes);
+    refs[n++] = node;
 
-        struct ggml_tensor * node = cgraph->nodes[i];
+    if (node->src0) refs[n++] = node->src0;
+    if (node->src1) refs[n++] = node->src1;
 
-        // TODO: this could be used to avoid unnecessary computations, but it needs to be improved
-        //if (node->grad == NULL && node->perf_runs > 0) {
-        //    continue;
-        //}
+    for (int j = 0; j < GGML_MAX_OPT; j++) {
+        if (node->opt[j]) refs[n++] = node->opt[j];
+    }
 
-        const int64_t perf_node_start_cycles  = ggml_perf_cycles();
-        const int64_t perf_node_start_time_us = ggml_perf_time_us();
+    return n;
+}
 
-        // INIT
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_INIT,
-            /*.ith   =*/ 0,
-            /*.nth   =*/ node->n_tasks,
-            /*.wsize =*/ cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-            /*.wdata =*/ cgraph->work ? cgraph->work->data : NULL,
-        };
+size_t ggml_graph_alloc(struct ggml_context * ctx, struct ggml_cgraph * cgraph, void * buffer) {
+    ggml_assert_aligned(buffer);
 
-        ggml_compute_forward(&params, node);
+    // as many threads as ggml_graph_compute() will use
+    const int n_threads_graph = cgraph->n_threads > 0 ? cgraph->n_threads : 8;
+    const int n_threads       = cgraph->pool ? MIN(n_threads_graph, cgraph->pool->n_threads) : n_threads_graph;
 
-        // COMPUTE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+    size_t work_size = ggml_graph_plan_tasks(cgraph, n_threads);
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    struct ggml_alloc alloc = { 0 };
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
-            }
+    // the graph and the tensors that its views point into
+    alloc.n_hash = 1;
+    while (alloc.n_hash < 4*(cgraph->n_nodes + cgraph->n_leafs) + 16) {
+        alloc.n_hash *= 2;
+    }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    alloc.tensors = calloc(alloc.n_hash, sizeof(struct ggml_alloc_tensor));
+    alloc.free    = malloc(alloc.n_hash*sizeof(struct ggml_alloc_block));
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    GGML_ASSERT(alloc.tensors != NULL && alloc.free != NULL);
 
-            atomic_store(&state_shared.has_work, true);
-        }
+    struct ggml_tensor * refs[3 + GGML_MAX_OPT];
 
-        params.type = GGML_TASK_COMPUTE;
-        ggml_compute_forward(&params, node);
+    // lifetimes
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+        const int n_refs = ggml_alloc_node_refs(node, refs);
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+        for (int j = 0; j < n_refs; j++) {
+            if (j > 0) {
+                ggml_alloc_get(&alloc, refs[j])->consumed = true;
             }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
-
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+            struct ggml_alloc_tensor * e = ggml_alloc_get_src(&alloc, refs[j]);
+            if (e->planned) {
+                e->last = i;
             }
         }
 
-        // FINALIZE
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
-            }
+        if (node->op == GGML_OP_CPY) {
+            ggml_alloc_get_src(&alloc, node)->written = true;
+        }
+    }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    // the outputs of the graph live to the end
+    // a copy into a view of a tensor that later nodes read is not an output, even if no node reads the copy itself
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-            // launch thread pool
-            for (int j = 0; j < n_threads - 1; j++) {
-                workers[j].params = (struct ggml_compute_params) {
-                    .type  = GGML_TASK_FINALIZE,
-                    .ith   = j + 1,
-                    .nth   = node->n_tasks,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                };
-                workers[j].node = node;
+        if (!ggml_alloc_get(&alloc, node)->consumed) {
+            struct ggml_alloc_tensor * e = ggml_alloc_get_src(&alloc, node);
+            if (e->planned && !(node->op == GGML_OP_CPY && e->last > i)) {
+                e->last = cgraph->n_nodes;
             }
+        }
+    }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    // the work buffer is used by all the nodes
+    const size_t work_offs = work_size > 0 ? ggml_alloc_block_new(&alloc, ggml_alloc_size(work_size)) : 0;
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+    // the inputs - the leafs that are not copied into - are set before the graph is computed
+    for (int i = 0; i < cgraph->n_leafs; i++) {
+        struct ggml_alloc_tensor * e = ggml_alloc_get(&alloc, cgraph->leafs[i]);
 
-            atomic_store(&state_shared.has_work, true);
+        if (e->planned && !e->written && e->state == 0) {
+            ggml_alloc_tensor_new(&alloc, e);
         }
+    }
 
-        params.type = GGML_TASK_FINALIZE;
-        ggml_compute_forward(&params, node);
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const int n_refs = ggml_alloc_node_refs(cgraph->nodes[i], refs);
 
-        // wait for thread pool
-        if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+        for (int j = 0; j < n_refs; j++) {
+            struct ggml_alloc_tensor * e = ggml_alloc_get_src(&alloc, refs[j]);
+            if (e->planned && e->state == 0) {
+                ggml_alloc_tensor_new(&alloc, e);
             }
+        }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+        // the memory of the sources that no later node uses
+        for (int j = 0; j < n_refs; j++) {
+            struct ggml_alloc_tensor * e = ggml_alloc_get_src(&alloc, refs[j]);
+            if (e->planned && e->state == 1 && e->last == i) {
+                ggml_alloc_block_free(&alloc, e->offs, ggml_alloc_size(ggml_nbytes(e->t)));
+                e->state = 2;
             }
+        }
+    }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+    if (buffer != NULL) {
+        for (int i = 0; i < alloc.n_hash; i++) {
+            const struct ggml_alloc_tensor * e = &alloc.tensors[i];
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
+            if (e->t != NULL && e->planned) {
+                GGML_ASSERT(e->state != 0);
+                ((struct ggml_tensor *) e->t)->data = (char *) buffer + e->offs;
             }
         }
 
-        // performance stats (node)
-        {
-            int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_node_start_cycles;
-            int64_t perf_time_us_cur = ggml_perf_time_us() - perf_node_start_time_us;
+        for (int k = 0; k < 2; k++) {
+            struct ggml_tensor ** tensors = k == 0 ? cgraph->nodes   : cgraph->leafs;
+            const int             n       = k == 0 ? cgraph->n_nodes : cgraph->n_leafs;
 
-            node->perf_runs++;
-            node->perf_cycles  += perf_cycles_cur;
-            node->perf_time_us += perf_time_us_cur;
+            for (int i = 0; i < n; i++) {
+                struct ggml_tensor * t = tensors[i];
+
+                if (t->view_src && ggml_alloc_get(&alloc, t->view_src)->planned) {
+                    t->data = (char *) t->view_src->data + t->view_offs;
+                }
+            }
         }
-    }
 
-    // join thread pool
-    if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
+        if (work_size > 0) {
+            const int ne = (int) work_size;
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = ggml_thread_join(workers[j].thrd, NULL);
-            assert(rc == 0);
-            UNUSED(rc);
+            cgraph->work      = ggml_new_tensor_impl(ctx, GGML_TYPE_I8, 1, &ne, (char *) buffer + work_offs);
+            cgraph->work_size = work_size;
         }
 
-        ggml_lock_destroy(&state_shared.spin);
+        cgraph->n_threads_plan = n_threads;
     }
 
-    // performance stats (graph)
-    {
-        int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
-        int64_t perf_time_us_cur = ggml_perf_time_us() - perf_start_time_us;
-
-        cgraph->perf_runs++;
-        cgraph->perf_cycles  += perf_cycles_cur;
-        cgraph->perf_time_us += perf_time_us_cur;
+    free(alloc.tensors);
+    free(alloc.free);
 
-        GGML_PRINT_DEBUG("%s: perf (%d) - cpu = %.3f / %.3f ms, wall = %.3f / %.3f ms\n",
-                __func__, cgraph->perf_runs,
-                (double) perf_cycles_cur      / (double) ggml_cycles_per_ms(),
-                (double) cgraph->perf_cycles  / (double) ggml_cycles_per_ms() / (double) cgraph->perf_runs,
-                (double) perf_time_us_cur     / 1000.0,
-                (double) cgraph->perf_time_us / 1000.0 / cgraph->perf_runs);
-    }
+    return alloc.top;
 }
 
 void ggml_graph_reset(struct ggml_cgraph * cgraph) {
@@ -7663,6 +10639,8 @@ void ggml_graph_reset(struct ggml_cgraph * cgraph) {
 
 void ggml_graph_print(const struct ggml_cgraph * cgraph) {
     int64_t perf_total_per_op_us[GGML_OP_COUNT] = {0};
+    int64_t perf_total_us        = 0;
+    int64_t perf_total_serial_us = 0; // time spent in nodes computed by a single thread
 
     GGML_PRINT("=== GRAPH ===\n");
 
@@ -7674,11 +10652,15 @@ void ggml_graph_print(const struct ggml_cgraph * cgraph) {
         struct ggml_tensor * node = cgraph->nodes[i];
 
         perf_total_per_op_us[node->op] += node->perf_time_us;
+        perf_total_us                  += node->perf_time_us;
+        if (node->n_tasks == 1) {
+            perf_total_serial_us += node->perf_time_us;
+        }
 
-        GGML_PRINT(" - %3d: [ %6d, %6d, %6d] %16s %s (%3d) cpu = %7.3f / %7.3f ms, wall = %7.3f / %7.3f ms\n",
+        GGML_PRINT(" - %3d: [ %6d, %6d, %6d] %16s %s (%3d) tasks = %2d, cpu = %7.3f / %7.3f ms, wall = %7.3f / %7.3f ms\n",
                 i,
                 node->ne[0], node->ne[1], node->ne[2],
-                GGML_OP_LABEL[node->op], node->is_param ? "x" : node->grad ? "g" : " ", node->perf_runs,
+                GGML_OP_LABEL[node->op], node->is_param ? "x" : node->grad ? "g" : " ", node->perf_runs, node->n_tasks,
                 (double) node->perf_cycles  / (double) ggml_cycles_per_ms(),
                 (double) node->perf_cycles  / (double) ggml_cycles_per_ms() / (double) node->perf_runs,
                 (double) node->perf_time_us / 1000.0,
@@ -7699,6 +10681,10 @@ void ggml_graph_print(const struct ggml_cgraph * cgraph) {
         GGML_PRINT("perf_total_per_op_us[%16s] = %7.3f ms\n", GGML_OP_LABEL[i], (double) perf_total_per_op_us[i] / 1000.0);
     }
 
+    GGML_PRINT("perf_total_serial_us = %7.3f / %7.3f ms (%.1f%%)\n",
+            (double) perf_total_serial_us / 1000.0, (double) perf_total_us / 1000.0,
+            perf_total_us > 0 ? 100.0*(double) perf_total_serial_us/(double) perf_total_us : 0.0);
+
     GGML_PRINT("========================================\n");
 }
 
@@ -8471,6 +11457,7 @@ enum ggml_opt_result ggml_opt(
         struct ggml_init_params params_ctx = {
             .mem_size   = 16*1024*1024,
             .mem_buffer = NULL,
+            .no_alloc   = false,
         };
 
         ctx = ggml_init(params_ctx);
@@ -180,9 +180,13 @@ extern "C" {
 #define GGML_MAX_DIMS     4
 #define GGML_MAX_NODES    4096
 #define GGML_MAX_PARAMS   16
-#define GGML_MAX_CONTEXTS 64
+#define GGML_MAX_CONTEXTS 512
 #define GGML_MAX_OPT      4
 
+// version of the quantized block formats - bump when the layout of any of the Q types changes
+#define GGML_QNT_VERSION        2
+#define GGML_QNT_VERSION_FACTOR 1000 // model ftype = qntvr*factor + ftype
+
 #ifdef __ARM_NEON
 // we use the built-in 16-bit float type
 typedef __fp16 ggml_fp16_t;
@@ -203,6 +207,14 @@ enum ggml_type {
     GGML_TYPE_I32,
     GGML_TYPE_F16,
     GGML_TYPE_F32,
+    // block-quantized types, 32 elements per block
+    // only supported as src0 of ggml_mul_mat and ggml_get_rows
+    GGML_TYPE_Q4_0, // 4-bit, per-block scale
+    GGML_TYPE_Q4_1, // 4-bit, per-block scale and min
+    GGML_TYPE_Q5_0, // 5-bit, per-block scale
+    GGML_TYPE_Q5_1, // 5-bit, per-block scale and min
+    GGML_TYPE_Q8_0, // 8-bit, per-block scale
+    GGML_TYPE_Q8_1, // 8-bit, per-block scale and sum - only used for the activations in the Q4_1/Q5_1 dot products
     GGML_TYPE_COUNT,
 };
 
@@ -249,6 +261,14 @@ enum ggml_op {
     GGML_OP_COUNT,
 };
 
+// layout of the data of a tensor
+// the weights of a model can be packed once, at load time, into the layout that the operation reading them works on
+enum ggml_layout {
+    GGML_LAYOUT_ROWS = 0,    // rows of ne[0] elements, with the strides nb[]
+    GGML_LAYOUT_MUL_MAT,     // F16 src0 of ggml_mul_mat, in panels of interleaved rows (see ggml_mul_mat_pack())
+    GGML_LAYOUT_CONV_1D,     // F16 src0 of ggml_conv_1d_1s/2s, [ne[2]][ne[0]][ne[1]] (see ggml_conv_1d_pack())
+};
+
 // n-dimensional tensor
 struct ggml_tensor {
     enum ggml_type type;
@@ -279,9 +299,19 @@ struct ggml_tensor {
     int64_t perf_time_us;
 
     void * data;
-    char padding[8];
+
+    // the tensor whose memory this one is a view of (never a view itself), and the offset in it
+    // set by the views, the reshapes and the in-place operations, for ggml_graph_alloc()
+    struct ggml_tensor * view_src;
+    size_t               view_offs;
+
+    enum ggml_layout layout;
+
+    char padding[4];
 };
 
+struct ggml_threadpool;
+
 // computation graph
 struct ggml_cgraph {
     int n_nodes;
@@ -291,6 +321,14 @@ struct ggml_cgraph {
     size_t work_size;
     struct ggml_tensor * work;
 
+    // optional persistent worker threads (see ggml_threadpool_new())
+    // if NULL, ggml_graph_compute() creates n_threads - 1 threads for the duration of the call
+    struct ggml_threadpool * pool;
+
+    // the number of threads that the tasks of the nodes and the work buffer are planned for
+    // a graph that is computed again with as many threads is not planned again, 0 - not planned yet
+    int n_threads_plan;
+
     struct ggml_tensor * nodes[GGML_MAX_NODES];
     struct ggml_tensor * grads[GGML_MAX_NODES];
     struct ggml_tensor * leafs[GGML_MAX_NODES];
@@ -312,6 +350,7 @@ struct ggml_init_params {
     // memory pool
     size_t mem_size;   // bytes
     void * mem_buffer; // if NULL, memory will be allocated internally
+    bool   no_alloc;   // don't allocate memory for the tensor data - the caller sets tensor->data, e.g. to memory mapped weights
 };
 
 void    ggml_time_init(void); // call this once at the beginning of the program
@@ -326,9 +365,28 @@ void ggml_print_objects(const struct ggml_context * ctx);
 int    ggml_nelements(const struct ggml_tensor * tensor);
 size_t ggml_nbytes   (const struct ggml_tensor * tensor);
 
-size_t ggml_type_size   (enum ggml_type type);
+int    ggml_blck_size   (enum ggml_type type);
+size_t ggml_type_size   (enum ggml_type type); // size in bytes of one block (one element for non-quantized types)
+float  ggml_type_sizef  (enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
 size_t ggml_element_size(const struct ggml_tensor * tensor);
 
+// memory that a context uses for each tensor, in addition to its data
+size_t ggml_tensor_overhead(void);
+
+// log-softmax of the n values of x, for sampling outside of a graph - values of -INFINITY get probability 0
+// logprobs[i] = x[i] - log(sum_j exp(x[j])) and probs[i] = exp(logprobs[i]), either can be NULL
+// returns log(sum_j exp(x[j]))
+float ggml_log_soft_max_f32(int n, float * logprobs, float * probs, const float * x);
+
+const char * ggml_type_name(enum ggml_type type);
+bool         ggml_is_quantized(enum ggml_type type);
+
+// quantize n floats from src into dst, which must have room for ggml_type_size(type)*n/ggml_blck_size(type) bytes
+// n must be a multiple of ggml_blck_size(type)
+// returns the number of bytes written
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n);
+void   ggml_dequantize(enum ggml_type type, const void * src, float * dst, int n);
+
 struct ggml_context * ggml_init(struct ggml_init_params params);
 void ggml_free(struct ggml_context * ctx);
 
@@ -336,6 +394,10 @@ size_t ggml_used_mem(const struct ggml_context * ctx);
 
 size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
 
+// with no_alloc, the tensors created in ctx get no memory (data == NULL) - see ggml_graph_alloc()
+// the tensors of ggml_new_i32() and ggml_new_f32() always get memory, as they are set right away
+void ggml_set_no_alloc(struct ggml_context * ctx, bool no_alloc);
+
 struct ggml_tensor * ggml_new_tensor(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -395,6 +457,8 @@ struct ggml_tensor * ggml_dup(
         struct ggml_context * ctx,
         struct ggml_tensor  * a);
 
+// b is broadcast to the shape of a: each dimension of b must be 1 or divide the corresponding dimension of a
+// e.g. a bias row [n, 1] can be added to [n, m] directly, without ggml_repeat()
 struct ggml_tensor * ggml_add(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -405,6 +469,7 @@ struct ggml_tensor * ggml_sub(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// b is broadcast to the shape of a, as in ggml_add()
 struct ggml_tensor * ggml_mul(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -480,6 +545,12 @@ struct ggml_tensor * ggml_mul_mat(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// packs the F16 matrix a in place into the panels that the blocked matrix multiplication reads, so that it is not
+// packed again by every ggml_mul_mat(ctx, a, b) - a can only be used as src0 of ggml_mul_mat afterwards
+// returns false, leaving a as it is, if a is not a contiguous F16 matrix or the blocked matrix multiplication is not
+// available
+bool ggml_mul_mat_pack(struct ggml_tensor * a);
+
 //
 // operations on tensors without backpropagation
 //
@@ -520,6 +591,14 @@ struct ggml_tensor * ggml_reshape_3d(
         int                   ne1,
         int                   ne2);
 
+struct ggml_tensor * ggml_reshape_4d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        int                   ne3);
+
 // offset in bytes
 struct ggml_tensor * ggml_view_1d(
         struct ggml_context * ctx,
@@ -590,6 +669,15 @@ struct ggml_tensor * ggml_conv_1d_2s(
         struct ggml_tensor  * a,
         struct ggml_tensor  * b);
 
+// packs the F16 kernel a of ggml_conv_1d_1s/2s in place with the taps outermost, the layout the convolution reads
+// a can only be used as the kernel of a convolution afterwards
+// returns false, leaving a as it is, if a is not a contiguous F16 kernel
+bool ggml_conv_1d_pack(struct ggml_tensor * a);
+
+// softmax(q*k^T/sqrt(D))*v without storing the scores, q: [D, N, H], k: [D, M, H], v: [M, D, H] -> [D, N, H] F32
+// q, k and v can be F16 or F32 and strided. k with the keys contiguous (k->nb[1] == element size) and v with the
+// values of each key contiguous (v->nb[1] == element size) are read fastest
+// masked: query i sees the keys up to M - N + i
 struct ggml_tensor * ggml_flash_attn(
         struct ggml_context * ctx,
         struct ggml_tensor  * q,
@@ -597,6 +685,9 @@ struct ggml_tensor * ggml_flash_attn(
         struct ggml_tensor  * v,
         bool                  masked);
 
+// the work buffer that ggml_flash_attn needs for each thread, with heads of size D
+size_t ggml_flash_attn_thread_wsize(int D);
+
 struct ggml_tensor * ggml_flash_ff(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -619,6 +710,32 @@ struct ggml_cgraph ggml_build_forward (struct ggml_tensor * tensor);
 struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cgraph * gf, bool keep);
 
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
+
+// static memory planning
+//
+// assigns the tensors of the graph that have no memory - built in a context with no_alloc - to offsets in one buffer,
+// from their lifetimes in the order of the nodes: a tensor is live from the node that computes it (or the first one
+// that writes into it through a view) to the last node that reads it, directly or through views, and its memory is
+// reused by the tensors computed after that. the tensors that no node writes are inputs and live from the start, the
+// nodes that no node reads are outputs and live to the end. the work buffer of the graph for cgraph->n_threads threads
+// is in the buffer too, so that it can be computed with a context that only holds the tensor objects
+//
+// returns the size that the buffer needs - the peak of the memory in use by the graph
+// with buffer == NULL only measures, otherwise points the tensors and their views into buffer, which must be at least
+// that large and aligned like malloc(). a graph is planned once, after it has been built completely
+size_t ggml_graph_alloc(struct ggml_context * ctx, struct ggml_cgraph * cgraph, void * buffer);
+
+// the work buffer of a graph is allocated in ctx by ggml_graph_compute()
+// the F16 matrix multiplications with many src1 columns need this much more of it for each thread
+size_t ggml_mul_mat_thread_wsize(void);
+
+// a set of n_threads - 1 worker threads that can be reused by many ggml_graph_compute() calls
+// the thread calling ggml_graph_compute() is the n_threads-th thread
+// idle workers sleep until the next graph, instead of spinning
+// a pool must not be used by more than one ggml_graph_compute() call at a time
+struct ggml_threadpool * ggml_threadpool_new(int n_threads);
+void ggml_threadpool_free     (struct ggml_threadpool * pool);
+int  ggml_threadpool_n_threads(const struct ggml_threadpool * pool);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
 // print info and performance information for the graph
@@ -4,19 +4,28 @@
 #include "ggml.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <map>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 #include <regex>
 #include <random>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #if defined(GGML_BIG_ENDIAN)
 #include <bit>
 
@@ -103,8 +112,22 @@ static void byteswap_tensor(ggml_tensor * tensor) {
 //#define WHISPER_USE_FLASH_FF
 #define WHISPER_MAX_DECODERS 16
 
-#define WHISPER_USE_SCRATCH
-#define WHISPER_MAX_SCRATCH_BUFFERS 16
+// number of tokens in a page of the self-attention KV cache (see whisper_kv_pages)
+#define WHISPER_KV_PAGE_SIZE 16
+
+// number of decoder graphs that a state keeps, and the multiple of tokens that their self-attention is padded to
+// (see whisper_decode_graph)
+#define WHISPER_MAX_DECODE_GRAPHS    4
+#define WHISPER_DECODE_GRAPH_KV_STEP 32
+
+// granularity of the automatically sized audio context (see whisper_full_params.audio_ctx_auto)
+#define WHISPER_AUDIO_CTX_ALIGN 64
+
+// model file magic, and the magic of model files where the data of each tensor starts at a multiple of
+// WHISPER_FILE_ALIGNMENT bytes, so that it can be used in place when the file is memory mapped
+#define WHISPER_FILE_MAGIC         0x67676d6c // "ggml"
+#define WHISPER_FILE_MAGIC_ALIGNED 0x67676d61 // "ggma"
+#define WHISPER_FILE_ALIGNMENT     32
 
 // available whisper models
 enum e_model {
@@ -220,38 +243,6 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
 
 static const size_t MB = 1024*1024;
 
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH0 = {
-    { MODEL_TINY,     12ull*MB },
-    { MODEL_BASE,     15ull*MB },
-    { MODEL_SMALL,    23ull*MB },
-    { MODEL_MEDIUM,   31ull*MB },
-    { MODEL_LARGE,    38ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH1 = {
-    { MODEL_TINY,     18ull*MB },
-    { MODEL_BASE,     24ull*MB },
-    { MODEL_SMALL,    36ull*MB },
-    { MODEL_MEDIUM,   48ull*MB },
-    { MODEL_LARGE,    60ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH2 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_SCRATCH3 = {
-    { MODEL_TINY,      4ull*MB },
-    { MODEL_BASE,      4ull*MB },
-    { MODEL_SMALL,     6ull*MB },
-    { MODEL_MEDIUM,    7ull*MB },
-    { MODEL_LARGE,     9ull*MB },
-};
-
 static const std::map<e_model, size_t> MEM_REQ_MODEL = {
     { MODEL_TINY,     74ull*MB },
     { MODEL_BASE,    142ull*MB },
@@ -276,22 +267,6 @@ static const std::map<e_model, size_t> MEM_REQ_KV_CROSS = {
     { MODEL_LARGE,   235ull*MB },
 };
 
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,      6ull*MB },
-    { MODEL_BASE,      8ull*MB },
-    { MODEL_SMALL,    13ull*MB },
-    { MODEL_MEDIUM,   22ull*MB },
-    { MODEL_LARGE,    33ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,      3ull*MB },
-    { MODEL_BASE,      5ull*MB },
-    { MODEL_SMALL,    10ull*MB },
-    { MODEL_MEDIUM,   18ull*MB },
-    { MODEL_LARGE,    27ull*MB },
-};
-
 struct whisper_mel {
     int n_len;
     int n_mel;
@@ -304,6 +279,44 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // range [beg, end) of the non-zero weights of each filter, so that the filterbank can skip the zeros
+    std::vector<int> beg;
+    std::vector<int> end;
+};
+
+// mixed-radix factorization and twiddle factors for whisper_fft() of a given real input size
+struct whisper_fft_plan {
+    int n = 0; // number of real input values
+    int m = 0; // size of the complex transform: n/2 if n is even (two real values are packed per complex value), otherwise n
+
+    std::vector<int>   factors;    // radix of each stage of the complex transform
+    std::vector<float> twiddles;   // complex, per stage of radix p: w_(L*p)^(s*j) for s = 1..p-1, j = 0..L-1
+    std::vector<float> twiddles_r; // complex, w_n^k for k = 0..n/2, used to unpack the real transform
+};
+
+// window and FFT plan used by log_mel_spectrogram(), built on first use and rebuilt if the FFT size changes
+struct whisper_mel_cache {
+    int fft_size = 0;
+
+    whisper_fft_plan   fft;
+    std::vector<float> hann;
+};
+
+// double-array trie over the token strings of the vocab, for the longest-match lookups of tokenize()
+// the transition from node s by byte c is to node t = base[s] + c if check[t] == s
+struct whisper_trie {
+    std::vector<int32_t> base;
+    std::vector<int32_t> check; // parent of the node, -1 - free slot
+    std::vector<int32_t> value; // token that ends at the node, -1 - none
+};
+
+// ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
 struct whisper_vocab {
@@ -315,6 +328,8 @@ struct whisper_vocab {
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
+    whisper_trie trie; // token_to_id, for tokenize()
+
     id token_eot  = 50256;
     id token_sot  = 50257;
     id token_prev = 50360;
@@ -326,6 +341,10 @@ struct whisper_vocab {
     static const id token_translate  = 50358;
     static const id token_transcribe = 50359;
 
+    // tokens suppressed by the logit filters, looked up once when the vocab is loaded
+    id token_space = -1; // " " - suppress_blank
+    std::vector<id> tokens_non_speech; // suppress_non_speech_tokens
+
     bool is_multilingual() const {
         return n_vocab == 51865;
     }
@@ -366,7 +385,7 @@ struct whisper_hparams {
     int32_t n_text_head   = 6;
     int32_t n_text_layer  = 4;
     int32_t n_mels        = 80;
-    int32_t f16           = 1;
+    int32_t ftype         = 1; // enum whisper_ftype
 };
 
 // audio encoding layer
@@ -467,6 +486,42 @@ struct whisper_kv_cache {
     int n; // number of tokens currently in the cache
 };
 
+// self-attention KV cache shared by all decoders of a state
+// the memory is split in pages of WHISPER_KV_PAGE_SIZE tokens and each decoder maps its tokens to pages with a
+// whisper_kv_seq. beams that fork from the same decoder share the pages of their common prefix - a shared page is
+// copied only when one of them writes to it
+struct whisper_kv_pages {
+    // [n_text_state, n_text_layer*n_pages*WHISPER_KV_PAGE_SIZE]
+    // the rows of layer il start at il*n_pages*WHISPER_KV_PAGE_SIZE, so consecutive pages are contiguous in memory
+    struct ggml_tensor * k = nullptr;
+    struct ggml_tensor * v = nullptr;
+
+    struct ggml_context * ctx = nullptr;
+
+    std::vector<uint8_t> buf;
+
+    int n_pages = 0;
+
+    std::vector<int> refs; // number of sequences using each page
+    std::vector<int> free; // stack of unused pages, the lowest page on top
+
+    int64_t n_cow = 0; // number of tokens copied by copy-on-write so far
+};
+
+// the tokens of one decoder in the paged KV cache
+struct whisper_kv_seq {
+    std::vector<int> pages; // token i is in slot i % WHISPER_KV_PAGE_SIZE of page pages[i / WHISPER_KV_PAGE_SIZE]
+
+    int n = 0; // number of tokens currently in the cache
+};
+
+// new tokens of the decoders that are stored in consecutive rows of the self-attention KV cache
+struct whisper_kv_run {
+    int i0;  // first token, in the tokens of all decoders
+    int row; // row of the first token, relative to the first row of the layer
+    int n;   // number of tokens
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -527,8 +582,8 @@ struct whisper_sequence {
 
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
-    // each decoders keeps its own KV-cache
-    whisper_kv_cache kv_self;
+    // the pages of the shared self-attention KV cache used by this decoder
+    whisper_kv_seq kv_self;
 
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -543,8 +598,86 @@ struct whisper_decoder {
     std::vector<float> probs;
     std::vector<float> logits;
     std::vector<float> logprobs;
+};
+
+// thread pools shared by all sessions of a whisper_session_manager
+// a graph leases one of them for the duration of its computation, so the number of busy compute threads stays fixed
+// however many sessions are running
+struct whisper_pool_set {
+    std::mutex              mutex;
+    std::condition_variable cond;
+
+    std::vector<ggml_threadpool *> pools;
+    std::vector<ggml_threadpool *> free; // pools that are not leased at the moment
+
+    ggml_threadpool * acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !free.empty(); });
+
+        ggml_threadpool * pool = free.back();
+        free.pop_back();
+
+        return pool;
+    }
+
+    void release(ggml_threadpool * pool) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free.push_back(pool);
+        }
+        cond.notify_one();
+    }
+};
+
+// a decoder graph of whisper_decode_batch_internal() with its own context
+// the graphs of single-token steps are kept by the state: the next steps of as many decoders compute the same graph
+// again with new inputs, until the self-attention has more tokens than the graph was built for
+struct whisper_decode_graph {
+    int n_tokens    = 0; // new tokens of each decoder
+    int n_batch     = 0; // decoders, 0 - no graph
+    int n_kv        = 0; // tokens in the self-attention of each decoder, the tokens after n_past + n_tokens are masked
+    int n_audio_ctx = 0;
+    int n_threads   = 0;
+
+    bool logits_all = false; // logits of all new tokens, not only of the last token of each decoder
 
-    std::vector<whisper_token> tokens_tmp; // used for whisper_decode calls
+    // the memory of the state that the graph refers to
+    const void * kv_self  = nullptr;
+    const void * kv_cross = nullptr;
+    int          n_pages  = 0;
+
+    const void * buf_alloc = nullptr; // the tensors of the graph, planned by ggml_graph_alloc()
+
+    int64_t t_used = 0; // time of the last use, the least recently used graph is replaced by a new one
+
+    std::vector<uint8_t> buf;
+
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    // inputs
+    struct ggml_tensor * embd     = nullptr; // [n_batch*n_tokens]
+    struct ggml_tensor * position = nullptr; // [n_batch*n_tokens]
+    struct ggml_tensor * kv_rows  = nullptr; // [n_batch*n_kv], rows of the K and V of all tokens in the cache, or null
+
+    std::vector<struct ggml_tensor *> kq_n_past; // n_past of the mask of each layer
+    std::vector<struct ggml_tensor *> kv_store;  // stores of the new K and V rows, [n_layer][n_runs][2]
+
+    // output
+    struct ggml_tensor * logits = nullptr; // [n_vocab, n_batch], or [n_vocab, n_batch*n_tokens] with logits_all
+};
+
+// the self-attention KV rows and the logits of the last prompt that whisper_full_with_state() decoded, for the next
+// pass over the same audio window (temperature fallback)
+// the K and V of the prompt tokens depend on the audio through the cross-attention of the previous layers, so they can
+// only be reused while kv_cross is the same
+struct whisper_prompt_cache {
+    std::vector<whisper_token> tokens;
+    std::vector<float>         logits; // [n_vocab], after the last token
+
+    whisper_kv_seq kv; // shares the pages with the decoders
+
+    int64_t kv_cross_id = -1; // whisper_state.kv_cross_id of the audio that the prompt was decoded with
 };
 
 struct whisper_state {
@@ -553,25 +686,61 @@ struct whisper_state {
     int64_t t_decode_us = 0;
     int64_t t_mel_us = 0;
 
+    int64_t t_decode_build_us   = 0; // part of t_decode_us spent building graphs
+    int64_t t_decode_compute_us = 0; // part of t_decode_us spent computing graphs
+    int64_t t_draft_us = 0; // time spent in the draft model, for speculative decoding
+    int64_t t_prompt_us = 0; // part of t_decode_us spent decoding the prompts of whisper_full
+
     int32_t n_sample = 0; // number of tokens sampled
     int32_t n_encode = 0; // number of encoder calls
     int32_t n_decode = 0; // number of decoder calls
+    int32_t n_decode_build = 0; // number of decoder graphs built
+    int32_t n_draft = 0;          // number of tokens proposed by the draft model (see whisper_full_params.draft)
+    int32_t n_draft_accepted = 0; // number of proposed tokens that were accepted
+    int32_t n_prompt_decoded = 0; // number of prompt tokens decoded
+    int32_t n_prompt_reused  = 0; // number of prompt tokens taken from the prompt cache
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
     // cross-attention KV cache for the decoders
     // shared between all decoders
     whisper_kv_cache kv_cross;
+
+    int64_t kv_cross_id = 0; // incremented every time kv_cross is computed
+
+    // self-attention KV cache, the pages are shared between the decoders
+    whisper_kv_pages kv_pages;
+
+    whisper_prompt_cache prompt_cache;
+
+    bool keep_prompt = true; // false - decode the whole prompt in every pass
+
     whisper_mel mel;
+    whisper_mel_cache mel_cache;
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS] = {};
 
+    // decoder graphs kept for the next steps, and the graph of a step that is not kept (its context is in buf_compute)
+    whisper_decode_graph decode_graphs[WHISPER_MAX_DECODE_GRAPHS];
+    whisper_decode_graph decode_graph;
+
+    bool keep_decode_graphs = true; // false - build a new graph for each step
+
     // memory buffers used by encode / decode contexts
+    // the graphs are built with no_alloc: the contexts in buf_compute only hold the tensors, their data is in buf_alloc
+    // at the offsets planned by ggml_graph_alloc() (see whisper_graph_alloc)
     std::vector<uint8_t> buf_compute;
-    std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
+    std::vector<uint8_t> buf_alloc;
 
-    int    buf_last = 0;
-    size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
+    // worker threads used by all encode / decode graphs of this state
+    // kept alive between calls, so that we don't create and join threads for every decoded token
+    struct ggml_threadpool * threadpool = nullptr;
+
+    // if not null, the graphs use the thread pools of the session manager instead (see whisper_pool_lease)
+    whisper_pool_set * pools = nullptr;
+
+    // if not null, the audio is encoded together with that of other states (see whisper_encoder_batcher_encode)
+    whisper_encoder_batcher * batcher = nullptr;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -581,6 +750,7 @@ struct whisper_state {
 
     // work container used to avoid memory allocations
     std::vector<std::pair<double, whisper_vocab::id>> logits_id;
+    std::vector<whisper_token_data> tokens_topk;
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 
@@ -595,52 +765,89 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
-    void use_buf(struct ggml_context * ctx, int i) {
-#if defined(WHISPER_USE_SCRATCH)
-        size_t last_size = 0;
-
-        if (i == -1) {
-            last_size = ggml_set_scratch(ctx, { 0, 0, nullptr, });
-        } else {
-            auto & buf = buf_scratch[i];
-            last_size = ggml_set_scratch(ctx, { 0, buf.size(), buf.data(), });
+    struct ggml_threadpool * get_threadpool(int n_threads) {
+        if (threadpool && ggml_threadpool_n_threads(threadpool) != n_threads) {
+            ggml_threadpool_free(threadpool);
+            threadpool = nullptr;
         }
 
-        if (buf_last >= 0) {
-            buf_max_size[buf_last] = std::max(buf_max_size[buf_last], last_size);
+        if (threadpool == nullptr && n_threads > 1) {
+            threadpool = ggml_threadpool_new(n_threads);
         }
 
-        buf_last = i;
-#else
-        (void) i;
-        (void) ctx;
-#endif
+        return threadpool;
     }
+};
 
-    size_t get_buf_max_mem(int i) const {
-#if defined(WHISPER_USE_SCRATCH)
-        return buf_max_size[i];
-#else
-        (void) i;
-        return 0;
-#endif
+// the thread pool used by one encoder / decoder graph of a state
+// leased from the session manager for as long as the lease lives, or the state's own pool
+struct whisper_pool_lease {
+    whisper_pool_set * set  = nullptr;
+    ggml_threadpool  * pool = nullptr;
+
+    whisper_pool_lease(whisper_state & wstate, int n_threads) : set(wstate.pools) {
+        pool = set ? set->acquire() : wstate.get_threadpool(n_threads);
+    }
+
+    ~whisper_pool_lease() {
+        if (set) {
+            set->release(pool);
+        }
     }
+
+    whisper_pool_lease(const whisper_pool_lease &) = delete;
+    whisper_pool_lease & operator=(const whisper_pool_lease &) = delete;
 };
 
 struct whisper_context {
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
-    ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 or FP16)
+    ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type of the 2D weight matrices (FP32, FP16 or quantized)
+    ggml_type itype = ggml_type::GGML_TYPE_F16; // type of the conv weights, the KV caches and the K/V copies in the graphs (FP32 or FP16)
 
     whisper_model model;
     whisper_vocab vocab;
     whisper_state * state = nullptr;
 };
 
+// reads a model, either through a whisper_model_loader or directly from a file in memory (e.g. memory mapped)
+// keeps track of the offset in the file, to find the alignment padding of the tensor data
+struct whisper_model_reader {
+    whisper_model_loader * loader = nullptr;
+
+    const uint8_t * mapped      = nullptr;
+    size_t          mapped_size = 0;
+
+    size_t offset = 0;
+
+    void read(void * dst, size_t size) {
+        if (mapped) {
+            size = std::min(size, mapped_size - offset);
+            memcpy(dst, mapped + offset, size);
+        } else {
+            size = loader->read(loader->context, dst, size);
+        }
+        offset += size;
+    }
+
+    // skip the given number of bytes and return a pointer to them, only when reading from memory
+    const uint8_t * skip(size_t size) {
+        if (!mapped || size > mapped_size - offset) {
+            return nullptr;
+        }
+        offset += size;
+        return mapped + offset - size;
+    }
+
+    bool eof() const {
+        return mapped ? offset >= mapped_size : loader->eof(loader->context);
+    }
+};
+
 template<typename T>
-static void read_safe(whisper_model_loader * loader, T & dest) {
-    loader->read(loader->context, &dest, sizeof(T));
+static void read_safe(whisper_model_reader & reader, T & dest) {
+    reader.read(&dest, sizeof(T));
     BYTESWAP_VALUE(dest);
 }
 
@@ -655,6 +862,7 @@ static bool kv_cache_init(
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size();
     params.mem_buffer = cache.buf.data();
+    params.no_alloc   = false;
 
     cache.ctx = ggml_init(params);
 
@@ -675,20 +883,47 @@ static bool kv_cache_init(
     return true;
 }
 
-static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
-    WHISPER_ASSERT(cache.ctx);
+static void kv_cache_free(struct whisper_kv_cache & cache) {
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
+        cache.ctx = nullptr;
+    }
+}
+
+static void kv_pages_free(struct whisper_kv_pages & cache) {
+    if (cache.ctx) {
+        ggml_free(cache.ctx);
+        cache.ctx = nullptr;
+    }
+
+    cache.n_pages = 0;
+    cache.refs.clear();
+    cache.free.clear();
+}
+
+// (re)allocates the paged self-attention KV cache with room for n_seq sequences of n_ctx tokens, and one more page
+// for the copy of the last page of a prompt that is shared with the prompt cache (see whisper_prompt_cache)
+// the pages of a previous allocation must have been released
+static bool kv_pages_init(
+        const struct whisper_hparams & hparams,
+             struct whisper_kv_pages & cache,
+                           ggml_type   wtype,
+                                 int   n_ctx,
+                                 int   n_seq) {
+    kv_pages_free(cache);
 
-    const int n_elements = ggml_nelements(cache.k);
-    WHISPER_ASSERT(n_elements == ggml_nelements(cache.v));
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
 
-    const ggml_type wtype = cache.k->type;
-    WHISPER_ASSERT(wtype == cache.v->type);
+    const int n_pages = n_seq*((n_ctx + WHISPER_KV_PAGE_SIZE - 1)/WHISPER_KV_PAGE_SIZE) + 1;
+    const int n_rows  = n_text_layer*n_pages*WHISPER_KV_PAGE_SIZE;
 
-    WHISPER_ASSERT(cache.buf.size() >= 2*n_elements*ggml_type_size(wtype));
+    cache.buf.resize(2*size_t(n_text_state)*n_rows*ggml_type_size(wtype) + 2*256);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size();
     params.mem_buffer = cache.buf.data();
+    params.no_alloc   = false;
 
     cache.ctx = ggml_init(params);
 
@@ -697,572 +932,961 @@ static bool kv_cache_reinit(struct whisper_kv_cache & cache) {
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_2d(cache.ctx, wtype, n_text_state, n_rows);
+    cache.v = ggml_new_tensor_2d(cache.ctx, wtype, n_text_state, n_rows);
+
+    cache.n_pages = n_pages;
+    cache.refs.assign(n_pages, 0);
+
+    cache.free.resize(n_pages);
+    for (int i = 0; i < n_pages; ++i) {
+        cache.free[i] = n_pages - 1 - i;
+    }
 
     return true;
 }
 
-static void kv_cache_free(struct whisper_kv_cache & cache) {
-    if (cache.ctx) {
-        ggml_free(cache.ctx);
-        cache.ctx = nullptr;
+// returns the pages of a sequence to the cache
+static void kv_seq_release(struct whisper_kv_pages & cache, struct whisper_kv_seq & seq) {
+    // last page first, so that the first page is on top of the free stack again and the next sequence gets the
+    // same consecutive pages
+    for (int i = (int) seq.pages.size() - 1; i >= 0; --i) {
+        const int page = seq.pages[i];
+
+        if (--cache.refs[page] == 0) {
+            cache.free.push_back(page);
+        }
     }
+
+    seq.pages.clear();
+    seq.n = 0;
 }
 
-// load the model from a ggml file
-//
-// file format:
-//
-//   - hparams
-//   - pre-computed mel filters
-//   - vocab
-//   - weights
-//
-// see the convert-pt-to-ggml.py script for details
-//
-static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
-    fprintf(stderr, "%s: loading model\n", __func__);
+// makes dst a fork of src - the two share all pages until one of them writes to a page
+static void kv_seq_share(struct whisper_kv_pages & cache, struct whisper_kv_seq & dst, const struct whisper_kv_seq & src) {
+    if (&dst == &src) {
+        return;
+    }
 
-    const int64_t t_start_us = ggml_time_us();
+    for (const int page : src.pages) {
+        ++cache.refs[page];
+    }
 
-    wctx.t_start_us = t_start_us;
+    kv_seq_release(cache, dst);
 
-    auto & model = wctx.model;
-    auto & vocab = wctx.vocab;
+    dst.pages = src.pages;
+    dst.n     = src.n;
+}
 
-    // verify magic
-    {
-        uint32_t magic;
-        read_safe(loader, magic);
-        if (magic != 0x67676d6c) {
-            fprintf(stderr, "%s: invalid model data (bad magic)\n", __func__);
-            return false;
+// keeps the first n tokens of a sequence and returns the pages that are past them to the cache
+static void kv_seq_truncate(struct whisper_kv_pages & cache, struct whisper_kv_seq & seq, int n) {
+    const int n_pages = (n + WHISPER_KV_PAGE_SIZE - 1)/WHISPER_KV_PAGE_SIZE;
+
+    while ((int) seq.pages.size() > n_pages) {
+        const int page = seq.pages.back();
+        seq.pages.pop_back();
+
+        if (--cache.refs[page] == 0) {
+            cache.free.push_back(page);
         }
     }
 
-    //load hparams
-    {
-        auto & hparams = model.hparams;
+    seq.n = std::min(seq.n, n);
+}
 
-        read_safe(loader, hparams.n_vocab);
-        read_safe(loader, hparams.n_audio_ctx);
-        read_safe(loader, hparams.n_audio_state);
-        read_safe(loader, hparams.n_audio_head);
-        read_safe(loader, hparams.n_audio_layer);
-        read_safe(loader, hparams.n_text_ctx);
-        read_safe(loader, hparams.n_text_state);
-        read_safe(loader, hparams.n_text_head);
-        read_safe(loader, hparams.n_text_layer);
-        read_safe(loader, hparams.n_mels);
-        read_safe(loader, hparams.f16);
+// maps the tokens [n_past, n_past + n_tokens) of a sequence to pages that only this sequence uses
+// a shared page is copied first (copy-on-write), keeping the tokens of it that are before n_past
+static bool kv_seq_prepare(struct whisper_kv_pages & cache, struct whisper_kv_seq & seq, int n_past, int n_tokens) {
+    const int n_page = WHISPER_KV_PAGE_SIZE;
 
-        assert(hparams.n_text_state == hparams.n_audio_state);
+    const int i0 = n_past/n_page;
+    const int i1 = (n_past + n_tokens - 1)/n_page;
 
-        if (hparams.n_audio_layer == 4) {
-            model.type = e_model::MODEL_TINY;
-        }
+    for (int i = i0; i <= i1 && i < (int) seq.pages.size(); ++i) {
+        const int page = seq.pages[i];
 
-        if (hparams.n_audio_layer == 6) {
-            model.type = e_model::MODEL_BASE;
+        if (cache.refs[page] == 1) {
+            continue;
         }
 
-        if (hparams.n_audio_layer == 12) {
-            model.type = e_model::MODEL_SMALL;
+        if (cache.free.empty()) {
+            return false;
         }
 
-        if (hparams.n_audio_layer == 24) {
-            model.type = e_model::MODEL_MEDIUM;
-        }
+        const int page_new = cache.free.back();
+        cache.free.pop_back();
 
-        if (hparams.n_audio_layer == 32) {
-            model.type = e_model::MODEL_LARGE;
-        }
+        cache.refs[page_new] = 1;
+        cache.refs[page]    -= 1;
 
-        // for the big tensors, we have the option to store the data in 16-bit floats
-        // in order to save memory and also to speed up the computation
-        wctx.wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        const int n_keep = std::max(0, std::min(n_page, n_past - i*n_page));
 
-        const size_t scale = model.hparams.f16 ? 1 : 2;
+        if (n_keep > 0) {
+            const int n_layer = cache.k->ne[1]/(cache.n_pages*n_page);
 
-        fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
-        fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
-        fprintf(stderr, "%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
-        fprintf(stderr, "%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
-        fprintf(stderr, "%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
-        fprintf(stderr, "%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
-        fprintf(stderr, "%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
-        fprintf(stderr, "%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
-        fprintf(stderr, "%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
-        fprintf(stderr, "%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        fprintf(stderr, "%s: f16           = %d\n", __func__, hparams.f16);
-        fprintf(stderr, "%s: type          = %d\n", __func__, model.type);
+            for (int il = 0; il < n_layer; ++il) {
+                const size_t row_src = size_t(il*cache.n_pages + page    )*n_page;
+                const size_t row_dst = size_t(il*cache.n_pages + page_new)*n_page;
 
-        // print memory requirements
-        {
-            // this is the total memory required to run the inference
-            const size_t mem_required =
-                     MEM_REQ_SCRATCH0.at (model.type) +
-                     MEM_REQ_SCRATCH1.at (model.type) +
-                     MEM_REQ_SCRATCH2.at (model.type) +
-                     MEM_REQ_SCRATCH3.at (model.type) +
-                scale*MEM_REQ_MODEL.at   (model.type) +
-                scale*MEM_REQ_KV_CROSS.at(model.type) +
-                scale*std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type));
+                memcpy((char *) cache.k->data + row_dst*cache.k->nb[1], (char *) cache.k->data + row_src*cache.k->nb[1], n_keep*cache.k->nb[1]);
+                memcpy((char *) cache.v->data + row_dst*cache.v->nb[1], (char *) cache.v->data + row_src*cache.v->nb[1], n_keep*cache.v->nb[1]);
+            }
+
+            cache.n_cow += n_keep;
+        }
 
-            // this is the memory required by one decoder
-            const size_t mem_required_decoder =
-                scale*MEM_REQ_KV_SELF.at(model.type);
+        seq.pages[i] = page_new;
+    }
 
-            fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per decoder)\n", __func__,
-                    mem_required / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
+    while ((int) seq.pages.size() <= i1) {
+        if (cache.free.empty()) {
+            return false;
         }
 
-        // initialize all memory buffers
-        // always have at least one decoder
+        const int page_new = cache.free.back();
+        cache.free.pop_back();
 
-        wctx.model.buf = new std::vector<uint8_t>();
-        wctx.model.buf->resize(scale*MEM_REQ_MODEL.at(model.type));
+        cache.refs[page_new] = 1;
 
-        // we skip initialization of the state until it is needed
-        // because it might be that state will always be provided externally.
+        seq.pages.push_back(page_new);
     }
 
-    // load mel filters
-    {
-        auto & filters = wctx.model.filters;
-
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+    return true;
+}
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+// the K or V rows of the first n_kv tokens of a sequence in layer il, as a [n_state, n_kv] tensor of the cache type
+// the rows are used in place if the pages of the tokens are consecutive, otherwise they are gathered with the
+// (precomputed) row indices in rows - these can also be the rows of several sequences, one after the other
+static struct ggml_tensor * kv_seq_rows(
+          struct ggml_context * ctx,
+    const struct whisper_kv_pages & cache,
+           struct ggml_tensor * kv,
+    const struct whisper_kv_seq & seq,
+           struct ggml_tensor * rows,
+                          int   il,
+                          int   n_kv) {
+    const int n_state = kv->ne[0];
+    const int n_rows  = cache.n_pages*WHISPER_KV_PAGE_SIZE;
+
+    if (rows == nullptr) {
+        return ggml_view_1d(ctx, kv, n_kv*n_state, (il*n_rows + seq.pages[0]*WHISPER_KV_PAGE_SIZE)*kv->nb[1]);
     }
 
-    // load vocab
-    {
-        int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+    struct ggml_tensor * cur = ggml_get_rows(ctx, ggml_view_2d(ctx, kv, n_state, n_rows, kv->nb[1], il*n_rows*kv->nb[1]), rows);
 
-        //if (n_vocab != model.hparams.n_vocab) {
-        //    fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
-        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
-        //    return false;
-        //}
+    if (kv->type != GGML_TYPE_F32) {
+        cur = ggml_cpy(ctx, cur, ggml_new_tensor_2d(ctx, kv->type, n_state, rows->ne[0]));
+    }
 
-        std::string word;
-        std::vector<char> tmp;
+    return cur;
+}
 
-        tmp.reserve(128);
+// the memory tables are for FP16 models - FP32 needs twice as much for the KV caches and the compute buffer
+static size_t whisper_itype_scale(ggml_type itype) {
+    return itype == GGML_TYPE_F32 ? 2 : 1;
+}
 
-        for (int i = 0; i < n_vocab; i++) {
-            uint32_t len;
-            read_safe(loader, len);
+// type of the 2D weight matrices for the model-wide ftype
+static bool whisper_ftype_to_wtype(int32_t ftype, ggml_type & wtype) {
+    switch (ftype) {
+        case WHISPER_FTYPE_ALL_F32:     wtype = GGML_TYPE_F32;  return true;
+        case WHISPER_FTYPE_MOSTLY_F16:  wtype = GGML_TYPE_F16;  return true;
+        case WHISPER_FTYPE_MOSTLY_Q4_0: wtype = GGML_TYPE_Q4_0; return true;
+        case WHISPER_FTYPE_MOSTLY_Q4_1: wtype = GGML_TYPE_Q4_1; return true;
+        case WHISPER_FTYPE_MOSTLY_Q5_0: wtype = GGML_TYPE_Q5_0; return true;
+        case WHISPER_FTYPE_MOSTLY_Q5_1: wtype = GGML_TYPE_Q5_1; return true;
+        case WHISPER_FTYPE_MOSTLY_Q8_0: wtype = GGML_TYPE_Q8_0; return true;
+    }
 
-            if (len > 0) {
-                tmp.resize(len);
-                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-                word.assign(&tmp[0], tmp.size());
-            } else {
-                // seems like we have an empty-string token in multi-language models (i = 50256)
-                //fprintf(stderr, "%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
-                word = "";
-            }
+    return false;
+}
 
-            vocab.token_to_id[word] = i;
-            vocab.id_to_token[i] = word;
+// the per-tensor type codes in the model file
+// these are the ggml_type values of upstream ggml, which differ from ours
+static bool whisper_ttype_to_type(int32_t ttype, ggml_type & type) {
+    switch (ttype) {
+        case 0: type = GGML_TYPE_F32;  return true;
+        case 1: type = GGML_TYPE_F16;  return true;
+        case 2: type = GGML_TYPE_Q4_0; return true;
+        case 3: type = GGML_TYPE_Q4_1; return true;
+        case 6: type = GGML_TYPE_Q5_0; return true;
+        case 7: type = GGML_TYPE_Q5_1; return true;
+        case 8: type = GGML_TYPE_Q8_0; return true;
+    }
 
-            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+    return false;
+}
+
+static int32_t whisper_type_to_ttype(ggml_type type) {
+    for (int32_t ttype = 0; ttype < 16; ++ttype) {
+        ggml_type t;
+        if (whisper_ttype_to_type(ttype, t) && t == type) {
+            return ttype;
         }
+    }
 
-        vocab.n_vocab = model.hparams.n_vocab;
-        if (vocab.is_multilingual()) {
-            vocab.token_eot++;
-            vocab.token_sot++;
-            vocab.token_prev++;
-            vocab.token_solm++;
-            vocab.token_not++;
-            vocab.token_beg++;
+    return -1;
+}
+
+// place the children of node s - the keys [lo, hi) share their first d bytes, which lead to s
+static void whisper_trie_place(
+                                    whisper_trie & trie,
+    const std::vector<std::pair<std::string, int32_t>> & keys,
+                                       int32_t & next_free,
+                                           int   s,
+                                           int   lo,
+                                           int   hi,
+                                           int   d) {
+    // the key that ends at s sorts first
+    if (lo < hi && (int) keys[lo].first.size() == d) {
+        trie.value[s] = keys[lo].second;
+        lo++;
+    }
+
+    if (lo == hi) {
+        return;
+    }
+
+    // children: the distinct next bytes, with the range of keys of each
+    std::vector<int> labels;
+    std::vector<int> bounds;
+    for (int k = lo; k < hi; ++k) {
+        const int c = (uint8_t) keys[k].first[d];
+        if (labels.empty() || labels.back() != c) {
+            labels.push_back(c);
+            bounds.push_back(k);
         }
+    }
+    bounds.push_back(hi);
 
-        if (n_vocab < model.hparams.n_vocab) {
-            fprintf(stderr, "%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
-            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
-                if (i > vocab.token_beg) {
-                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
-                } else if (i == vocab.token_eot) {
-                    word = "[_EOT_]";
-                } else if (i == vocab.token_sot) {
-                    word = "[_SOT_]";
-                } else if (i == vocab.token_prev) {
-                    word = "[_PREV_]";
-                } else if (i == vocab.token_not) {
-                    word = "[_NOT_]";
-                } else if (i == vocab.token_beg) {
-                    word = "[_BEG_]";
-                } else {
-                    word = "[_extra_token_" + std::to_string(i) + "]";
-                }
-                vocab.token_to_id[word] = i;
-                vocab.id_to_token[i] = word;
+    // first-fit: the smallest base at or after the first free slot for which all children are free
+    int32_t b = std::max(1, next_free - labels[0]);
+    while (true) {
+        const size_t n_min = b + labels.back() + 1;
+        if (trie.check.size() < n_min) {
+            const size_t n_new = std::max(n_min, 2*trie.check.size());
+
+            trie.base .resize(n_new,  0);
+            trie.check.resize(n_new, -1);
+            trie.value.resize(n_new, -1);
+        }
+
+        bool ok = true;
+        for (const int c : labels) {
+            if (trie.check[b + c] >= 0) {
+                ok = false;
+                break;
             }
         }
+
+        if (ok) {
+            break;
+        }
+
+        b++;
     }
 
-    size_t ctx_size = 0;
+    trie.base[s] = b;
+    for (const int c : labels) {
+        trie.check[b + c] = s;
+    }
 
-    const ggml_type wtype = wctx.wtype;
+    while (next_free < (int32_t) trie.check.size() && trie.check[next_free] >= 0) {
+        next_free++;
+    }
 
-    {
-        const auto & hparams = model.hparams;
+    for (int i = 0; i < (int) labels.size(); ++i) {
+        whisper_trie_place(trie, keys, next_free, b + labels[i], bounds[i], bounds[i + 1], d + 1);
+    }
+}
 
-        const int n_vocab = hparams.n_vocab;
+static void whisper_trie_build(whisper_trie & trie, const std::map<std::string, int32_t> & token_to_id) {
+    // std::map orders the strings bytewise, as the placement needs
+    std::vector<std::pair<std::string, int32_t>> keys;
+    keys.reserve(token_to_id.size());
+    for (const auto & kv : token_to_id) {
+        if (!kv.first.empty()) {
+            keys.push_back(kv);
+        }
+    }
 
-        const int n_audio_ctx   = hparams.n_audio_ctx;
-        const int n_audio_state = hparams.n_audio_state;
-        const int n_audio_layer = hparams.n_audio_layer;
+    trie.base .assign(2*keys.size() + 256,  0);
+    trie.check.assign(2*keys.size() + 256, -1);
+    trie.value.assign(2*keys.size() + 256, -1);
 
-        const int n_text_ctx   = hparams.n_text_ctx;
-        const int n_text_state = hparams.n_text_state;
-        const int n_text_layer = hparams.n_text_layer;
+    // the root is node 0
+    trie.check[0] = 0;
 
-        const int n_mels = hparams.n_mels;
+    int32_t next_free = 1;
+    whisper_trie_place(trie, keys, next_free, 0, 0, keys.size(), 0);
 
-        // encoder
-        {
-            ctx_size += n_audio_ctx*n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_pe;
+    // drop the free slots at the end - the lookups check the bounds
+    size_t n_used = trie.check.size();
+    while (n_used > 1 && trie.check[n_used - 1] < 0) {
+        n_used--;
+    }
 
-            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(wtype);         // e_conv_1_w
-            ctx_size +=          n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_1_b
+    trie.base .resize(n_used);
+    trie.check.resize(n_used);
+    trie.value.resize(n_used);
 
-            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(wtype);         // e_conv_2_w
-            ctx_size +=                 n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_2_b
+    trie.base .shrink_to_fit();
+    trie.check.shrink_to_fit();
+    trie.value.shrink_to_fit();
+}
 
-            ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_w;
-            ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_b;
-        }
+// load the model from a ggml file
+//
+// file format:
+//
+//   - hparams
+//   - pre-computed mel filters
+//   - vocab
+//   - weights
+//
+// see the convert-pt-to-ggml.py script for details
+//
+// creates the tensors of the weights in model.ctx and maps them by name, for the model described by model.hparams
+static void whisper_model_init_tensors(whisper_model & model, ggml_type wtype, ggml_type itype) {
+    auto & ctx = model.ctx;
 
-        // decoder
-        {
-            ctx_size += n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F32); // d_pe;
+    const auto & hparams = model.hparams;
 
-            ctx_size += n_vocab*n_text_state*ggml_type_size(wtype); // d_te;
+    const int n_vocab = hparams.n_vocab;
 
-            ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_w;
-            ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_b;
-        }
+    const int n_audio_ctx   = hparams.n_audio_ctx;
+    const int n_audio_state = hparams.n_audio_state;
+    const int n_audio_layer = hparams.n_audio_layer;
 
-        // encoder layers
-        {
-            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
-            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
+    const int n_text_ctx   = hparams.n_text_ctx;
+    const int n_text_state = hparams.n_text_state;
+    const int n_text_layer = hparams.n_text_layer;
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_0_w
-            ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
+    const int n_mels = hparams.n_mels;
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_1_w
-            ctx_size += n_audio_layer*(                n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
+    model.layers_encoder.resize(n_audio_layer);
+    model.layers_decoder.resize(n_text_layer);
 
-            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
-            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
+    // encoder
+    {
+        model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_q_w
-            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
+        model.e_conv_1_w = ggml_new_tensor_3d(ctx, itype,         3, n_mels, n_audio_state);
+        model.e_conv_1_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype)); // attn_k_w
+        model.e_conv_2_w = ggml_new_tensor_3d(ctx, itype,         3, n_audio_state, n_audio_state);
+        model.e_conv_2_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_v_w
-            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
+        model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+        model.e_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_ln_1_w
-            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
-        }
+        // map by name
+        model.tensors["encoder.positional_embedding"] = model.e_pe;
 
-        // decoder layers
-        {
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
+        model.tensors["encoder.conv1.weight"] = model.e_conv_1_w;
+        model.tensors["encoder.conv1.bias"]   = model.e_conv_1_b;
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_0_w
-            ctx_size += n_text_layer*(             4*n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
+        model.tensors["encoder.conv2.weight"] = model.e_conv_2_w;
+        model.tensors["encoder.conv2.bias"]   = model.e_conv_2_b;
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_1_w
-            ctx_size += n_text_layer*(               n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
+        model.tensors["encoder.ln_post.weight"] = model.e_ln_w;
+        model.tensors["encoder.ln_post.bias"]   = model.e_ln_b;
 
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
+        for (int i = 0; i < n_audio_layer; ++i) {
+            auto & layer = model.layers_encoder[i];
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_q_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
+            layer.mlp_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.mlp_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // attn_k_w
+            layer.mlp_0_w = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, 4*n_audio_state);
+            layer.mlp_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_v_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
+            layer.mlp_1_w = ggml_new_tensor_2d(ctx, wtype,         4*n_audio_state, n_audio_state);
+            layer.mlp_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_ln_1_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
-                                                                                                //
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_w
-            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_b
+            layer.attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_q_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_q_b
+            layer.attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
+            layer.attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // cross_attn_k_w
+            layer.attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_v_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_v_b
+            layer.attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
+            layer.attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_ln_1_w
-            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_1_b
-        }
+            layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
+            layer.attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
 
-        ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*256; // object overhead
+            // map by name
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp_ln.weight"] = layer.mlp_ln_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp_ln.bias"]   = layer.mlp_ln_b;
 
-        fprintf(stderr, "%s: model ctx     = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
-    }
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.0.weight"] = layer.mlp_0_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.0.bias"]   = layer.mlp_0_b;
 
-    // create the ggml context
-    {
-        struct ggml_init_params params;
-        params.mem_size   = wctx.model.buf->size();
-        params.mem_buffer = wctx.model.buf->data();
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.2.weight"] = layer.mlp_1_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.2.bias"]   = layer.mlp_1_b;
 
-        model.ctx = ggml_init(params);
-        if (!model.ctx) {
-            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
-            return false;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn_ln.weight"] = layer.attn_ln_0_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn_ln.bias"]   = layer.attn_ln_0_b;
+
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.query.weight"] = layer.attn_q_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.query.bias"]   = layer.attn_q_b;
+
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.key.weight"] = layer.attn_k_w;
+
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.value.weight"] = layer.attn_v_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.value.bias"]   = layer.attn_v_b;
+
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.out.weight"] = layer.attn_ln_1_w;
+            model.tensors["encoder.blocks." + std::to_string(i) + ".attn.out.bias"]   = layer.attn_ln_1_b;
         }
     }
 
-    // prepare memory for the weights
+    // decoder
     {
-        auto & ctx = model.ctx;
-
-        const auto & hparams = model.hparams;
-
-        const int n_vocab = hparams.n_vocab;
+        model.d_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_text_state, n_text_ctx);
 
-        const int n_audio_ctx   = hparams.n_audio_ctx;
-        const int n_audio_state = hparams.n_audio_state;
-        const int n_audio_layer = hparams.n_audio_layer;
+        model.d_te = ggml_new_tensor_2d(ctx, wtype, n_text_state, n_vocab);
 
-        const int n_text_ctx   = hparams.n_text_ctx;
-        const int n_text_state = hparams.n_text_state;
-        const int n_text_layer = hparams.n_text_layer;
+        model.d_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+        model.d_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-        const int n_mels = hparams.n_mels;
+        // map by name
+        model.tensors["decoder.positional_embedding"] = model.d_pe;
 
-        model.layers_encoder.resize(n_audio_layer);
-        model.layers_decoder.resize(n_text_layer);
+        model.tensors["decoder.token_embedding.weight"] = model.d_te;
 
-        // encoder
-        {
-            model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
+        model.tensors["decoder.ln.weight"] = model.d_ln_w;
+        model.tensors["decoder.ln.bias"]   = model.d_ln_b;
 
-            model.e_conv_1_w = ggml_new_tensor_3d(ctx, wtype,         3, n_mels, n_audio_state);
-            model.e_conv_1_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
+        for (int i = 0; i < n_text_layer; ++i) {
+            auto & layer = model.layers_decoder[i];
 
-            model.e_conv_2_w = ggml_new_tensor_3d(ctx, wtype,         3, n_audio_state, n_audio_state);
-            model.e_conv_2_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
+            layer.mlp_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+            layer.mlp_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-            model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
-            model.e_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.mlp_0_w = ggml_new_tensor_2d(ctx, wtype,           n_text_state, 4*n_text_state);
+            layer.mlp_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_text_state);
 
-            // map by name
-            model.tensors["encoder.positional_embedding"] = model.e_pe;
+            layer.mlp_1_w = ggml_new_tensor_2d(ctx, wtype,         4*n_text_state, n_text_state);
+            layer.mlp_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
 
-            model.tensors["encoder.conv1.weight"] = model.e_conv_1_w;
-            model.tensors["encoder.conv1.bias"]   = model.e_conv_1_b;
+            layer.attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+            layer.attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-            model.tensors["encoder.conv2.weight"] = model.e_conv_2_w;
-            model.tensors["encoder.conv2.bias"]   = model.e_conv_2_b;
+            layer.attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-            model.tensors["encoder.ln_post.weight"] = model.e_ln_w;
-            model.tensors["encoder.ln_post.bias"]   = model.e_ln_b;
+            layer.attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
 
-            for (int i = 0; i < n_audio_layer; ++i) {
-                auto & layer = model.layers_encoder[i];
+            layer.attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.mlp_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
-                layer.mlp_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.mlp_0_w = ggml_new_tensor_2d(ctx, wtype,           n_audio_state, 4*n_audio_state);
-                layer.mlp_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_audio_state);
+            layer.cross_attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+            layer.cross_attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.mlp_1_w = ggml_new_tensor_2d(ctx, wtype,         4*n_audio_state, n_audio_state);
-                layer.mlp_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_audio_state);
+            layer.cross_attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.cross_attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
-                layer.attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.cross_attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
 
-                layer.attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
-                layer.attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            layer.cross_attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.cross_attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
+            layer.cross_attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+            layer.cross_attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
 
-                layer.attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
-                layer.attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            // map by name
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp_ln.weight"] = layer.mlp_ln_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp_ln.bias"]   = layer.mlp_ln_b;
 
-                layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_audio_state, n_audio_state);
-                layer.attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.0.weight"] = layer.mlp_0_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.0.bias"]   = layer.mlp_0_b;
 
-                // map by name
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp_ln.weight"] = layer.mlp_ln_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp_ln.bias"]   = layer.mlp_ln_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.2.weight"] = layer.mlp_1_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.2.bias"]   = layer.mlp_1_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.0.weight"] = layer.mlp_0_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.0.bias"]   = layer.mlp_0_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn_ln.weight"] = layer.attn_ln_0_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn_ln.bias"]   = layer.attn_ln_0_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.2.weight"] = layer.mlp_1_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".mlp.2.bias"]   = layer.mlp_1_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.query.weight"] = layer.attn_q_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.query.bias"]   = layer.attn_q_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn_ln.weight"] = layer.attn_ln_0_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn_ln.bias"]   = layer.attn_ln_0_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.key.weight"] = layer.attn_k_w;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.query.weight"] = layer.attn_q_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.query.bias"]   = layer.attn_q_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.value.weight"] = layer.attn_v_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.value.bias"]   = layer.attn_v_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.key.weight"] = layer.attn_k_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.out.weight"] = layer.attn_ln_1_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".attn.out.bias"]   = layer.attn_ln_1_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.value.weight"] = layer.attn_v_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.value.bias"]   = layer.attn_v_b;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.weight"] = layer.cross_attn_ln_0_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.bias"]   = layer.cross_attn_ln_0_b;
 
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.out.weight"] = layer.attn_ln_1_w;
-                model.tensors["encoder.blocks." + std::to_string(i) + ".attn.out.bias"]   = layer.attn_ln_1_b;
-            }
-        }
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.weight"] = layer.cross_attn_q_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.bias"]   = layer.cross_attn_q_b;
 
-        // decoder
-        {
-            model.d_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_text_state, n_text_ctx);
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.key.weight"] = layer.cross_attn_k_w;
 
-            model.d_te = ggml_new_tensor_2d(ctx, wtype, n_text_state, n_vocab);
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.weight"] = layer.cross_attn_v_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.bias"]   = layer.cross_attn_v_b;
 
-            model.d_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
-            model.d_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.weight"] = layer.cross_attn_ln_1_w;
+            model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.bias"]   = layer.cross_attn_ln_1_b;
+        }
+    }
+}
 
-            // map by name
-            model.tensors["decoder.positional_embedding"] = model.d_pe;
+// packs the weights of the encoder and the cross-attention in place (see whisper_model_load), returns the number of packed tensors
+static int whisper_model_pack_weights(whisper_model & model) {
+    int n_packed = 0;
+
+    n_packed += ggml_conv_1d_pack(model.e_conv_1_w);
+    n_packed += ggml_conv_1d_pack(model.e_conv_2_w);
+
+    for (auto & layer : model.layers_encoder) {
+        n_packed += ggml_mul_mat_pack(layer.attn_q_w);
+        n_packed += ggml_mul_mat_pack(layer.attn_k_w);
+        n_packed += ggml_mul_mat_pack(layer.attn_v_w);
+        n_packed += ggml_mul_mat_pack(layer.attn_ln_1_w);
+#ifndef WHISPER_USE_FLASH_FF
+        n_packed += ggml_mul_mat_pack(layer.mlp_0_w);
+        n_packed += ggml_mul_mat_pack(layer.mlp_1_w);
+#endif
+    }
 
-            model.tensors["decoder.token_embedding.weight"] = model.d_te;
+    for (auto & layer : model.layers_decoder) {
+        n_packed += ggml_mul_mat_pack(layer.cross_attn_k_w);
+        n_packed += ggml_mul_mat_pack(layer.cross_attn_v_w);
+    }
 
-            model.tensors["decoder.ln.weight"] = model.d_ln_w;
-            model.tensors["decoder.ln.bias"]   = model.d_ln_b;
+    return n_packed;
+}
 
-            for (int i = 0; i < n_text_layer; ++i) {
-                auto & layer = model.layers_decoder[i];
+static bool whisper_model_load(whisper_model_reader & reader, whisper_context & wctx) {
+    fprintf(stderr, "%s: loading model\n", __func__);
 
-                layer.mlp_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
-                layer.mlp_ln_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+    const int64_t t_start_us = ggml_time_us();
 
-                layer.mlp_0_w = ggml_new_tensor_2d(ctx, wtype,           n_text_state, 4*n_text_state);
-                layer.mlp_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 4*n_text_state);
+    wctx.t_start_us = t_start_us;
 
-                layer.mlp_1_w = ggml_new_tensor_2d(ctx, wtype,         4*n_text_state, n_text_state);
-                layer.mlp_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,   n_text_state);
+    auto & model = wctx.model;
+    auto & vocab = wctx.vocab;
 
-                layer.attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
-                layer.attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+    // the tensor data of aligned models is used in place, when the model is in memory
+    bool aligned  = false;
+    bool in_place = false;
 
-                layer.attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+    // verify magic
+    {
+        uint32_t magic;
+        read_safe(reader, magic);
+        if (magic != WHISPER_FILE_MAGIC && magic != WHISPER_FILE_MAGIC_ALIGNED) {
+            fprintf(stderr, "%s: invalid model data (bad magic)\n", __func__);
+            return false;
+        }
 
-                layer.attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+        aligned = magic == WHISPER_FILE_MAGIC_ALIGNED;
 
-                layer.attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+#if !defined(GGML_BIG_ENDIAN)
+        in_place = aligned && reader.mapped && (uintptr_t) reader.mapped % WHISPER_FILE_ALIGNMENT == 0;
+#endif
+    }
 
-                layer.attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+    //load hparams
+    {
+        auto & hparams = model.hparams;
 
-                layer.cross_attn_ln_0_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
-                layer.cross_attn_ln_0_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+        read_safe(reader, hparams.n_vocab);
+        read_safe(reader, hparams.n_audio_ctx);
+        read_safe(reader, hparams.n_audio_state);
+        read_safe(reader, hparams.n_audio_head);
+        read_safe(reader, hparams.n_audio_layer);
+        read_safe(reader, hparams.n_text_ctx);
+        read_safe(reader, hparams.n_text_state);
+        read_safe(reader, hparams.n_text_head);
+        read_safe(reader, hparams.n_text_layer);
+        read_safe(reader, hparams.n_mels);
+        read_safe(reader, hparams.ftype);
+
+        // quantized models store the version of the block format in the ftype
+        const int32_t qntvr = hparams.ftype / GGML_QNT_VERSION_FACTOR;
+        hparams.ftype %= GGML_QNT_VERSION_FACTOR;
 
-                layer.cross_attn_q_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.cross_attn_q_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+        assert(hparams.n_text_state == hparams.n_audio_state);
 
-                layer.cross_attn_k_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
+        if (hparams.n_audio_layer == 4) {
+            model.type = e_model::MODEL_TINY;
+        }
 
-                layer.cross_attn_v_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.cross_attn_v_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+        if (hparams.n_audio_layer == 6) {
+            model.type = e_model::MODEL_BASE;
+        }
 
-                layer.cross_attn_ln_1_w = ggml_new_tensor_2d(ctx, wtype,         n_text_state, n_text_state);
-                layer.cross_attn_ln_1_b = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_text_state);
+        if (hparams.n_audio_layer == 12) {
+            model.type = e_model::MODEL_SMALL;
+        }
 
-                // map by name
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp_ln.weight"] = layer.mlp_ln_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp_ln.bias"]   = layer.mlp_ln_b;
+        if (hparams.n_audio_layer == 24) {
+            model.type = e_model::MODEL_MEDIUM;
+        }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.0.weight"] = layer.mlp_0_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.0.bias"]   = layer.mlp_0_b;
+        if (hparams.n_audio_layer == 32) {
+            model.type = e_model::MODEL_LARGE;
+        }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.2.weight"] = layer.mlp_1_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".mlp.2.bias"]   = layer.mlp_1_b;
+        // for the big tensors, we have the option to store the data in 16-bit floats or quantized blocks
+        // in order to save memory and also to speed up the computation
+        if (!whisper_ftype_to_wtype(hparams.ftype, wctx.wtype)) {
+            fprintf(stderr, "%s: invalid model data (unsupported ftype %d)\n", __func__, hparams.ftype);
+            return false;
+        }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn_ln.weight"] = layer.attn_ln_0_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn_ln.bias"]   = layer.attn_ln_0_b;
+        if (ggml_is_quantized(wctx.wtype) && qntvr != GGML_QNT_VERSION) {
+            fprintf(stderr, "%s: invalid model data (quantization version %d, expected %d) - requantize the model\n",
+                    __func__, qntvr, GGML_QNT_VERSION);
+            return false;
+        }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.query.weight"] = layer.attn_q_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.query.bias"]   = layer.attn_q_b;
+        wctx.itype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.key.weight"] = layer.attn_k_w;
+        fprintf(stderr, "%s: n_vocab       = %d\n", __func__, hparams.n_vocab);
+        fprintf(stderr, "%s: n_audio_ctx   = %d\n", __func__, hparams.n_audio_ctx);
+        fprintf(stderr, "%s: n_audio_state = %d\n", __func__, hparams.n_audio_state);
+        fprintf(stderr, "%s: n_audio_head  = %d\n", __func__, hparams.n_audio_head);
+        fprintf(stderr, "%s: n_audio_layer = %d\n", __func__, hparams.n_audio_layer);
+        fprintf(stderr, "%s: n_text_ctx    = %d\n", __func__, hparams.n_text_ctx);
+        fprintf(stderr, "%s: n_text_state  = %d\n", __func__, hparams.n_text_state);
+        fprintf(stderr, "%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
+        fprintf(stderr, "%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
+        fprintf(stderr, "%s: n_mels        = %d\n", __func__, hparams.n_mels);
+        fprintf(stderr, "%s: ftype         = %d (%s)\n", __func__, hparams.ftype, ggml_type_name(wctx.wtype));
+        fprintf(stderr, "%s: qntvr         = %d\n", __func__, qntvr);
+        fprintf(stderr, "%s: type          = %d\n", __func__, model.type);
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.value.weight"] = layer.attn_v_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.value.bias"]   = layer.attn_v_b;
+        // the model memory buffer is allocated below, once the size of the weights is known
+        // we skip initialization of the state until it is needed
+        // because it might be that state will always be provided externally.
+    }
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.out.weight"] = layer.attn_ln_1_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".attn.out.bias"]   = layer.attn_ln_1_b;
+    // load mel filters
+    {
+        auto & filters = wctx.model.filters;
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.weight"] = layer.cross_attn_ln_0_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn_ln.bias"]   = layer.cross_attn_ln_0_b;
+        read_safe(reader, filters.n_mel);
+        read_safe(reader, filters.n_fft);
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.weight"] = layer.cross_attn_q_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.query.bias"]   = layer.cross_attn_q_b;
+        filters.data.resize(filters.n_mel * filters.n_fft);
+        reader.read(filters.data.data(), filters.data.size() * sizeof(float));
+        BYTESWAP_FILTERS(filters);
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.key.weight"] = layer.cross_attn_k_w;
+        filters.beg.resize(filters.n_mel);
+        filters.end.resize(filters.n_mel);
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.weight"] = layer.cross_attn_v_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.value.bias"]   = layer.cross_attn_v_b;
+        for (int j = 0; j < filters.n_mel; j++) {
+            int beg = filters.n_fft;
+            int end = 0;
 
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.weight"] = layer.cross_attn_ln_1_w;
-                model.tensors["decoder.blocks." + std::to_string(i) + ".cross_attn.out.bias"]   = layer.cross_attn_ln_1_b;
+            for (int k = 0; k < filters.n_fft; k++) {
+                if (filters.data[j*filters.n_fft + k] != 0.0f) {
+                    beg = std::min(beg, k);
+                    end = k + 1;
+                }
             }
+
+            filters.beg[j] = std::min(beg, end);
+            filters.end[j] = end;
         }
     }
 
-    // load weights
+    // load vocab
     {
-        size_t total_size = 0;
+        int32_t n_vocab = 0;
+        read_safe(reader, n_vocab);
 
-        model.n_loaded = 0;
+        //if (n_vocab != model.hparams.n_vocab) {
+        //    fprintf(stderr, "%s: invalid model file '%s' (bad vocab size %d != %d)\n",
+        //            __func__, fname.c_str(), n_vocab, model.hparams.n_vocab);
+        //    return false;
+        //}
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ftype;
+        std::string word;
+        std::vector<char> tmp;
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ftype);
+        tmp.reserve(128);
 
-            if (loader->eof(loader->context)) {
-                break;
-            }
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            read_safe(reader, len);
 
-            int32_t nelements = 1;
-            int32_t ne[3] = { 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
+            if (len > 0) {
+                tmp.resize(len);
+                reader.read(&tmp[0], tmp.size()); // read to buffer
+                word.assign(&tmp[0], tmp.size());
+            } else {
+                // seems like we have an empty-string token in multi-language models (i = 50256)
+                //fprintf(stderr, "%s: warning: empty-string token in vocab, i = %d\n", __func__, i);
+                word = "";
             }
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            vocab.token_to_id[word] = i;
+            vocab.id_to_token[i] = word;
+
+            //printf("%s: vocab[%d] = '%s'\n", __func__, i, word.c_str());
+        }
+
+        vocab.n_vocab = model.hparams.n_vocab;
+        if (vocab.is_multilingual()) {
+            vocab.token_eot++;
+            vocab.token_sot++;
+            vocab.token_prev++;
+            vocab.token_solm++;
+            vocab.token_not++;
+            vocab.token_beg++;
+        }
+
+        if (n_vocab < model.hparams.n_vocab) {
+            fprintf(stderr, "%s: adding %d extra tokens\n", __func__, model.hparams.n_vocab - n_vocab);
+            for (int i = n_vocab; i < model.hparams.n_vocab; i++) {
+                if (i > vocab.token_beg) {
+                    word = "[_TT_" + std::to_string(i - vocab.token_beg) + "]";
+                } else if (i == vocab.token_eot) {
+                    word = "[_EOT_]";
+                } else if (i == vocab.token_sot) {
+                    word = "[_SOT_]";
+                } else if (i == vocab.token_prev) {
+                    word = "[_PREV_]";
+                } else if (i == vocab.token_not) {
+                    word = "[_NOT_]";
+                } else if (i == vocab.token_beg) {
+                    word = "[_BEG_]";
+                } else {
+                    word = "[_extra_token_" + std::to_string(i) + "]";
+                }
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+            }
+        }
+
+        whisper_trie_build(vocab.trie, vocab.token_to_id);
+
+        if (vocab.token_to_id.find(" ") != vocab.token_to_id.end()) {
+            vocab.token_space = vocab.token_to_id.at(" ");
+        }
+
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                    vocab.tokens_non_speech.push_back(vocab.token_to_id.at(suppress_token));
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+            vocab.tokens_non_speech.push_back(vocab.token_to_id.at(" -"));
+        }
+        if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+            vocab.tokens_non_speech.push_back(vocab.token_to_id.at(" '"));
+        }
+    }
+
+    size_t ctx_size = 0;
+
+    const ggml_type wtype = wctx.wtype;
+    const ggml_type itype = wctx.itype;
+
+    {
+        const auto & hparams = model.hparams;
+
+        const int n_vocab = hparams.n_vocab;
+
+        const int n_audio_ctx   = hparams.n_audio_ctx;
+        const int n_audio_state = hparams.n_audio_state;
+        const int n_audio_layer = hparams.n_audio_layer;
+
+        const int n_text_ctx   = hparams.n_text_ctx;
+        const int n_text_state = hparams.n_text_state;
+        const int n_text_layer = hparams.n_text_layer;
+
+        const int n_mels = hparams.n_mels;
+
+        // encoder
+        {
+            ctx_size += n_audio_ctx*n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_pe;
+
+            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(itype);         // e_conv_1_w
+            ctx_size +=          n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_1_b
+
+            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(itype);         // e_conv_2_w
+            ctx_size +=                 n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_2_b
+
+            ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_w;
+            ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_b;
+        }
+
+        // decoder
+        {
+            ctx_size += n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F32); // d_pe;
+
+            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype); // d_te;
+
+            ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_w;
+            ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_b;
+        }
+
+        // encoder layers
+        {
+            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
+            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
+
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_0_w
+            ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
+
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_1_w
+            ctx_size += n_audio_layer*(                n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
+
+            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
+            ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
+
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_q_w
+            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
+
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype)); // attn_k_w
+
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_v_w
+            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
+
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_ln_1_w
+            ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
+        }
+
+        // decoder layers
+        {
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
+
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_0_w
+            ctx_size += n_text_layer*(             4*n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
+
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_1_w
+            ctx_size += n_text_layer*(               n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
+
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_q_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // attn_k_w
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_v_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_ln_1_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
+                                                                                                //
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_w
+            ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_q_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_q_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // cross_attn_k_w
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_v_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_v_b
+
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_ln_1_w
+            ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_1_b
+        }
+
+        // the weights stay in the mapped file, the context only holds the tensor objects
+        if (in_place) {
+            ctx_size = 0;
+        }
+
+        ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*256; // object overhead
+
+        fprintf(stderr, "%s: model ctx     = %7.2f MB%s\n", __func__, ctx_size/(1024.0*1024.0), in_place ? " (weights mapped)" : "");
+    }
+
+    // print memory requirements
+    {
+        const size_t scale = whisper_itype_scale(wctx.itype);
+
+        // this is the total memory required to run the inference, without the compute buffer that is measured when a
+        // state is created (see whisper_state_alloc_size)
+        const size_t mem_required =
+                 ctx_size +
+            scale*MEM_REQ_KV_CROSS.at(model.type);
+
+        // this is the memory required by one decoder
+        const size_t mem_required_decoder =
+            scale*MEM_REQ_KV_SELF.at(model.type);
+
+        fprintf(stderr, "%s: mem required  = %7.2f MB (+ %7.2f MB per decoder)\n", __func__,
+                mem_required / 1024.0 / 1024.0, mem_required_decoder / 1024.0 / 1024.0);
+    }
+
+    // initialize all memory buffers
+    // always have at least one decoder
+    wctx.model.buf = new std::vector<uint8_t>();
+    wctx.model.buf->resize(ctx_size);
+
+    // create the ggml context
+    {
+        struct ggml_init_params params;
+        params.mem_size   = wctx.model.buf->size();
+        params.mem_buffer = wctx.model.buf->data();
+        params.no_alloc   = in_place;
+
+        model.ctx = ggml_init(params);
+        if (!model.ctx) {
+            fprintf(stderr, "%s: ggml_init() failed\n", __func__);
+            return false;
+        }
+    }
+
+    // prepare memory for the weights
+    whisper_model_init_tensors(model, wtype, itype);
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(reader, n_dims);
+            read_safe(reader, length);
+            read_safe(reader, ttype);
+
+            if (reader.eof()) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[3] = { 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(reader, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name;
+            std::vector<char> tmp(length); // create a buffer
+            reader.read(&tmp[0], tmp.size()); // read to buffer
+            name.assign(&tmp[0], tmp.size());
 
             if (model.tensors.find(name) == model.tensors.end()) {
                 fprintf(stderr, "%s: unknown tensor '%s' in model file\n", __func__, name.data());
@@ -1281,18 +1905,38 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+            ggml_type type;
+            if (!whisper_ttype_to_type(ttype, type) || type != tensor->type) {
+                fprintf(stderr, "%s: tensor '%s' has wrong type in model file: got %d, expected %s\n",
+                        __func__, name.data(), ttype, ggml_type_name(tensor->type));
+                return false;
+            }
+
+            const size_t bpe = ggml_type_size(type);
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
+            if ((nelements*bpe)/ggml_blck_size(type) != ggml_nbytes(tensor)) {
                 fprintf(stderr, "%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                        __func__, name.data(), ggml_nbytes(tensor), (nelements*bpe)/ggml_blck_size(type));
                 return false;
             }
 
-            loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-            BYTESWAP_TENSOR(tensor);
+            if (aligned) {
+                uint8_t padding[WHISPER_FILE_ALIGNMENT];
+                reader.read(padding, (WHISPER_FILE_ALIGNMENT - reader.offset % WHISPER_FILE_ALIGNMENT) % WHISPER_FILE_ALIGNMENT);
+            }
+
+            if (in_place) {
+                tensor->data = (void *) reader.skip(ggml_nbytes(tensor));
+                if (tensor->data == nullptr) {
+                    fprintf(stderr, "%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+                    return false;
+                }
+            } else {
+                reader.read(tensor->data, ggml_nbytes(tensor));
+                BYTESWAP_TENSOR(tensor);
+            }
 
-            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
+            //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ggml_type_name(type), ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
             model.n_loaded++;
         }
@@ -1307,94 +1951,87 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
+    // pack the weights that are only multiplied by the n_audio_ctx columns of the encoder into the layouts that the
+    // kernels read, in place, so that they are not repacked by every encode
+    // the decoder weights are multiplied by a few columns at a time and stay in rows
+    // weights used in place belong to the caller's mapping, that is read-only and may be shared, so they are not
+    // written - they stay in rows and the kernels pack them on the fly
+    if (model.n_loaded > 0 && !in_place && !ggml_cpu_has_blas()) {
+        const int n_packed = whisper_model_pack_weights(model);
+
+        fprintf(stderr, "%s: packed        = %d tensors\n", __func__, n_packed);
+    }
+
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
+// grows buf_compute to hold a context of size bytes
+// no context may be allocated in buf_compute
+static void whisper_buf_compute_reserve(whisper_state & wstate, size_t size) {
+    if (wstate.buf_compute.size() < size) {
+        wstate.buf_compute.resize(size);
+    }
+}
+
+// plans the memory of a graph that was built in a context with no_alloc in wstate.buf_alloc, which grows if the graph
+// needs more - the kept decoder graphs point into buf_alloc too, so they are not current once it has moved
+// the graph is planned for gf.n_threads threads and must be computed with as many
+static void whisper_graph_alloc(whisper_state & wstate, struct ggml_context * ctx, struct ggml_cgraph & gf) {
+    const size_t size = ggml_graph_alloc(ctx, &gf, nullptr);
+
+    if (wstate.buf_alloc.size() < size) {
+        wstate.buf_alloc.resize(size);
+    }
+
+    ggml_graph_alloc(ctx, &gf, wstate.buf_alloc.data());
+}
+
+// the memory of the context of an encoder graph for n_batch utterances: the tensors of the graph (about 64 per layer,
+// views included, the convolutions of each utterance and the stores of its cross-attention K and V), but not their data
+static size_t whisper_encode_graph_mem_size(const whisper_context & wctx, int n_batch) {
+    const size_t n_audio_layer = wctx.model.hparams.n_audio_layer;
+    const size_t n_text_layer  = wctx.model.hparams.n_text_layer;
+
+    const size_t n_tensors = n_audio_layer*64 + n_text_layer*(8 + 16*n_batch) + 32*n_batch + 64;
+
+    return n_tensors*ggml_tensor_overhead();
+}
+
+// builds the graph of whisper_encode_batch_internal() in ctx0, which has no_alloc
 //
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+// the outputs are the cross-attention K and V of each utterance, stored in its kv_cross
+// the inputs are the mel spectrograms of the utterances, [2*n_ctx, n_mels] each, filled in once the graph is planned
 //
-static bool whisper_encode_internal(
+static void whisper_encode_graph_build(
         whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads){
-
-    const int64_t t_start_us = ggml_time_us();
-
+  whisper_state * const * states,
+              const int   n_batch,
+    struct ggml_context * ctx0,
+     struct ggml_cgraph & gf,
+    std::vector<struct ggml_tensor *> & mels) {
     const auto & model   = wctx.model;
-    const auto & mel_inp = wstate.mel;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_ctx   = states[0]->exp_n_audio_ctx > 0 ? states[0]->exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
     const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
-
-    struct ggml_init_params params;
-    params.mem_size   = wstate.buf_compute.size();
-    params.mem_buffer = wstate.buf_compute.data();
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    wstate.use_buf(ctx0, 0);
-
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
-
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
-
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
-        }
-    }
-
-    struct ggml_tensor * cur;
 
-    // convolution + gelu
-    {
-        wstate.use_buf(ctx0, 1);
-
-        cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
-        cur = ggml_add(ctx0,
-            ggml_repeat(ctx0,
-                model.e_conv_1_b,
-                cur),
-            cur);
+    // number of audio frames in the batch
+    const int n_tok = n_batch*n_ctx;
 
-        cur = ggml_gelu(ctx0, cur);
+    mels.clear();
 
-        wstate.use_buf(ctx0, 0);
+    struct ggml_tensor * inpL = nullptr;
 
-        cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
-        cur = ggml_add(ctx0,
-            ggml_repeat(ctx0,
-                model.e_conv_2_b,
-                cur),
-            cur);
-
-        cur = ggml_gelu(ctx0, cur);
+    if (n_batch > 1) {
+        inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tok);
     }
 
-    wstate.use_buf(ctx0, 3);
-
     // ===================================================================
     // NOTE: experimenting with partial evaluation of the encoder (ignore)
     //static int iter = -1;
@@ -1412,47 +2049,74 @@ static bool whisper_encode_internal(
     const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    // ===================================================================
 
-    cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+    for (int ib = 0; ib < n_batch; ++ib) {
+        struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
 
-    // ===================================================================
+        mels.push_back(mel);
 
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+        struct ggml_tensor * cur;
+
+        // convolution + gelu
+        {
+            cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
+            cur = ggml_add(ctx0,
+                cur,
+                model.e_conv_1_b);
+
+            cur = ggml_gelu(ctx0, cur);
+
+            cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
+            cur = ggml_add(ctx0,
+                cur,
+                model.e_conv_2_b);
+
+            cur = ggml_gelu(ctx0, cur);
+        }
+
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+
+        cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+
+        // original:
+        //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+        if (n_batch == 1) {
+            inpL = cur;
+        } else {
+            // the copies of the convolution outputs into the batch are added to the graph before the layers that read them
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, inpL, n_state, n_ctx, inpL->nb[1], ib*n_ctx*inpL->nb[1])));
+        }
+    }
+
+    struct ggml_tensor * cur;
 
-    struct ggml_tensor * inpL = cur;
 
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_encoder[il];
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_norm(ctx0, inpL);
 
             // cur = ln_0_w*cur + ln_0_b
             cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
-                    ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                    cur),
-                ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+                    cur,
+                    layer.attn_ln_0_w),
+                layer.attn_ln_0_b);
         }
 
         // self-attention
         {
-            wstate.use_buf(ctx0, 1);
-
             struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                 layer.attn_q_w,
                 cur);
 
             Qcur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    layer.attn_q_b,
-                    Qcur),
-                Qcur);
+                Qcur,
+                layer.attn_q_b);
 
             //Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
@@ -1468,39 +2132,35 @@ static bool whisper_encode_internal(
                 cur);
 
             Vcur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    layer.attn_v_b,
-                    Vcur),
-                Vcur);
+                Vcur,
+                layer.attn_v_b);
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
-
 #ifdef WHISPER_USE_FLASH_ATTN
+            // Q and V are read in place, K is transposed once so that the keys are contiguous
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
+                        ggml_reshape_4d(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, wctx.wtype, n_state/n_head, n_head, n_ctx)),
+                            n_state/n_head, n_head, n_ctx, n_batch),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.wtype, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
+                        ggml_reshape_4d(ctx0,
+                            ggml_cpy(ctx0,
+                                ggml_transpose(ctx0, Kcur),
+                                ggml_new_tensor_2d(ctx0, wctx.itype, n_tok, n_state)),
+                            n_ctx, n_batch, n_state/n_head, n_head),
+                        1, 3, 0, 2);
 
             struct ggml_tensor * V =
-                ggml_cpy(ctx0,
-                        ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
-                            1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.wtype, n_ctx, n_state/n_head, n_head)
-                        );
+                ggml_permute(ctx0,
+                        ggml_reshape_4d(ctx0,
+                            Vcur,
+                            n_state/n_head, n_head, n_ctx, n_batch),
+                        1, 2, 0, 3);
 
             struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
@@ -1508,14 +2168,14 @@ static bool whisper_encode_internal(
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctx0, wctx.wtype, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             // K * Q
@@ -1533,7 +2193,7 @@ static bool whisper_encode_internal(
             //    ggml_permute(ctx0,
             //            ggml_cpy(ctx0,
             //                Vcur,
-            //                ggml_new_tensor_3d(ctx0, wctx.wtype, n_state/n_head, n_head, n_ctx)),
+            //                ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_head, n_ctx, n_batch)),
             //            1, 2, 0, 3);
 
             //struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
@@ -1541,41 +2201,33 @@ static bool whisper_encode_internal(
             struct ggml_tensor * V =
                 ggml_cpy(ctx0,
                         ggml_permute(ctx0,
-                            ggml_reshape_3d(ctx0,
+                            ggml_reshape_4d(ctx0,
                                 Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                                n_state/n_head, n_head, n_ctx, n_batch),
                             0, 2, 1, 3),
-                        ggml_new_tensor_3d(ctx0, wctx.wtype, n_state/n_head, n_ctx, n_head)
+                        ggml_new_tensor_4d(ctx0, wctx.itype, n_state/n_head, n_ctx, n_head, n_batch)
                         );
 
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, ggml_transpose(ctx0, V), KQ_soft_max);
 #endif
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_cpy(ctx0,
                 KQV_merged,
-                ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx));
+                ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tok));
         }
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_mul_mat(ctx0,
                 layer.attn_ln_1_w,
                 cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_add(ctx0,
-                ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                cur);
+                cur,
+                layer.attn_ln_1_b);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         cur = ggml_add(ctx0, cur, inpL);
 
@@ -1585,62 +2237,44 @@ static bool whisper_encode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
                 cur = ggml_norm(ctx0, inpFF);
 
-                wstate.use_buf(ctx0, 1);
-
                 // cur = mlp_ln_w*cur + mlp_ln_b
                 cur = ggml_add(ctx0,
                     ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+                        cur,
+                        layer.mlp_ln_w),
+                    layer.mlp_ln_b);
     }
 
 #ifdef WHISPER_USE_FLASH_FF
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_flash_ff(ctx0,
-                ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wstate.wtype, n_state, n_ctx)),
+                ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, wctx.itype, n_state, n_tok)),
                 layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
-            wstate.use_buf(ctx0, 0);
-
             // fully connected
             cur = ggml_mul_mat(ctx0,
                 layer.mlp_0_w,
                 cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_add(ctx0,
-                ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                cur);
-
-            wstate.use_buf(ctx0, 0);
+                cur,
+                layer.mlp_0_b);
 
             // GELU activation
             cur = ggml_gelu(ctx0, cur);
 
-            wstate.use_buf(ctx0, 1);
-
             // projection
             cur = ggml_mul_mat(ctx0,
                 layer.mlp_1_w,
                 cur);
 
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_add(ctx0,
-                ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                cur);
+                cur,
+                layer.mlp_1_b);
 #endif
 }
 
-        wstate.use_buf(ctx0, 3);
-
         inpL = ggml_add(ctx0, cur, inpFF);
     }
 
@@ -1648,31 +2282,14 @@ static bool whisper_encode_internal(
 
     // norm
     {
-        wstate.use_buf(ctx0, 0);
-
         cur = ggml_norm(ctx0, cur);
 
-        wstate.use_buf(ctx0, 1);
-
         // cur = ln_f_g*cur + ln_f_b
         cur = ggml_add(ctx0,
             ggml_mul(ctx0,
-                ggml_repeat(ctx0, model.e_ln_w, cur),
-                cur),
-            ggml_repeat(ctx0, model.e_ln_b, cur));
-    }
-
-    wstate.use_buf(ctx0, -1);
-
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute(ctx0, &gf);
-
-        //ggml_graph_print(&gf);
+                cur,
+                model.e_ln_w),
+            model.e_ln_b);
     }
 
     // cur
@@ -1690,129 +2307,224 @@ static bool whisper_encode_internal(
     //}
 
     // pre-compute cross-attention memory
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        auto& layer = model.layers_decoder[il];
+
+        struct ggml_tensor* Kcross = ggml_mul_mat(ctx0,
+            layer.cross_attn_k_w,
+            cur);
 
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = GGML_OP_NONE;
-        cur->src0 = nullptr;
-        cur->src1 = nullptr;
+#ifndef WHISPER_USE_FLASH_ATTN
+        Kcross = ggml_scale(ctx0, Kcross, ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
+#endif
 
-        for (int il = 0; il < model.hparams.n_text_layer; ++il) {
-            auto& layer = model.layers_decoder[il];
+        struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
+            layer.cross_attn_v_w,
+            cur);
 
-            wstate.use_buf(ctx0, 0);
+        Vcross = ggml_add(ctx0,
+            Vcross,
+            layer.cross_attn_v_b);
 
-            struct ggml_tensor* Kcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_k_w,
-                cur);
+        // each utterance has its own cross-attention memory
+        for (int ib = 0; ib < n_batch; ++ib) {
+            const auto & kv_cross = states[ib]->kv_cross;
 
-            Kcross = ggml_scale(ctx0, Kcross, ggml_new_f32(ctx0, pow(float(n_state) / n_head, -0.25)));
+            //struct ggml_tensor * k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+            //struct ggml_tensor * v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx, (ggml_element_size(kv_cross.v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+            struct ggml_tensor* k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx, (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
+            struct ggml_tensor* v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx, (ggml_element_size(kv_cross.v)*n_state)*(il*n_ctx));
 
-            wstate.use_buf(ctx0, 1);
+#ifdef WHISPER_USE_FLASH_ATTN
+            // the keys are stored transposed [n_state][n_ctx], the layout that ggml_flash_attn reads fastest
+            struct ggml_tensor* Kcross_cur = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], Kcross->nb[1]*(ib*n_ctx));
+            struct ggml_tensor* Vcross_cur = ggml_view_1d(ctx0, Vcross, n_state*n_ctx, (ggml_element_size(Vcross)*n_state)*(ib*n_ctx));
 
-            struct ggml_tensor* Vcross = ggml_mul_mat(ctx0,
-                layer.cross_attn_v_w,
-                cur);
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_transpose(ctx0, Kcross_cur), ggml_reshape_2d(ctx0, k, n_ctx, n_state)));
+#else
+            struct ggml_tensor* Kcross_cur = ggml_view_1d(ctx0, Kcross, n_state*n_ctx, (ggml_element_size(Kcross)*n_state)*(ib*n_ctx));
+            struct ggml_tensor* Vcross_cur = ggml_view_1d(ctx0, Vcross, n_state*n_ctx, (ggml_element_size(Vcross)*n_state)*(ib*n_ctx));
+
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_cur, k));
+#endif
+            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_cur, v));
+        }
+    }
+}
+
+// evaluate the encoder for a batch of utterances
+//
+// given audio recordings (more specifically, their log mel spectrograms), runs forward pass of the encoder
+// part of the transformer model and stores the encoded features in the cross-attention KV cache of each utterance
+//
+// the convolutions are computed per utterance, then the utterances are concatenated along the time axis and all
+// other layers run on the [n_state, n_batch*n_ctx] activations, with the attention over separate 4d batches, so
+// each weight matrix is read once per batch instead of once per utterance
+//
+//   - wctx:        the model
+//   - wstate:      provides the compute buffers and the threads
+//   - states:      the utterances: the mel spectrogram of each is the input, its kv_cross the output
+//   - mel_offsets: offset in the mel spectrogram of each utterance (i.e. audio offset)
+//   - n_batch:     number of utterances, all of them with the same audio context
+//   - n_threads:   number of threads to use
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+  whisper_state * const * states,
+              const int * mel_offsets,
+              const int   n_batch,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const int n_ctx = states[0]->exp_n_audio_ctx > 0 ? states[0]->exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    whisper_buf_compute_reserve(wstate, whisper_encode_graph_mem_size(wctx, n_batch));
+
+    struct ggml_init_params params;
+    params.mem_size   = wstate.buf_compute.size();
+    params.mem_buffer = wstate.buf_compute.data();
+    params.no_alloc   = true;
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
 
-            Vcross = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    layer.cross_attn_v_b,
-                    Vcross),
-                Vcross);
+    std::vector<struct ggml_tensor *> mels;
 
-            wstate.use_buf(ctx0, -1);
+    whisper_encode_graph_build(wctx, states, n_batch, ctx0, gf, mels);
 
-            //struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            //struct ggml_tensor * v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            struct ggml_tensor* k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
-            struct ggml_tensor* v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx, (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx));
+    whisper_graph_alloc(wstate, ctx0, gf);
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+    for (int ib = 0; ib < n_batch; ++ib) {
+        const auto & mel_inp = states[ib]->mel;
+        assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+
+        float * dst = (float *) mels[ib]->data;
+        memset(dst, 0, ggml_nbytes(mels[ib]));
+
+        const int i0 = std::min(mel_offsets[ib], mel_inp.n_len);
+        const int i1 = std::min(mel_offsets[ib] + 2*n_ctx, mel_inp.n_len);
+
+        for (int j = 0; j < mel_inp.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+            }
         }
+    }
+
+    // run the computation
+    {
+        whisper_pool_lease lease(wstate, n_threads);
+
+        gf.pool = lease.pool;
 
         ggml_graph_compute(ctx0, &gf);
+
         //ggml_graph_print(&gf);
     }
 
     ////////////////////////////////////////////////////////////////////////////
 
-    //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
+    //printf("%s: used_mem = %f MB, %f MB\n", __func__,
     //        ggml_used_mem(ctx0)/1024.0/1024.0,
-    //        wctx.get_buf_max_mem(0)/1024.0/1024.0,
-    //        wctx.get_buf_max_mem(1)/1024.0/1024.0,
-    //        wctx.get_buf_max_mem(2)/1024.0/1024.0,
-    //        wctx.get_buf_max_mem(3)/1024.0/1024.0);
+    //        wstate.buf_alloc.size()/1024.0/1024.0);
 
     ggml_free(ctx0);
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
+    for (int ib = 0; ib < n_batch; ++ib) {
+        states[ib]->t_encode_us += ggml_time_us() - t_start_us;
+        states[ib]->n_encode++;
+        states[ib]->kv_cross_id++;
+    }
 
     return true;
 }
 
-// evaluate the decoder
+// evaluate the encoder with the given state
 //
-// given text prompt + audio features -> computes the logits for the next token
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
 //
-//   - model:      the model
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
 //   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
 //
-static bool whisper_decode_internal(
+static bool whisper_encode_internal(
         whisper_context & wctx,
           whisper_state & wstate,
-        whisper_decoder & decoder,
-    const whisper_token * tokens,
-              const int   n_tokens,
-              const int   n_past,
-              const int   n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+              const int   mel_offset,
+              const int   n_threads){
+    whisper_state * states[1] = { &wstate };
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    return whisper_encode_batch_internal(wctx, wstate, states, &mel_offset, 1, n_threads);
+}
 
-    auto & kv_self = decoder.kv_self;
+// the memory of the context of a decoder graph that stores the new K and V rows in n_runs runs: the tensors of the
+// graph (about 64 per layer, views included, and a few more for each run), but not their data
+static size_t whisper_decode_graph_mem_size(const whisper_context & wctx, int n_runs) {
+    const size_t n_layer = wctx.model.hparams.n_text_layer;
 
-    WHISPER_ASSERT(!!kv_self.ctx);
+    const size_t n_tensors = n_layer*(2*64 + 8*n_runs) + 64;
 
-    auto & logits_out = wstate.logits;
+    return n_tensors*ggml_tensor_overhead();
+}
 
-    const int n_vocab = hparams.n_vocab;
+static void whisper_decode_graph_free(whisper_decode_graph & dg) {
+    if (dg.ctx) {
+        ggml_free(dg.ctx);
+        dg.ctx = nullptr;
+    }
+
+    dg.n_batch = 0;
+}
+
+// builds the graph of whisper_decode_batch_internal() in dg.ctx, which has no_alloc, for dg.n_batch decoders with
+// dg.n_tokens new tokens each and dg.n_kv tokens in the self-attention
+//
+// the new K and V rows are stored in the given runs, and the K and V rows of all tokens are gathered with dg.kv_rows,
+// or are used in place from the pages of seq if there are no row indices
+// all inputs are filled in by whisper_decode_graph_set_inputs(), once the graph is planned
+//
+static void whisper_decode_graph_build(
+         whisper_context & wctx,
+           whisper_state & wstate,
+    whisper_decode_graph & dg,
+    const std::vector<whisper_kv_run> & kv_runs,
+    const whisper_kv_seq & seq,
+                    bool   gather) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const auto & kv_pages = wstate.kv_pages;
 
-    const int n_ctx   = hparams.n_text_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-
-    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
+    const int N    = dg.n_tokens;
+    const int B    = dg.n_batch;
+    const int M    = dg.n_audio_ctx;
+    const int n_kv = dg.n_kv;
 
-    struct ggml_init_params params;
-    params.mem_size   = wstate.buf_compute.size();
-    params.mem_buffer = wstate.buf_compute.data();
+    const int n_rows = kv_pages.n_pages*WHISPER_KV_PAGE_SIZE; // rows of the KV cache per layer
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    struct ggml_context * ctx0 = dg.ctx;
 
-    struct ggml_cgraph gf = {};
-    gf.n_threads = n_threads;
+    dg.gf = {};
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    dg.kq_n_past.clear();
+    dg.kv_store.clear();
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
+    dg.embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N*B);
+    dg.position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N*B);
+    dg.kv_rows  = gather ? ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_kv*B) : nullptr;
 
-    wstate.use_buf(ctx0, 3);
+    struct ggml_tensor * embd     = dg.embd;
+    struct ggml_tensor * position = dg.position;
+    struct ggml_tensor * kv_rows  = dg.kv_rows;
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -1827,31 +2539,25 @@ static bool whisper_decode_internal(
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_norm(ctx0, inpL);
 
             // cur = ln_0_w*cur + ln_0_b
             cur = ggml_add(ctx0,
                     ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
         }
 
         // self-attention
         {
-            wstate.use_buf(ctx0, 1);
-
             struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.attn_q_w,
                     cur);
 
             Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
+                    Qcur,
+                    layer.attn_q_b);
 
             Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
@@ -1867,127 +2573,139 @@ static bool whisper_decode_internal(
                     cur);
 
             Vcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.attn_v_b,
-                        Vcur),
-                    Vcur);
+                    Vcur,
+                    layer.attn_v_b);
 
             // store key and value to memory
-            {
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_state, (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_self.v, N*n_state, (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + n_past));
+            // the stores are kept in dg.kv_store, to point them to other rows when the graph is computed again
+            for (const auto & run : kv_runs) {
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_pages.k, run.n*n_state, kv_pages.k->nb[1]*(il*n_rows + run.row));
+                struct ggml_tensor * v = ggml_view_1d(ctx0, kv_pages.v, run.n*n_state, kv_pages.v->nb[1]*(il*n_rows + run.row));
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcur, v));
+                k = ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcur, run.n*n_state, Kcur->nb[1]*run.i0), k);
+                v = ggml_cpy(ctx0, ggml_view_1d(ctx0, Vcur, run.n*n_state, Vcur->nb[1]*run.i0), v);
+
+                ggml_build_forward_expand(&dg.gf, k);
+                ggml_build_forward_expand(&dg.gf, v);
+
+                dg.kv_store.push_back(k);
+                dg.kv_store.push_back(v);
             }
 
             // ------
 
-            wstate.use_buf(ctx0, 0);
+            struct ggml_tensor * Kself = kv_seq_rows(ctx0, kv_pages, kv_pages.k, seq, kv_rows, il, n_kv);
+            struct ggml_tensor * Vself = kv_seq_rows(ctx0, kv_pages, kv_pages.v, seq, kv_rows, il, n_kv);
+
+            // the heads of each decoder are in dimension 2 and the decoders in dimension 3
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N, B)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                        ggml_reshape_4d(ctx0,
+                            Kself,
+                            n_state/n_head, n_head, n_kv, B),
                         0, 2, 1, 3);
 
-            wstate.use_buf(ctx0, 1);
-
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-            wstate.use_buf(ctx0, 0);
-
             //struct ggml_tensor * KQ_scaled =
             //    ggml_scale(ctx0,
             //            KQ,
             //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
             //            );
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
+            // n_past is set for each run of the graph, the tokens after the last one in a padded graph are masked too
+            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, 0);
 
-            wstate.use_buf(ctx0, 1);
+            dg.kq_n_past.push_back(KQ_masked->src1);
 
             struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
 
-            wstate.use_buf(ctx0, 0);
-
             struct ggml_tensor * V_trans =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0,
-                            ggml_view_1d(ctx0, kv_self.v, (n_past + N)*n_state, il*n_ctx*ggml_element_size(kv_self.v)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                        ggml_reshape_4d(ctx0,
+                            Vself,
+                            n_state/n_head, n_head, n_kv, B),
                         1, 2, 0, 3);
 
-            wstate.use_buf(ctx0, 1);
-
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
             cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N*B));
         }
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.attn_ln_1_b);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
 
-            wstate.use_buf(ctx0, 1);
-
             // cur = ln_0_w*cur + ln_0_b
             cur = ggml_add(ctx0,
                     ggml_mul(ctx0,
-                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
         }
 
         // cross-attention
         {
-            wstate.use_buf(ctx0, 0);
-
             struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.cross_attn_q_w,
                     cur);
 
             Qcur = ggml_add(ctx0,
-                    ggml_repeat(ctx0,
-                        layer.cross_attn_q_b,
-                        Qcur),
-                    Qcur);
+                    Qcur,
+                    layer.cross_attn_q_b);
+
+            struct ggml_tensor * Vcross =
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
+                        n_state/n_head, n_head, M);
+
+            struct ggml_tensor * V_trans = ggml_permute(ctx0, Vcross, 1, 2, 0, 3);
+
+#ifdef WHISPER_USE_FLASH_ATTN
+            // the keys are stored transposed and unscaled
+            struct ggml_tensor * K =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
+                            M, n_state/n_head, n_head),
+                        1, 0, 2, 3);
 
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_reshape_3d(ctx0,
+                            Qcur,
+                            n_state/n_head, n_head, N*B),
+                        0, 2, 1, 3);
+
+            struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V_trans, false);
+#else
             Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // Kcross is already scaled
@@ -1996,28 +2714,17 @@ static bool whisper_decode_internal(
                         ggml_view_1d(ctx0, wstate.kv_cross.k, M*n_state, il*M*ggml_element_size(wstate.kv_cross.k)*n_state),
                         n_state/n_head, n_head, M);
 
-            struct ggml_tensor * Vcross =
-                ggml_reshape_3d(ctx0,
-                        ggml_view_1d(ctx0, wstate.kv_cross.v, M*n_state, il*M*ggml_element_size(wstate.kv_cross.v)*n_state),
-                        n_state/n_head, n_head, M);
-
-            struct ggml_tensor * V_trans = ggml_permute(ctx0, Vcross, 1, 2, 0, 3);
-
             // ------
 
-            wstate.use_buf(ctx0, 1);
-
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
                         ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N*B)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
-            wstate.use_buf(ctx0, 0);
-
             // K * Q
             struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
@@ -2030,41 +2737,30 @@ static bool whisper_decode_internal(
             // no masking for cross-attention
             //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
-            wstate.use_buf(ctx0, 1);
-
             struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
 
-            wstate.use_buf(ctx0, 0);
-
             struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
-
-            wstate.use_buf(ctx0, 1);
+#endif
 
             struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            // cur = KQV_merged.contiguous().view(n_state, N)
+            // cur = KQV_merged.contiguous().view(n_state, N*B)
             cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N*B));
         }
 
         // projection
         {
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_mul_mat(ctx0,
                     layer.cross_attn_ln_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
-                    cur);
+                    cur,
+                    layer.cross_attn_ln_1_b);
         }
 
-        wstate.use_buf(ctx0, 2);
-
         // add the input
         cur = ggml_add(ctx0, cur, inpCA);
 
@@ -2074,54 +2770,38 @@ static bool whisper_decode_internal(
         {
             // norm
             {
-                wstate.use_buf(ctx0, 0);
-
                 cur = ggml_norm(ctx0, inpFF);
 
-                wstate.use_buf(ctx0, 1);
-
                 // cur = mlp_ln_w*cur + mlp_ln_b
                 cur = ggml_add(ctx0,
                         ggml_mul(ctx0,
-                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
-                            cur),
-                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
             }
 
-            wstate.use_buf(ctx0, 0);
-
             // fully connected
             cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            wstate.use_buf(ctx0, 1);
-
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
-                    cur);
-
-            wstate.use_buf(ctx0, 0);
+                    cur,
+                    layer.mlp_0_b);
 
             // GELU activation
             cur = ggml_gelu(ctx0, cur);
 
-            wstate.use_buf(ctx0, 1);
-
             // projection
             cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            wstate.use_buf(ctx0, 0);
-
             cur = ggml_add(ctx0,
-                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
-                    cur);
+                    cur,
+                    layer.mlp_1_b);
         }
 
-        wstate.use_buf(ctx0, 3);
-
         inpL = ggml_add(ctx0, cur, inpFF);
     }
 
@@ -2129,2639 +2809,6902 @@ static bool whisper_decode_internal(
 
     // norm
     {
-        wstate.use_buf(ctx0, 0);
-
         cur = ggml_norm(ctx0, cur);
 
-        wstate.use_buf(ctx0, 1);
-
         cur = ggml_add(ctx0,
                 ggml_mul(ctx0,
-                    ggml_repeat(ctx0, model.d_ln_w, cur),
-                    cur),
-                ggml_repeat(ctx0, model.d_ln_b, cur));
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
     }
 
-    wstate.use_buf(ctx0, 0);
+    // compute logits only for the last token of each decoder, unless the logits of all N tokens are needed
+    if (N > 1 && !dg.logits_all) {
+        cur = ggml_cpy(ctx0,
+                ggml_view_2d(ctx0, cur, cur->ne[0], B, N*cur->nb[1], (N - 1)*cur->nb[1]),
+                ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, B));
+    }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all N tokens
-    // might be useful in the future
-    cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    dg.logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    ggml_build_forward_expand(&dg.gf, dg.logits);
+}
 
-    wstate.use_buf(ctx0, -1);
+// fills in the inputs of a decoder graph: the new tokens of the decoders and their positions, the rows of the K and V of
+// all tokens in the cache and n_past of the masks, and points the stores of the new K and V rows to the given runs
+static void whisper_decode_graph_set_inputs(
+           whisper_state & wstate,
+    whisper_decode_graph & dg,
+    whisper_decoder * const * decoders,
+     const whisper_token * tokens,
+    const std::vector<whisper_kv_run> & kv_runs,
+                     int   n_past) {
+    const auto & kv_pages = wstate.kv_pages;
 
-    // run the computation
-    {
-        ggml_build_forward_expand(&gf, logits);
-        ggml_graph_compute       (ctx0, &gf);
-    }
+    const int N = dg.n_tokens;
+    const int B = dg.n_batch;
 
-    // extract logits for all N tokens
-    //logits_out.resize(N*n_vocab);
-    //memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    const int n_kv   = n_past + N;
+    const int n_page = WHISPER_KV_PAGE_SIZE;
+    const int n_rows = kv_pages.n_pages*n_page; // rows of the KV cache per layer
 
-    // extract logits only for the last token
-    logits_out.resize(n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*n_vocab);
+    memcpy(dg.embd->data, tokens, N*B*ggml_element_size(dg.embd));
 
-    if (N > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1024.0/1024.0,
-        //        wctx.get_buf_max_mem(0)/1024.0/1024.0,
-        //        wctx.get_buf_max_mem(1)/1024.0/1024.0,
-        //        wctx.get_buf_max_mem(2)/1024.0/1024.0,
-        //        wctx.get_buf_max_mem(3)/1024.0/1024.0);
+    for (int i = 0; i < N*B; ++i) {
+        ((int32_t *) dg.position->data)[i] = n_past + i%N;
     }
 
-    ggml_free(ctx0);
+    // the rows of all tokens in the cache, one decoder after the other
+    // the tokens after the last one in a padded graph get the row of the first token, so that they are not garbage
+    if (dg.kv_rows) {
+        for (int ib = 0; ib < B; ++ib) {
+            const auto & pages = decoders[ib]->kv_self.pages;
 
-    wstate.t_decode_us += ggml_time_us() - t_start_us;
-    wstate.n_decode++;
+            int32_t * rows = (int32_t *) dg.kv_rows->data + ib*dg.n_kv;
 
-    return true;
-}
+            for (int j = 0; j < dg.n_kv; ++j) {
+                rows[j] = j < n_kv ? pages[j/n_page]*n_page + j%n_page : rows[0];
+            }
+        }
+    }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+    for (auto * t : dg.kq_n_past) {
+        ggml_set_i32(t, n_past);
+    }
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    const int n_runs = kv_runs.size();
 
-    return std::string(buf);
-}
+    for (int i = 0; i < (int) dg.kv_store.size(); i += 2) {
+        const int    il  = i/(2*n_runs);
+        const auto & run = kv_runs[(i/2) % n_runs];
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+        struct ggml_tensor * k = dg.kv_store[i + 0];
+        struct ggml_tensor * v = dg.kv_store[i + 1];
 
-    out.resize(N*2);
+        // the copy is a view of its destination
+        k->data = k->src1->data = (char *) kv_pages.k->data + kv_pages.k->nb[1]*(il*n_rows + run.row);
+        v->data = v->src1->data = (char *) kv_pages.v->data + kv_pages.v->nb[1]*(il*n_rows + run.row);
+    }
+}
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+// a kept graph refers to the KV caches and the compute buffer of the state, it can't be used once they have moved
+static bool whisper_decode_graph_is_current(const whisper_state & wstate, const whisper_decode_graph & dg) {
+    return dg.kv_self   == wstate.kv_pages.k->data && dg.n_pages == wstate.kv_pages.n_pages &&
+           dg.kv_cross  == wstate.kv_cross.k->data &&
+           dg.buf_alloc == wstate.buf_alloc.data();
+}
 
-        for (int n = 0; n < N; n++) {
-            float angle = 2*M_PI*k*n/N;
-            re += in[n]*cos(angle);
-            im -= in[n]*sin(angle);
+// the graph for n_batch decoders with one new token each and n_kv tokens in the self-attention, kept from an earlier
+// step or built in place of the least recently used graph of the state
+static whisper_decode_graph * whisper_decode_graph_get(
+         whisper_context & wctx,
+           whisper_state & wstate,
+    whisper_decoder * const * decoders,
+    const std::vector<whisper_kv_run> & kv_runs,
+                     int   n_batch,
+                     int   n_kv,
+                     int   n_threads) {
+    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+    whisper_decode_graph * res = nullptr;
+
+    for (auto & dg : wstate.decode_graphs) {
+        if (dg.n_batch == n_batch && dg.n_tokens == 1 && dg.n_kv == n_kv && dg.n_audio_ctx == n_audio_ctx &&
+            dg.n_threads == n_threads && whisper_decode_graph_is_current(wstate, dg)) {
+            res = &dg;
+            break;
         }
-
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    if (res == nullptr) {
+        const int64_t t_start_us = ggml_time_us();
 
-    int N = in.size();
+        res = &wstate.decode_graphs[0];
+        for (auto & dg : wstate.decode_graphs) {
+            if (dg.t_used < res->t_used) {
+                res = &dg;
+            }
+        }
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+        whisper_decode_graph_free(*res);
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
-    }
+        const size_t mem_size = whisper_decode_graph_mem_size(wctx, kv_runs.size());
+        if (res->buf.size() < mem_size) {
+            res->buf.resize(mem_size);
+        }
 
-    std::vector<float> even;
-    std::vector<float> odd;
+        struct ggml_init_params params;
+        params.mem_size   = res->buf.size();
+        params.mem_buffer = res->buf.data();
+        params.no_alloc   = true;
 
-    even.reserve(N/2);
-    odd.reserve(N/2);
+        res->ctx = ggml_init(params);
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
-        }
-    }
+        res->n_tokens    = 1;
+        res->n_batch     = n_batch;
+        res->n_kv        = n_kv;
+        res->n_audio_ctx = n_audio_ctx;
+        res->n_threads   = n_threads;
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+        res->kv_self  = wstate.kv_pages.k->data;
+        res->n_pages  = wstate.kv_pages.n_pages;
+        res->kv_cross = wstate.kv_cross.k->data;
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+        res->gf = {};
 
-    for (int k = 0; k < N/2; k++) {
-        float theta = 2*M_PI*k/N;
+        whisper_decode_graph_build(wctx, wstate, *res, kv_runs, decoders[0]->kv_self, true);
 
-        float re = cos(theta);
-        float im = -sin(theta);
+        res->gf.n_threads = n_threads;
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        whisper_graph_alloc(wstate, res->ctx, res->gf);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        // if the compute buffer has moved to make room for this graph, the other kept graphs are not current any more
+        res->buf_alloc = wstate.buf_alloc.data();
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        wstate.t_decode_build_us += ggml_time_us() - t_start_us;
+        wstate.n_decode_build++;
     }
+
+    res->t_used = ggml_time_us();
+
+    return res;
 }
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
-static bool log_mel_spectrogram(
-          whisper_state & wstate,
-            const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   fft_size,
-              const int   fft_step,
-              const int   n_mel,
-              const int   n_threads,
-  const whisper_filters & filters,
-             const bool   speed_up,
-            whisper_mel & mel) {
-    const int64_t t_start_us = ggml_time_us();
+// are the graphs of steps with n_tokens new tokens kept by the state and computed again for the following steps?
+static bool whisper_decode_graph_keep(const whisper_state & wstate, int n_tokens) {
+    return n_tokens == 1 && wstate.keep_decode_graphs;
+}
 
-    // Hanning window
-    std::vector<float> hann;
-    hann.resize(fft_size);
-    for (int i = 0; i < fft_size; i++) {
-        hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
+// the number of tokens in the self-attention of the decoder graph for n_tokens new tokens and n_kv tokens in total
+// a kept graph is padded to a multiple of WHISPER_DECODE_GRAPH_KV_STEP tokens, so that it serves as many steps
+static int whisper_decode_graph_n_kv(const whisper_context & wctx, const whisper_state & wstate, int n_tokens, int n_kv) {
+    if (!whisper_decode_graph_keep(wstate, n_tokens)) {
+        return n_kv;
     }
 
-    mel.n_mel = n_mel;
-    mel.n_len = (n_samples)/fft_step;
-    mel.data.resize(mel.n_mel*mel.n_len);
+    const int n_step = WHISPER_DECODE_GRAPH_KV_STEP;
 
-    const int n_fft = 1 + (speed_up ? fft_size/4 : fft_size/2);
+    return std::min(wctx.model.hparams.n_text_ctx, (n_kv + n_step - 1)/n_step*n_step);
+}
 
-    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
-    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+// evaluate the decoder for several decoders at once
+//
+// given text prompt + audio features -> computes the logits for the next token of each decoder
+//
+// all decoders are evaluated in one graph: the tokens of all of them go through the weight matrices together and
+// only the self-attention is done per decoder, against its own KV cache
+// the graphs of single-token steps are kept by the state and computed again with new inputs (see whisper_decode_graph)
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - decoders:   the decoders
+//   - tokens:     text prompt of each decoder, one after the other ([n_batch][n_tokens])
+//   - n_tokens:   number of tokens in the prompt of each decoder
+//   - n_past:     number of past tokens to prefix the prompts with, the same for all decoders
+//   - n_batch:    number of decoders
+//   - logits_all: compute the logits of all tokens, not only of the last token of each decoder
+//
+// the logits of decoder i are in row i of wstate.logits, or in rows i*n_tokens ... (i + 1)*n_tokens - 1 with logits_all
+//
+static bool whisper_decode_batch_internal(
+          whisper_context & wctx,
+            whisper_state & wstate,
+  whisper_decoder * const * decoders,
+      const whisper_token * tokens,
+                const int   n_tokens,
+                const int   n_past,
+                const int   n_batch,
+                const int   n_threads,
+               const bool   logits_all = false) {
+    const int64_t t_start_us = ggml_time_us();
 
-    std::vector<std::thread> workers(n_threads);
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw] = std::thread([&](int ith) {
-            std::vector<float> fft_in;
-            fft_in.resize(fft_size);
-            for (int i = 0; i < fft_size; i++) {
-                fft_in[i] = 0.0;
-            }
+    const auto & hparams = wctx.model.hparams;
 
-            std::vector<float> fft_out;
-            fft_out.resize(2*fft_size);
+    auto & kv_pages = wstate.kv_pages;
 
-            for (int i = ith; i < mel.n_len; i += n_threads) {
-                const int offset = i*fft_step;
+    WHISPER_ASSERT(!!kv_pages.ctx);
 
-                // apply Hanning window
-                for (int j = 0; j < fft_size; j++) {
-                    if (offset + j < n_samples) {
-                        fft_in[j] = hann[j]*samples[offset + j];
-                    } else {
-                        fft_in[j] = 0.0;
-                    }
-                }
+    auto & logits_out = wstate.logits;
 
-                // FFT -> mag^2
-                fft(fft_in, fft_out);
+    const int n_vocab = hparams.n_vocab;
 
-                for (int j = 0; j < fft_size; j++) {
-                    fft_out[j] = (fft_out[2*j + 0]*fft_out[2*j + 0] + fft_out[2*j + 1]*fft_out[2*j + 1]);
-                }
-                for (int j = 1; j < fft_size/2; j++) {
-                    //if (i == 0) {
-                    //    printf("%d: %f %f\n", j, fft_out[j], fft_out[fft_size - j]);
-                    //}
-                    fft_out[j] += fft_out[fft_size - j];
-                }
-                if (i == 0) {
-                    //for (int j = 0; j < fft_size; j++) {
-                    //    printf("%d: %e\n", j, fft_out[j]);
-                    //}
-                }
+    const int N = n_tokens;
+    const int B = n_batch;
+    const int M = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-                if (speed_up) {
-                    // scale down in the frequency domain results in a speed up in the time domain
-                    for (int j = 0; j < n_fft; j++) {
-                        fft_out[j] = 0.5*(fft_out[2*j] + fft_out[2*j + 1]);
-                    }
-                }
+    //WHISPER_PRINT_DEBUG("%s: n_past = %d, N = %d, M = %d, n_ctx = %d\n", __func__, n_past, N, M, n_ctx);
 
-                // mel spectrogram
-                for (int j = 0; j < mel.n_mel; j++) {
-                    double sum = 0.0;
+    for (int ib = 0; ib < B; ++ib) {
+        if (!kv_seq_prepare(kv_pages, decoders[ib]->kv_self, n_past, N)) {
+            fprintf(stderr, "%s: out of pages in the self-attention KV cache\n", __func__);
+            return false;
+        }
+    }
 
-                    for (int k = 0; k < n_fft; k++) {
-                        sum += fft_out[k]*filters.data[j*n_fft + k];
-                    }
-                    if (sum < 1e-10) {
-                        sum = 1e-10;
-                    }
+    const int n_kv   = n_past + N;
+    const int n_page = WHISPER_KV_PAGE_SIZE;
 
-                    sum = log10(sum);
+    // a kept graph is computed again for other rows, so it stores each token separately
+    const bool keep = whisper_decode_graph_keep(wstate, N);
 
-                    mel.data[j*mel.n_len + i] = sum;
-                }
-            }
-        }, iw);
-    }
+    // the new tokens are stored in runs of consecutive rows
+    std::vector<whisper_kv_run> kv_runs;
+    for (int ib = 0; ib < B; ++ib) {
+        const auto & pages = decoders[ib]->kv_self.pages;
 
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw].join();
-    }
+        for (int i = n_past; i < n_kv; ++i) {
+            const int row = pages[i/n_page]*n_page + i%n_page;
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+            if (keep || kv_runs.empty() || kv_runs.back().row + kv_runs.back().n != row) {
+                kv_runs.push_back({ ib*N + i - n_past, row, 0 });
+            }
+
+            kv_runs.back().n++;
         }
     }
-    //printf("%s: max = %f\n", __func__, mmax);
 
-    mmax -= 8.0;
+    whisper_decode_graph * dg = &wstate.decode_graph;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
+    if (keep) {
+        dg = whisper_decode_graph_get(wctx, wstate, decoders, kv_runs, B, whisper_decode_graph_n_kv(wctx, wstate, N, n_kv), n_threads);
+    } else {
+        const int64_t t_build_start_us = ggml_time_us();
+
+        // the K and V rows of all tokens are gathered with row indices, unless they are in consecutive pages
+        const auto & pages0 = decoders[0]->kv_self.pages;
+
+        bool consecutive = B == 1;
+        for (int i = 1; consecutive && i*n_page < n_kv; ++i) {
+            consecutive = pages0[i] == pages0[0] + i;
         }
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+        whisper_buf_compute_reserve(wstate, whisper_decode_graph_mem_size(wctx, kv_runs.size()));
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+        struct ggml_init_params params;
+        params.mem_size   = wstate.buf_compute.size();
+        params.mem_buffer = wstate.buf_compute.data();
+        params.no_alloc   = true;
 
-    return true;
-}
+        dg->ctx = ggml_init(params);
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
-//
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+        dg->n_tokens    = N;
+        dg->n_batch     = B;
+        dg->n_kv        = n_kv;
+        dg->n_audio_ctx = M;
+        dg->logits_all  = logits_all;
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+        dg->gf = {};
 
-        std::regex re(pat);
-        std::smatch m;
+        whisper_decode_graph_build(wctx, wstate, *dg, kv_runs, decoders[0]->kv_self, !consecutive);
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
-        }
-    }
+        dg->gf.n_threads = n_threads;
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+        whisper_graph_alloc(wstate, dg->ctx, dg->gf);
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            while (j > i) {
-                auto it = vocab.token_to_id.find(word.substr(i, j-i));
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    break;
-                }
-                --j;
-            }
-            if (i == n) {
-                break;
-            }
-            if (j == i) {
-                auto sub = word.substr(i, 1);
-                if (vocab.token_to_id.find(sub) != vocab.token_to_id.end()) {
-                    tokens.push_back(vocab.token_to_id.at(sub));
-                } else {
-                    fprintf(stderr, "%s: unknown token '%s'\n", __func__, sub.data());
-                }
-                ++i;
-            }
-        }
+        wstate.t_decode_build_us += ggml_time_us() - t_build_start_us;
+        wstate.n_decode_build++;
     }
 
-    return tokens;
-}
+    whisper_decode_graph_set_inputs(wstate, *dg, decoders, tokens, kv_runs, n_past);
 
-//
-// interface implementation
-//
+    // run the computation
+    {
+        const int64_t t_compute_start_us = ggml_time_us();
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    whisper_state * state = new whisper_state;
+        whisper_pool_lease lease(wstate, n_threads);
 
-    const size_t scale = ctx->model.hparams.f16 ? 1 : 2;
+        dg->gf.pool = lease.pool;
 
+        ggml_graph_compute(dg->ctx, &dg->gf);
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_SELF.at(ctx->model.type), state->decoders[0].kv_self, ctx->wtype, ctx->model.hparams.n_text_ctx)) {
-        fprintf(stderr, "%s: kv_cache_init() failed for self-attention cache\n", __func__);
-        return nullptr;
+        wstate.t_decode_compute_us += ggml_time_us() - t_compute_start_us;
     }
 
-    {
-        const size_t memory_size = ggml_nbytes(state->decoders[0].kv_self.k) + ggml_nbytes(state->decoders[0].kv_self.v);
-        fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
+    // extract the logits of all N tokens, or only of the last token of each decoder
+    const int n_logits = dg->logits_all ? N*B : B;
 
-    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->wtype, ctx->model.hparams.n_audio_ctx)) {
-        fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
-        return nullptr;
-    }
+    logits_out.resize(n_logits*n_vocab);
+    memcpy(logits_out.data(), ggml_get_data(dg->logits), sizeof(float)*n_logits*n_vocab);
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        fprintf(stderr, "%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
-    }
+    whisper_decode_graph_free(wstate.decode_graph);
 
+    wstate.t_decode_us += ggml_time_us() - t_start_us;
+    wstate.n_decode++;
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    return true;
+}
 
-    state->logits_id.reserve(ctx->model.hparams.n_vocab);
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+        whisper_decoder & decoder,
+    const whisper_token * tokens,
+              const int   n_tokens,
+              const int   n_past,
+              const int   n_threads,
+             const bool   logits_all = false) {
+    whisper_decoder * decoders[1] = { &decoder };
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+    return whisper_decode_batch_internal(wctx, wstate, decoders, tokens, n_tokens, n_past, 1, n_threads, logits_all);
+}
 
-    state->decoders[0].probs.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve(ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve(ctx->vocab.n_vocab);
-    state->buf_compute.resize(scale * std::max(MEM_REQ_ENCODE.at(ctx->model.type), MEM_REQ_DECODE.at(ctx->model.type)));
+// the number of decoders with n_tokens new tokens that whisper_decode_batch_internal() can evaluate in one graph
+// it is limited by the size of the graph - storing the new K and V rows of a decoder adds a few nodes to each layer
+static int whisper_decode_batch_max(const whisper_context & wctx, int n_tokens) {
+    const int n_layer = wctx.model.hparams.n_text_layer;
 
-    state->buf_scratch[0].resize(MEM_REQ_SCRATCH0.at(ctx->model.type));
-    state->buf_scratch[1].resize(MEM_REQ_SCRATCH1.at(ctx->model.type));
-    state->buf_scratch[2].resize(MEM_REQ_SCRATCH2.at(ctx->model.type));
-    state->buf_scratch[3].resize(MEM_REQ_SCRATCH3.at(ctx->model.type));
+    const int n_nodes_layer = 64; // nodes of a layer, without the stores
+    const int n_nodes_run   = 6;  // nodes of the stores of one run of consecutive rows
+    const int n_runs        = (n_tokens + WHISPER_KV_PAGE_SIZE - 1)/WHISPER_KV_PAGE_SIZE + 1; // runs of a decoder, at most
 
-    state->rng = std::mt19937(0);
+    const int n_max_nodes = ((GGML_MAX_NODES - 64)/n_layer - n_nodes_layer)/(n_nodes_run*n_runs);
 
-    return state;
+    return std::max(1, std::min(WHISPER_MAX_DECODERS, n_max_nodes));
 }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
-    whisper_model_loader loader = {};
+// makes room in the self-attention KV cache for a full sequence of each of n_decoders decoders
+static bool whisper_state_reserve_decoders(whisper_context & wctx, whisper_state & wstate, int n_decoders) {
+    const auto & hparams = wctx.model.hparams;
 
-    fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
+    const int n_text_ctx = hparams.n_text_ctx;
 
-    auto fin = std::ifstream(path_model, std::ios::binary);
-    if (!fin) {
-        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
-    }
+    if (wstate.kv_pages.n_pages < n_decoders*((n_text_ctx + WHISPER_KV_PAGE_SIZE - 1)/WHISPER_KV_PAGE_SIZE) + 1) {
+        for (int j = 0; j < WHISPER_MAX_DECODERS; j++) {
+            kv_seq_release(wstate.kv_pages, wstate.decoders[j].kv_self);
+        }
 
-    loader.context = &fin;
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+        kv_seq_release(wstate.kv_pages, wstate.prompt_cache.kv);
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+        if (!kv_pages_init(hparams, wstate.kv_pages, wctx.itype, n_text_ctx, n_decoders)) {
+            fprintf(stderr, "%s: kv_pages_init() failed for self-attention, %d decoders\n", __func__, n_decoders);
+            return false;
+        }
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+        WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, %d decoders\n", __func__, n_decoders);
+    }
 
-    return whisper_init_no_state(&loader);
+    return true;
 }
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
+// the peak memory of the tensors of the encoder graph for one utterance with the full audio context, as planned for
+// n_threads threads
+static size_t whisper_encode_alloc_size(whisper_context & wctx, whisper_state & wstate, int n_threads) {
+    std::vector<uint8_t> buf(whisper_encode_graph_mem_size(wctx, 1));
 
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
-    whisper_model_loader loader = {};
+    struct ggml_init_params params;
+    params.mem_size   = buf.size();
+    params.mem_buffer = buf.data();
+    params.no_alloc   = true;
 
-    fprintf(stderr, "%s: loading model from buffer\n", __func__);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-    loader.context = &ctx;
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+    whisper_state * states[1] = { &wstate };
+    std::vector<struct ggml_tensor *> mels;
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+    whisper_encode_graph_build(wctx, states, 1, ctx0, gf, mels);
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
+    const size_t size = ggml_graph_alloc(ctx0, &gf, nullptr);
 
-        return size_to_copy;
-    };
+    ggml_free(ctx0);
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+    return size;
+}
 
-        return buf->current_offset >= buf->size;
-    };
+// the peak memory of the tensors of the decoder graph for n_batch decoders with n_tokens new tokens each and n_kv
+// tokens in the self-attention, as planned for n_threads threads
+// the K and V rows of the self-attention are gathered, which needs more memory than using them in place
+static size_t whisper_decode_alloc_size(whisper_context & wctx, whisper_state & wstate, int n_tokens, int n_batch, int n_kv, int n_threads) {
+    std::vector<whisper_kv_run> kv_runs;
+    for (int ib = 0; ib < n_batch; ++ib) {
+        kv_runs.push_back({ ib*n_tokens, 0, n_tokens });
+    }
 
-    loader.close = [](void * /*ctx*/) { };
+    whisper_decode_graph dg;
 
-    return whisper_init_no_state(&loader);
-}
+    dg.buf.resize(whisper_decode_graph_mem_size(wctx, kv_runs.size()));
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    ggml_time_init();
+    struct ggml_init_params params;
+    params.mem_size   = dg.buf.size();
+    params.mem_buffer = dg.buf.data();
+    params.no_alloc   = true;
 
-    whisper_context * ctx = new whisper_context;
+    dg.ctx = ggml_init(params);
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        fprintf(stderr, "%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
-    }
+    dg.n_tokens    = n_tokens;
+    dg.n_batch     = n_batch;
+    dg.n_kv        = n_kv;
+    dg.n_audio_ctx = wctx.model.hparams.n_audio_ctx;
 
-    loader->close(loader->context);
+    whisper_decode_graph_build(wctx, wstate, dg, kv_runs, wstate.decoders[0].kv_self, true);
 
-    return ctx;
+    dg.gf.n_threads = n_threads;
+
+    const size_t size = ggml_graph_alloc(dg.ctx, &dg.gf, nullptr);
+
+    whisper_decode_graph_free(dg);
+
+    return size;
 }
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
-    if (!ctx) {
-        return nullptr;
+// the size of the compute buffer of a state (see whisper_graph_alloc) for graphs of n_threads threads: the largest of
+// the encoder, the decoder for the longest prompt of whisper_full() and a step of n_decoders decoders at the end of the
+// text context
+static size_t whisper_state_alloc_size(whisper_context & wctx, whisper_state & wstate, int n_decoders, int n_threads, size_t * mem_encode = nullptr, size_t * mem_decode = nullptr) {
+    const int n_text_ctx = wctx.model.hparams.n_text_ctx;
+
+    const int n_batch = std::min(n_decoders, whisper_decode_batch_max(wctx, 1));
+
+    const size_t size_encode = whisper_encode_alloc_size(wctx, wstate, n_threads);
+    const size_t size_decode = std::max(
+            whisper_decode_alloc_size(wctx, wstate, n_text_ctx/2, 1, n_text_ctx/2, n_threads),
+            whisper_decode_alloc_size(wctx, wstate, 1, n_batch, n_text_ctx, n_threads));
+
+    if (mem_encode) {
+        *mem_encode = size_encode;
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    if (mem_decode) {
+        *mem_decode = size_decode;
     }
 
-    return ctx;
+    return std::max(size_encode, size_decode);
 }
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
-    if (!ctx) {
-        return nullptr;
-    }
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
-    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
 
-    return ctx;
+    return std::string(buf);
 }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    whisper_context * ctx = whisper_init_no_state(loader);
-    if (!ctx) {
-        return nullptr;
+// build the plan for a real FFT of size n
+//
+// the complex transform is a self-sorting (Stockham) mixed-radix FFT, with radix 4, 2, 3 and 5 stages
+// and a generic stage for any other prime factor, so that the 400- and 800-point Whisper frames don't
+// need a slow DFT and no bit-reversal permutation is needed
+static void whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    plan.n = n;
+    plan.m = n % 2 == 0 ? n/2 : n;
+
+    plan.factors.clear();
+    plan.twiddles.clear();
+    plan.twiddles_r.clear();
+
+    int r = plan.m;
+    while (r % 4 == 0) {
+        plan.factors.push_back(4);
+        r /= 4;
     }
-
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    for (int p = 2; r > 1; ) {
+        if (r % p == 0) {
+            plan.factors.push_back(p);
+            r /= p;
+        } else {
+            p++;
+        }
     }
 
-    return ctx;
-}
-
-void whisper_free_state(struct whisper_state * state)
-{
-    if (state) {
-        kv_cache_free(state->kv_cross);
+    int L = 1;
+    for (int p : plan.factors) {
+        for (int s = 1; s < p; s++) {
+            for (int j = 0; j < L; j++) {
+                const double angle = -2.0*M_PI*s*j/(L*p);
+                plan.twiddles.push_back(cos(angle));
+                plan.twiddles.push_back(sin(angle));
+            }
+        }
 
-        for (int i = 0; i < WHISPER_MAX_DECODERS; ++i) {
-            kv_cache_free(state->decoders[i].kv_self);
+        // the generic stage also needs the p-th roots of unity
+        if (p > 5) {
+            for (int i = 0; i < p; i++) {
+                const double angle = -2.0*M_PI*i/p;
+                plan.twiddles.push_back(cos(angle));
+                plan.twiddles.push_back(sin(angle));
+            }
         }
 
-        delete state;
+        L *= p;
     }
-}
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        if (ctx->model.ctx) {
-            ggml_free(ctx->model.ctx);
-        }
-        if (ctx->model.buf) {
-            delete ctx->model.buf;
+    if (n % 2 == 0) {
+        for (int k = 0; k <= n/2; k++) {
+            const double angle = -2.0*M_PI*k/n;
+            plan.twiddles_r.push_back(cos(angle));
+            plan.twiddles_r.push_back(sin(angle));
         }
+    }
+}
 
-        whisper_free_state(ctx->state);
+// one stage of the complex transform:
+//   x holds r1*p interleaved sub-transforms of size L, y receives r1 sub-transforms of size L*p
+//   y[k][j + L*q] = sum_s w_p^(s*q) * (w_(L*p)^(s*j) * x[k + s*r1][j])
 
-        delete ctx;
+static void whisper_fft_radix2(const float * x, float * y, const float * tw, int L, int r1) {
+    for (int k = 0; k < r1; k++) {
+        const float * x0 = x + 2*L*k;
+        const float * x1 = x + 2*L*(k + r1);
+
+        float * y0 = y + 2*L*2*k;
+        float * y1 = y0 + 2*L;
+
+        for (int j = 0; j < L; j++) {
+            const float a0r = x0[2*j + 0];
+            const float a0i = x0[2*j + 1];
+
+            const float a1r = x1[2*j + 0]*tw[2*j + 0] - x1[2*j + 1]*tw[2*j + 1];
+            const float a1i = x1[2*j + 0]*tw[2*j + 1] + x1[2*j + 1]*tw[2*j + 0];
+
+            y0[2*j + 0] = a0r + a1r;
+            y0[2*j + 1] = a0i + a1i;
+            y1[2*j + 0] = a0r - a1r;
+            y1[2*j + 1] = a0i - a1i;
+        }
     }
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
-        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+static void whisper_fft_radix3(const float * x, float * y, const float * tw, int L, int r1) {
+    const float * tw1 = tw;
+    const float * tw2 = tw + 2*L;
+
+    const float s3 = 0.866025403784438647f; // sin(2*pi/3)
+
+    for (int k = 0; k < r1; k++) {
+        const float * x0 = x + 2*L*k;
+        const float * x1 = x + 2*L*(k + r1);
+        const float * x2 = x + 2*L*(k + 2*r1);
+
+        float * y0 = y + 2*L*3*k;
+        float * y1 = y0 + 2*L;
+        float * y2 = y0 + 4*L;
+
+        for (int j = 0; j < L; j++) {
+            const float a0r = x0[2*j + 0];
+            const float a0i = x0[2*j + 1];
+
+            const float a1r = x1[2*j + 0]*tw1[2*j + 0] - x1[2*j + 1]*tw1[2*j + 1];
+            const float a1i = x1[2*j + 0]*tw1[2*j + 1] + x1[2*j + 1]*tw1[2*j + 0];
+            const float a2r = x2[2*j + 0]*tw2[2*j + 0] - x2[2*j + 1]*tw2[2*j + 1];
+            const float a2i = x2[2*j + 0]*tw2[2*j + 1] + x2[2*j + 1]*tw2[2*j + 0];
+
+            const float tr = a1r + a2r;
+            const float ti = a1i + a2i;
+            const float mr = a0r - 0.5f*tr;
+            const float mi = a0i - 0.5f*ti;
+            const float dr = s3*(a1r - a2r);
+            const float di = s3*(a1i - a2i);
+
+            y0[2*j + 0] = a0r + tr;
+            y0[2*j + 1] = a0i + ti;
+            y1[2*j + 0] = mr + di;
+            y1[2*j + 1] = mi - dr;
+            y2[2*j + 0] = mr - di;
+            y2[2*j + 1] = mi + dr;
+        }
     }
-
-    return 0;
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+static void whisper_fft_radix4(const float * x, float * y, const float * tw, int L, int r1) {
+    const float * tw1 = tw;
+    const float * tw2 = tw + 2*L;
+    const float * tw3 = tw + 4*L;
+
+    for (int k = 0; k < r1; k++) {
+        const float * x0 = x + 2*L*k;
+        const float * x1 = x + 2*L*(k + r1);
+        const float * x2 = x + 2*L*(k + 2*r1);
+        const float * x3 = x + 2*L*(k + 3*r1);
+
+        float * y0 = y + 2*L*4*k;
+        float * y1 = y0 + 2*L;
+        float * y2 = y0 + 4*L;
+        float * y3 = y0 + 6*L;
+
+        for (int j = 0; j < L; j++) {
+            const float a0r = x0[2*j + 0];
+            const float a0i = x0[2*j + 1];
+
+            const float a1r = x1[2*j + 0]*tw1[2*j + 0] - x1[2*j + 1]*tw1[2*j + 1];
+            const float a1i = x1[2*j + 0]*tw1[2*j + 1] + x1[2*j + 1]*tw1[2*j + 0];
+            const float a2r = x2[2*j + 0]*tw2[2*j + 0] - x2[2*j + 1]*tw2[2*j + 1];
+            const float a2i = x2[2*j + 0]*tw2[2*j + 1] + x2[2*j + 1]*tw2[2*j + 0];
+            const float a3r = x3[2*j + 0]*tw3[2*j + 0] - x3[2*j + 1]*tw3[2*j + 1];
+            const float a3i = x3[2*j + 0]*tw3[2*j + 1] + x3[2*j + 1]*tw3[2*j + 0];
+
+            const float s02r = a0r + a2r;
+            const float s02i = a0i + a2i;
+            const float d02r = a0r - a2r;
+            const float d02i = a0i - a2i;
+            const float s13r = a1r + a3r;
+            const float s13i = a1i + a3i;
+            const float d13r = a1r - a3r;
+            const float d13i = a1i - a3i;
+
+            // w_4 = -i
+            y0[2*j + 0] = s02r + s13r;
+            y0[2*j + 1] = s02i + s13i;
+            y1[2*j + 0] = d02r + d13i;
+            y1[2*j + 1] = d02i - d13r;
+            y2[2*j + 0] = s02r - s13r;
+            y2[2*j + 1] = s02i - s13i;
+            y3[2*j + 0] = d02r - d13i;
+            y3[2*j + 1] = d02i + d13r;
+        }
+    }
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
-int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
-        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
+static void whisper_fft_radix5(const float * x, float * y, const float * tw, int L, int r1) {
+    const float * tw1 = tw;
+    const float * tw2 = tw + 2*L;
+    const float * tw3 = tw + 4*L;
+    const float * tw4 = tw + 6*L;
+
+    const float c1 =  0.309016994374947424f; // cos(2*pi/5)
+    const float c2 = -0.809016994374947424f; // cos(4*pi/5)
+    const float s1 =  0.951056516295153572f; // sin(2*pi/5)
+    const float s2 =  0.587785252292473129f; // sin(4*pi/5)
+
+    for (int k = 0; k < r1; k++) {
+        const float * x0 = x + 2*L*k;
+        const float * x1 = x + 2*L*(k + r1);
+        const float * x2 = x + 2*L*(k + 2*r1);
+        const float * x3 = x + 2*L*(k + 3*r1);
+        const float * x4 = x + 2*L*(k + 4*r1);
+
+        float * y0 = y + 2*L*5*k;
+        float * y1 = y0 + 2*L;
+        float * y2 = y0 + 4*L;
+        float * y3 = y0 + 6*L;
+        float * y4 = y0 + 8*L;
+
+        for (int j = 0; j < L; j++) {
+            const float a0r = x0[2*j + 0];
+            const float a0i = x0[2*j + 1];
+
+            const float a1r = x1[2*j + 0]*tw1[2*j + 0] - x1[2*j + 1]*tw1[2*j + 1];
+            const float a1i = x1[2*j + 0]*tw1[2*j + 1] + x1[2*j + 1]*tw1[2*j + 0];
+            const float a2r = x2[2*j + 0]*tw2[2*j + 0] - x2[2*j + 1]*tw2[2*j + 1];
+            const float a2i = x2[2*j + 0]*tw2[2*j + 1] + x2[2*j + 1]*tw2[2*j + 0];
+            const float a3r = x3[2*j + 0]*tw3[2*j + 0] - x3[2*j + 1]*tw3[2*j + 1];
+            const float a3i = x3[2*j + 0]*tw3[2*j + 1] + x3[2*j + 1]*tw3[2*j + 0];
+            const float a4r = x4[2*j + 0]*tw4[2*j + 0] - x4[2*j + 1]*tw4[2*j + 1];
+            const float a4i = x4[2*j + 0]*tw4[2*j + 1] + x4[2*j + 1]*tw4[2*j + 0];
+
+            const float b1r = a1r + a4r;
+            const float b1i = a1i + a4i;
+            const float b2r = a2r + a3r;
+            const float b2i = a2i + a3i;
+            const float d1r = a1r - a4r;
+            const float d1i = a1i - a4i;
+            const float d2r = a2r - a3r;
+            const float d2i = a2i - a3i;
+
+            const float m1r = a0r + c1*b1r + c2*b2r;
+            const float m1i = a0i + c1*b1i + c2*b2i;
+            const float m2r = a0r + c2*b1r + c1*b2r;
+            const float m2i = a0i + c2*b1i + c1*b2i;
+
+            // -i*(e1) and -i*(e2)
+            const float e1r = s1*d1r + s2*d2r;
+            const float e1i = s1*d1i + s2*d2i;
+            const float e2r = s2*d1r - s1*d2r;
+            const float e2i = s2*d1i - s1*d2i;
+
+            y0[2*j + 0] = a0r + b1r + b2r;
+            y0[2*j + 1] = a0i + b1i + b2i;
+            y1[2*j + 0] = m1r + e1i;
+            y1[2*j + 1] = m1i - e1r;
+            y4[2*j + 0] = m1r - e1i;
+            y4[2*j + 1] = m1i + e1r;
+            y2[2*j + 0] = m2r + e2i;
+            y2[2*j + 1] = m2i - e2r;
+            y3[2*j + 0] = m2r - e2i;
+            y3[2*j + 1] = m2i + e2r;
+        }
     }
-
-    return 0;
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+// any other radix, O(p^2) per butterfly
+static void whisper_fft_radix_generic(const float * x, float * y, const float * tw, int L, int r1, int p) {
+    const float * roots = tw + 2*(p - 1)*L;
+
+    for (int k = 0; k < r1; k++) {
+        for (int j = 0; j < L; j++) {
+            for (int q = 0; q < p; q++) {
+                float sr = 0.0f;
+                float si = 0.0f;
+
+                for (int s = 0; s < p; s++) {
+                    const float * xs = x + 2*(L*(k + s*r1) + j);
+
+                    float ar = xs[0];
+                    float ai = xs[1];
+                    if (s > 0) {
+                        const float * w = tw + 2*((s - 1)*L + j);
+                        const float tr = ar*w[0] - ai*w[1];
+                        ai = ar*w[1] + ai*w[0];
+                        ar = tr;
+                    }
 
-int whisper_set_mel_with_state(
-        struct whisper_context * /*ctx*/,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != WHISPER_N_MEL) {
-        fprintf(stderr, "%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
-        return -1;
+                    const float * w = roots + 2*((s*q) % p);
+                    sr += ar*w[0] - ai*w[1];
+                    si += ar*w[1] + ai*w[0];
+                }
+
+                y[2*(L*p*k + j + L*q) + 0] = sr;
+                y[2*(L*p*k + j + L*q) + 1] = si;
+            }
+        }
     }
+}
 
-    state->mel.n_len = n_len;
-    state->mel.n_mel = n_mel;
+// complex FFT of plan.m interleaved re/im values, ping-ponging between buf0 and buf1 (2*plan.m floats each)
+// src may be one of the buffers; returns the one holding the result
+static const float * whisper_fft_complex(const whisper_fft_plan & plan, const float * src, float * buf0, float * buf1) {
+    const float * tw = plan.twiddles.data();
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    int L = 1;
+    for (int p : plan.factors) {
+        float * dst = src == buf0 ? buf1 : buf0;
 
-    return 0;
-}
+        const int r1 = plan.m/(L*p);
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+        switch (p) {
+            case 2:  whisper_fft_radix2(src, dst, tw, L, r1); break;
+            case 3:  whisper_fft_radix3(src, dst, tw, L, r1); break;
+            case 4:  whisper_fft_radix4(src, dst, tw, L, r1); break;
+            case 5:  whisper_fft_radix5(src, dst, tw, L, r1); break;
+            default: whisper_fft_radix_generic(src, dst, tw, L, r1, p); break;
+        }
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
-        fprintf(stderr, "%s: failed to eval\n", __func__);
-        return -1;
+        tw += 2*(p - 1)*L + (p > 5 ? 2*p : 0);
+        L  *= p;
+
+        src = dst;
     }
 
-    return 0;
+    return src;
 }
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
-        fprintf(stderr, "%s: failed to eval\n", __func__);
-        return -1;
-    }
+// FFT of plan.n real values
+// out receives the complex spectrum for k = 0..n/2, as n/2 + 1 interleaved re/im pairs
+// work must hold 4*plan.m floats
+static void whisper_fft(const whisper_fft_plan & plan, const float * in, float * out, float * work) {
+    const int n = plan.n;
+    const int m = plan.m;
 
-    return 0;
-}
+    float * buf0 = work;
+    float * buf1 = work + 2*m;
 
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    const int selected_decoder_id = 0;
+    if (n % 2 == 1) {
+        for (int i = 0; i < n; i++) {
+            buf0[2*i + 0] = in[i];
+            buf0[2*i + 1] = 0.0f;
+        }
 
-    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        fprintf(stderr, "%s: failed to eval\n", __func__);
-        return 1;
+        const float * z = whisper_fft_complex(plan, buf0, buf0, buf1);
+        memcpy(out, z, 2*(n/2 + 1)*sizeof(float));
+        return;
     }
 
-    return 0;
-}
+    // the even and odd samples are the real and imaginary parts of a half-size complex transform z
+    // X[k] = (z[k] + conj(z[m - k]))/2 - i*w_n^k*(z[k] - conj(z[m - k]))/2
+    const float * z = whisper_fft_complex(plan, in, buf0, buf1);
+    const float * w = plan.twiddles_r.data();
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    // TODO: add selected_decoder_id to state
-    const int selected_decoder_id = 0;
+    for (int k = 0; k <= m; k++) {
+        const int k0 = k == m ? 0 : k;
+        const int k1 = k == 0 ? 0 : m - k;
 
-    if (ctx->state == nullptr) {
-        fprintf(stderr, "%s: ERROR state was not loaded.\n", __func__);
-        return false;
-    }
+        const float zr =  z[2*k0 + 0];
+        const float zi =  z[2*k0 + 1];
+        const float cr =  z[2*k1 + 0];
+        const float ci = -z[2*k1 + 1];
 
+        const float er = 0.5f*(zr + cr);
+        const float ei = 0.5f*(zi + ci);
+        const float or_ =  0.5f*(zi - ci);
+        const float oi  = -0.5f*(zr - cr);
 
-    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
-        fprintf(stderr, "%s: failed to eval\n", __func__);
-        return 1;
+        out[2*k + 0] = er + w[2*k + 0]*or_ - w[2*k + 1]*oi;
+        out[2*k + 1] = ei + w[2*k + 0]*oi  + w[2*k + 1]*or_;
     }
-
-    return 0;
 }
 
-int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
-    const auto res = tokenize(ctx->vocab, text);
+// dot product for the mel filterbank
+static float whisper_vec_dot_f32(const int n, const float * x, const float * y) {
+    int i = 0;
+    float sum = 0.0f;
 
-    if (n_max_tokens < (int) res.size()) {
-        fprintf(stderr, "%s: too many resulting tokens: %d (max %d)\n", __func__, (int) res.size(), n_max_tokens);
-        return -1;
+#if defined(__AVX__)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+#if defined(__FMA__)
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc);
+#else
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+#endif
     }
 
-    for (int i = 0; i < (int) res.size(); i++) {
-        tokens[i] = res[i];
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_add_ps(acc4, _mm_movehl_ps(acc4, acc4));
+    acc4 = _mm_add_ss(acc4, _mm_movehdup_ps(acc4));
+    sum = _mm_cvtss_f32(acc4);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vmlaq_f32(acc, vld1q_f32(x + i), vld1q_f32(y + i));
     }
 
-    return res.size();
-}
+    sum = vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1) + vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#endif
 
-int whisper_lang_max_id() {
-    auto max_id = 0;
-    for (const auto & kv : g_lang) {
-        max_id = std::max(max_id, kv.second.first);
+    for (; i < n; i++) {
+        sum += x[i]*y[i];
     }
 
-    return max_id;
+    return sum;
 }
 
-int whisper_lang_id(const char * lang) {
-    if (!g_lang.count(lang)) {
-        for (const auto & kv : g_lang) {
-            if (kv.second.second == lang) {
-                return kv.second.first;
-            }
-        }
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
+static bool log_mel_spectrogram(
+          whisper_state & wstate,
+            const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   fft_size,
+              const int   fft_step,
+              const int   n_mel,
+              const int   n_threads,
+  const whisper_filters & filters,
+             const bool   speed_up,
+            whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
 
-        fprintf(stderr, "%s: unknown language '%s'\n", __func__, lang);
-        return -1;
+    const int n_fft = 1 + (speed_up ? fft_size/4 : fft_size/2);
+
+    if (filters.n_mel != n_mel || filters.n_fft != n_fft) {
+        fprintf(stderr, "%s: mel filters are %d x %d, expected %d x %d\n", __func__, filters.n_mel, filters.n_fft, n_mel, n_fft);
+        return false;
     }
 
-    return g_lang.at(lang).first;
-}
+    whisper_mel_cache & cache = wstate.mel_cache;
 
-const char * whisper_lang_str(int id) {
-    for (const auto & kv : g_lang) {
-        if (kv.second.first == id) {
-            return kv.first.c_str();
+    if (cache.fft_size != fft_size) {
+        cache.fft_size = fft_size;
+
+        whisper_fft_plan_init(cache.fft, fft_size);
+
+        // Hanning window
+        cache.hann.resize(fft_size);
+        for (int i = 0; i < fft_size; i++) {
+            cache.hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
         }
     }
 
-    fprintf(stderr, "%s: unknown language id %d\n", __func__, id);
-    return nullptr;
-}
+    const whisper_fft_plan   & plan = cache.fft;
+    const std::vector<float> & hann = cache.hann;
 
-int whisper_lang_auto_detect_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    const int seek = offset_ms/10;
+    mel.n_mel = n_mel;
+    mel.n_len = (n_samples)/fft_step;
+    mel.data.resize(mel.n_mel*mel.n_len);
 
-    if (seek < 0) {
-        fprintf(stderr, "%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
-        return -1;
-    }
+    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
+    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
 
-    if (seek >= state->mel.n_len) {
-        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len*10);
-        return -2;
-    }
+    const int n_workers = std::max(1, n_threads);
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
-        fprintf(stderr, "%s: failed to encode\n", __func__);
-        return -6;
-    }
+    auto worker = [&](int ith) {
+        std::vector<float> fft_in(fft_size, 0.0f);
+        std::vector<float> fft_out(2*(fft_size/2 + 1));
+        std::vector<float> fft_work(4*plan.m);
+        std::vector<float> power(fft_size/2 + 2);
 
-    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+        for (int i = ith; i < mel.n_len; i += n_workers) {
+            const int offset = i*fft_step;
 
-    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
-        fprintf(stderr, "%s: failed to decode\n", __func__);
-        return -7;
-    }
+            // apply Hanning window
+            const int n_in = std::max(0, std::min(fft_size, n_samples - offset));
+            for (int j = 0; j < n_in; j++) {
+                fft_in[j] = hann[j]*samples[offset + j];
+            }
+            for (int j = n_in; j < fft_size; j++) {
+                fft_in[j] = 0.0f;
+            }
 
-    auto & logits_id = state->logits_id;
-    logits_id.clear();
+            // FFT -> mag^2
+            whisper_fft(plan, fft_in.data(), fft_out.data(), fft_work.data());
 
-    for (const auto & kv : g_lang) {
-        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
-    }
+            for (int j = 0; j <= fft_size/2; j++) {
+                power[j] = fft_out[2*j + 0]*fft_out[2*j + 0] + fft_out[2*j + 1]*fft_out[2*j + 1];
+            }
 
-    // sort descending
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+            // fold in the negative frequencies
+            // bin n/2 + 1 is only read by the speed-up below, it is the unfolded mirror of bin (n - 1)/2
+            power[fft_size/2 + 1] = power[(fft_size - 1)/2];
+            for (int j = 1; j < fft_size/2; j++) {
+                power[j] *= 2.0f;
+            }
 
-    // softmax
-    {
-        const auto max = logits_id[0].first;
+            if (speed_up) {
+                // scale down in the frequency domain results in a speed up in the time domain
+                for (int j = 0; j < n_fft; j++) {
+                    power[j] = 0.5*(power[2*j] + power[2*j + 1]);
+                }
+            }
 
-        double sum = 0.0f;
-        for (auto & kv : logits_id) {
-            kv.first = exp(kv.first - max);
-            sum += kv.first;
-        }
+            // mel spectrogram
+            for (int j = 0; j < mel.n_mel; j++) {
+                const int beg = filters.beg[j];
+                const int end = filters.end[j];
 
-        for (auto & kv : logits_id) {
-            kv.first /= sum;
-        }
-    }
+                double sum = whisper_vec_dot_f32(end - beg, power.data() + beg, filters.data.data() + j*n_fft + beg);
+                if (sum < 1e-10) {
+                    sum = 1e-10;
+                }
 
-    {
-        for (const auto & prob : logits_id) {
-            if (lang_probs) {
-                lang_probs[prob.second] = prob.first;
-            }
+                sum = log10(sum);
 
-            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+                mel.data[j*mel.n_len + i] = sum;
+            }
         }
-    }
-
-    return logits_id[0].second;
-}
+    };
 
-int whisper_lang_auto_detect(
-        struct whisper_context * ctx,
-                           int   offset_ms,
-                           int   n_threads,
-                         float * lang_probs) {
-    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
-}
+    std::vector<std::thread> workers(n_workers - 1);
+    for (int iw = 0; iw < n_workers - 1; ++iw) {
+        workers[iw] = std::thread(worker, iw + 1);
+    }
 
-int whisper_model_n_vocab(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_vocab;
-}
+    worker(0);
 
-int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+    for (int iw = 0; iw < n_workers - 1; ++iw) {
+        workers[iw].join();
+    }
 
-int whisper_model_n_audio_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_state;
-}
+    // clamping and normalization
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
+    }
+    //printf("%s: max = %f\n", __func__, mmax);
 
-int whisper_model_n_audio_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_head;
-}
+    mmax -= 8.0;
 
-int whisper_model_n_audio_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_layer;
-}
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
+        }
 
-int whisper_model_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
 
-int whisper_model_n_text_state(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_state;
-}
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
 
-int whisper_model_n_text_head(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_head;
+    return true;
 }
 
-int whisper_model_n_text_layer(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_layer;
-}
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+// the words are split by hand, with the same result as the C++ regex in the "C" locale (letters and digits are
+// ASCII, the bytes of other UTF-8 characters are neither), and the tokens are found in the trie of the vocab
+// nothing is allocated
 
-int whisper_model_n_mels(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_mels;
-}
+static bool whisper_is_alpha(uint8_t c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static bool whisper_is_digit(uint8_t c) { return c >= '0' && c <= '9'; }
+static bool whisper_is_space(uint8_t c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
 
-int whisper_model_f16(struct whisper_context * ctx) {
-    return ctx->model.hparams.f16;
-}
+// end of the word that starts at text[i]
+static int whisper_pretokenize(const char * text, int n, int i) {
+    const auto at = [&](int k) { return k < n ? (uint8_t) text[k] : 0; };
 
-int whisper_model_type(struct whisper_context * ctx) {
-    return ctx->model.type;
-}
+    // 's|'t|'re|'ve|'m|'ll|'d
+    if (at(i) == '\'') {
+        const uint8_t c0 = at(i + 1);
+        const uint8_t c1 = at(i + 2);
 
-const char *whisper_model_type_readable(struct whisper_context * ctx) {
-    switch (ctx->model.type) {
-    case e_model::MODEL_TINY:
-        return "tiny";
-    case e_model::MODEL_BASE:
-        return "base";
-    case e_model::MODEL_SMALL:
-        return "small";
-    case e_model::MODEL_MEDIUM:
-        return "medium";
-    case e_model::MODEL_LARGE:
-        return "large";
-    default:
-        return "unknown";
+        if (c0 == 's' || c0 == 't' || c0 == 'm' || c0 == 'd') {
+            return i + 2;
+        }
+        if ((c0 == 'r' && c1 == 'e') || (c0 == 'v' && c1 == 'e') || (c0 == 'l' && c1 == 'l')) {
+            return i + 3;
+        }
     }
-}
 
-int whisper_n_len_from_state(struct whisper_state * state) {
-    return state->mel.n_len;
-}
+    //  ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+
+    {
+        int j = at(i) == ' ' ? i + 1 : i;
 
-int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->state->mel.n_len;
-}
+        if (j < n) {
+            const uint8_t c = at(j);
 
-int whisper_n_vocab(struct whisper_context * ctx) {
-    return ctx->vocab.n_vocab;
-}
+            if (whisper_is_alpha(c)) {
+                while (j < n && whisper_is_alpha(at(j))) j++;
+                return j;
+            }
+            if (whisper_is_digit(c)) {
+                while (j < n && whisper_is_digit(at(j))) j++;
+                return j;
+            }
+            if (!whisper_is_space(c)) {
+                while (j < n && !whisper_is_space(at(j)) && !whisper_is_alpha(at(j)) && !whisper_is_digit(at(j))) j++;
+                return j;
+            }
+        }
+    }
 
-int whisper_n_text_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_text_ctx;
-}
+    // \s+(?!\S)|\s+ - the whitespace before a word, except the last character, which goes with the word
+    int j = i;
+    while (j < n && whisper_is_space(at(j))) j++;
 
-int whisper_n_audio_ctx(struct whisper_context * ctx) {
-    return ctx->model.hparams.n_audio_ctx;
-}
+    if (j < n && j - 1 > i) {
+        return j - 1;
+    }
 
-int whisper_is_multilingual(struct whisper_context * ctx) {
-    return ctx->vocab.is_multilingual() ? 1 : 0;
+    return std::max(j, i + 1);
 }
 
-float * whisper_get_logits(struct whisper_context * ctx) {
-    return ctx->state->logits.data();
-}
+// longest token at the start of text[0, n), -1 if none - len is set to its length
+static whisper_vocab::id whisper_trie_match(const whisper_trie & trie, const char * text, int n, int & len) {
+    const int32_t n_nodes = trie.check.size();
 
+    whisper_vocab::id id = -1;
 
-float * whisper_get_logits_from_state(struct whisper_state * state) {
-    return state->logits.data();
-}
+    int32_t s = 0;
+    for (int i = 0; i < n; ++i) {
+        const int32_t t = trie.base[s] + (uint8_t) text[i];
+        if (t >= n_nodes || trie.check[t] != s) {
+            break;
+        }
 
-const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
-    return ctx->vocab.id_to_token.at(token).c_str();
-}
+        s = t;
+        if (trie.value[s] >= 0) {
+            id  = trie.value[s];
+            len = i + 1;
+        }
+    }
 
-whisper_token whisper_token_eot(struct whisper_context * ctx) {
-    return ctx->vocab.token_eot;
+    return id;
 }
 
-whisper_token whisper_token_sot(struct whisper_context * ctx) {
-    return ctx->vocab.token_sot;
-}
+// returns the number of tokens of the text - only the first n_max_tokens are stored
+static int tokenize(const whisper_vocab & vocab, const char * text, whisper_vocab::id * tokens, int n_max_tokens) {
+    const int n = strlen(text);
 
-whisper_token whisper_token_prev(struct whisper_context * ctx) {
-    return ctx->vocab.token_prev;
-}
+    int n_tokens = 0;
 
-whisper_token whisper_token_solm(struct whisper_context * ctx) {
-    return ctx->vocab.token_solm;
-}
+    for (int i = 0; i < n; ) {
+        const int i_end = whisper_pretokenize(text, n, i);
 
-whisper_token whisper_token_not(struct whisper_context * ctx) {
-    return ctx->vocab.token_not;
-}
+        // find the longest tokens that form the word
+        while (i < i_end) {
+            int len = 1;
+            const whisper_vocab::id id = whisper_trie_match(vocab.trie, text + i, i_end - i, len);
 
-whisper_token whisper_token_beg(struct whisper_context * ctx) {
-    return ctx->vocab.token_beg;
-}
+            if (id >= 0) {
+                if (n_tokens < n_max_tokens) {
+                    tokens[n_tokens] = id;
+                }
+                n_tokens++;
+            } else {
+                fprintf(stderr, "%s: unknown token '%.*s'\n", __func__, 1, text + i);
+            }
 
-whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
-    return whisper_token_sot(ctx) + 1 + lang_id;
-}
+            i += len;
+        }
+    }
 
-whisper_token whisper_token_translate(void) {
-    return whisper_vocab::token_translate;
+    return n_tokens;
 }
 
-whisper_token whisper_token_transcribe(void) {
-    return whisper_vocab::token_transcribe;
-}
+//
+// interface implementation
+//
 
-void whisper_print_timings(struct whisper_context * ctx) {
-    const int64_t t_end_us = ggml_time_us();
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
 
-    fprintf(stderr, "\n");
-    fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
-    if (ctx->state != nullptr) {
+    const size_t scale = whisper_itype_scale(ctx->itype);
 
-        const int32_t n_sample = std::max(1, ctx->state->n_sample);
-        const int32_t n_encode = std::max(1, ctx->state->n_encode);
-        const int32_t n_decode = std::max(1, ctx->state->n_decode);
 
-        fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
-        fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
-        fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
-        fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
-        fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+    // room for one decoder, whisper_full() adds pages for more decoders when it needs them
+    if (!kv_pages_init(ctx->model.hparams, state->kv_pages, ctx->itype, ctx->model.hparams.n_text_ctx, 1)) {
+        fprintf(stderr, "%s: kv_pages_init() failed for self-attention cache\n", __func__);
+        return nullptr;
     }
-    fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
-}
 
-void whisper_reset_timings(struct whisper_context * ctx) {
-    if (ctx->state != nullptr) {
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_pages.k) + ggml_nbytes(state->kv_pages.v);
+        fprintf(stderr, "%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
     }
-}
 
-const char * whisper_print_system_info(void) {
-    static std::string s;
+    if (!kv_cache_init(ctx->model.hparams, scale * MEM_REQ_KV_CROSS.at(ctx->model.type), state->kv_cross, ctx->itype, ctx->model.hparams.n_audio_ctx)) {
+        fprintf(stderr, "%s: kv_cache_init() failed for cross-attention cache\n", __func__);
+        return nullptr;
+    }
 
-    s  = "";
-    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
-    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
-    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
-    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
-    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
-    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
-    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
-    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
-    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
-    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
-    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
-    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        fprintf(stderr, "%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+    }
 
-    return s.c_str();
-}
 
-////////////////////////////////////////////////////////////////////////////
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
 
-struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
-    struct whisper_full_params result = {
-        /*.strategy         =*/ strategy,
+    state->logits_id.reserve(ctx->model.hparams.n_vocab);
+    state->tokens_topk.reserve(WHISPER_MAX_DECODERS);
 
-        /*.n_threads        =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
-        /*.n_max_text_ctx   =*/ 16384,
-        /*.offset_ms        =*/ 0,
-        /*.duration_ms      =*/ 0,
+    state->prompt_cache.tokens.reserve(ctx->model.hparams.n_text_ctx);
+    state->prompt_cache.logits.reserve(ctx->vocab.n_vocab);
 
-        /*.translate        =*/ false,
-        /*.no_context       =*/ true,
-        /*.single_segment   =*/ false,
-        /*.print_special    =*/ false,
-        /*.print_progress   =*/ true,
-        /*.print_realtime   =*/ false,
-        /*.print_timestamps =*/ true,
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
 
-        /*.token_timestamps =*/ false,
-        /*.thold_pt         =*/ 0.01f,
-        /*.thold_ptsum      =*/ 0.01f,
-        /*.max_len          =*/ 0,
-        /*.split_on_word    =*/ false,
-        /*.max_tokens       =*/ 0,
+    state->decoders[0].probs.resize(ctx->vocab.n_vocab);
+    state->decoders[0].logits.resize(ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.resize(ctx->vocab.n_vocab);
 
-        /*.speed_up         =*/ false,
-        /*.audio_ctx        =*/ 0,
+    // the compute buffer of the graphs, for the default number of threads of whisper_full_params
+    // it grows if a graph needs more - e.g. for more threads or several decoders at once
+    {
+        const int n_threads = std::min(4, (int32_t) std::thread::hardware_concurrency());
 
-        /*.prompt_tokens    =*/ nullptr,
-        /*.prompt_n_tokens  =*/ 0,
+        size_t mem_encode = 0;
+        size_t mem_decode = 0;
 
-        /*.language         =*/ "en",
+        state->buf_alloc.resize(whisper_state_alloc_size(*ctx, *state, 1, n_threads, &mem_encode, &mem_decode));
+
+        fprintf(stderr, "%s: compute buffer = %7.2f MB (encode %7.2f MB, decode %7.2f MB)\n", __func__,
+                state->buf_alloc.size()/1024.0/1024.0, mem_encode/1024.0/1024.0, mem_decode/1024.0/1024.0);
+    }
+
+    state->rng = std::mt19937(0);
+
+    return state;
+}
+
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    whisper_model_loader loader = {};
+
+    fprintf(stderr, "%s: loading model from '%s'\n", __func__, path_model);
+
+    auto fin = std::ifstream(path_model, std::ios::binary);
+    if (!fin) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    loader.context = &fin;
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    return whisper_init_no_state(&loader);
+}
+
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+    whisper_model_loader loader = {};
+
+    fprintf(stderr, "%s: loading model from buffer\n", __func__);
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_no_state(&loader);
+}
+
+struct whisper_context * whisper_init_from_mapped_buffer_no_state(const void * data, size_t size) {
+    ggml_time_init();
+
+    fprintf(stderr, "%s: loading model from mapped buffer\n", __func__);
+
+    whisper_model_reader reader;
+    reader.mapped      = (const uint8_t *) data;
+    reader.mapped_size = size;
+
+    whisper_context * ctx = new whisper_context;
+
+    if (!whisper_model_load(reader, *ctx)) {
+        fprintf(stderr, "%s: failed to load model\n", __func__);
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    ggml_time_init();
+
+    whisper_model_reader reader;
+    reader.loader = loader;
+
+    whisper_context * ctx = new whisper_context;
+
+    if (!whisper_model_load(reader, *ctx)) {
+        loader->close(loader->context);
+        fprintf(stderr, "%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    whisper_context * ctx = whisper_init_from_file_no_state(path_model);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    whisper_context * ctx = whisper_init_from_buffer_no_state(buffer, buffer_size);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_mapped_buffer(const void * data, size_t size) {
+    whisper_context * ctx = whisper_init_from_mapped_buffer_no_state(data, size);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    whisper_context * ctx = whisper_init_no_state(loader);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+void whisper_free_state(struct whisper_state * state)
+{
+    if (state) {
+        kv_cache_free(state->kv_cross);
+        kv_pages_free(state->kv_pages);
+
+        for (auto & dg : state->decode_graphs) {
+            whisper_decode_graph_free(dg);
+        }
+
+        ggml_threadpool_free(state->threadpool);
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        if (ctx->model.ctx) {
+            ggml_free(ctx->model.ctx);
+        }
+        if (ctx->model.buf) {
+            delete ctx->model.buf;
+        }
+
+        whisper_free_state(ctx->state);
+
+        delete ctx;
+    }
+}
+
+// helpers for whisper_model_quantize() and whisper_model_align()
+
+// copies the magic, hparams, mel filters and vocab of a model file - the output always has aligned tensor data
+// ftype_inp receives the ftype of the input, ftype_out is written in its place unless it is negative
+static bool whisper_model_copy_header(std::ifstream & finp, std::ofstream & fout, bool & aligned_inp, int32_t & ftype_inp, int32_t ftype_out) {
+    // magic
+    {
+        uint32_t magic = 0;
+        finp.read((char *) &magic, sizeof(magic));
+        if (magic != WHISPER_FILE_MAGIC && magic != WHISPER_FILE_MAGIC_ALIGNED) {
+            return false;
+        }
+
+        aligned_inp = magic == WHISPER_FILE_MAGIC_ALIGNED;
+
+        const uint32_t magic_out = WHISPER_FILE_MAGIC_ALIGNED;
+        fout.write((char *) &magic_out, sizeof(magic_out));
+    }
+
+    // hparams - everything up to the ftype is copied unchanged
+    {
+        int32_t hparams[10];
+
+        finp.read((char *) hparams,    sizeof(hparams));
+        finp.read((char *) &ftype_inp, sizeof(ftype_inp));
+
+        if (ftype_out < 0) {
+            ftype_out = ftype_inp;
+        }
+
+        fout.write((char *) hparams,    sizeof(hparams));
+        fout.write((char *) &ftype_out, sizeof(ftype_out));
+    }
+
+    // mel filters
+    {
+        int32_t n_mel;
+        int32_t n_fft;
+
+        finp.read((char *) &n_mel, sizeof(n_mel));
+        finp.read((char *) &n_fft, sizeof(n_fft));
+
+        std::vector<float> filters(n_mel*n_fft);
+        finp.read((char *) filters.data(), filters.size()*sizeof(float));
+
+        fout.write((char *) &n_mel, sizeof(n_mel));
+        fout.write((char *) &n_fft, sizeof(n_fft));
+        fout.write((char *) filters.data(), filters.size()*sizeof(float));
+    }
+
+    // vocab
+    {
+        int32_t n_vocab;
+        finp.read ((char *) &n_vocab, sizeof(n_vocab));
+        fout.write((char *) &n_vocab, sizeof(n_vocab));
+
+        std::vector<char> word;
+
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            finp.read ((char *) &len, sizeof(len));
+            fout.write((char *) &len, sizeof(len));
+
+            word.resize(len);
+            finp.read (word.data(), len);
+            fout.write(word.data(), len);
+        }
+    }
+
+    return (bool) finp;
+}
+
+// the padding before the data of each tensor in aligned model files
+static void whisper_model_skip_padding(std::ifstream & finp) {
+    const size_t offset = (size_t) finp.tellg();
+    finp.seekg((WHISPER_FILE_ALIGNMENT - offset % WHISPER_FILE_ALIGNMENT) % WHISPER_FILE_ALIGNMENT, std::ios::cur);
+}
+
+static void whisper_model_write_padding(std::ofstream & fout) {
+    static const char zeros[WHISPER_FILE_ALIGNMENT] = { 0 };
+
+    const size_t offset = (size_t) fout.tellp();
+    fout.write(zeros, (WHISPER_FILE_ALIGNMENT - offset % WHISPER_FILE_ALIGNMENT) % WHISPER_FILE_ALIGNMENT);
+}
+
+int whisper_model_align(const char * fname_inp, const char * fname_out) {
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp);
+        return 1;
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out);
+        return 1;
+    }
+
+    bool aligned_inp = false;
+
+    // everything but the magic is copied unchanged
+    {
+        int32_t ftype_inp = 0;
+
+        if (!whisper_model_copy_header(finp, fout, aligned_inp, ftype_inp, -1)) {
+            fprintf(stderr, "%s: invalid model file '%s'\n", __func__, fname_inp);
+            return 1;
+        }
+    }
+
+    size_t total_size = 0;
+    int    n_tensors  = 0;
+
+    std::vector<uint8_t> data;
+
+    while (true) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        finp.read((char *) &n_dims, sizeof(n_dims));
+        finp.read((char *) &length, sizeof(length));
+        finp.read((char *) &ttype,  sizeof(ttype));
+
+        if (finp.eof()) {
+            break;
+        }
+
+        int32_t nelements = 1;
+        int32_t ne[3] = { 1, 1, 1 };
+        for (int i = 0; i < n_dims; ++i) {
+            finp.read((char *) &ne[i], sizeof(ne[i]));
+            nelements *= ne[i];
+        }
+
+        std::string name(length, 0);
+        finp.read(&name[0], length);
+
+        ggml_type type;
+        if (!whisper_ttype_to_type(ttype, type)) {
+            fprintf(stderr, "%s: tensor '%s' has unsupported type %d\n", __func__, name.c_str(), ttype);
+            return 1;
+        }
+
+        if (aligned_inp) {
+            whisper_model_skip_padding(finp);
+        }
+
+        data.resize((nelements*ggml_type_size(type))/ggml_blck_size(type));
+        finp.read((char *) data.data(), data.size());
+
+        fout.write((char *) &n_dims, sizeof(n_dims));
+        fout.write((char *) &length, sizeof(length));
+        fout.write((char *) &ttype,  sizeof(ttype));
+        for (int i = 0; i < n_dims; ++i) {
+            fout.write((char *) &ne[i], sizeof(ne[i]));
+        }
+        fout.write(name.data(), length);
+        whisper_model_write_padding(fout);
+        fout.write((char *) data.data(), data.size());
+
+        total_size += data.size();
+        n_tensors++;
+    }
+
+    fprintf(stderr, "%s: aligned %d tensors, %.2f MB, to %d bytes\n", __func__, n_tensors, total_size/1024.0/1024.0, WHISPER_FILE_ALIGNMENT);
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_model_quantize(const char * fname_inp, const char * fname_out, enum whisper_ftype ftype) {
+    ggml_type qtype;
+    if (!whisper_ftype_to_wtype(ftype, qtype) || !ggml_is_quantized(qtype)) {
+        fprintf(stderr, "%s: invalid quantization type %d\n", __func__, ftype);
+        return 1;
+    }
+
+    // ggml_init() sets up the FP16 conversion tables
+    {
+        struct ggml_init_params params = { 1024, NULL, false };
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_free(ctx);
+    }
+
+    auto finp = std::ifstream(fname_inp, std::ios::binary);
+    if (!finp) {
+        fprintf(stderr, "%s: failed to open '%s' for reading\n", __func__, fname_inp);
+        return 1;
+    }
+
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, fname_out);
+        return 1;
+    }
+
+    bool aligned_inp = false;
+
+    // hparams, mel filters and vocab are copied unchanged, except for the ftype
+    {
+        int32_t ftype_inp = 0;
+
+        if (!whisper_model_copy_header(finp, fout, aligned_inp, ftype_inp, GGML_QNT_VERSION*GGML_QNT_VERSION_FACTOR + ftype)) {
+            fprintf(stderr, "%s: invalid model file '%s'\n", __func__, fname_inp);
+            return 1;
+        }
+
+        if (ftype_inp != WHISPER_FTYPE_ALL_F32 && ftype_inp != WHISPER_FTYPE_MOSTLY_F16) {
+            fprintf(stderr, "%s: input model must be F32 or F16, got ftype %d\n", __func__, ftype_inp);
+            return 1;
+        }
+    }
+
+    // weights
+    {
+        size_t total_size_inp = 0;
+        size_t total_size_out = 0;
+
+        // sums of squares of the quantization error and of the weights, over all quantized tensors
+        double total_err = 0.0;
+        double total_ref = 0.0;
+
+        std::vector<uint8_t> data_inp;
+        std::vector<uint8_t> data_out;
+        std::vector<float>   data_f32;
+        std::vector<float>   data_deq;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            finp.read((char *) &n_dims, sizeof(n_dims));
+            finp.read((char *) &length, sizeof(length));
+            finp.read((char *) &ttype,  sizeof(ttype));
+
+            if (finp.eof()) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[3] = { 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                finp.read((char *) &ne[i], sizeof(ne[i]));
+                nelements *= ne[i];
+            }
+
+            std::string name(length, 0);
+            finp.read(&name[0], length);
+
+            ggml_type type;
+            if (!whisper_ttype_to_type(ttype, type) || (type != GGML_TYPE_F32 && type != GGML_TYPE_F16)) {
+                fprintf(stderr, "%s: tensor '%s' has unsupported type %d\n", __func__, name.c_str(), ttype);
+                return 1;
+            }
+
+            if (aligned_inp) {
+                whisper_model_skip_padding(finp);
+            }
+
+            data_inp.resize(nelements*ggml_type_size(type));
+            finp.read((char *) data_inp.data(), data_inp.size());
+
+            // the 2D weight matrices are quantized and the conv weights are stored as F16 - see whisper_model_load()
+            ggml_type type_out = type;
+            if (n_dims == 2 && ne[0] % ggml_blck_size(qtype) == 0 &&
+                name != "encoder.positional_embedding" && name != "decoder.positional_embedding") {
+                type_out = qtype;
+            } else if (n_dims == 3) {
+                type_out = GGML_TYPE_F16;
+            }
+
+            double err = 0.0;
+            double ref = 0.0;
+
+            if (type_out == type) {
+                data_out = data_inp;
+            } else {
+                data_f32.resize(nelements);
+                if (type == GGML_TYPE_F16) {
+                    const ggml_fp16_t * src = (const ggml_fp16_t *) data_inp.data();
+                    for (int i = 0; i < nelements; ++i) {
+                        data_f32[i] = ggml_fp16_to_fp32(src[i]);
+                    }
+                } else {
+                    memcpy(data_f32.data(), data_inp.data(), nelements*sizeof(float));
+                }
+
+                data_out.resize(nelements*ggml_type_size(type_out)/ggml_blck_size(type_out));
+                data_deq.resize(nelements);
+
+                if (type_out == GGML_TYPE_F16) {
+                    ggml_fp16_t * dst = (ggml_fp16_t *) data_out.data();
+                    for (int i = 0; i < nelements; ++i) {
+                        dst[i] = ggml_fp32_to_fp16(data_f32[i]);
+                        data_deq[i] = ggml_fp16_to_fp32(dst[i]);
+                    }
+                } else {
+                    ggml_quantize  (type_out, data_f32.data(), data_out.data(), nelements);
+                    ggml_dequantize(type_out, data_out.data(), data_deq.data(), nelements);
+                }
+
+                for (int i = 0; i < nelements; ++i) {
+                    const double d = data_f32[i] - data_deq[i];
+                    err += d*d;
+                    ref += (double) data_f32[i]*data_f32[i];
+                }
+
+                if (type_out == qtype) {
+                    total_err += err;
+                    total_ref += ref;
+                }
+            }
+
+            const int32_t ttype_out = whisper_type_to_ttype(type_out);
+
+            fout.write((char *) &n_dims,    sizeof(n_dims));
+            fout.write((char *) &length,    sizeof(length));
+            fout.write((char *) &ttype_out, sizeof(ttype_out));
+            for (int i = 0; i < n_dims; ++i) {
+                fout.write((char *) &ne[i], sizeof(ne[i]));
+            }
+            fout.write(name.data(), length);
+            whisper_model_write_padding(fout);
+            fout.write((char *) data_out.data(), data_out.size());
+
+            fprintf(stderr, "%48s - [%5d, %5d, %5d], %4s -> %4s, %7.2f MB -> %7.2f MB, rms err = %.5f\n",
+                    name.c_str(), ne[0], ne[1], ne[2], ggml_type_name(type), ggml_type_name(type_out),
+                    data_inp.size()/1024.0/1024.0, data_out.size()/1024.0/1024.0, ref > 0.0 ? sqrt(err/ref) : 0.0);
+
+            total_size_inp += data_inp.size();
+            total_size_out += data_out.size();
+        }
+
+        fprintf(stderr, "%s: model size  = %8.2f MB\n", __func__, total_size_inp/1024.0/1024.0);
+        fprintf(stderr, "%s: quant size  = %8.2f MB (%s)\n", __func__, total_size_out/1024.0/1024.0, ggml_type_name(qtype));
+        fprintf(stderr, "%s: rms err     = %.5f (relative, over the quantized weights)\n", __func__, total_ref > 0.0 ? sqrt(total_err/total_ref) : 0.0);
+    }
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, fname_out);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, state->mel)) {
+        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
+int whisper_pcm_to_mel_phase_vocoder_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, 2 * WHISPER_N_FFT, 2 * WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, state->mel)) {
+        fprintf(stderr, "%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
+int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_phase_vocoder_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != WHISPER_N_MEL) {
+        fprintf(stderr, "%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
+        return -1;
+    }
+
+    state->mel.n_len = n_len;
+    state->mel.n_mel = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+// =================================================================================================
+
+//
+// Batched encoder
+//
+
+struct whisper_encoder_batcher {
+    whisper_context * ctx = nullptr;
+
+    int max_batch   = 1;
+    int max_wait_ms = 0;
+    int n_threads   = 1;
+
+    // compute buffers and threads of the batched graphs
+    // only one batch is computed at a time
+    whisper_state * wbatch = nullptr;
+    std::mutex      compute_mutex;
+
+    struct request {
+        whisper_state * state;
+        int             offset;
+        int64_t         t_deadline_us; // encode by then, even if the batch is not full
+
+        bool done;
+        bool ok;
+    };
+
+    std::mutex              mutex;
+    std::condition_variable cond;      // new requests, or shutdown
+    std::condition_variable cond_done; // a batch has been encoded
+
+    std::vector<request *> queue;
+    bool shutdown = false;
+
+    std::thread worker;
+};
+
+static int whisper_encoder_n_ctx(const whisper_context & ctx, const whisper_state & state) {
+    return state.exp_n_audio_ctx > 0 ? state.exp_n_audio_ctx : ctx.model.hparams.n_audio_ctx;
+}
+
+static bool whisper_encode_batch_locked(whisper_encoder_batcher & batcher, whisper_state * const * states, const int * offsets, int n_batch) {
+    std::lock_guard<std::mutex> lock(batcher.compute_mutex);
+
+    return whisper_encode_batch_internal(*batcher.ctx, *batcher.wbatch, states, offsets, n_batch, batcher.n_threads);
+}
+
+// forms the batches of whisper_encoder_batcher_encode()
+static void whisper_encoder_batcher_run(whisper_encoder_batcher * batcher) {
+    std::unique_lock<std::mutex> lock(batcher->mutex);
+
+    std::vector<whisper_encoder_batcher::request *> batch;
+    std::vector<whisper_state *> states;
+    std::vector<int>             offsets;
+
+    while (true) {
+        batcher->cond.wait(lock, [&] { return batcher->shutdown || !batcher->queue.empty(); });
+
+        if (batcher->queue.empty()) {
+            break;
+        }
+
+        // wait for a full batch, but not past the deadline of the oldest request
+        const int64_t t_deadline_us = batcher->queue.front()->t_deadline_us;
+
+        while (!batcher->shutdown && (int) batcher->queue.size() < batcher->max_batch) {
+            const int64_t t_now_us = ggml_time_us();
+            if (t_now_us >= t_deadline_us) {
+                break;
+            }
+
+            batcher->cond.wait_for(lock, std::chrono::microseconds(t_deadline_us - t_now_us));
+        }
+
+        // the oldest request, and the next ones with the same audio context
+        const int n_ctx = whisper_encoder_n_ctx(*batcher->ctx, *batcher->queue.front()->state);
+
+        batch.clear();
+        for (auto it = batcher->queue.begin(); it != batcher->queue.end() && (int) batch.size() < batcher->max_batch; ) {
+            if (whisper_encoder_n_ctx(*batcher->ctx, *(*it)->state) == n_ctx) {
+                batch.push_back(*it);
+                it = batcher->queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        lock.unlock();
+
+        states.clear();
+        offsets.clear();
+        for (auto * req : batch) {
+            states.push_back(req->state);
+            offsets.push_back(req->offset);
+        }
+
+        const bool ok = whisper_encode_batch_locked(*batcher, states.data(), offsets.data(), (int) batch.size());
+
+        lock.lock();
+
+        for (auto * req : batch) {
+            req->done = true;
+            req->ok   = ok;
+        }
+
+        batcher->cond_done.notify_all();
+    }
+}
+
+struct whisper_encoder_batcher * whisper_encoder_batcher_init(struct whisper_context * ctx, int max_batch, int max_wait_ms, int n_threads) {
+    if (max_batch <= 0) {
+        fprintf(stderr, "%s: invalid max_batch = %d\n", __func__, max_batch);
+        return nullptr;
+    }
+
+    whisper_encoder_batcher * batcher = new whisper_encoder_batcher;
+
+    batcher->ctx         = ctx;
+    batcher->max_batch   = max_batch;
+    batcher->max_wait_ms = std::max(0, max_wait_ms);
+    batcher->n_threads   = std::max(1, n_threads);
+
+    // the compute buffers grow with the batches that are encoded (see whisper_graph_alloc)
+    batcher->wbatch = new whisper_state;
+
+    batcher->worker = std::thread(whisper_encoder_batcher_run, batcher);
+
+    return batcher;
+}
+
+void whisper_encoder_batcher_free(struct whisper_encoder_batcher * batcher) {
+    if (batcher) {
+        {
+            std::lock_guard<std::mutex> lock(batcher->mutex);
+            batcher->shutdown = true;
+        }
+        batcher->cond.notify_all();
+
+        batcher->worker.join();
+
+        whisper_free_state(batcher->wbatch);
+
+        delete batcher;
+    }
+}
+
+int whisper_encode_batch(
+        struct whisper_encoder_batcher * batcher,
+          struct whisper_state * const * states,
+                           const int   * offsets,
+                                   int   n_batch) {
+    if (n_batch <= 0 || n_batch > batcher->max_batch) {
+        fprintf(stderr, "%s: n_batch = %d, must be between 1 and %d\n", __func__, n_batch, batcher->max_batch);
+        return -1;
+    }
+
+    for (int i = 1; i < n_batch; ++i) {
+        if (whisper_encoder_n_ctx(*batcher->ctx, *states[i]) != whisper_encoder_n_ctx(*batcher->ctx, *states[0])) {
+            fprintf(stderr, "%s: all states of a batch must use the same audio context\n", __func__);
+            return -2;
+        }
+    }
+
+    if (!whisper_encode_batch_locked(*batcher, states, offsets, n_batch)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -3;
+    }
+
+    return 0;
+}
+
+int whisper_encoder_batcher_encode(
+        struct whisper_encoder_batcher * batcher,
+                  struct whisper_state * state,
+                                   int   offset) {
+    whisper_encoder_batcher::request req = { state, offset, ggml_time_us() + 1000ll*batcher->max_wait_ms, false, false };
+
+    std::unique_lock<std::mutex> lock(batcher->mutex);
+
+    batcher->queue.push_back(&req);
+    batcher->cond.notify_one();
+
+    batcher->cond_done.wait(lock, [&] { return req.done; });
+
+    if (!req.ok) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    const int selected_decoder_id = 0;
+
+    if (!whisper_decode_internal(*ctx, *state, state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    // TODO: add selected_decoder_id to state
+    const int selected_decoder_id = 0;
+
+    if (ctx->state == nullptr) {
+        fprintf(stderr, "%s: ERROR state was not loaded.\n", __func__);
+        return false;
+    }
+
+
+    if (!whisper_decode_internal(*ctx, *ctx->state, ctx->state->decoders[selected_decoder_id], tokens, n_tokens, n_past, n_threads)) {
+        fprintf(stderr, "%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
+
+int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
+    const int n_tokens = tokenize(ctx->vocab, text, tokens, n_max_tokens);
+
+    if (n_max_tokens < n_tokens) {
+        fprintf(stderr, "%s: too many resulting tokens: %d (max %d)\n", __func__, n_tokens, n_max_tokens);
+        return -1;
+    }
+
+    return n_tokens;
+}
+
+int whisper_lang_max_id() {
+    auto max_id = 0;
+    for (const auto & kv : g_lang) {
+        max_id = std::max(max_id, kv.second.first);
+    }
+
+    return max_id;
+}
+
+int whisper_lang_id(const char * lang) {
+    if (!g_lang.count(lang)) {
+        for (const auto & kv : g_lang) {
+            if (kv.second.second == lang) {
+                return kv.second.first;
+            }
+        }
+
+        fprintf(stderr, "%s: unknown language '%s'\n", __func__, lang);
+        return -1;
+    }
+
+    return g_lang.at(lang).first;
+}
+
+const char * whisper_lang_str(int id) {
+    for (const auto & kv : g_lang) {
+        if (kv.second.first == id) {
+            return kv.first.c_str();
+        }
+    }
+
+    fprintf(stderr, "%s: unknown language id %d\n", __func__, id);
+    return nullptr;
+}
+
+int whisper_lang_auto_detect_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    const int seek = offset_ms/10;
+
+    if (seek < 0) {
+        fprintf(stderr, "%s: offset %dms is before the start of the audio\n", __func__, offset_ms);
+        return -1;
+    }
+
+    if (seek >= state->mel.n_len) {
+        fprintf(stderr, "%s: offset %dms is past the end of the audio (%dms)\n", __func__, offset_ms, state->mel.n_len*10);
+        return -2;
+    }
+
+    // run the encoder
+    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+        fprintf(stderr, "%s: failed to encode\n", __func__);
+        return -6;
+    }
+
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx) };
+
+    if (whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads) != 0) {
+        fprintf(stderr, "%s: failed to decode\n", __func__);
+        return -7;
+    }
+
+    auto & logits_id = state->logits_id;
+    logits_id.clear();
+
+    for (const auto & kv : g_lang) {
+        const auto token_lang = whisper_token_lang(ctx, kv.second.first);
+        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+    }
+
+    // sort descending
+    {
+        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
+        std::sort(logits_id.begin(), logits_id.end(), [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        });
+    }
+
+    // softmax
+    {
+        const auto max = logits_id[0].first;
+
+        double sum = 0.0f;
+        for (auto & kv : logits_id) {
+            kv.first = exp(kv.first - max);
+            sum += kv.first;
+        }
+
+        for (auto & kv : logits_id) {
+            kv.first /= sum;
+        }
+    }
+
+    {
+        for (const auto & prob : logits_id) {
+            if (lang_probs) {
+                lang_probs[prob.second] = prob.first;
+            }
+
+            //printf("%s: lang %2d (%3s): %f\n", __func__, prob.second, whisper_lang_str(prob.second), prob.first);
+        }
+    }
+
+    return logits_id[0].second;
+}
+
+int whisper_lang_auto_detect(
+        struct whisper_context * ctx,
+                           int   offset_ms,
+                           int   n_threads,
+                         float * lang_probs) {
+    return whisper_lang_auto_detect_with_state(ctx, ctx->state, offset_ms, n_threads, lang_probs);
+}
+
+int whisper_model_n_vocab(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_vocab;
+}
+
+int whisper_model_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_model_n_audio_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_state;
+}
+
+int whisper_model_n_audio_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_head;
+}
+
+int whisper_model_n_audio_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_layer;
+}
+
+int whisper_model_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_model_n_text_state(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_state;
+}
+
+int whisper_model_n_text_head(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_head;
+}
+
+int whisper_model_n_text_layer(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_layer;
+}
+
+int whisper_model_n_mels(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_mels;
+}
+
+int whisper_model_f16(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype == WHISPER_FTYPE_MOSTLY_F16;
+}
+
+int whisper_model_ftype(struct whisper_context * ctx) {
+    return ctx->model.hparams.ftype;
+}
+
+int whisper_model_type(struct whisper_context * ctx) {
+    return ctx->model.type;
+}
+
+const char *whisper_model_type_readable(struct whisper_context * ctx) {
+    switch (ctx->model.type) {
+    case e_model::MODEL_TINY:
+        return "tiny";
+    case e_model::MODEL_BASE:
+        return "base";
+    case e_model::MODEL_SMALL:
+        return "small";
+    case e_model::MODEL_MEDIUM:
+        return "medium";
+    case e_model::MODEL_LARGE:
+        return "large";
+    default:
+        return "unknown";
+    }
+}
+
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len;
+}
+
+int whisper_n_len(struct whisper_context * ctx) {
+    return ctx->state->mel.n_len;
+}
+
+int whisper_n_vocab(struct whisper_context * ctx) {
+    return ctx->vocab.n_vocab;
+}
+
+int whisper_n_text_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_text_ctx;
+}
+
+int whisper_n_audio_ctx(struct whisper_context * ctx) {
+    return ctx->model.hparams.n_audio_ctx;
+}
+
+int whisper_is_multilingual(struct whisper_context * ctx) {
+    return ctx->vocab.is_multilingual() ? 1 : 0;
+}
+
+float * whisper_get_logits(struct whisper_context * ctx) {
+    return ctx->state->logits.data();
+}
+
+
+float * whisper_get_logits_from_state(struct whisper_state * state) {
+    return state->logits.data();
+}
+
+const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
+    return ctx->vocab.id_to_token.at(token).c_str();
+}
+
+whisper_token whisper_token_eot(struct whisper_context * ctx) {
+    return ctx->vocab.token_eot;
+}
+
+whisper_token whisper_token_sot(struct whisper_context * ctx) {
+    return ctx->vocab.token_sot;
+}
+
+whisper_token whisper_token_prev(struct whisper_context * ctx) {
+    return ctx->vocab.token_prev;
+}
+
+whisper_token whisper_token_solm(struct whisper_context * ctx) {
+    return ctx->vocab.token_solm;
+}
+
+whisper_token whisper_token_not(struct whisper_context * ctx) {
+    return ctx->vocab.token_not;
+}
+
+whisper_token whisper_token_beg(struct whisper_context * ctx) {
+    return ctx->vocab.token_beg;
+}
+
+whisper_token whisper_token_lang(struct whisper_context * ctx, int lang_id) {
+    return whisper_token_sot(ctx) + 1 + lang_id;
+}
+
+whisper_token whisper_token_translate(void) {
+    return whisper_vocab::token_translate;
+}
+
+whisper_token whisper_token_transcribe(void) {
+    return whisper_vocab::token_transcribe;
+}
+
+void whisper_print_timings(struct whisper_context * ctx) {
+    const int64_t t_end_us = ggml_time_us();
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us / 1000.0f);
+    if (ctx->state != nullptr) {
+
+        const int32_t n_sample = std::max(1, ctx->state->n_sample);
+        const int32_t n_encode = std::max(1, ctx->state->n_encode);
+        const int32_t n_decode = std::max(1, ctx->state->n_decode);
+
+        fprintf(stderr, "%s:     fallbacks = %3d p / %3d h\n", __func__, ctx->state->n_fail_p, ctx->state->n_fail_h);
+        fprintf(stderr, "%s:      mel time = %8.2f ms\n", __func__, ctx->state->t_mel_us / 1000.0f);
+        fprintf(stderr, "%s:   sample time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_sample_us, n_sample, 1e-3f * ctx->state->t_sample_us / n_sample);
+        fprintf(stderr, "%s:   encode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_encode_us, n_encode, 1e-3f * ctx->state->t_encode_us / n_encode);
+        fprintf(stderr, "%s:   decode time = %8.2f ms / %5d runs (%8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
+        fprintf(stderr, "%s:    - building = %8.2f ms / %5d graphs, computing = %8.2f ms, other = %8.2f ms\n", __func__,
+                1e-3f * ctx->state->t_decode_build_us, ctx->state->n_decode_build, 1e-3f * ctx->state->t_decode_compute_us,
+                1e-3f * (ctx->state->t_decode_us - ctx->state->t_decode_build_us - ctx->state->t_decode_compute_us));
+        if (ctx->state->n_draft > 0) {
+            fprintf(stderr, "%s:    draft time = %8.2f ms / %5d tokens, accepted = %5d (%5.1f%%)\n", __func__,
+                    1e-3f * ctx->state->t_draft_us, ctx->state->n_draft, ctx->state->n_draft_accepted,
+                    100.0f * ctx->state->n_draft_accepted / ctx->state->n_draft);
+        }
+        if (ctx->state->n_prompt_decoded + ctx->state->n_prompt_reused > 0) {
+            fprintf(stderr, "%s:   prompt time = %8.2f ms / %5d tokens decoded, %5d reused\n", __func__,
+                    1e-3f * ctx->state->t_prompt_us, ctx->state->n_prompt_decoded, ctx->state->n_prompt_reused);
+        }
+    }
+    fprintf(stderr, "%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
+}
+
+void whisper_reset_timings(struct whisper_context * ctx) {
+    if (ctx->state != nullptr) {
+        ctx->state->t_sample_us = 0;
+        ctx->state->t_encode_us = 0;
+        ctx->state->t_decode_us = 0;
+        ctx->state->t_decode_build_us = 0;
+        ctx->state->t_decode_compute_us = 0;
+        ctx->state->t_draft_us = 0;
+        ctx->state->t_prompt_us = 0;
+    }
+}
+
+const char * whisper_print_system_info(void) {
+    static std::string s;
+
+    s  = "";
+    s += "AVX = "       + std::to_string(ggml_cpu_has_avx())       + " | ";
+    s += "AVX2 = "      + std::to_string(ggml_cpu_has_avx2())      + " | ";
+    s += "AVX512 = "    + std::to_string(ggml_cpu_has_avx512())    + " | ";
+    s += "FMA = "       + std::to_string(ggml_cpu_has_fma())       + " | ";
+    s += "NEON = "      + std::to_string(ggml_cpu_has_neon())      + " | ";
+    s += "ARM_FMA = "   + std::to_string(ggml_cpu_has_arm_fma())   + " | ";
+    s += "F16C = "      + std::to_string(ggml_cpu_has_f16c())      + " | ";
+    s += "FP16_VA = "   + std::to_string(ggml_cpu_has_fp16_va())   + " | ";
+    s += "WASM_SIMD = " + std::to_string(ggml_cpu_has_wasm_simd()) + " | ";
+    s += "BLAS = "      + std::to_string(ggml_cpu_has_blas())      + " | ";
+    s += "SSE3 = "      + std::to_string(ggml_cpu_has_sse3())      + " | ";
+    s += "VSX = "       + std::to_string(ggml_cpu_has_vsx())       + " | ";
+
+    return s.c_str();
+}
+
+////////////////////////////////////////////////////////////////////////////
+
+struct whisper_full_params whisper_full_default_params(enum whisper_sampling_strategy strategy) {
+    struct whisper_full_params result = {
+        /*.strategy         =*/ strategy,
+
+        /*.n_threads        =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_max_text_ctx   =*/ 16384,
+        /*.offset_ms        =*/ 0,
+        /*.duration_ms      =*/ 0,
+
+        /*.translate        =*/ false,
+        /*.no_context       =*/ true,
+        /*.single_segment   =*/ false,
+        /*.print_special    =*/ false,
+        /*.print_progress   =*/ true,
+        /*.print_realtime   =*/ false,
+        /*.print_timestamps =*/ true,
+
+        /*.token_timestamps =*/ false,
+        /*.thold_pt         =*/ 0.01f,
+        /*.thold_ptsum      =*/ 0.01f,
+        /*.max_len          =*/ 0,
+        /*.split_on_word    =*/ false,
+        /*.max_tokens       =*/ 0,
+
+        /*.speed_up         =*/ false,
+        /*.audio_ctx        =*/ 0,
+        /*.audio_ctx_auto   =*/ false,
+
+        /*.prompt_tokens    =*/ nullptr,
+        /*.prompt_n_tokens  =*/ 0,
+
+        /*.language         =*/ "en",
 
         /*.suppress_blank   =*/ true,
         /*.suppress_non_speech_tokens =*/ false,
 
-        /*.temperature      =*/  0.0f,
-        /*.max_initial_ts   =*/  1.0f,
-        /*.length_penalty   =*/ -1.0f,
+        /*.temperature      =*/  0.0f,
+        /*.max_initial_ts   =*/  1.0f,
+        /*.length_penalty   =*/ -1.0f,
+
+        /*.temperature_inc  =*/  0.0f, // TODO: temporary disabled until improve performance
+        /*.entropy_thold    =*/  2.4f,
+        /*.logprob_thold    =*/ -1.0f,
+        /*.no_speech_thold  =*/  0.6f,
+
+        /*.greedy           =*/ {
+            /*.best_of   =*/ -1,
+        },
+
+        /*.beam_search      =*/ {
+            /*.beam_size =*/ -1,
+
+            /*.patience  =*/ -1.0f,
+        },
+
+        /*.draft            =*/ {
+            /*.ctx      =*/ nullptr,
+            /*.state    =*/ nullptr,
+            /*.n_tokens =*/ 4,
+        },
+
+        /*.new_segment_callback           =*/ nullptr,
+        /*.new_segment_callback_user_data =*/ nullptr,
+
+        /*.encoder_begin_callback           =*/ nullptr,
+        /*.encoder_begin_callback_user_data =*/ nullptr,
+
+        /*.logits_filter_callback           =*/ nullptr,
+        /*.logits_filter_callback_user_data =*/ nullptr,
+    };
+
+    switch (strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                result.greedy = {
+                    /*.best_of   =*/ 1,
+                };
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                result.beam_search = {
+                    /*.beam_size =*/ 5,
+
+                    /*.patience  =*/ -1.0f,
+                };
+            } break;
+    }
+
+    return result;
+}
+
+// forward declarations
+static float get_signal_abs_sum(const float * signal, int n_samples);
+static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum);
+
+// trim from start (in place)
+static inline void ltrim(std::string &s) {
+    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
+        return !std::isspace(ch);
+    }));
+}
+
+// trim from end (in place)
+static inline void rtrim(std::string &s) {
+    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
+        return !std::isspace(ch);
+    }).base(), s.end());
+}
+
+// trim from both ends (in place)
+static inline void trim(std::string &s) {
+    rtrim(s);
+    ltrim(s);
+}
+
+static inline bool should_split_on_word(const char * txt, bool split_on_word) {
+    if (!split_on_word) return true;
+
+    return txt[0] == ' ';
+}
+
+// wrap the last segment to max_len characters
+// returns the number of new segments
+static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
+    auto segment = state.result_all.back();
+
+    int res = 1;
+    int acc = 0;
+
+    std::string text;
+
+    for (int i = 0; i < (int) segment.tokens.size(); i++) {
+        const auto & token = segment.tokens[i];
+        if (token.id >= whisper_token_eot(&ctx)) {
+            continue;
+        }
+
+        const auto txt = whisper_token_to_str(&ctx, token.id);
+        const int cur = strlen(txt);
+
+        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
+            // split here
+            if (split_on_word) {
+                trim(text);
+            }
+
+            state.result_all.back().text = std::move(text);
+            state.result_all.back().t1 = token.t0;
+            state.result_all.back().tokens.resize(i);
+
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    if (split_on_word) {
+        trim(text);
+    }
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+// process the logits for the selected decoder
+// - applies logit filters
+// - computes logprobs and probs
+//
+// the logits of the decoder are in row i_logits of state.logits (see whisper_decode_batch_internal)
+static void whisper_process_logits(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params,
+              struct whisper_decoder & decoder,
+                               float   temperature,
+                                 int   i_logits) {
+    const auto & vocab      = ctx.vocab;
+    const auto & tokens_cur = decoder.sequence.tokens;
+
+    const bool is_initial = tokens_cur.size() == 0;
+    const int  n_logits   = vocab.id_to_token.size();
+
+    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+
+    // extract the logits for the last token
+    // we will be mutating and therefore we don't want to use the ctx.logits buffer directly
+    // the buffers of the decoder have n_vocab elements from whisper_init_state() on - nothing is allocated here
+    auto & probs    = decoder.probs;
+    auto & logits   = decoder.logits;
+    auto & logprobs = decoder.logprobs;
+    {
+        const float * logits_src = state.logits.data() + i_logits*n_logits;
+
+        // copy and scale in one pass
+        if (temperature > 0.0f) {
+            const float scale = 1.0f/temperature;
+            for (int i = 0; i < n_logits; i++) {
+                logits[i] = logits_src[i]*scale;
+            }
+        } else {
+            memcpy(logits.data(), logits_src, n_logits*sizeof(float));
+        }
+    }
+
+    // the suppressed tokens are masked in place with -INFINITY, so that the log-softmax gives them probability 0
+    float * logits_masked = logits.data();
+
+    // apply logit filters here
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
+    {
+        // suppress blank
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
+        if (params.suppress_blank) {
+            if (is_initial) {
+                logits[vocab.token_eot] = -INFINITY;
+                if (vocab.token_space >= 0) {
+                    logits[vocab.token_space] = -INFINITY;
+                }
+            }
+        }
+
+        // suppress <|notimestamps|> token
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+        logits[vocab.token_not] = -INFINITY;
+
+        // suppress sot and solm tokens
+        logits[vocab.token_sot]  = -INFINITY;
+        logits[vocab.token_solm] = -INFINITY;
+
+        // suppress task tokens
+        logits[vocab.token_translate]  = -INFINITY;
+        logits[vocab.token_transcribe] = -INFINITY;
+
+        if (params.logits_filter_callback) {
+            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
+        }
+
+        // suppress non-speech tokens
+        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+        // the token ids are looked up when the vocab is loaded (see whisper_vocab.tokens_non_speech)
+        if (params.suppress_non_speech_tokens) {
+            for (const whisper_token id : vocab.tokens_non_speech) {
+                logits_masked[id] = -INFINITY;
+            }
+        }
+
+        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
+        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
+        {
+            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
+            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+
+            //fprintf(stderr, "last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+
+            if (last_was_timestamp) {
+                if (penultimate_was_timestamp) {
+                    std::fill(logits_masked + vocab.token_beg, logits_masked + n_logits, -INFINITY);
+                } else {
+                    std::fill(logits_masked, logits_masked + vocab.token_eot, -INFINITY);
+                }
+            }
+        }
+
+        // the initial timestamp cannot be larger than max_initial_ts
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial && params.max_initial_ts > 0.0f) {
+            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
+            const int   tid0      = std::round(params.max_initial_ts/precision);
+
+            if (vocab.token_beg + tid0 + 1 < n_logits) {
+                std::fill(logits_masked + vocab.token_beg + tid0 + 1, logits_masked + n_logits, -INFINITY);
+            }
+        }
+
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            std::fill(logits_masked + vocab.token_beg, logits_masked + std::min(vocab.token_beg + tid0, n_logits), -INFINITY);
+        }
+
+        // populate the logprobs and probs arrays (log_softmax)
+        ggml_log_soft_max_f32(n_logits, logprobs.data(), probs.data(), logits.data());
+
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over timestamps
+            float timestamp_logprob = -INFINITY;
+            {
+                double sum_ts = 0.0;
+                for (int i = vocab.token_beg; i < n_logits; ++i) {
+                    sum_ts += probs[i];
+                }
+                if (sum_ts > 0.0) {
+                    timestamp_logprob = log(sum_ts);
+                }
+            }
+
+            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+
+            //fprintf(stderr, "timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+            if (timestamp_logprob > max_text_token_logprob) {
+                std::fill(logits.begin(),   logits.begin()   + vocab.token_beg, -INFINITY);
+                std::fill(logprobs.begin(), logprobs.begin() + vocab.token_beg, -INFINITY);
+                std::fill(probs.begin(),    probs.begin()    + vocab.token_beg, 0.0f);
+            }
+        }
+    }
+
+#if 0
+    // print first 100 logits - token string : logit
+    for (int i = 0; i < 100; i++) {
+        const auto token   = vocab.id_to_token.at(i);
+        const auto prob    = probs[i];
+        const auto logit   = logits[i];
+        const auto logprob = logprobs[i];
+        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
+    }
+
+    // "And", "and", " And", " and"
+    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
+    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
+    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
+    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
+    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+
+    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
+    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
+    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
+    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
+    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+
+    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
+    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
+    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
+    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
+    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
+#endif
+}
+
+static whisper_token_data whisper_sample_token(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                       bool   best) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                result.tid = i;
+            }
+        }
+
+        result.pt    = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
+
+    if (best) {
+        for (int i = 0; i < n_logits; ++i) {
+            if (result.p < probs[i]) {
+                result.id   = i;
+                result.p    = probs[i];
+                result.plog = logprobs[i];
+            }
+        }
+    } else {
+        // inverse transform sampling - std::discrete_distribution would allocate a table of n_vocab weights per token
+        double sum = 0.0;
+        for (int i = 0; i < n_logits; ++i) {
+            sum += probs[i];
+        }
+
+        std::uniform_real_distribution<double> dist(0.0, sum);
+
+        double u = dist(state.rng);
+        for (int i = 0; i < n_logits; ++i) {
+            if (probs[i] > 0.0f) {
+                result.id = i;
+
+                u -= probs[i];
+                if (u < 0.0) {
+                    break;
+                }
+            }
+        }
+
+        result.p    = probs[result.id];
+        result.plog = logprobs[result.id];
+    }
+
+    if (result.id >= vocab.token_beg) {
+        result.tid = result.id;
+        result.pt  = result.p;
+    }
+
+    state.n_sample++;
+
+    return result;
+}
+
+// the k tokens with the largest logits, in decreasing order - result is cleared first
+static void whisper_sample_token_topk(
+            whisper_context & ctx,
+              whisper_state & state,
+      const whisper_decoder & decoder,
+                        int   k,
+    std::vector<whisper_token_data> & result) {
+    const auto & vocab = ctx.vocab;
+
+    const auto & probs    = decoder.probs;
+    const auto & logits   = decoder.logits;
+    const auto & logprobs = decoder.logprobs;
+
+    const int n_logits = vocab.n_vocab;
+
+    k = std::min(k, n_logits);
+
+    // partial selection: keep the k largest logits seen so far in decreasing order - most logits are below the k-th
+    // and are rejected with one comparison
+    auto & logits_id = state.logits_id;
+
+    logits_id.clear();
+    for (int i = 0; i < n_logits; ++i) {
+        if ((int) logits_id.size() == k) {
+            if (logits[i] <= logits_id.back().first) {
+                continue;
+            }
+            logits_id.pop_back();
+        }
+
+        int j = logits_id.size();
+        logits_id.emplace_back();
+        for (; j > 0 && logits_id[j - 1].first < logits[i]; --j) {
+            logits_id[j] = logits_id[j - 1];
+        }
+        logits_id[j] = { logits[i], i };
+    }
+
+    result.clear();
+
+    whisper_token tid = vocab.token_beg;
+
+    float pt    = 0.0;
+    float ptsum = 0.0;
+
+    {
+        double sum_ts = 0.0;
+        double max_ts = 0.0;
+
+        for (int i = vocab.token_beg; i < n_logits; i++) {
+            if (probs[i] == -INFINITY) {
+                continue;
+            }
+
+            sum_ts += probs[i];
+            if (max_ts < probs[i]) {
+                max_ts = probs[i];
+                tid = i;
+            }
+        }
+
+        pt    = max_ts/(sum_ts + 1e-10);
+        ptsum = sum_ts;
+    }
+
+    for (int i = 0; i < k; ++i) {
+        const auto id = logits_id[i].second;
+
+        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+
+        if (result[i].id >= vocab.token_beg) {
+            result[i].tid = result[i].id;
+            result[i].pt  = result[i].p;
+        }
+    }
+
+    state.n_sample++;
+}
+
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
+static void whisper_sequence_score(
+        const struct whisper_full_params & params,
+                        whisper_sequence & sequence) {
+    if (sequence.result_len == 0) {
+        return;
+    }
+
+    double result = 0.0f;
+
+    for (int i = 0; i < sequence.result_len; ++i) {
+        result += sequence.tokens[i].plog;
+    }
+
+    sequence.sum_logprobs = result;
+    sequence.avg_logprobs = result/sequence.result_len;
+
+    double penalty = sequence.result_len;
+
+    if (params.length_penalty > 0.0f) {
+        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
+    }
+
+    sequence.score = result/penalty;
+
+    // compute the entropy of the sequence of the last 32 tokens
+    {
+        const int n = 32;
+
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+// speculative decoding of the greedy decoder of whisper_full_with_state() with a draft model (see
+// whisper_full_params.draft)
+struct whisper_draft {
+    whisper_context * ctx   = nullptr; // nullptr - no speculative decoding
+    whisper_state   * state = nullptr;
+
+    int seek = -1; // the window that the audio of the draft state has been encoded for
+
+    std::vector<whisper_token> tokens_kv;  // the tokens in the self-attention KV cache of the draft decoder
+    std::vector<whisper_token> tokens_cur; // work buffer: the tokens of the decoder, followed by the proposed ones
+
+    // the proposed tokens - the logits after the sampled token that they follow and after each of them are in rows
+    // 0 ... n of the logits of the state
+    std::vector<whisper_token> tokens;
+
+    int n_accepted = 0; // number of proposed tokens that have been sampled so far
+};
+
+// proposes the next n_tokens tokens of the decoder with the draft model
+// the tokens are chosen greedily, with the same logit filters as the decoder except for the user callback, which
+// expects the logits of the model
+static void whisper_draft_propose(
+                whisper_draft & draft,
+    const whisper_full_params & params,
+    const std::vector<whisper_token> & prompt,
+        const whisper_decoder & decoder,
+                          int   seek,
+                          int   n_tokens,
+                          int   n_threads) {
+    auto & dctx     = *draft.ctx;
+    auto & dstate   = *draft.state;
+    auto & ddecoder = dstate.decoders[0];
+
+    draft.tokens.clear();
+    draft.n_accepted = 0;
+
+    // the audio features of a new window - the KV cache of the old one is of no use
+    if (draft.seek != seek) {
+        if (!whisper_encode_internal(dctx, dstate, seek, n_threads)) {
+            return;
+        }
+
+        draft.seek = seek;
+        draft.tokens_kv.clear();
+    }
+
+    auto & tokens_cur = draft.tokens_cur;
+
+    tokens_cur = prompt;
+    for (const auto & token : decoder.sequence.tokens) {
+        tokens_cur.push_back(token.id);
+    }
+
+    // keep the KV cache of the tokens that the decoder still has - at least the last token is evaluated again, for
+    // its logits
+    int n_keep = 0;
+    while (n_keep < (int) draft.tokens_kv.size() && n_keep + 1 < (int) tokens_cur.size() && draft.tokens_kv[n_keep] == tokens_cur[n_keep]) {
+        n_keep++;
+    }
+
+    draft.tokens_kv.resize(n_keep);
+    ddecoder.kv_self.n = n_keep;
+
+    // the timestamp rules of the logit filters follow the tokens of the decoder
+    ddecoder.sequence   = decoder.sequence;
+    ddecoder.has_ts     = decoder.has_ts;
+    ddecoder.seek_delta = decoder.seek_delta;
+
+    whisper_full_params dparams = params;
+    dparams.logits_filter_callback = nullptr;
+
+    // the model evaluates the last token of the decoder and the proposed ones in one pass
+    n_tokens = std::min(n_tokens, dctx.model.hparams.n_text_ctx - (int) tokens_cur.size());
+
+    while ((int) draft.tokens.size() < n_tokens) {
+        const int n_past = draft.tokens_kv.size();
+
+        if (!whisper_decode_internal(dctx, dstate, ddecoder, tokens_cur.data() + n_past, tokens_cur.size() - n_past, n_past, n_threads)) {
+            break;
+        }
+
+        draft.tokens_kv.insert(draft.tokens_kv.end(), tokens_cur.begin() + n_past, tokens_cur.end());
+        ddecoder.kv_self.n = draft.tokens_kv.size();
+
+        whisper_process_logits(dctx, dstate, dparams, ddecoder, 0.0f, 0);
+
+        const auto token = whisper_sample_token(dctx, dstate, ddecoder, true);
+
+        draft.tokens.push_back(token.id);
+        tokens_cur.push_back(token.id);
+
+        if (token.id == whisper_token_eot(&dctx)) {
+            break;
+        }
+
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (token.id > whisper_token_beg(&dctx)) {
+            ddecoder.has_ts     = true;
+            ddecoder.seek_delta = 2*(token.id - whisper_token_beg(&dctx));
+        }
+    }
+}
+
+// obtains the logits of the next token of the greedy decoder with speculative decoding, in place of
+// whisper_decode_internal() and whisper_process_logits()
+//
+// the draft model proposes the tokens that follow the last sampled token, and the model evaluates the sampled token and
+// the proposed ones in one pass, which gives the logits after each of them. as long as the sampled tokens are the
+// proposed ones, their logits are already there. the first token that differs is evaluated with the next proposals,
+// and their K and V rows take the place of those of the rejected tokens
+static bool whisper_draft_decode(
+            whisper_context & ctx,
+              whisper_state & state,
+              whisper_draft & draft,
+    const whisper_full_params & params,
+    const std::vector<whisper_token> & prompt,
+            whisper_decoder & decoder,
+                        int   seek,
+                      float   temperature) {
+    const whisper_token token = decoder.sequence.tokens.back().id;
+
+    int i_logits = 0;
+
+    if (draft.n_accepted < (int) draft.tokens.size() && draft.tokens[draft.n_accepted] == token) {
+        i_logits = ++draft.n_accepted;
+
+        state.n_draft_accepted++;
+    } else {
+        const int64_t t_start_us = ggml_time_us();
+
+        whisper_draft_propose(draft, params, prompt, decoder, seek, params.draft.n_tokens, params.n_threads);
+
+        state.t_draft_us += ggml_time_us() - t_start_us;
+        state.n_draft    += draft.tokens.size();
+
+        std::vector<whisper_token> tokens = { token };
+        tokens.insert(tokens.end(), draft.tokens.begin(), draft.tokens.end());
+
+        if (!whisper_decode_internal(ctx, state, decoder, tokens.data(), tokens.size(), decoder.kv_self.n, params.n_threads, true)) {
+            return false;
+        }
+    }
+
+    {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        whisper_process_logits(ctx, state, params, decoder, temperature, i_logits);
+
+        ++decoder.kv_self.n;
+
+        state.t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+
+    return true;
+}
+
+// decodes the prompt of a pass of whisper_full_with_state() into the KV cache of decoder 0, and leaves the logits after
+// its last token in state.logits
+// the tokens that the prompt has in common with the previous prompt over the same audio are taken from the prompt
+// cache instead - all of them for the passes of a temperature fallback that use the same prompt
+static bool whisper_decode_prompt(
+            whisper_context & ctx,
+              whisper_state & state,
+    const std::vector<whisper_token> & prompt,
+                        int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & cache   = state.prompt_cache;
+    auto & decoder = state.decoders[0];
+
+    const int n_prompt = prompt.size();
+
+    int n_keep = 0;
+    if (state.keep_prompt && cache.kv_cross_id == state.kv_cross_id) {
+        while (n_keep < (int) cache.tokens.size() && n_keep < n_prompt && cache.tokens[n_keep] == prompt[n_keep]) {
+            n_keep++;
+        }
+    }
+
+    if (n_keep == n_prompt && n_keep == (int) cache.tokens.size()) {
+        kv_seq_share(state.kv_pages, decoder.kv_self, cache.kv);
+
+        state.logits.assign(cache.logits.begin(), cache.logits.end());
+    } else {
+        // the logits after the last token are needed
+        n_keep = std::min(n_keep, n_prompt - 1);
+
+        kv_seq_release(state.kv_pages, decoder.kv_self);
+
+        if (n_keep > 0) {
+            kv_seq_share(state.kv_pages, decoder.kv_self, cache.kv);
+            kv_seq_truncate(state.kv_pages, decoder.kv_self, n_keep);
+        }
+
+        // the pages of the old prompt that the new one does not share are free again, and the shared ones are
+        // written without a copy
+        kv_seq_release(state.kv_pages, cache.kv);
+
+        if (!whisper_decode_internal(ctx, state, decoder, prompt.data() + n_keep, n_prompt - n_keep, n_keep, n_threads)) {
+            return false;
+        }
+
+        decoder.kv_self.n = n_prompt;
+
+        if (state.keep_prompt) {
+            kv_seq_share(state.kv_pages, cache.kv, decoder.kv_self);
+
+            cache.tokens = prompt;
+            cache.logits.assign(state.logits.begin(), state.logits.begin() + ctx.vocab.n_vocab);
+            cache.kv_cross_id = state.kv_cross_id;
+        }
+    }
+
+    state.n_prompt_decoded += n_prompt - n_keep;
+    state.n_prompt_reused  += n_keep;
+    state.t_prompt_us      += ggml_time_us() - t_start_us;
+
+    return true;
+}
+
+// number of threads to use when whisper_full_params.n_threads is 0
+// hardware_concurrency() counts logical processors - with SMT about half of them are physical cores, and using more
+// threads than that makes the barriers between graph nodes much more expensive
+// leave at least one core for the rest of the process (audio capture etc.)
+static int whisper_auto_n_threads() {
+    const int n_logical = std::thread::hardware_concurrency();
+
+    return std::max(1, std::min(8, std::min(n_logical/2, n_logical - 1)));
+}
+
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    if (params.n_threads <= 0) {
+        params.n_threads = whisper_auto_n_threads();
+    }
+
+    // clear old results
+    auto & result_all = state->result_all;
+
+    result_all.clear();
+
+    // the compute threads of a session are shared with the other sessions, so its spectrogram is computed on the calling thread
+    const int n_threads_mel = state->pools ? 1 : params.n_threads;
+
+    // compute log mel spectrogram
+    if (params.speed_up) {
+        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, n_threads_mel) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -1;
+        }
+    } else {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, n_threads_mel) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    // auto-detect language if not specified
+    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        if (lang_id < 0) {
+            fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id = lang_id;
+        params.language = whisper_lang_str(lang_id);
+
+        fprintf(stderr, "%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+    }
+
+    if (params.token_timestamps) {
+        state->t_beg    = 0;
+        state->t_last   = 0;
+        state->tid_last = 0;
+        state->energy = get_signal_energy(samples, n_samples, 32);
+    }
+
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
+
+    // if length of spectrogram is less than 1s (100 samples), then return
+    // basically don't process anything that is less than 1s
+    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
+    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
+        return 0;
+    }
+
+    // a set of temperatures to use
+    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
+    std::vector<float> temperatures;
+    if (params.temperature_inc > 0.0f) {
+        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
+            temperatures.push_back(t);
+        }
+    } else {
+        temperatures.push_back(params.temperature);
+    }
+
+    // initialize the decoders
+    int n_decoders = 1;
+
+    switch (params.strategy) {
+        case WHISPER_SAMPLING_GREEDY:
+            {
+                n_decoders = params.greedy.best_of;
+            } break;
+        case WHISPER_SAMPLING_BEAM_SEARCH:
+            {
+                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
+            } break;
+    };
+
+    n_decoders = std::max(1, n_decoders);
+
+    // make room in the self-attention KV cache for a full sequence of each decoder
+    if (!whisper_state_reserve_decoders(*ctx, *state, n_decoders)) {
+        return -4;
+    }
+
+    // speculative decoding: the draft model gets the same spectrogram
+    whisper_draft draft;
+    if (params.draft.ctx && params.draft.n_tokens > 0) {
+        const auto & hparams  = ctx->model.hparams;
+        const auto & dhparams = params.draft.ctx->model.hparams;
+
+        draft.ctx   = params.draft.ctx;
+        draft.state = params.draft.state ? params.draft.state : params.draft.ctx->state;
+
+        if (draft.state == nullptr || draft.state == state || dhparams.n_vocab != hparams.n_vocab || dhparams.n_mels != hparams.n_mels ||
+            dhparams.n_audio_ctx != hparams.n_audio_ctx || dhparams.n_text_ctx != hparams.n_text_ctx) {
+            fprintf(stderr, "%s: the draft model does not match the model - not using it\n", __func__);
+            draft.ctx = nullptr;
+        } else if (!whisper_state_reserve_decoders(*draft.ctx, *draft.state, 1)) {
+            return -4;
+        } else {
+            draft.state->mel = state->mel;
+        }
+    }
+
+    // TAGS: WHISPER_DECODER_INIT
+    for (int j = 1; j < n_decoders; j++) {
+        auto & decoder = state->decoders[j];
+
+        if (decoder.probs.empty()) {
+            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+
+            decoder.probs.resize   (ctx->vocab.n_vocab);
+            decoder.logits.resize  (ctx->vocab.n_vocab);
+            decoder.logprobs.resize(ctx->vocab.n_vocab);
+        }
+    }
+
+    // the accumulated text context so far
+    auto & prompt_past = state->prompt_past;
+    if (params.no_context) {
+        prompt_past.clear();
+    }
+
+    // prepend the prompt tokens to the prompt_past
+    if (params.prompt_tokens && params.prompt_n_tokens > 0) {
+        // parse tokens from the pointer
+        for (int i = 0; i < params.prompt_n_tokens; i++) {
+            prompt_past.push_back(params.prompt_tokens[i]);
+        }
+        std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
+    }
+
+    // size the audio context to the input: each audio position covers 2 mel frames
+    // round up to a multiple of WHISPER_AUDIO_CTX_ALIGN, plus one extra block so that the end of the input is not at the
+    // very edge of the context
+    if (params.audio_ctx_auto) {
+        const int n_frames = seek_end - seek_start;
+        const int n_align  = WHISPER_AUDIO_CTX_ALIGN;
+
+        params.audio_ctx = std::min(whisper_n_audio_ctx(ctx), n_align*((n_frames/2 + n_align - 1)/n_align + 1));
+    }
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    if (draft.ctx) {
+        draft.state->exp_n_audio_ctx = params.audio_ctx;
+    }
+
+    // these tokens determine the task that will be performed
+    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
+    if (whisper_is_multilingual(ctx)) {
+        const int lang_id = whisper_lang_id(params.language);
+        state->lang_id = lang_id;
+        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
+        if (params.translate) {
+            prompt_init.push_back(whisper_token_translate());
+        } else {
+            prompt_init.push_back(whisper_token_transcribe());
+        }
+    }
+
+    int progress_prev = 0;
+    int progress_step = 5;
+
+    int seek = seek_start;
+
+    std::vector<whisper_token> prompt;
+    prompt.reserve(whisper_n_text_ctx(ctx));
+
+    // beam-search helpers
+    // the KV cache of each decoder before reordering the beams - they share their pages with the decoders
+    std::vector<whisper_kv_seq> kv_bufs;
+
+    struct beam_candidate {
+        int decoder_idx;
+        int seek_delta;
+
+        bool has_ts;
+
+        whisper_sequence sequence;
+    };
+
+    std::vector<beam_candidate> beam_candidates;
+
+    // the decoders that are evaluated together, and their tokens
+    std::vector<int>               decode_ids;
+    std::vector<int>               decode_ids_next;
+    std::vector<whisper_decoder *> decode_batch;
+    std::vector<whisper_token>     decode_tokens;
+
+    // main loop
+    while (true) {
+        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
+        while (progress_cur >= progress_prev + progress_step) {
+            progress_prev += progress_step;
+            if (params.print_progress) {
+                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
+            }
+        }
+
+        // of only 1 second left, then stop
+        if (seek + 100 >= seek_end) {
+            break;
+        }
+
+        if (params.encoder_begin_callback) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
+                fprintf(stderr, "%s: encoder_begin_callback returned false - aborting\n", __func__);
+                break;
+            }
+        }
+
+        // encode audio features starting at offset seek
+        if (state->batcher) {
+            if (whisper_encoder_batcher_encode(state->batcher, state, seek) != 0) {
+                fprintf(stderr, "%s: failed to encode\n", __func__);
+                return -6;
+            }
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
+            fprintf(stderr, "%s: failed to encode\n", __func__);
+            return -6;
+        }
+
+        // if there is a very short audio segment left to process, we remove any past prompt since it tends
+        // to confuse the decoder and often make it repeat or hallucinate stuff
+        if (seek > seek_start && seek + 500 >= seek_end) {
+            prompt_past.clear();
+        }
+
+        int best_decoder_id = 0;
+
+        for (int it = 0; it < (int) temperatures.size(); ++it) {
+            const float t_cur = temperatures[it];
+
+            int n_decoders_cur = 1;
+
+            switch (params.strategy) {
+                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        }
+                    } break;
+                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                    {
+                        if (t_cur > 0.0f) {
+                            n_decoders_cur = params.greedy.best_of;
+                        } else {
+                            n_decoders_cur = params.beam_search.beam_size;
+                        }
+                    } break;
+            };
+
+            n_decoders_cur = std::max(1, n_decoders_cur);
+
+            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+
+            // TAGS: WHISPER_DECODER_INIT
+            for (int j = 0; j < n_decoders_cur; ++j) {
+                auto & decoder = state->decoders[j];
+
+                kv_seq_release(state->kv_pages, decoder.kv_self);
+
+                decoder.sequence.tokens.clear();
+                decoder.sequence.result_len       = 0;
+                decoder.sequence.sum_logprobs_all = 0.0;
+                decoder.sequence.sum_logprobs     = -INFINITY;
+                decoder.sequence.avg_logprobs     = -INFINITY;
+                decoder.sequence.entropy          = 0.0;
+                decoder.sequence.score            = -INFINITY;
+
+                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+
+                decoder.failed    = false;
+                decoder.completed = false;
+                decoder.has_ts    = false;
+            }
+
+            // init prompt and kv cache for the current iteration
+            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
+            {
+                prompt.clear();
+
+                // if we have already generated some text, use it as a prompt to condition the next generation
+                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
+                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+
+                    prompt = { whisper_token_prev(ctx) };
+                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
+                }
+
+                // init new transcription with sot, language (opt) and task tokens
+                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+
+                // print the prompt
+                WHISPER_PRINT_DEBUG("\n\n");
+                for (int i = 0; i < (int) prompt.size(); i++) {
+                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
+                }
+                WHISPER_PRINT_DEBUG("\n\n");
+
+                if (!whisper_decode_prompt(*ctx, *state, prompt, params.n_threads)) {
+                    fprintf(stderr, "%s: failed to decode\n", __func__);
+                    return -7;
+                }
+
+                {
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur, 0);
+
+                    for (int j = 1; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        kv_seq_share(state->kv_pages, decoder.kv_self, state->decoders[0].kv_self);
+
+                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                    }
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                }
+            }
+
+            // speculative decoding is exact only when the decoder always takes the most probable token
+            const bool use_draft = draft.ctx && n_decoders_cur == 1 && t_cur < 1e-6f &&
+                params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY;
+
+            draft.tokens.clear();
+            draft.n_accepted = 0;
+
+            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+                const int64_t t_start_sample_us = ggml_time_us();
+
+                // store the KV caches of all decoders when doing beam-search
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    kv_bufs.resize(n_decoders_cur);
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        kv_seq_share(state->kv_pages, kv_bufs[j], decoder.kv_self);
+                    }
+
+                    beam_candidates.clear();
+                }
+
+                // generate new sequence candidates for each decoder
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.completed || decoder.failed) {
+                        continue;
+                    }
+
+                    switch (params.strategy) {
+                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                            {
+                                if (t_cur < 1e-6f) {
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
+                                } else {
+                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
+                                }
+
+                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                            } break;
+                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                            {
+                                auto & tokens_new = state->tokens_topk;
+
+                                whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size, tokens_new);
+
+                                for (const auto & token : tokens_new) {
+                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
+                                    beam_candidates.back().sequence.tokens.push_back(token);
+                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+
+                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
+                                }
+                            } break;
+                    };
+                }
+
+                // for beam-search, choose the top candidates and update the KV caches
+                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    std::sort(
+                            beam_candidates.begin(),
+                            beam_candidates.end(),
+                            [](const beam_candidate & a, const beam_candidate & b) {
+                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                    });
+
+                    uint32_t cur_c = 0;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        auto & cur = beam_candidates[cur_c++];
+
+                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
+                            ++cur_c;
+                        }
+
+                        decoder.sequence   = cur.sequence;
+                        decoder.seek_delta = cur.seek_delta;
+                        decoder.has_ts     = cur.has_ts;
+
+                        kv_seq_share(state->kv_pages, decoder.kv_self, kv_bufs[cur.decoder_idx]);
+
+                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
+                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
+                    }
+
+                    // the pages that are no longer used by any beam are freed here
+                    for (auto & kv_buf : kv_bufs) {
+                        kv_seq_release(state->kv_pages, kv_buf);
+                    }
+                }
+
+                // update the decoder state
+                // - check if the sequence is completed
+                // - check if the sequence is failed
+                // - update sliding window based on timestamp tokens
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.completed || decoder.failed) {
+                        continue;
+                    }
+
+                    auto & has_ts     = decoder.has_ts;
+                    auto & failed     = decoder.failed;
+                    auto & completed  = decoder.completed;
+                    auto & seek_delta = decoder.seek_delta;
+                    auto & result_len = decoder.sequence.result_len;
+
+                    {
+                        const auto & token = decoder.sequence.tokens.back();
+
+                        // timestamp token - update sliding window
+                        if (token.id > whisper_token_beg(ctx)) {
+                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+
+                            // do not allow to go back in time
+                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
+                                failed = true; // TODO: maybe this is not a failure ?
+                                continue;
+                            }
+
+                            seek_delta = seek_delta_new;
+                            result_len = i + 1;
+                            has_ts = true;
+                        }
+
+#ifdef WHISPER_DEBUG
+                        {
+                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
+                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
+                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
+                        }
+#endif
+
+                        // end of segment
+                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
+                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
+                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
+                           ) {
+                            if (result_len == 0) {
+                                if (seek + seek_delta + 100 >= seek_end) {
+                                    result_len = i + 1;
+                                } else {
+                                    failed = true;
+                                    continue;
+                                }
+                            }
+
+                            if (params.single_segment) {
+                                result_len = i + 1;
+                                seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            }
+
+                            completed = true;
+                            continue;
+                        }
+
+                        // TESTS: if no tensors are loaded, it means we are running tests
+                        if (ctx->model.n_loaded == 0) {
+                            seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            completed = true;
+                            continue;
+                        }
+                    }
+
+                    // sometimes, the decoding can get stuck in a repetition loop
+                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
+                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                        failed = true;
+                        continue;
+                    }
+                }
+
+                // check if all decoders have finished (i.e. completed or failed)
+                {
+                    bool completed_all = true;
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        completed_all = false;
+                    }
+
+                    if (completed_all) {
+                        break;
+                    }
+                }
+
+                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                if (use_draft) {
+                    if (!whisper_draft_decode(*ctx, *state, draft, params, prompt, state->decoders[0], seek, t_cur)) {
+                        fprintf(stderr, "%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    continue;
+                }
+
+                // obtain logits for the next token
+                // the decoders with the same number of past tokens are evaluated together, in as few batches as possible
+                decode_ids.clear();
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.failed || decoder.completed) {
+                        continue;
+                    }
+
+                    decode_ids.push_back(j);
+                }
+
+                while (!decode_ids.empty()) {
+                    const int n_past      = state->decoders[decode_ids[0]].kv_self.n;
+                    const int n_batch_max = whisper_decode_batch_max(*ctx, 1);
+
+                    decode_ids_next.clear();
+                    decode_batch.clear();
+                    decode_tokens.clear();
+
+                    for (const int j : decode_ids) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.kv_self.n != n_past || (int) decode_batch.size() == n_batch_max) {
+                            decode_ids_next.push_back(j);
+                            continue;
+                        }
+
+                        decode_batch.push_back(&decoder);
+                        decode_tokens.push_back(decoder.sequence.tokens.back().id);
+                    }
+
+                    //WHISPER_PRINT_DEBUG("%s: decoding %d decoders, n_past %d\n", __func__, (int) decode_batch.size(), n_past);
+
+                    if (!whisper_decode_batch_internal(*ctx, *state, decode_batch.data(), decode_tokens.data(), 1, n_past, decode_batch.size(), params.n_threads)) {
+                        fprintf(stderr, "%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    {
+                        const int64_t t_start_sample_us = ggml_time_us();
+
+                        for (int ib = 0; ib < (int) decode_batch.size(); ++ib) {
+                            whisper_process_logits(*ctx, *state, params, *decode_batch[ib], t_cur, ib);
+
+                            ++decode_batch[ib]->kv_self.n;
+                        }
+
+                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                    }
+
+                    decode_ids.swap(decode_ids_next);
+                }
+            }
+
+            // rank the resulting sequences and select the best one
+            {
+                double best_score = -INFINITY;
+
+                for (int j = 0; j < n_decoders_cur; ++j) {
+                    auto & decoder = state->decoders[j];
+
+                    if (decoder.failed) {
+                        continue;
+                    }
+
+                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
+                    whisper_sequence_score(params, decoder.sequence);
+
+                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
+                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+
+                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
+                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
+                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+
+                        decoder.failed = true;
+                        state->n_fail_h++;
+
+                        continue;
+                    }
+
+                    if (best_score < decoder.sequence.score) {
+                        best_score = decoder.sequence.score;
+                        best_decoder_id = j;
+                    }
+                }
+
+                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+            }
+
+            // was the decoding successful for the current temperature?
+            {
+                bool success = true;
+
+                const auto & decoder = state->decoders[best_decoder_id];
+
+                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
+                    success = false;
+                    state->n_fail_p++;
+                }
+
+                if (success) {
+                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
+                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
+                    //}
+
+                    break;
+                }
+            }
+
+            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
+        }
+
+        // output results through a user-provided callback
+        {
+            const auto & best_decoder = state->decoders[best_decoder_id];
+
+            const auto seek_delta = best_decoder.seek_delta;
+            const auto result_len = best_decoder.sequence.result_len;
+
+            const auto & tokens_cur = best_decoder.sequence.tokens;
+
+            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+
+            // update prompt_past
+            prompt_past.clear();
+            if (prompt.front() == whisper_token_prev(ctx)) {
+                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
+            }
+
+            for (int i = 0; i < result_len; ++i) {
+                prompt_past.push_back(tokens_cur[i].id);
+            }
+
+            // store the text from this iteration
+            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
+                int  i0 = 0;
+                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+
+                std::string text;
+
+                for (int i = 0; i < (int) tokens_cur.size(); i++) {
+                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
+                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+
+                    if (params.print_special == false && tokens_cur[i].id >= whisper_token_eot(ctx)) {
+                    } else {
+                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
+                    }
+
+                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
+                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+
+                        if (!text.empty()) {
+                            const auto tt0 = params.speed_up ? 2*t0 : t0;
+                            const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+                            if (params.print_realtime) {
+                                if (params.print_timestamps) {
+                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                } else {
+                                    printf("%s", text.c_str());
+                                    fflush(stdout);
+                                }
+                            }
+
+                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+
+                            result_all.push_back({ tt0, tt1, text, {} });
+                            for (int j = i0; j <= i; j++) {
+                                result_all.back().tokens.push_back(tokens_cur[j]);
+                            }
+
+                            int n_new = 1;
+
+                            if (params.token_timestamps) {
+                                whisper_exp_compute_token_level_timestamps(
+                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+                                if (params.max_len > 0) {
+                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                                }
+                            }
+                            if (params.new_segment_callback) {
+                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                            }
+                        }
+                        text = "";
+                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
+                            i++;
+                        }
+                        i--;
+                        t0 = t1;
+                        i0 = i + 1;
+                    }
+                }
+
+                if (!text.empty()) {
+                    const auto t1 = seek + seek_delta;
+
+                    const auto tt0 = params.speed_up ? 2*t0 : t0;
+                    const auto tt1 = params.speed_up ? 2*t1 : t1;
+
+                    if (params.print_realtime) {
+                        if (params.print_timestamps) {
+                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                        } else {
+                            printf("%s", text.c_str());
+                            fflush(stdout);
+                        }
+                    }
+
+                    result_all.push_back({ tt0, tt1, text, {} });
+                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
+                        result_all.back().tokens.push_back(tokens_cur[j]);
+                    }
+
+                    int n_new = 1;
+
+                    if (params.token_timestamps) {
+                        whisper_exp_compute_token_level_timestamps(
+                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+
+                        if (params.max_len > 0) {
+                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
+                        }
+                    }
+                    if (params.new_segment_callback) {
+                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                    }
+                }
+            }
+
+            // update audio window
+            seek += seek_delta;
+
+            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        }
+    }
+
+    return 0;
+}
+
+
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    if (n_processors == 1) {
+        return whisper_full(ctx, params, samples, n_samples);
+    }
+    int ret = 0;
+
+    // prepare separate states for each thread
+    std::vector<whisper_state*> states;
+
+    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
+    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+
+    // the calling thread will process the first chunk
+    // while the other threads will process the remaining chunks
+
+    std::vector<std::thread> workers(n_processors - 1);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        // create a new state for each thread
+        states.push_back(whisper_init_state(ctx));
+
+        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
+        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+
+        auto params_cur = params;
+
+        params_cur.offset_ms = 0;
+        params_cur.print_progress = false;
+        params_cur.print_realtime = false;
+
+        params_cur.new_segment_callback = nullptr;
+        params_cur.new_segment_callback_user_data = nullptr;
+
+        // the draft state can serve only one thread - the calling one
+        params_cur.draft.ctx = nullptr;
+
+        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+    }
+
+    {
+        auto params_cur = params;
+
+        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
+        params_cur.print_realtime = false;
+
+        // Run the first transformation using default state but only for the first chunk.
+        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    }
+
+    for (int i = 0; i < n_processors - 1; ++i) {
+        workers[i].join();
+    }
+
+    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+
+    // combine results into result_state->result_all from all other states
+    for (int i = 0; i < n_processors - 1; ++i) {
+        auto& results_i = states[i]->result_all;
+
+        for (auto& result : results_i) {
+            // correct the segment timestamp taking into account the offset
+            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+
+
+            // make sure that segments are not overlapping
+            if (!ctx->state->result_all.empty()) {
+                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            }
+
+            ctx->state->result_all.push_back(std::move(result));
+
+            // call the new_segment_callback for each segment
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
+        }
+
+        ctx->state->t_mel_us += states[i]->t_mel_us;
+
+        ctx->state->t_sample_us += states[i]->t_sample_us;
+        ctx->state->t_encode_us += states[i]->t_encode_us;
+        ctx->state->t_decode_us += states[i]->t_decode_us;
+
+        ctx->state->t_decode_build_us   += states[i]->t_decode_build_us;
+        ctx->state->t_decode_compute_us += states[i]->t_decode_compute_us;
+        ctx->state->t_prompt_us         += states[i]->t_prompt_us;
+
+        ctx->state->n_prompt_decoded += states[i]->n_prompt_decoded;
+        ctx->state->n_prompt_reused  += states[i]->n_prompt_reused;
+
+        whisper_free_state(states[i]);
+    }
+
+    // average the timings
+    ctx->state->t_mel_us    /= n_processors;
+    ctx->state->t_sample_us /= n_processors;
+    ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_decode_us /= n_processors;
+
+    ctx->state->t_decode_build_us   /= n_processors;
+    ctx->state->t_decode_compute_us /= n_processors;
+    ctx->state->t_prompt_us         /= n_processors;
+
+    // print information about the audio boundaries
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        fprintf(stderr, "%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    }
+    fprintf(stderr, "%s: the transcription quality may be degraded near these boundaries\n", __func__);
+
+    return ret;
+}
+
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
+
+int whisper_full_n_segments(struct whisper_context * ctx) {
+    return ctx->state->result_all.size();
+}
+
+int whisper_full_get_prompt_past_from_state(struct whisper_state * state, whisper_token * tokens, int n_max) {
+    const int n = state->prompt_past.size();
+    const int n_copy = std::min(n, std::max(0, n_max));
+
+    for (int i = 0; i < n_copy; ++i) {
+        tokens[i] = state->prompt_past[n - n_copy + i];
+    }
+
+    return n;
+}
+
+void whisper_full_set_prompt_past_from_state(struct whisper_state * state, const whisper_token * tokens, int n_tokens) {
+    state->prompt_past.assign(tokens, tokens + n_tokens);
+}
+
+int whisper_full_lang_id_from_state(struct whisper_state * state) {
+    return state->lang_id;
+}
+
+int whisper_full_lang_id(struct whisper_context * ctx) {
+    return ctx->state->lang_id;
+}
+
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
+}
+
+int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t0;
+}
+
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
+}
+
+int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].t1;
+}
+
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
+}
+
+const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].text.c_str();
+}
+
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
+}
+
+int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
+    return ctx->state->result_all[i_segment].tokens.size();
+}
+
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
+}
+
+const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
+}
+
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
+}
+
+whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].id;
+}
+
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
+}
+
+struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token];
+}
+
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
+}
+
+float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
+    return ctx->state->result_all[i_segment].tokens[i_token].p;
+}
+
+// =================================================================================================
+
+//
+// Sessions
+//
+
+struct whisper_session_manager {
+    whisper_context * ctx = nullptr;
+
+    whisper_session_params params;
+
+    whisper_pool_set pools;
+
+    // encodes the audio of the sessions in batches, if encode_max_batch > 1
+    whisper_encoder_batcher * batcher = nullptr;
+
+    std::mutex                   mutex;
+    std::vector<whisper_state *> sessions;
+
+    // memory of a session with n decoders, [WHISPER_MAX_DECODERS + 1] (see whisper_state_mem_required)
+    std::vector<size_t> mem_required;
+};
+
+// memory of a state with the given number of decoders and graphs of n_threads threads, as allocated by
+// whisper_init_state() and whisper_full_with_state()
+// the beams of a beam search share the pages of the self-attention KV cache, so it needs room for one sequence per decoder
+// the compute buffer is measured with the graphs of wstate (see whisper_state_alloc_size)
+static size_t whisper_state_mem_required(whisper_context & wctx, whisper_state & wstate, int n_decoders, int n_threads) {
+    const e_model type  = wctx.model.type;
+    const size_t  scale = whisper_itype_scale(wctx.itype);
+
+    return scale*MEM_REQ_KV_SELF.at(type)*n_decoders +
+           scale*MEM_REQ_KV_CROSS.at(type) +
+           whisper_state_alloc_size(wctx, wstate, n_decoders, n_threads);
+}
+
+struct whisper_session_params whisper_session_default_params(void) {
+    struct whisper_session_params result = {
+        /*.max_sessions        =*/ 16,
+
+        /*.n_threads           =*/ 0,
+        /*.n_threads_per_graph =*/ 0,
+
+        /*.mem_budget          =*/ 0,
+
+        /*.encode_max_batch    =*/ 1,
+        /*.encode_max_wait_ms  =*/ 20,
+    };
+
+    return result;
+}
+
+struct whisper_session_manager * whisper_session_manager_init(struct whisper_context * ctx, struct whisper_session_params params) {
+    if (ctx == nullptr || params.max_sessions <= 0) {
+        fprintf(stderr, "%s: invalid context or max_sessions\n", __func__);
+        return nullptr;
+    }
+
+    if (params.n_threads <= 0) {
+        params.n_threads = std::max(1, (int) std::thread::hardware_concurrency()/2);
+    }
+
+    if (params.n_threads_per_graph <= 0) {
+        params.n_threads_per_graph = std::max(1, params.n_threads/std::min(params.max_sessions, 4));
+    }
+
+    params.n_threads_per_graph = std::min(params.n_threads_per_graph, params.n_threads);
+
+    // measured once with the graphs of a state that is not used otherwise
+    std::vector<size_t> mem_required(WHISPER_MAX_DECODERS + 1, 0);
+    {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            fprintf(stderr, "%s: failed to initialize a state\n", __func__);
+            return nullptr;
+        }
+
+        for (int n = 1; n <= WHISPER_MAX_DECODERS; n++) {
+            mem_required[n] = whisper_state_mem_required(*ctx, *state, n, params.n_threads_per_graph);
+        }
+
+        whisper_free_state(state);
+    }
+
+    if (params.mem_budget > 0 && mem_required[1] > params.mem_budget) {
+        fprintf(stderr, "%s: a session needs %.2f MB, the budget is %.2f MB\n", __func__,
+                mem_required[1]/1024.0/1024.0, params.mem_budget/1024.0/1024.0);
+        return nullptr;
+    }
+
+    whisper_session_manager * manager = new whisper_session_manager;
+
+    manager->ctx    = ctx;
+    manager->params = params;
+
+    manager->mem_required = mem_required;
+
+    // no more graphs than sessions can run at the same time
+    const int n_pools = std::max(1, std::min(params.max_sessions, params.n_threads/params.n_threads_per_graph));
+
+    for (int i = 0; i < n_pools; i++) {
+        manager->pools.pools.push_back(ggml_threadpool_new(params.n_threads_per_graph));
+    }
+
+    manager->pools.free = manager->pools.pools;
+
+    if (params.encode_max_batch > 1) {
+        manager->batcher = whisper_encoder_batcher_init(ctx, std::min(params.encode_max_batch, params.max_sessions), params.encode_max_wait_ms, params.n_threads_per_graph);
+        manager->batcher->wbatch->pools = &manager->pools;
+    }
+
+    fprintf(stderr, "%s: max sessions = %d, %d x %d threads, session memory = %.2f MB\n", __func__,
+            params.max_sessions, n_pools, params.n_threads_per_graph, mem_required[1]/1024.0/1024.0);
+
+    return manager;
+}
+
+void whisper_session_manager_free(struct whisper_session_manager * manager) {
+    if (manager) {
+        for (whisper_state * state : manager->sessions) {
+            whisper_free_state(state);
+        }
+
+        whisper_encoder_batcher_free(manager->batcher);
+
+        for (ggml_threadpool * pool : manager->pools.pools) {
+            ggml_threadpool_free(pool);
+        }
+
+        delete manager;
+    }
+}
+
+struct whisper_state * whisper_session_open(struct whisper_session_manager * manager) {
+    {
+        std::lock_guard<std::mutex> lock(manager->mutex);
+
+        if ((int) manager->sessions.size() >= manager->params.max_sessions) {
+            fprintf(stderr, "%s: %d sessions are open already\n", __func__, manager->params.max_sessions);
+            return nullptr;
+        }
+
+        // reserve the slot, so the state can be allocated without holding the lock
+        manager->sessions.push_back(nullptr);
+    }
+
+    whisper_state * state = whisper_init_state(manager->ctx);
+    if (state) {
+        state->pools   = &manager->pools;
+        state->batcher = manager->batcher;
+    }
+
+    std::lock_guard<std::mutex> lock(manager->mutex);
+
+    auto it = std::find(manager->sessions.begin(), manager->sessions.end(), nullptr);
+    if (state) {
+        *it = state;
+    } else {
+        manager->sessions.erase(it);
+    }
+
+    return state;
+}
+
+void whisper_session_close(struct whisper_session_manager * manager, struct whisper_state * state) {
+    {
+        std::lock_guard<std::mutex> lock(manager->mutex);
+
+        auto it = std::find(manager->sessions.begin(), manager->sessions.end(), state);
+        if (it == manager->sessions.end()) {
+            fprintf(stderr, "%s: not a session of this manager\n", __func__);
+            return;
+        }
+
+        manager->sessions.erase(it);
+    }
+
+    whisper_free_state(state);
+}
+
+int whisper_session_full(
+        struct whisper_session_manager * manager,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples) {
+    if (state->pools != &manager->pools) {
+        fprintf(stderr, "%s: not a session of this manager\n", __func__);
+        return -1;
+    }
+
+    params.n_threads = manager->params.n_threads_per_graph;
+
+    // whisper_full_with_state() grows the self-attention KV cache to one sequence per decoder
+    if (manager->params.mem_budget > 0) {
+        int n_decoders_max = 1;
+        while (n_decoders_max < WHISPER_MAX_DECODERS &&
+               manager->mem_required[n_decoders_max + 1] <= manager->params.mem_budget) {
+            n_decoders_max++;
+        }
+
+        if (params.greedy.best_of > n_decoders_max || params.beam_search.beam_size > n_decoders_max) {
+            WHISPER_PRINT_DEBUG("%s: reducing the number of decoders to %d to stay within the memory budget\n", __func__, n_decoders_max);
+        }
+
+        params.greedy.best_of        = std::min(params.greedy.best_of,        n_decoders_max);
+        params.beam_search.beam_size = std::min(params.beam_search.beam_size, n_decoders_max);
+    }
+
+    return whisper_full_with_state(manager->ctx, state, params, samples, n_samples);
+}
+
+// =================================================================================================
+
+//
+// Voice activity detection
+//
+
+struct whisper_vad_state {
+    whisper_vad_params params;
+
+    int n_frame;       // samples per analysis frame
+    int n_calib;       // number of frames used for the initial noise floor estimate
+    int n_min_speech;  // in frames
+    int n_hangover;    // in frames
+    int64_t n_max_length; // in samples
+
+    whisper_fft_plan fft;
+
+    std::vector<float> hann;
+    std::vector<float> frame;
+    std::vector<float> fft_in;
+    std::vector<float> fft_out;
+    std::vector<float> fft_work;
+    std::vector<float> mag_prev;
+
+    int n_frame_fill;
+    int64_t n_processed;  // samples processed, including the partial frame
+    int64_t i_frame;      // number of complete frames processed
+
+    float noise;          // running estimate of the noise floor energy
+
+    int n_speech_run;     // consecutive speech frames
+    int n_silence_run;    // consecutive silence frames after speech
+    bool in_speech;
+
+    int64_t speech_beg;
+    int64_t speech_end;
+
+    int event;
+};
+
+struct whisper_vad_params whisper_vad_default_params(void) {
+    struct whisper_vad_params result = {
+        /*.sample_rate   =*/ WHISPER_SAMPLE_RATE,
+
+        /*.frame_ms      =*/ 16,
+        /*.calib_ms      =*/ 160,
+        /*.energy_thold  =*/ 3.0f,
+        /*.flux_thold    =*/ 0.5f,
+
+        /*.min_speech_ms =*/ 100,
+        /*.hangover_ms   =*/ 600,
+        /*.max_length_ms =*/ 10000,
+    };
+
+    return result;
+}
+
+struct whisper_vad_state * whisper_vad_init(struct whisper_vad_params params) {
+    if (params.sample_rate <= 0 || params.frame_ms <= 0) {
+        fprintf(stderr, "%s: invalid sample rate or frame length\n", __func__);
+        return nullptr;
+    }
+
+    whisper_vad_state * state = new whisper_vad_state;
+
+    state->params = params;
+
+    const int n_frame = std::max(1, (params.sample_rate*params.frame_ms)/1000);
+
+    state->n_frame      = n_frame;
+    state->n_calib      = std::max(1, params.calib_ms/params.frame_ms);
+    state->n_min_speech = std::max(1, params.min_speech_ms/params.frame_ms);
+    state->n_hangover   = std::max(1, params.hangover_ms/params.frame_ms);
+    state->n_max_length = ((int64_t) params.max_length_ms*params.sample_rate)/1000;
+
+    state->hann.resize(n_frame);
+    for (int i = 0; i < n_frame; i++) {
+        state->hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(n_frame)));
+    }
+
+    whisper_fft_plan_init(state->fft, n_frame);
+
+    state->frame.resize(n_frame);
+    state->fft_in.resize(n_frame);
+    state->fft_out.resize(2*(n_frame/2 + 1));
+    state->fft_work.resize(4*state->fft.m);
+    state->mag_prev.resize(n_frame/2 + 1);
+
+    whisper_vad_reset(state);
+
+    return state;
+}
+
+void whisper_vad_free(struct whisper_vad_state * state) {
+    delete state;
+}
+
+void whisper_vad_reset(struct whisper_vad_state * state) {
+    state->n_frame_fill  = 0;
+    state->n_processed   = 0;
+    state->i_frame       = 0;
+    state->noise         = 0.0f;
+    state->n_speech_run  = 0;
+    state->n_silence_run = 0;
+    state->in_speech     = false;
+    state->speech_beg    = -1;
+    state->speech_end    = -1;
+    state->event         = WHISPER_VAD_WAITING;
+
+    std::fill(state->mag_prev.begin(), state->mag_prev.end(), 0.0f);
+}
+
+// classify a single complete frame and advance the endpointing state machine
+static void whisper_vad_process_frame(whisper_vad_state & vs) {
+    const int n = vs.n_frame;
+
+    // energy: average of the fabs of the signal, the same measure as get_signal_energy() over a single window
+    const float energy = get_signal_abs_sum(vs.frame.data(), n)/n;
+
+    // normalised spectral flux: positive change in magnitude spectrum relative to the previous frame
+    for (int i = 0; i < n; i++) {
+        vs.fft_in[i] = vs.hann[i]*vs.frame[i];
+    }
+
+    whisper_fft(vs.fft, vs.fft_in.data(), vs.fft_out.data(), vs.fft_work.data());
+
+    float flux     = 0.0f;
+    float mag_prev = 0.0f;
+    for (int k = 0; k <= n/2; k++) {
+        const float mag = sqrtf(vs.fft_out[2*k + 0]*vs.fft_out[2*k + 0] + vs.fft_out[2*k + 1]*vs.fft_out[2*k + 1]);
+        flux     += std::max(0.0f, mag - vs.mag_prev[k]);
+        mag_prev += vs.mag_prev[k];
+        vs.mag_prev[k] = mag;
+    }
+    flux /= (mag_prev + 1e-6f);
+
+    const int64_t frame_beg = vs.i_frame*n;
+
+    vs.i_frame++;
+
+    // until speech starts, the noise floor is the quietest frame so far - the user often starts speaking right away, so
+    // the first frames can't be assumed to be silence, but there are quieter frames between the syllables.
+    // digital silence (e.g. while the capture device starts) says nothing about the noise, so it is skipped
+    if (!vs.in_speech && energy > 1e-5f && (vs.noise == 0.0f || energy < vs.noise)) {
+        vs.noise = energy;
+    }
+
+    if (vs.i_frame <= vs.n_calib) {
+        return;
+    }
+
+    const float noise_floor = std::max(vs.noise, 1e-5f);
+
+    const bool is_speech =
+        energy > vs.params.energy_thold*noise_floor ||
+        (flux > vs.params.flux_thold && energy > 0.5f*vs.params.energy_thold*noise_floor);
+
+    if (!is_speech) {
+        // slowly track the noise floor during silence
+        vs.noise = 0.95f*vs.noise + 0.05f*energy;
+    }
+
+    if (!vs.in_speech) {
+        if (is_speech) {
+            if (vs.n_speech_run == 0) {
+                vs.speech_beg = frame_beg;
+            }
+            vs.n_speech_run++;
+
+            if (vs.n_speech_run >= vs.n_min_speech) {
+                vs.in_speech     = true;
+                vs.n_silence_run = 0;
+                vs.event         = WHISPER_VAD_SPEECH;
+            }
+        } else {
+            vs.n_speech_run = 0;
+            vs.speech_beg   = -1;
+        }
+        if (is_speech) {
+            vs.speech_end = frame_beg + n;
+        }
+        return;
+    }
+
+    if (is_speech) {
+        vs.n_silence_run = 0;
+        vs.speech_end    = frame_beg + n;
+    } else {
+        vs.n_silence_run++;
+
+        if (vs.n_silence_run >= vs.n_hangover) {
+            vs.event = WHISPER_VAD_END_OF_SPEECH;
+        }
+    }
+}
+
+int whisper_vad_process(struct whisper_vad_state * state, const float * samples, int n_samples) {
+    whisper_vad_state & vs = *state;
+
+    if (vs.event == WHISPER_VAD_END_OF_SPEECH || vs.event == WHISPER_VAD_MAX_LENGTH) {
+        return vs.event;
+    }
+
+    for (int i = 0; i < n_samples; i++) {
+        vs.frame[vs.n_frame_fill++] = samples[i];
+        vs.n_processed++;
+
+        if (vs.n_frame_fill == vs.n_frame) {
+            vs.n_frame_fill = 0;
+
+            whisper_vad_process_frame(vs);
+
+            if (vs.event == WHISPER_VAD_END_OF_SPEECH) {
+                break;
+            }
+        }
+
+        if (vs.n_max_length > 0 && vs.n_processed >= vs.n_max_length) {
+            vs.event = WHISPER_VAD_MAX_LENGTH;
+            break;
+        }
+    }
+
+    return vs.event;
+}
+
+int64_t whisper_vad_speech_beg(struct whisper_vad_state * state) {
+    return state->in_speech ? state->speech_beg : -1;
+}
+
+int64_t whisper_vad_speech_end(struct whisper_vad_state * state) {
+    return state->in_speech ? state->speech_end : -1;
+}
+
+// =================================================================================================
+
+//
+// Temporary interface needed for exposing ggml interface
+// Will be removed in the future when ggml becomes a separate library
+//
+
+WHISPER_API int whisper_bench_memcpy(int n_threads) {
+    fputs(whisper_bench_memcpy_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    size_t n    = 50;
+    size_t arr  = n_threads > 0 ? 1024 : n_threads; // trick to avoid compiler optimizations
+
+    // 1 GB array
+    const size_t size = arr*1024llu*1024llu;
+
+    char * src = (char *) malloc(size);
+    char * dst = (char *) malloc(size);
+
+    for (size_t i = 0; i < size; i++) src[i] = i;
+
+    memcpy(dst, src, size); // heat-up
+
+    double tsum = 0.0;
+
+    for (size_t i = 0; i < n; i++) {
+        const int64_t t0 = ggml_time_us();
+
+        memcpy(dst, src, size);
+
+        const int64_t t1 = ggml_time_us();
+
+        tsum += (t1 - t0)*1e-6;
+
+        src[0] = rand();
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "memcpy: %.2f GB/s\n", (double) (n*size)/(tsum*1024llu*1024llu*1024llu));
+    s += strbuf;
+
+    // needed to prevent the compile from optimizing the memcpy away
+    {
+        double sum = 0.0;
+
+        for (size_t i = 0; i < size; i++) sum += dst[i];
+
+        snprintf(strbuf, sizeof(strbuf), "sum:    %s %f\n", sum == -536870910.00 ? "ok" : "error", sum);
+        s += strbuf;
+    }
+
+    free(src);
+    free(dst);
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
+    const char * str = whisper_bench_ggml_mul_mat_str(n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
+
+WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_max = 128;
+
+    const std::vector<size_t> sizes = {
+        64, 128, 256, 512, 1024, 2048, 4096,
+    };
+
+    const size_t N_max = sizes.back();
+
+    const std::vector<ggml_type> wtypes = {
+        GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1, GGML_TYPE_Q8_0, GGML_TYPE_F16, GGML_TYPE_F32,
+    };
+
+    // a: N*N*sizeof(float)
+    // b: N*N*sizeof(float)
+    // c: N*N*sizeof(float)
+    // when F16 or a quantized type is used, there is an extra work buffer of at most N*N*sizeof(float)
+    std::vector<char> buf(4llu*N_max*N_max*sizeof(float) + 4*256);
+
+    // the quantized weights are initialized with a valid pattern below, so that the timings aren't skewed by NaNs
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+    std::vector<float> a_f32;
+
+    for (int j = 0; j < (int) sizes.size(); j++) {
+        const size_t N = sizes[j];
+
+        snprintf(strbuf, sizeof(strbuf), "ggml_mul_mat: %4zu x %4zu:", N, N);
+        s += strbuf;
+
+        for (int k = 0; k < (int) wtypes.size(); ++k) {
+            const ggml_type wtype = wtypes[k];
+
+            // GFLOPS/s
+            double gflops = 0.0;
+            int    n      = 0;
+
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ buf.size(),
+                /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
+            };
+
+            struct ggml_context * ctx0 = ggml_init(gparams);
+
+            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
+            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+
+            if (ggml_is_quantized(wtype)) {
+                a_f32.resize(N*N);
+                for (size_t i = 0; i < a_f32.size(); i++) a_f32[i] = (float)((i*7919) % 255) - 127.0f;
+
+                ggml_quantize(wtype, a_f32.data(), a->data, (int) a_f32.size());
+            }
+
+            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+
+            struct ggml_cgraph gf = ggml_build_forward(c);
+
+            gf.n_threads = n_threads;
+            gf.pool      = pool;
+
+            double tsum = 0.0;
+
+            // heat-up
+            ggml_graph_compute(ctx0, &gf);
+
+            for (int i = 0; i < n_max; ++i) {
+                const int64_t t0 = ggml_time_us();
+
+                ggml_graph_compute(ctx0, &gf);
+
+                const int64_t t1 = ggml_time_us();
+
+                tsum += (t1 - t0)*1e-6;
+                n++;
+
+                if (tsum > 1.0 && n >= 3) {
+                    break;
+                }
+            }
+
+            ggml_free(ctx0);
+
+            gflops = ((2.0*N*N*N*n)/tsum)*1e-9;
+
+            snprintf(strbuf, sizeof(strbuf), " %s %7.1f GFLOPS (%3d runs)%s", ggml_type_name(wtype), gflops, n, k + 1 < (int) wtypes.size() ? " /" : "\n");
+            s += strbuf;
+        }
+    }
+
+    // the F16 matrix multiplications of the encoder of each model, with the blocked GEMM and with the dot products
+    // that are used for a few src1 columns - src1 is split into views of 8 columns for the latter
+    {
+        struct shape {
+            const char * name;
+            int n0; // src0 rows
+            int k;  // src0 columns
+        };
+
+        const int n_states[] = { 384, 512, 768, 1024, 1280 };
+        const char * models[] = { "tiny", "base", "small", "medium", "large" };
+
+        const int n_ctx   = 1500;
+        const int n_split = 8;
+
+        for (int m = 0; m < 5; ++m) {
+            const int n_state = n_states[m];
+
+            const shape shapes[] = {
+                { "attn",   n_state,   n_state, },
+                { "mlp_0", 4*n_state,  n_state, },
+                { "mlp_1",   n_state, 4*n_state, },
+            };
+
+            for (const auto & sh : shapes) {
+                // src0, src1, dst twice, the work buffer and the views
+                std::vector<char> buf2(sizeof(ggml_fp16_t)*sh.n0*sh.k + 2*sizeof(float)*sh.k*n_ctx + 2*sizeof(float)*sh.n0*n_ctx +
+                        sizeof(float)*n_threads*(1 << 20) + 16*1024*1024);
+
+                struct ggml_init_params gparams = {
+                    /*.mem_size   =*/ buf2.size(),
+                    /*.mem_buffer =*/ buf2.data(),
+                    /*.no_alloc   =*/ false,
+                };
+
+                struct ggml_context * ctx0 = ggml_init(gparams);
+
+                struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, sh.k, sh.n0);
+                struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, sh.k, n_ctx);
+
+                for (int i = 0; i < sh.n0*sh.k; i++) ((ggml_fp16_t *) a->data)[i] = ggml_fp32_to_fp16((((int64_t) i*7919) % 255)/127.0f - 1.0f);
+                for (int i = 0; i < sh.k*n_ctx; i++) ((float *) b->data)[i] = (((int64_t) i*104729) % 251)/125.0f - 1.0f;
+
+                struct ggml_cgraph gf[2];
+
+                gf[0] = ggml_build_forward(ggml_mul_mat(ctx0, a, b));
+
+                gf[1] = {};
+                for (int j = 0; j < n_ctx; j += n_split) {
+                    struct ggml_tensor * bj = ggml_view_2d(ctx0, b, sh.k, std::min(n_split, n_ctx - j), b->nb[1], j*b->nb[1]);
+
+                    ggml_build_forward_expand(&gf[1], ggml_mul_mat(ctx0, a, bj));
+                }
+
+                double gflops[2];
+
+                for (int l = 0; l < 2; ++l) {
+                    gf[l].n_threads = n_threads;
+                    gf[l].pool      = pool;
+
+                    // heat-up
+                    ggml_graph_compute(ctx0, &gf[l]);
+
+                    double tsum = 0.0;
+                    int    n    = 0;
+
+                    while (tsum < 1.0 || n < 2) {
+                        const int64_t t0 = ggml_time_us();
+
+                        ggml_graph_compute(ctx0, &gf[l]);
+
+                        tsum += (ggml_time_us() - t0)*1e-6;
+                        n++;
+                    }
+
+                    gflops[l] = 2.0*sh.n0*sh.k*n_ctx*n/tsum*1e-9;
+                }
+
+                // dst of the GEMM vs the dst of each view
+                double max_diff = 0.0;
+                double max_abs  = 0.0;
+
+                const float * c = (const float *) gf[0].nodes[gf[0].n_nodes - 1]->data;
+
+                for (int i = 0; i < gf[1].n_nodes; ++i) {
+                    const struct ggml_tensor * cj = gf[1].nodes[i];
+                    if (cj->op != GGML_OP_MUL_MAT) {
+                        continue;
+                    }
+
+                    const int j0 = (int) (((const char *) cj->src1->data - (const char *) b->data)/b->nb[1]);
+
+                    for (int j = 0; j < cj->ne[1]; ++j) {
+                        for (int r = 0; r < sh.n0; ++r) {
+                            const float x = c[(j0 + j)*sh.n0 + r];
+                            const float y = ((const float *) cj->data)[j*sh.n0 + r];
+
+                            max_diff = std::max(max_diff, (double) std::fabs(x - y));
+                            max_abs  = std::max(max_abs,  (double) std::fabs(y));
+                        }
+                    }
+                }
+
+                ggml_free(ctx0);
+
+                snprintf(strbuf, sizeof(strbuf), "ggml_mul_mat: %-6s %-5s %4d x %4d x %4d: gemm %7.1f GFLOPS, dot %7.1f GFLOPS, speed-up %5.2fx, max diff %.2e of %.1f: %s\n",
+                        models[m], sh.name, sh.n0, sh.k, n_ctx, gflops[0], gflops[1], gflops[0]/gflops[1], max_diff, max_abs,
+                        max_diff <= 1e-6*sh.k*std::max(1.0, max_abs) ? "ok" : "FAILED");
+                s += strbuf;
+            }
+        }
+    }
+
+    ggml_threadpool_free(pool);
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_ggml_conv_1d(int n_threads) {
+    const char * str = whisper_bench_ggml_conv_1d_str(n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
+
+WHISPER_API const char * whisper_bench_ggml_conv_1d_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_states[] = { 384, 512, 768, 1024, 1280 };
+    const char * models[] = { "tiny", "base", "small", "medium", "large" };
+
+    const int n_mels = 80;
+    const int n_len  = 3000; // mel frames of a 30 s window
+    const int n_tiny = 8;    // mel frames short enough for the dot products instead of the implicit GEMM
+    const int nk     = 3;
+
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+    for (int m = 0; m < 5; ++m) {
+        const int n_state = n_states[m];
+
+        for (int i_conv = 0; i_conv < 2; ++i_conv) {
+            const int n_in   = i_conv == 0 ? n_mels : n_state;
+            const int stride = i_conv == 0 ? 1 : 2;
+
+            // the kernel, the inputs, the outputs and the work buffers of the four graphs, with room to spare
+            std::vector<char> buf(4*sizeof(ggml_fp16_t)*nk*n_in*n_state + 4*sizeof(float)*(n_len + n_tiny)*(n_in + n_state) +
+                    4*n_threads*ggml_mul_mat_thread_wsize() + 1024*1024);
+
+            struct ggml_init_params gparams = {
+                /*.mem_size   =*/ buf.size(),
+                /*.mem_buffer =*/ buf.data(),
+                /*.no_alloc   =*/ false,
+            };
+
+            struct ggml_context * ctx0 = ggml_init(gparams);
+
+            struct ggml_tensor * w = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, nk, n_in, n_state);
+            struct ggml_tensor * x = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_len, n_in);
+
+            struct ggml_tensor * x_tiny = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tiny, n_in);
+
+            for (int i = 0; i < nk*n_in*n_state; i++) ((ggml_fp16_t *) w->data)[i] = ggml_fp32_to_fp16((((int64_t) i*7919) % 255)/127.0f - 1.0f);
+            for (int i = 0; i < n_len*n_in; i++) ((float *) x->data)[i] = (((int64_t) i*104729) % 251)/125.0f - 1.0f;
+            for (int i = 0; i < n_tiny*n_in; i++) ((float *) x_tiny->data)[i] = (((int64_t) i*7907) % 253)/126.0f - 1.0f;
+
+            // the reference uses the kernel in rows and the input rounded to F16, like the convolutions
+            std::vector<float> w_f32(nk*n_in*n_state);
+            for (int i = 0; i < (int) w_f32.size(); i++) w_f32[i] = ggml_fp16_to_fp32(((ggml_fp16_t *) w->data)[i]);
+
+            double max_diff = 0.0;
+            double max_abs  = 0.0;
+
+            // compares the output channels with a stride of ch_step against a double precision convolution
+            auto check = [&](const struct ggml_tensor * src, const struct ggml_tensor * dst, int ch_step) {
+                const int n_src = src->ne[0];
+                const int n_dst = dst->ne[0];
+
+                for (int o = 0; o < n_state; o += ch_step) {
+                    for (int t = 0; t < n_dst; ++t) {
+                        double sum = 0.0;
+                        for (int c = 0; c < n_in; ++c) {
+                            for (int k = 0; k < nk; ++k) {
+                                const int ts = t*stride + k - nk/2;
+                                if (ts < 0 || ts >= n_src) {
+                                    continue;
+                                }
+                                const float v = ggml_fp16_to_fp32(ggml_fp32_to_fp16(((const float *) src->data)[c*n_src + ts]));
+                                sum += (double) w_f32[(o*n_in + c)*nk + k]*v;
+                            }
+                        }
+
+                        max_diff = std::max(max_diff, std::fabs(sum - ((const float *) dst->data)[o*n_dst + t]));
+                        max_abs  = std::max(max_abs,  std::fabs(sum));
+                    }
+                }
+            };
+
+            double gflops[2] = { 0.0, 0.0 };
+
+            // with the kernel in rows, and packed with ggml_conv_1d_pack() as whisper_model_load does
+            for (int l = 0; l < 2; ++l) {
+                if (l == 1 && !ggml_conv_1d_pack(w)) {
+                    break;
+                }
+
+                struct ggml_tensor * y      = i_conv == 0 ? ggml_conv_1d_1s(ctx0, w, x)      : ggml_conv_1d_2s(ctx0, w, x);
+                struct ggml_tensor * y_tiny = i_conv == 0 ? ggml_conv_1d_1s(ctx0, w, x_tiny) : ggml_conv_1d_2s(ctx0, w, x_tiny);
+
+                struct ggml_cgraph gf = ggml_build_forward(y);
+
+                gf.n_threads = n_threads;
+                gf.pool      = pool;
+
+                // heat-up
+                ggml_graph_compute(ctx0, &gf);
+
+                double tsum = 0.0;
+                int    n    = 0;
+
+                while (tsum < 1.0 || n < 2) {
+                    const int64_t t0 = ggml_time_us();
+
+                    ggml_graph_compute(ctx0, &gf);
+
+                    tsum += (ggml_time_us() - t0)*1e-6;
+                    n++;
+                }
+
+                gflops[l] = 2.0*nk*n_in*n_state*y->ne[0]*n/tsum*1e-9;
+
+                struct ggml_cgraph gf_tiny = ggml_build_forward(y_tiny);
+
+                gf_tiny.n_threads = n_threads;
+                gf_tiny.pool      = pool;
+
+                ggml_graph_compute(ctx0, &gf_tiny);
+
+                check(x,      y,      16);
+                check(x_tiny, y_tiny, 1);
+            }
+
+            ggml_free(ctx0);
+
+            snprintf(strbuf, sizeof(strbuf), "ggml_conv_1d: %-6s conv%d %4d -> %4d x %4d: rows %7.1f GFLOPS, packed %7.1f GFLOPS, max diff %.2e of %.1f: %s\n",
+                    models[m], i_conv + 1, n_in, n_state, n_len/stride, gflops[0], gflops[1], max_diff, max_abs,
+                    max_diff <= 1e-6*nk*n_in*std::max(1.0, max_abs) ? "ok" : "FAILED");
+            s += strbuf;
+        }
+    }
+
+    ggml_threadpool_free(pool);
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_ggml_flash_attn(int n_threads) {
+    const char * str = whisper_bench_ggml_flash_attn_str(n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
+
+WHISPER_API const char * whisper_bench_ggml_flash_attn_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int n_heads[] = { 6, 8, 12, 16, 20 };
+    const char * models[] = { "tiny", "base", "small", "medium", "large" };
 
-        /*.temperature_inc  =*/  0.0f, // TODO: temporary disabled until improve performance
-        /*.entropy_thold    =*/  2.4f,
-        /*.logprob_thold    =*/ -1.0f,
-        /*.no_speech_thold  =*/  0.6f,
+    const int n_ctxs[] = { 1500, 750, 375 }; // the full and shortened audio contexts
 
-        /*.greedy           =*/ {
-            /*.best_of   =*/ -1,
-        },
+    const int D      = 64; // head size of all the models
+    const int n_beam = 5;  // queries of the cross-attention with beam search
 
-        /*.beam_search      =*/ {
-            /*.beam_size =*/ -1,
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
 
-            /*.patience  =*/ -1.0f,
-        },
+    for (int m = 0; m < 5; ++m) {
+        const int H = n_heads[m];
 
-        /*.new_segment_callback           =*/ nullptr,
-        /*.new_segment_callback_user_data =*/ nullptr,
+        for (int i_ctx = 0; i_ctx < 3; ++i_ctx) {
+            const int M = n_ctxs[i_ctx];
 
-        /*.encoder_begin_callback           =*/ nullptr,
-        /*.encoder_begin_callback_user_data =*/ nullptr,
+            // encoder self-attention, and decoder cross-attention over the encoder output
+            for (int i_att = 0; i_att < 2; ++i_att) {
+                const int N = i_att == 0 ? M : n_beam;
 
-        /*.logits_filter_callback           =*/ nullptr,
-        /*.logits_filter_callback_user_data =*/ nullptr,
-    };
+                // the inputs, the outputs, the scores of the unfused path and the work buffers, with room to spare
+                std::vector<char> buf(sizeof(float)*((size_t) 4*D*N*H + 4*D*M*H + 2*N*M*H) +
+                        4*n_threads*ggml_mul_mat_thread_wsize() + 1024*1024);
 
-    switch (strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                result.greedy = {
-                    /*.best_of   =*/ 1,
+                struct ggml_init_params gparams = {
+                    /*.mem_size   =*/ buf.size(),
+                    /*.mem_buffer =*/ buf.data(),
+                    /*.no_alloc   =*/ false,
                 };
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                result.beam_search = {
-                    /*.beam_size =*/ 5,
 
-                    /*.patience  =*/ -1.0f,
-                };
-            } break;
-    }
+                struct ggml_context * ctx0 = ggml_init(gparams);
 
-    return result;
-}
+                // the fused kernel reads K with the keys contiguous and V with the values of each key contiguous, as
+                // the whisper graphs store them, the matrix multiplications read K in rows and V transposed
+                struct ggml_tensor * q    = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, D, N, H);
+                struct ggml_tensor * k    = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, D, M, H);
+                struct ggml_tensor * k_t  = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, M, D, H);
+                struct ggml_tensor * v    = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, D, M, H);
+                struct ggml_tensor * v_t  = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, M, D, H);
 
-// forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum);
+                for (int i = 0; i < D*N*H; i++) ((float *) q->data)[i] = (((int64_t) i*7919) % 255)/63.5f - 2.0f;
 
-// trim from start (in place)
-static inline void ltrim(std::string &s) {
-    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }));
-}
+                for (int h = 0; h < H; ++h) {
+                    for (int j = 0; j < M; ++j) {
+                        for (int d = 0; d < D; ++d) {
+                            const int64_t i = (int64_t) (h*M + j)*D + d;
 
-// trim from end (in place)
-static inline void rtrim(std::string &s) {
-    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-        return !std::isspace(ch);
-    }).base(), s.end());
-}
+                            const ggml_fp16_t ki = ggml_fp32_to_fp16(((i*104729) % 251)/62.5f - 2.0f);
+                            const ggml_fp16_t vi = ggml_fp32_to_fp16(((i*7907) % 253)/126.0f - 1.0f);
 
-// trim from both ends (in place)
-static inline void trim(std::string &s) {
-    rtrim(s);
-    ltrim(s);
-}
+                            ((ggml_fp16_t *) k->data)[i] = ki;
+                            ((ggml_fp16_t *) v->data)[i] = vi;
 
-static inline bool should_split_on_word(const char * txt, bool split_on_word) {
-    if (!split_on_word) return true;
+                            ((ggml_fp16_t *) k_t->data)[(h*D + d)*M + j] = ki;
+                            ((ggml_fp16_t *) v_t->data)[(h*D + d)*M + j] = vi;
+                        }
+                    }
+                }
 
-    return txt[0] == ' ';
+                struct ggml_tensor * y_fused = ggml_flash_attn(ctx0, q, ggml_permute(ctx0, k_t, 1, 0, 2, 3), ggml_permute(ctx0, v, 1, 0, 2, 3), false);
+
+                struct ggml_tensor * y_unfused =
+                    ggml_mul_mat(ctx0,
+                            v_t,
+                            ggml_soft_max(ctx0,
+                                ggml_scale(ctx0,
+                                    ggml_mul_mat(ctx0, k, q),
+                                    ggml_new_f32(ctx0, 1.0f/sqrtf(D)))));
+
+                double t_ms[2] = { 0.0, 0.0 };
+
+                for (int l = 0; l < 2; ++l) {
+                    struct ggml_cgraph gf = ggml_build_forward(l == 0 ? y_unfused : y_fused);
+
+                    gf.n_threads = n_threads;
+                    gf.pool      = pool;
+
+                    // heat-up
+                    ggml_graph_compute(ctx0, &gf);
+
+                    double tsum = 0.0;
+                    int    n    = 0;
+
+                    while (tsum < 1.0 || n < 2) {
+                        const int64_t t0 = ggml_time_us();
+
+                        ggml_graph_compute(ctx0, &gf);
+
+                        tsum += (ggml_time_us() - t0)*1e-6;
+                        n++;
+                    }
+
+                    t_ms[l] = 1e3*tsum/n;
+                }
+
+                // every 16th query of each head against a double precision softmax
+                double max_diff = 0.0;
+
+                std::vector<double> p(M);
+
+                for (int h = 0; h < H; ++h) {
+                    for (int i = 0; i < N; i += 16) {
+                        const float * qi = (const float *) q->data + (h*N + i)*D;
+
+                        double max = -INFINITY;
+                        for (int j = 0; j < M; ++j) {
+                            double sum = 0.0;
+                            for (int d = 0; d < D; ++d) {
+                                sum += (double) qi[d]*ggml_fp16_to_fp32(((const ggml_fp16_t *) k->data)[(h*M + j)*D + d]);
+                            }
+                            p[j] = sum/sqrt((double) D);
+                            max = std::max(max, p[j]);
+                        }
+
+                        double sum = 0.0;
+                        for (int j = 0; j < M; ++j) {
+                            p[j] = exp(p[j] - max);
+                            sum += p[j];
+                        }
+
+                        for (int d = 0; d < D; ++d) {
+                            double o = 0.0;
+                            for (int j = 0; j < M; ++j) {
+                                o += p[j]*ggml_fp16_to_fp32(((const ggml_fp16_t *) v->data)[(h*M + j)*D + d]);
+                            }
+
+                            max_diff = std::max(max_diff, std::fabs(o/sum - ((const float *) y_fused->data)[(h*N + i)*D + d]));
+                        }
+                    }
+                }
+
+                ggml_free(ctx0);
+
+                snprintf(strbuf, sizeof(strbuf), "ggml_flash_attn: %-6s %-5s %4d x %4d x %2d heads: unfused %8.2f ms, fused %8.2f ms, %5.2fx, max diff %.2e: %s\n",
+                        models[m], i_att == 0 ? "self" : "cross", N, M, H, t_ms[0], t_ms[1], t_ms[0]/t_ms[1], max_diff,
+                        max_diff <= 1e-5 ? "ok" : "FAILED");
+                s += strbuf;
+            }
+        }
+    }
+
+    ggml_threadpool_free(pool);
+
+    return s.c_str();
 }
 
-// wrap the last segment to max_len characters
-// returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+WHISPER_API int whisper_bench_ggml_threads(int n_threads_max, bool with_cpu_hog) {
+    fputs(whisper_bench_ggml_threads_str(n_threads_max, with_cpu_hog), stderr);
+    return 0;
+}
 
-    int res = 1;
-    int acc = 0;
+WHISPER_API const char * whisper_bench_ggml_threads_str(int n_threads_max, bool with_cpu_hog) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    std::string text;
+    ggml_time_init();
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
-        if (token.id >= whisper_token_eot(&ctx)) {
-            continue;
+    // keep every processor busy with a spinning thread
+    std::atomic<bool> hog_stop(false);
+    std::vector<std::thread> hogs;
+    if (with_cpu_hog) {
+        const int n_hog = std::max(1, (int) std::thread::hardware_concurrency());
+        for (int i = 0; i < n_hog; ++i) {
+            hogs.emplace_back([&hog_stop]() {
+                volatile uint64_t x = 0;
+                while (!hog_stop.load(std::memory_order_relaxed)) {
+                    x = x + 1;
+                }
+            });
         }
+    }
 
-        const auto txt = whisper_token_to_str(&ctx, token.id);
-        const int cur = strlen(txt);
+    // encoder-like: [n_state x n_state] x [n_state x 256] and decoder-like: [n_state x n_state] x [n_state x 1], base model sizes
+    const int n_state = 512;
+    const int n_cols[2] = { 256, 1 };
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            // split here
-            if (split_on_word) {
-                trim(text);
-            }
+    std::vector<char> buf(2llu*n_state*n_state*sizeof(float) + 4llu*n_state*n_cols[0]*sizeof(float) + 4*1024);
 
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
+    for (int k = 0; k < 2; ++k) {
+        const int N = n_cols[k];
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+        struct ggml_init_params gparams = {
+            /*.mem_size   =*/ buf.size(),
+            /*.mem_buffer =*/ buf.data(),
+            /*.no_alloc   =*/ false,
+        };
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+        struct ggml_context * ctx0 = ggml_init(gparams);
 
-            acc = 0;
-            text = "";
+        struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_state, n_state);
+        struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
 
-            segment = state.result_all.back();
-            i = -1;
+        memset(a->data, 0, ggml_nbytes(a));
+        memset(b->data, 0, ggml_nbytes(b));
 
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
+        struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+
+        double t_1 = 0.0;
+
+        for (int n_threads = 1; n_threads <= n_threads_max; ++n_threads) {
+            struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+            struct ggml_cgraph gf = ggml_build_forward(c);
+
+            gf.n_threads = n_threads;
+            gf.pool      = pool;
+
+            // heat-up
+            ggml_graph_compute(ctx0, &gf);
+
+            int    n    = 0;
+            double tsum = 0.0;
+
+            while (tsum < 0.5 || n < 3) {
+                const int64_t t0 = ggml_time_us();
+
+                ggml_graph_compute(ctx0, &gf);
+
+                const int64_t t1 = ggml_time_us();
+
+                tsum += (t1 - t0)*1e-6;
+                n++;
+            }
+
+            ggml_threadpool_free(pool);
+
+            const double t = 1e3*tsum/n;
+            if (n_threads == 1) {
+                t_1 = t;
+            }
+
+            snprintf(strbuf, sizeof(strbuf), "ggml_threads: %s %4d x %4d x %4d: %2d threads: %8.3f ms (%5d runs), speed-up %5.2fx%s\n",
+                    k == 0 ? "encoder" : "decoder", n_state, n_state, N, n_threads, t, n, t_1/t, with_cpu_hog ? " (with CPU hog)" : "");
+            s += strbuf;
         }
+
+        ggml_free(ctx0);
     }
 
-    if (split_on_word) {
-        trim(text);
+    hog_stop = true;
+    for (auto & hog : hogs) {
+        hog.join();
     }
-    state.result_all.back().text = std::move(text);
 
-    return res;
+    return s.c_str();
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+WHISPER_API int whisper_bench_ggml_elementwise(int n_threads) {
+    fputs(whisper_bench_ggml_elementwise_str(n_threads), stderr);
+    return 0;
+}
 
-// process the logits for the selected decoder
-// - applies logit filters
-// - computes logprobs and probs
-static void whisper_process_logits(
-              struct whisper_context & ctx,
-               struct whisper_state  & state,
-    const struct whisper_full_params   params,
-              struct whisper_decoder & decoder,
-                               float   temperature) {
-    const auto & vocab      = ctx.vocab;
-    const auto & tokens_cur = decoder.sequence.tokens;
+WHISPER_API const char * whisper_bench_ggml_elementwise_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    const bool is_initial = tokens_cur.size() == 0;
-    const int  n_logits   = vocab.id_to_token.size();
+    ggml_time_init();
 
-    WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
+    // the elementwise ops of the encoder, with base model sizes: n_state = 512, n_ctx = 1500
+    // "repeat" + "add" is the cost of adding a bias with ggml_repeat(), "add bias" the cost of the broadcasting ggml_add()
+    const int n_state = 512;
+    const int n_ctx   = 1500;
 
-    // extract the logits for the last token
-    // we will be mutating and therefore we don't want to use the ctx.logits buffer directly
-    auto & probs    = decoder.probs;
-    auto & logits   = decoder.logits;
-    auto & logprobs = decoder.logprobs;
-    {
-        logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + (state.logits.size() - n_logits), n_logits*sizeof(float));
+    std::vector<char> buf(16llu*4*n_state*n_ctx*sizeof(float) + 64*1024);
+
+    struct ggml_init_params gparams = {
+        /*.mem_size   =*/ buf.size(),
+        /*.mem_buffer =*/ buf.data(),
+        /*.no_alloc   =*/ false,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(gparams);
+
+    struct ggml_tensor * x    = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32,   n_state, n_ctx);
+    struct ggml_tensor * y    = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32,   n_state, n_ctx);
+    struct ggml_tensor * h    = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 4*n_state, n_ctx);
+    struct ggml_tensor * bias = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32,   n_state);
+
+    for (int i = 0; i < ggml_nelements(x); ++i) {
+        ((float *) x->data)[i] = 0.5f + 0.001f*(i % 1000);
+        ((float *) y->data)[i] = 1.5f - 0.001f*(i % 1000);
+    }
+    memset(h->data,    0, ggml_nbytes(h));
+    memset(bias->data, 0, ggml_nbytes(bias));
+
+    struct op_case {
+        const char * name;
+        struct ggml_tensor * t;
+    };
+
+    const op_case cases[] = {
+        { "repeat",  ggml_repeat(ctx0, bias, x) },
+        { "add",     ggml_add   (ctx0, x, y) },
+        { "add bias", ggml_add  (ctx0, x, bias) },
+        { "sub",     ggml_sub   (ctx0, x, y) },
+        { "mul",     ggml_mul   (ctx0, x, y) },
+        { "sqr",     ggml_sqr   (ctx0, x) },
+        { "mean",    ggml_mean  (ctx0, x) },
+        { "relu",    ggml_relu  (ctx0, h) },
+        { "cpy f16", ggml_cpy   (ctx0, x, ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_state, n_ctx)) },
+        { "cpy perm", ggml_cpy  (ctx0,
+                ggml_permute(ctx0, ggml_reshape_3d(ctx0, x, n_state/8, 8, n_ctx), 0, 2, 1, 3),
+                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/8, n_ctx, 8)) },
+    };
+
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_threads);
+
+    double tsum_1 = 0.0;
+    double tsum_n = 0.0;
+
+    for (const auto & c : cases) {
+        double t[2] = { 0.0, 0.0 };
+        int n_tasks = 1;
+
+        for (int k = 0; k < 2; ++k) {
+            struct ggml_cgraph gf = ggml_build_forward(c.t);
+
+            gf.n_threads = k == 0 ? 1 : n_threads;
+            gf.pool      = pool;
+
+            // heat-up
+            ggml_graph_compute(ctx0, &gf);
+
+            int    n    = 0;
+            double tsum = 0.0;
+
+            while (tsum < 0.2 || n < 3) {
+                const int64_t t0 = ggml_time_us();
+
+                ggml_graph_compute(ctx0, &gf);
+
+                const int64_t t1 = ggml_time_us();
+
+                tsum += (t1 - t0)*1e-6;
+                n++;
+            }
+
+            t[k] = 1e3*tsum/n;
+
+            if (k == 1) {
+                n_tasks = gf.nodes[gf.n_nodes - 1]->n_tasks;
+            }
+        }
+
+        tsum_1 += t[0];
+        tsum_n += t[1];
+
+        snprintf(strbuf, sizeof(strbuf), "ggml_elementwise: %-8s %5d x %5d: 1 thread %7.3f ms, %2d threads %7.3f ms (n_tasks = %2d), speed-up %5.2fx\n",
+                c.name, (int) c.t->ne[0], (int) (c.t->ne[1]*c.t->ne[2]*c.t->ne[3]), t[0], n_threads, t[1], n_tasks, t[0]/t[1]);
+        s += strbuf;
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "ggml_elementwise: total: 1 thread %7.3f ms, %2d threads %7.3f ms, speed-up %5.2fx\n",
+            tsum_1, n_threads, tsum_n, tsum_1/tsum_n);
+    s += strbuf;
+
+    ggml_threadpool_free(pool);
+    ggml_free(ctx0);
+
+    return s.c_str();
+}
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+WHISPER_API int whisper_bench_memory(int n_threads) {
+    const char * str = whisper_bench_memory_str(n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-        // will be populated a bit later
-        probs.resize(n_logits);
-        logprobs.resize(n_logits);
-    }
+WHISPER_API const char * whisper_bench_memory_str(int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    // apply logit filters here
-    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
-    {
-        // suppress blank
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L388-L390
-        if (params.suppress_blank) {
-            if (is_initial) {
-                logits[vocab.token_eot]           = -INFINITY;
-                logits[vocab.token_to_id.at(" ")] = -INFINITY;
-            }
-        }
+    struct model_desc {
+        const char * name;
+        e_model      type;
+        int          n_state;
+        int          n_head;
+        int          n_layer;
+        int          mb_old; // scratch buffers + the larger of the encode and decode buffers, before the graphs were planned
+    };
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
+    const model_desc models[] = {
+        { "tiny",   MODEL_TINY,    384,  6,  4,  38 },
+        { "base",   MODEL_BASE,    512,  8,  6,  46 },
+        { "small",  MODEL_SMALL,   768, 12, 12,  71 },
+        { "medium", MODEL_MEDIUM, 1024, 16, 24,  98 },
+        { "large",  MODEL_LARGE,  1280, 20, 32, 127 },
+    };
 
-        // suppress sot and solm tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_solm] = -INFINITY;
+    snprintf(strbuf, sizeof(strbuf), "%s: compute buffer of a state with 1 decoder, %d threads\n", __func__, n_threads);
+    s += strbuf;
 
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
+    for (const model_desc & m : models) {
+        // the graphs only need the shapes of the weights, so the model is created from its hparams without any data
+        whisper_context * ctx = new whisper_context;
 
-        if (params.logits_filter_callback) {
-            params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
+        ctx->wtype = GGML_TYPE_F16;
+        ctx->itype = GGML_TYPE_F16;
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_non_speech_tokens) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
+        auto & hparams = ctx->model.hparams;
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
-        }
+        hparams.n_vocab       = 51865;
+        hparams.n_audio_state = m.n_state;
+        hparams.n_audio_head  = m.n_head;
+        hparams.n_audio_layer = m.n_layer;
+        hparams.n_text_state  = m.n_state;
+        hparams.n_text_head   = m.n_head;
+        hparams.n_text_layer  = m.n_layer;
+        hparams.ftype         = 1;
 
-        // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
-        // https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L414-L424
-        {
-            const bool last_was_timestamp        = tokens_cur.size() > 0 && tokens_cur.back().id >= vocab.token_beg;
-            const bool penultimate_was_timestamp = tokens_cur.size() < 2 || tokens_cur[tokens_cur.size() - 2].id >= vocab.token_beg;
+        ctx->model.type = m.type;
+        ctx->vocab.n_vocab = hparams.n_vocab;
 
-            //fprintf(stderr, "last_was_timestamp=%d penultimate_was_timestamp=%d\n", last_was_timestamp, penultimate_was_timestamp);
+        {
+            struct ggml_init_params params;
+            params.mem_size   = (15 + 15*hparams.n_audio_layer + 24*hparams.n_text_layer)*256;
+            params.mem_buffer = nullptr;
+            params.no_alloc   = true;
 
-            if (last_was_timestamp) {
-                if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
-                }
-            }
+            ctx->model.ctx = ggml_init(params);
         }
 
-        // the initial timestamp cannot be larger than max_initial_ts
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial && params.max_initial_ts > 0.0f) {
-            const float precision = float(WHISPER_CHUNK_SIZE)/ctx.model.hparams.n_audio_ctx;
-            const int   tid0      = std::round(params.max_initial_ts/precision);
+        whisper_model_init_tensors(ctx->model, ctx->wtype, ctx->itype);
 
-            for (int i = vocab.token_beg + tid0 + 1; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
+        // ggml_graph_alloc() plans the tensors without data, so the weights need some - the graphs are only measured
+        // and never computed, so they can all share one buffer
+        size_t size_max = 0;
+        for (const auto & kv : ctx->model.tensors) {
+            size_max = std::max(size_max, ggml_nbytes(kv.second));
         }
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+        ctx->model.buf = new std::vector<uint8_t>(size_max);
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
-            }
+        for (const auto & kv : ctx->model.tensors) {
+            kv.second->data = ctx->model.buf->data();
         }
 
-        // populate the logprobs array (log_softmax)
-        {
-            const float logit_max = *std::max_element(logits.begin(), logits.end());
-            float logsumexp = 0.0f;
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logsumexp += expf(logits[i] - logit_max);
-                }
-            }
-            logsumexp = logf(logsumexp) + logit_max;
+        // the encoder weights of a loaded model are packed, which needs less of the work buffer
+        if (!ggml_cpu_has_blas()) {
+            whisper_model_pack_weights(ctx->model);
+        }
 
-            for (int i = 0; i < n_logits; ++i) {
-                if (logits[i] > -INFINITY) {
-                    logprobs[i] = logits[i] - logsumexp;
-                } else {
-                    logprobs[i] = -INFINITY;
-                }
-            }
+        ctx->state = whisper_init_state(ctx);
+        if (ctx->state == nullptr) {
+            snprintf(strbuf, sizeof(strbuf), "%-6s: FAILED to create the state\n", m.name);
+            s += strbuf;
+            whisper_free(ctx);
+            continue;
         }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+        size_t mem_encode = 0;
+        size_t mem_decode = 0;
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+        const size_t mem = whisper_state_alloc_size(*ctx, *ctx->state, 1, n_threads, &mem_encode, &mem_decode);
 
-            //fprintf(stderr, "timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+        const double mb     = mem/1024.0/1024.0;
+        const double mb_old = m.mb_old;
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            }
-        }
-    }
+        snprintf(strbuf, sizeof(strbuf), "%-6s: encode %7.2f MB, decode %7.2f MB, peak %7.2f MB - before %3d MB, %5.1f%% less%s\n",
+                m.name, mem_encode/1024.0/1024.0, mem_decode/1024.0/1024.0, mb, m.mb_old,
+                100.0*(mb_old - mb)/mb_old, mb < mb_old ? "" : " FAILED");
+        s += strbuf;
 
-    // compute probs
-    {
-        for (int i = 0; i < n_logits; ++i) {
-            if (logits[i] == -INFINITY) {
-                probs[i] = 0.0f;
-            } else {
-                probs[i] = expf(logprobs[i]);
-            }
-        }
+        whisper_free(ctx);
     }
 
-#if 0
-    // print first 100 logits - token string : logit
-    for (int i = 0; i < 100; i++) {
-        const auto token   = vocab.id_to_token.at(i);
-        const auto prob    = probs[i];
-        const auto logit   = logits[i];
-        const auto logprob = logprobs[i];
-        printf("%s : prob=%9.5f logit=%9.5f logprob=%9.5f\n", token.c_str(), prob, logit, logprob);
-    }
+    return s.c_str();
+}
 
-    // "And", "and", " And", " and"
-    printf("logits[\"and\"]  = %f\n", logits[vocab.token_to_id.at("and")]);
-    printf("logits[\"And\"]  = %f\n", logits[vocab.token_to_id.at("And")]);
-    printf("logits[\" and\"] = %f\n", logits[vocab.token_to_id.at(" and")]);
-    printf("logits[\" And\"] = %f\n", logits[vocab.token_to_id.at(" And")]);
-    printf("logits[\" so\"]  = %f\n", logits[vocab.token_to_id.at(" so")]);
+WHISPER_API int whisper_bench_audio_ctx(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    fputs(whisper_bench_audio_ctx_str(ctx, samples, n_samples, n_threads), stderr);
+    return 0;
+}
 
-    printf("logprobs[\"and\"]  = %f\n", logprobs[vocab.token_to_id.at("and")]);
-    printf("logprobs[\"And\"]  = %f\n", logprobs[vocab.token_to_id.at("And")]);
-    printf("logprobs[\" and\"] = %f\n", logprobs[vocab.token_to_id.at(" and")]);
-    printf("logprobs[\" And\"] = %f\n", logprobs[vocab.token_to_id.at(" And")]);
-    printf("logprobs[\" so\"]  = %f\n", logprobs[vocab.token_to_id.at(" so")]);
+WHISPER_API const char * whisper_bench_audio_ctx_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    printf("probs[\"and\"]  = %f\n", probs[vocab.token_to_id.at("and")]);
-    printf("probs[\"And\"]  = %f\n", probs[vocab.token_to_id.at("And")]);
-    printf("probs[\" and\"] = %f\n", probs[vocab.token_to_id.at(" and")]);
-    printf("probs[\" And\"] = %f\n", probs[vocab.token_to_id.at(" And")]);
-    printf("probs[\" so\"]  = %f\n", probs[vocab.token_to_id.at(" so")]);
-#endif
-}
+    ggml_time_init();
 
-static whisper_token_data whisper_sample_token(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                       bool   best) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return s.c_str();
+    }
 
-    const auto & vocab = ctx.vocab;
+    std::string text[2];
+    double      t_ms[2];
 
-    const auto & probs    = decoder.probs;
-    const auto & logprobs = decoder.logprobs;
+    for (int k = 0; k < 2; ++k) {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-    const int n_logits = vocab.n_vocab;
+        params.n_threads      = n_threads;
+        params.print_progress = false;
+        params.audio_ctx_auto = k == 1;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+        // heat-up
+        whisper_full_with_state(ctx, state, params, samples, n_samples);
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+        const int n_runs = 3;
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_runs; ++i) {
+            if (whisper_full_with_state(ctx, state, params, samples, n_samples) != 0) {
+                fprintf(stderr, "%s: failed to process audio\n", __func__);
+                break;
             }
         }
 
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
-    }
+        const int64_t t1 = ggml_time_us();
 
-    if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+        t_ms[k] = (t1 - t0)*1e-3/n_runs;
+
+        const int n_segments = whisper_full_n_segments_from_state(state);
+        for (int i = 0; i < n_segments; ++i) {
+            text[k] += whisper_full_get_segment_text_from_state(state, i);
         }
-    } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
 
-        result.id   = dist(state.rng);
-        result.p    = probs[result.id];
-        result.plog = logprobs[result.id];
+        // the text can be longer than strbuf, so it is appended directly
+        snprintf(strbuf, sizeof(strbuf), "audio_ctx: %-4s (%4d): %8.1f ms, text: '",
+                k == 0 ? "full" : "auto",
+                state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx),
+                t_ms[k]);
+        s += strbuf;
+        s += text[k];
+        s += "'\n";
     }
 
-    if (result.id >= vocab.token_beg) {
-        result.tid = result.id;
-        result.pt  = result.p;
-    }
+    snprintf(strbuf, sizeof(strbuf), "audio_ctx: %4.2f s of audio, speed-up %5.2fx, text %s\n",
+            (float) n_samples/WHISPER_SAMPLE_RATE, t_ms[0]/t_ms[1], text[0] == text[1] ? "matches" : "differs");
+    s += strbuf;
 
-    state.n_sample++;
+    whisper_free_state(state);
 
-    return result;
+    return s.c_str();
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
-            whisper_context & ctx,
-              whisper_state & state,
-      const whisper_decoder & decoder,
-                        int   k) {
-    const auto & vocab = ctx.vocab;
-
-    const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
-    const auto & logprobs = decoder.logprobs;
-
-    const int n_logits = vocab.n_vocab;
-
-    auto & logits_id = state.logits_id;
+// reference for whisper_bench_pcm_to_mel(): the mel spectrogram with a direct DFT in double precision,
+// with the same windowing, folding and normalization as log_mel_spectrogram()
+static void log_mel_spectrogram_ref(const float * samples, int n_samples, int fft_size, int fft_step, const whisper_filters & filters, whisper_mel & mel) {
+    const int n_fft = fft_size/2 + 1;
 
-    logits_id.clear();
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id.push_back({ logits[i], i });
+    std::vector<double> hann(fft_size);
+    std::vector<double> cos_t(fft_size);
+    std::vector<double> sin_t(fft_size);
+    for (int i = 0; i < fft_size; i++) {
+        hann[i]  = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
+        cos_t[i] = cos((2.0*M_PI*i)/(fft_size));
+        sin_t[i] = sin((2.0*M_PI*i)/(fft_size));
     }
 
-    std::partial_sort(
-            logits_id.begin(),
-            logits_id.begin() + k, logits_id.end(),
-            [](const std::pair<double, whisper_token> & a, const std::pair<double, whisper_token> & b) {
-                return a.first > b.first;
-            });
-
-    std::vector<whisper_token_data> result;
-    result.reserve(k);
-
-    whisper_token tid = vocab.token_beg;
+    mel.n_mel = filters.n_mel;
+    mel.n_len = n_samples/fft_step;
+    mel.data.resize(mel.n_mel*mel.n_len);
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    std::vector<double> frame(fft_size);
+    std::vector<double> power(n_fft);
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    for (int i = 0; i < mel.n_len; i++) {
+        for (int j = 0; j < fft_size; j++) {
+            frame[j] = i*fft_step + j < n_samples ? hann[j]*samples[i*fft_step + j] : 0.0;
+        }
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
+        for (int k = 0; k < n_fft; k++) {
+            double re = 0.0;
+            double im = 0.0;
+            for (int j = 0; j < fft_size; j++) {
+                re += frame[j]*cos_t[(k*j) % fft_size];
+                im -= frame[j]*sin_t[(k*j) % fft_size];
             }
+            power[k] = (k > 0 && k < fft_size/2 ? 2.0 : 1.0)*(re*re + im*im);
+        }
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
+        for (int j = 0; j < mel.n_mel; j++) {
+            double sum = 0.0;
+            for (int k = 0; k < n_fft; k++) {
+                sum += power[k]*filters.data[j*n_fft + k];
             }
-        }
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
+            mel.data[j*mel.n_len + i] = log10(std::max(sum, 1e-10));
+        }
     }
 
-    for (int i = 0; i < k; ++i) {
-        const auto id = logits_id[i].second;
+    const float mmax = *std::max_element(mel.data.begin(), mel.data.end()) - 8.0;
+    for (auto & v : mel.data) {
+        v = (std::max(v, mmax) + 4.0)/4.0;
+    }
+}
 
-        result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, 0.0f, });
+int whisper_bench_pcm_to_mel(struct whisper_context * ctx, int n_threads) {
+    const char * str = whisper_bench_pcm_to_mel_str(ctx, n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-        if (result[i].id >= vocab.token_beg) {
-            result[i].tid = result[i].id;
-            result[i].pt  = result[i].p;
-        }
-    }
+WHISPER_API const char * whisper_bench_pcm_to_mel_str(struct whisper_context * ctx, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    state.n_sample++;
+    ggml_time_init();
 
-    return result;
-}
+    // 30 s of a chirp, a few harmonics and some noise, at speech-like levels
+    const int n_samples = 30*WHISPER_SAMPLE_RATE;
 
-// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
-static void whisper_sequence_score(
-        const struct whisper_full_params & params,
-                        whisper_sequence & sequence) {
-    if (sequence.result_len == 0) {
-        return;
-    }
+    std::vector<float> pcm(n_samples);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> noise(0.0f, 0.01f);
 
-    double result = 0.0f;
+        for (int i = 0; i < n_samples; i++) {
+            const double t = (double) i/WHISPER_SAMPLE_RATE;
+            const double f = 100.0 + 100.0*t;
 
-    for (int i = 0; i < sequence.result_len; ++i) {
-        result += sequence.tokens[i].plog;
+            pcm[i] = 0.2*sin(2.0*M_PI*f*t) + 0.05*sin(2.0*M_PI*3*f*t) + 0.02*sin(2.0*M_PI*1000.0*t)*(i % 8000 < 4000) + noise(rng);
+        }
     }
 
-    sequence.sum_logprobs = result;
-    sequence.avg_logprobs = result/sequence.result_len;
+    // only the mel spectrogram of the state is used, so there is no need for the KV caches of whisper_init_state()
+    whisper_state * state = new whisper_state;
+
+    const int n_runs = 10;
 
-    double penalty = sequence.result_len;
+    for (int nth : { 1, n_threads }) {
+        // heat-up, builds the FFT plan
+        whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, nth);
 
-    if (params.length_penalty > 0.0f) {
-        penalty = pow((5.0 + penalty)/6.0, params.length_penalty);
-    }
+        const int64_t t0 = ggml_time_us();
 
-    sequence.score = result/penalty;
+        for (int i = 0; i < n_runs; i++) {
+            whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, nth);
+        }
 
-    // compute the entropy of the sequence of the last 32 tokens
-    {
-        const int n = 32;
+        const int64_t t1 = ggml_time_us();
 
-        int cnt = 0;
-        double entropy = 0.0f;
+        snprintf(strbuf, sizeof(strbuf), "pcm_to_mel: %4.1f s of audio, %2d threads: %8.3f ms\n", (float) n_samples/WHISPER_SAMPLE_RATE, nth, (t1 - t0)*1e-3/n_runs);
+        s += strbuf;
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
+        if (n_threads <= 1) {
+            break;
         }
+    }
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+    // compare against the double precision reference
+    {
+        whisper_mel mel_ref;
 
-            //WHISPER_PRINT_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        const int64_t t0 = ggml_time_us();
+        log_mel_spectrogram_ref(pcm.data(), n_samples, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters, mel_ref);
+        const int64_t t1 = ggml_time_us();
+
+        const whisper_mel & mel = state->mel;
+
+        double max_err = mel.data.size() == mel_ref.data.size() ? 0.0 : 1e20;
+        double sum_err = 0.0;
+        for (size_t i = 0; i < mel.data.size() && i < mel_ref.data.size(); i++) {
+            const double err = fabs(mel.data[i] - mel_ref.data[i]);
+            max_err  = std::max(max_err, err);
+            sum_err += err;
         }
 
-        sequence.entropy = entropy;
+        // the mel values are log10 of the power over 4, so 1e-3 is a relative power error of about 1%
+        const double tolerance = 1e-3;
+
+        snprintf(strbuf, sizeof(strbuf), "pcm_to_mel: reference %8.3f ms, max abs diff %.3e, mean abs diff %.3e, tolerance %.0e: %s\n",
+                (t1 - t0)*1e-3, max_err, sum_err/std::max<size_t>(1, mel.data.size()), tolerance, max_err <= tolerance ? "ok" : "FAILED");
+        s += strbuf;
     }
+
+    delete state;
+
+    return s.c_str();
 }
 
-int whisper_full_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    // clear old results
-    auto & result_all = state->result_all;
+int whisper_bench_encoder_batch(struct whisper_context * ctx, int n_threads, int max_batch, int audio_ctx) {
+    const char * str = whisper_bench_encoder_batch_str(ctx, n_threads, max_batch, audio_ctx);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-    result_all.clear();
+WHISPER_API const char * whisper_bench_encoder_batch_str(struct whisper_context * ctx, int n_threads, int max_batch, int audio_ctx) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    // compute log mel spectrogram
-    if (params.speed_up) {
-        if (whisper_pcm_to_mel_phase_vocoder_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
-            return -1;
-        }
-    } else {
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
-        }
-    }
+    ggml_time_init();
 
-    // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+    max_batch = std::max(1, max_batch);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            fprintf(stderr, "%s: failed to auto-detect language\n", __func__);
-            return -3;
+    // a different 30 s chirp per utterance
+    const int n_samples = 30*WHISPER_SAMPLE_RATE;
+
+    std::vector<whisper_state *> states;
+    std::vector<int>             offsets(max_batch, 0);
+
+    for (int ib = 0; ib < max_batch; ++ib) {
+        std::vector<float> pcm(n_samples);
+        for (int i = 0; i < n_samples; i++) {
+            const double t = (double) i/WHISPER_SAMPLE_RATE;
+            const double f = 100.0 + 20.0*ib + 50.0*t;
+
+            pcm[i] = 0.2*sin(2.0*M_PI*f*t);
         }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
 
-        fprintf(stderr, "%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-    }
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            break;
+        }
+        states.push_back(state);
 
-    if (params.token_timestamps) {
-        state->t_beg    = 0;
-        state->t_last   = 0;
-        state->tid_last = 0;
-        state->energy = get_signal_energy(samples, n_samples, 32);
+        state->exp_n_audio_ctx = audio_ctx;
+
+        whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, n_threads);
     }
 
-    const int seek_start = params.offset_ms/10;
-    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
+    whisper_encoder_batcher * batcher = whisper_encoder_batcher_init(ctx, (int) states.size(), 0, n_threads);
 
-    // if length of spectrogram is less than 1s (100 samples), then return
-    // basically don't process anything that is less than 1s
-    // see issue #39: https://github.com/ggerganov/whisper.cpp/issues/39
-    if (seek_end < seek_start + (params.speed_up ? 50 : 100)) {
-        return 0;
-    }
+    // the features of each utterance encoded on its own
+    std::vector<std::vector<float>> ref(states.size());
+    for (size_t ib = 0; ib < states.size(); ++ib) {
+        whisper_encode_batch(batcher, &states[ib], &offsets[ib], 1);
 
-    // a set of temperatures to use
-    // [ t0, t0 + delta, t0 + 2*delta, ..., < 1.0f + 1e-6f ]
-    std::vector<float> temperatures;
-    if (params.temperature_inc > 0.0f) {
-        for (float t = params.temperature; t < 1.0f + 1e-6f; t += params.temperature_inc) {
-            temperatures.push_back(t);
+        ggml_tensor * k = states[ib]->kv_cross.k;
+        for (int i = 0; i < ggml_nelements(k); i++) {
+            ref[ib].push_back(ggml_get_f32_1d(k, i));
         }
-    } else {
-        temperatures.push_back(params.temperature);
     }
 
-    // initialize the decoders
-    int n_decoders = 1;
+    double t_ms_1 = 0.0;
 
-    switch (params.strategy) {
-        case WHISPER_SAMPLING_GREEDY:
-            {
-                n_decoders = params.greedy.best_of;
-            } break;
-        case WHISPER_SAMPLING_BEAM_SEARCH:
-            {
-                n_decoders = std::max(params.greedy.best_of, params.beam_search.beam_size);
-            } break;
-    };
+    for (int n_batch = 1; batcher != nullptr; n_batch = std::min(2*n_batch, (int) states.size())) {
+        // heat-up
+        whisper_encode_batch(batcher, states.data(), offsets.data(), n_batch);
 
-    n_decoders = std::max(1, n_decoders);
+        const int n_runs = 3;
 
-    // TAGS: WHISPER_DECODER_INIT
-    for (int j = 1; j < n_decoders; j++) {
-        auto & decoder = state->decoders[j];
+        const int64_t t0 = ggml_time_us();
 
-        if (decoder.kv_self.ctx == nullptr) {
-            decoder.kv_self = state->decoders[0].kv_self;
-            if (!kv_cache_reinit(decoder.kv_self)) {
-                fprintf(stderr, "%s: kv_cache_reinit() failed for self-attention, decoder %d\n", __func__, j);
-                return -4;
-            }
+        for (int i = 0; i < n_runs; i++) {
+            whisper_encode_batch(batcher, states.data(), offsets.data(), n_batch);
+        }
 
-            WHISPER_PRINT_DEBUG("%s: initialized self-attention kv cache, decoder %d\n", __func__, j);
+        const int64_t t1 = ggml_time_us();
 
-            decoder.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+        const double t_ms = (t1 - t0)*1e-3/n_runs;
+        if (n_batch == 1) {
+            t_ms_1 = t_ms;
+        }
 
-            decoder.probs.resize   (ctx->vocab.n_vocab);
-            decoder.logits.resize  (ctx->vocab.n_vocab);
-            decoder.logprobs.resize(ctx->vocab.n_vocab);
+        double max_diff = 0.0;
+        for (int ib = 0; ib < n_batch; ++ib) {
+            ggml_tensor * k = states[ib]->kv_cross.k;
+            for (int i = 0; i < ggml_nelements(k); i++) {
+                max_diff = std::max(max_diff, (double) fabs(ggml_get_f32_1d(k, i) - ref[ib][i]));
+            }
         }
-    }
 
-    // the accumulated text context so far
-    auto & prompt_past = state->prompt_past;
-    if (params.no_context) {
-        prompt_past.clear();
-    }
+        snprintf(strbuf, sizeof(strbuf), "encoder batch: %2d x %4d frames, %2d threads: %9.1f ms per batch, %7.2f utterances/s, %5.2fx, max diff %.3e: %s\n",
+                n_batch, whisper_encoder_n_ctx(*ctx, *states[0]), n_threads, t_ms, 1e3*n_batch/t_ms, t_ms_1*n_batch/t_ms, max_diff, max_diff <= 1e-3 ? "ok" : "FAILED");
+        s += strbuf;
 
-    // prepend the prompt tokens to the prompt_past
-    if (params.prompt_tokens && params.prompt_n_tokens > 0) {
-        // parse tokens from the pointer
-        for (int i = 0; i < params.prompt_n_tokens; i++) {
-            prompt_past.push_back(params.prompt_tokens[i]);
+        if (n_batch == (int) states.size()) {
+            break;
         }
-        std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        fprintf(stderr, "%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
+    whisper_encoder_batcher_free(batcher);
 
-    // these tokens determine the task that will be performed
-    std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
-    if (whisper_is_multilingual(ctx)) {
-        const int lang_id = whisper_lang_id(params.language);
-        state->lang_id = lang_id;
-        prompt_init.push_back(whisper_token_lang(ctx, lang_id));
-        if (params.translate) {
-            prompt_init.push_back(whisper_token_translate());
-        } else {
-            prompt_init.push_back(whisper_token_transcribe());
-        }
+    for (auto * state : states) {
+        whisper_free_state(state);
     }
 
-    int progress_prev = 0;
-    int progress_step = 5;
-
-    int seek = seek_start;
+    return s.c_str();
+}
 
-    std::vector<whisper_token> prompt;
-    prompt.reserve(whisper_n_text_ctx(ctx));
+int whisper_bench_beam_search(struct whisper_context * ctx, int n_threads, int n_tokens) {
+    const char * str = whisper_bench_beam_search_str(ctx, n_threads, n_tokens);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-    // beam-search helpers
-    struct kv_buf {
-        std::vector<uint8_t> k;
-        std::vector<uint8_t> v;
-    };
+WHISPER_API const char * whisper_bench_beam_search_str(struct whisper_context * ctx, int n_threads, int n_tokens) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-    std::vector<kv_buf> kv_bufs;
+    ggml_time_init();
 
-    struct beam_candidate {
-        int decoder_idx;
-        int seek_delta;
+    const auto & hparams = ctx->model.hparams;
 
-        bool has_ts;
+    const int n_vocab = hparams.n_vocab;
 
-        whisper_sequence sequence;
-    };
+    n_tokens = std::max(1, std::min(n_tokens, hparams.n_text_ctx/2));
 
-    std::vector<beam_candidate> beam_candidates;
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return s.c_str();
+    }
 
-    // main loop
-    while (true) {
-        const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
-        while (progress_cur >= progress_prev + progress_step) {
-            progress_prev += progress_step;
-            if (params.print_progress) {
-                fprintf(stderr, "%s: progress = %3d%%\n", __func__, progress_prev);
-            }
-        }
+    // 30 s chirp
+    {
+        const int n_samples = 30*WHISPER_SAMPLE_RATE;
 
-        // of only 1 second left, then stop
-        if (seek + 100 >= seek_end) {
-            break;
-        }
+        std::vector<float> pcm(n_samples);
+        for (int i = 0; i < n_samples; i++) {
+            const double t = (double) i/WHISPER_SAMPLE_RATE;
+            const double f = 100.0 + 50.0*t;
 
-        if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
-                fprintf(stderr, "%s: encoder_begin_callback returned false - aborting\n", __func__);
-                break;
-            }
+            pcm[i] = 0.2*sin(2.0*M_PI*f*t);
         }
 
-        // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads)) {
-            fprintf(stderr, "%s: failed to encode\n", __func__);
-            return -6;
-        }
+        whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, n_threads);
+        whisper_encode_internal(*ctx, *state, 0, n_threads);
+    }
 
-        // if there is a very short audio segment left to process, we remove any past prompt since it tends
-        // to confuse the decoder and often make it repeat or hallucinate stuff
-        if (seek > seek_start && seek + 500 >= seek_end) {
-            prompt_past.clear();
-        }
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx), whisper_token_beg(ctx) };
 
-        int best_decoder_id = 0;
+    // size of the K and V rows of one token in all layers
+    const double kv_token_bytes = 2.0*hparams.n_text_layer*state->kv_pages.k->nb[1];
 
-        for (int it = 0; it < (int) temperatures.size(); ++it) {
-            const float t_cur = temperatures[it];
+    const int n_beam_max = 8;
 
-            int n_decoders_cur = 1;
+    std::vector<whisper_kv_seq>             kv_bufs(n_beam_max);
+    std::vector<std::vector<whisper_token>> history(n_beam_max);
+    std::vector<std::vector<whisper_token>> history_new(n_beam_max);
+    std::vector<std::vector<float>>         logits(n_beam_max);
 
-            switch (params.strategy) {
-                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        }
-                    } break;
-                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                    {
-                        if (t_cur > 0.0f) {
-                            n_decoders_cur = params.greedy.best_of;
-                        } else {
-                            n_decoders_cur = params.beam_search.beam_size;
-                        }
-                    } break;
-            };
+    for (int n_beam = 1; n_beam <= n_beam_max; ++n_beam) {
+        for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+            kv_seq_release(state->kv_pages, state->decoders[j].kv_self);
+        }
 
-            n_decoders_cur = std::max(1, n_decoders_cur);
+        kv_seq_release(state->kv_pages, state->prompt_cache.kv);
 
-            WHISPER_PRINT_DEBUG("\n%s: decoding with %d decoders, temperature = %.2f\n", __func__, n_decoders_cur, t_cur);
+        // one more sequence for the check below
+        if (state->kv_pages.n_pages < (n_beam + 1)*((hparams.n_text_ctx + WHISPER_KV_PAGE_SIZE - 1)/WHISPER_KV_PAGE_SIZE)) {
+            if (!kv_pages_init(hparams, state->kv_pages, ctx->itype, hparams.n_text_ctx, n_beam + 1)) {
+                break;
+            }
+        }
 
-            // TAGS: WHISPER_DECODER_INIT
-            for (int j = 0; j < n_decoders_cur; ++j) {
-                auto & decoder = state->decoders[j];
+        // the prompt is decoded once and shared by all beams
+        whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, n_threads);
+        state->decoders[0].kv_self.n = prompt.size();
 
-                decoder.kv_self.n = 0;
+        for (int j = 0; j < n_beam; ++j) {
+            kv_seq_share(state->kv_pages, state->decoders[j].kv_self, state->decoders[0].kv_self);
 
-                decoder.sequence.tokens.clear();
-                decoder.sequence.result_len       = 0;
-                decoder.sequence.sum_logprobs_all = 0.0;
-                decoder.sequence.sum_logprobs     = -INFINITY;
-                decoder.sequence.avg_logprobs     = -INFINITY;
-                decoder.sequence.entropy          = 0.0;
-                decoder.sequence.score            = -INFINITY;
+            history[j] = prompt;
+            logits[j]  = state->logits;
+        }
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+        const int64_t n_cow_0 = state->kv_pages.n_cow;
 
-                decoder.failed    = false;
-                decoder.completed = false;
-                decoder.has_ts    = false;
-            }
+        const int64_t t0 = ggml_time_us();
 
-            // init prompt and kv cache for the current iteration
-            // run whisper_decoder() only for decoder 0 and copy the results for the other decoders
-            {
-                prompt.clear();
+        for (int i = 0; i < n_tokens; ++i) {
+            // reorder the beams the way a beam search does - every step, each beam continues one of the best half of
+            // the previous beams
+            for (int j = 0; j < n_beam; ++j) {
+                kv_seq_share(state->kv_pages, kv_bufs[j], state->decoders[j].kv_self);
+            }
 
-                // if we have already generated some text, use it as a prompt to condition the next generation
-                if (!prompt_past.empty() && t_cur < 0.5f && params.n_max_text_ctx > 0) {
-                    int n_take = std::min(std::min(params.n_max_text_ctx, whisper_n_text_ctx(ctx)/2), int(prompt_past.size()));
+            for (int j = 0; j < n_beam; ++j) {
+                const int src = (i + j) % ((n_beam + 1)/2);
 
-                    prompt = { whisper_token_prev(ctx) };
-                    prompt.insert(prompt.begin() + 1, prompt_past.end() - n_take, prompt_past.end());
-                }
+                kv_seq_share(state->kv_pages, state->decoders[j].kv_self, kv_bufs[src]);
 
-                // init new transcription with sot, language (opt) and task tokens
-                prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
+                // the best token of the source beam
+                const float * lsrc = logits[src].data();
 
-                // print the prompt
-                WHISPER_PRINT_DEBUG("\n\n");
-                for (int i = 0; i < (int) prompt.size(); i++) {
-                    WHISPER_PRINT_DEBUG("%s: prompt[%d] = %s\n", __func__, i, ctx->vocab.id_to_token.at(prompt[i]).c_str());
-                }
-                WHISPER_PRINT_DEBUG("\n\n");
+                history_new[j] = history[src];
+                history_new[j].push_back(std::max_element(lsrc, lsrc + n_vocab) - lsrc);
+            }
 
-                if (!whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, params.n_threads)) {
-                    fprintf(stderr, "%s: failed to decode\n", __func__);
-                    return -7;
-                }
+            for (int j = 0; j < n_beam; ++j) {
+                kv_seq_release(state->kv_pages, kv_bufs[j]);
+                history[j].swap(history_new[j]);
+            }
 
-                {
-                    const int64_t t_start_sample_us = ggml_time_us();
+            for (int j = 0; j < n_beam; ++j) {
+                auto & decoder = state->decoders[j];
 
-                    whisper_process_logits(*ctx, *state, params, state->decoders[0], t_cur);
+                whisper_decode_internal(*ctx, *state, decoder, &history[j].back(), 1, decoder.kv_self.n, n_threads);
+                decoder.kv_self.n++;
 
-                    state->decoders[0].kv_self.n += prompt.size();
+                logits[j] = state->logits;
+            }
+        }
 
-                    for (int j = 1; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+        const int64_t t1 = ggml_time_us();
 
-                        memcpy(decoder.kv_self.k->data, state->decoders[0].kv_self.k->data, ggml_nbytes(decoder.kv_self.k));
-                        memcpy(decoder.kv_self.v->data, state->decoders[0].kv_self.v->data, ggml_nbytes(decoder.kv_self.v));
+        const double t_ms   = (t1 - t0)*1e-3/n_tokens;
+        const double kv_cow = (state->kv_pages.n_cow - n_cow_0)*kv_token_bytes/n_tokens;
 
-                        decoder.kv_self.n += prompt.size();
+        // a beam search that copies the whole KV cache of each beam to a buffer and back on every token
+        const double kv_copy = n_beam > 1 ? 2.0*n_beam*hparams.n_text_ctx*kv_token_bytes : 0.0;
 
-                        memcpy(decoder.probs.data(), state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(), state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
-                    }
+        int n_pages_used = 0;
+        for (int p = 0; p < state->kv_pages.n_pages; ++p) {
+            n_pages_used += state->kv_pages.refs[p] > 0;
+        }
 
-                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                }
+        // check the last logits of each beam against decoding its tokens from scratch
+        double max_diff = 0.0;
+        for (int j = 0; j < n_beam; ++j) {
+            whisper_kv_seq & seq = state->decoders[n_beam_max].kv_self;
+
+            whisper_decode_internal(*ctx, *state, state->decoders[n_beam_max], history[j].data(), history[j].size(), 0, n_threads);
+            kv_seq_release(state->kv_pages, seq);
+
+            for (int k = 0; k < n_vocab; ++k) {
+                max_diff = std::max(max_diff, (double) fabs(state->logits[k] - logits[j][k]));
             }
+        }
 
-            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-                const int64_t t_start_sample_us = ggml_time_us();
+        snprintf(strbuf, sizeof(strbuf), "beam search: beam %d, %2d threads: %8.2f ms per token (%6.2f ms per beam), KV copied %8.1f kB per token (%9.1f kB with full copies), %3d pages, max diff %.3e: %s\n",
+                n_beam, n_threads, t_ms, t_ms/n_beam, kv_cow/1024.0, kv_copy/1024.0, n_pages_used, max_diff, max_diff <= 1e-2 ? "ok" : "FAILED");
+        s += strbuf;
+    }
 
-                // store the KV caches of all decoders when doing beam-search
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    kv_bufs.resize(n_decoders_cur);
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+    whisper_free_state(state);
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+    return s.c_str();
+}
 
-                        kv_bufs[j].k.resize(ggml_nbytes(decoder.kv_self.k));
-                        kv_bufs[j].v.resize(ggml_nbytes(decoder.kv_self.v));
+int whisper_bench_decoder_batch(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens) {
+    const char * str = whisper_bench_decoder_batch_str(ctx, n_threads, n_decoders, n_tokens);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-                        memcpy(kv_bufs[j].k.data(), decoder.kv_self.k->data, kv_bufs[j].k.size());
-                        memcpy(kv_bufs[j].v.data(), decoder.kv_self.v->data, kv_bufs[j].v.size());
-                    }
+WHISPER_API const char * whisper_bench_decoder_batch_str(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                    beam_candidates.clear();
-                }
+    ggml_time_init();
 
-                // generate new sequence candidates for each decoder
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+    const auto & hparams = ctx->model.hparams;
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+    const int n_vocab = hparams.n_vocab;
 
-                    switch (params.strategy) {
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                            {
-                                if (t_cur < 1e-6f) {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, true));
-                                } else {
-                                    decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, *state, decoder, false));
-                                }
+    n_decoders = std::max(1, std::min(n_decoders, WHISPER_MAX_DECODERS));
+    n_tokens   = std::max(1, std::min(n_tokens, hparams.n_text_ctx/2));
 
-                                decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                            } break;
-                        case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                            {
-                                const auto tokens_new = whisper_sample_token_topk(*ctx, *state, decoder, params.beam_search.beam_size);
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return s.c_str();
+    }
 
-                                for (const auto & token : tokens_new) {
-                                    beam_candidates.push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence });
-                                    beam_candidates.back().sequence.tokens.push_back(token);
-                                    beam_candidates.back().sequence.sum_logprobs_all += token.plog;
+    if (!whisper_state_reserve_decoders(*ctx, *state, n_decoders)) {
+        whisper_free_state(state);
+        return s.c_str();
+    }
 
-                                    //WHISPER_PRINT_DEBUG("%s: beam candidate: %s (%f, %f)\n", __func__, ctx->vocab.id_to_token.at(token.id).c_str(), token.plog, beam_candidates.back().sequence.sum_logprobs_all);
-                                }
-                            } break;
-                    };
-                }
+    // 30 s chirp
+    {
+        const int n_samples = 30*WHISPER_SAMPLE_RATE;
 
-                // for beam-search, choose the top candidates and update the KV caches
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
-                    });
+        std::vector<float> pcm(n_samples);
+        for (int i = 0; i < n_samples; i++) {
+            const double t = (double) i/WHISPER_SAMPLE_RATE;
+            const double f = 100.0 + 50.0*t;
 
-                    uint32_t cur_c = 0;
+            pcm[i] = 0.2*sin(2.0*M_PI*f*t);
+        }
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+        whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, n_threads);
+        whisper_encode_internal(*ctx, *state, 0, n_threads);
+    }
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
-                        }
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx), whisper_token_beg(ctx) };
 
-                        auto & cur = beam_candidates[cur_c++];
+    std::vector<whisper_decoder *> decoders(n_decoders);
+    for (int j = 0; j < n_decoders; ++j) {
+        decoders[j] = &state->decoders[j];
+    }
 
-                        while (beam_candidates.size() > cur_c && beam_candidates[cur_c].sequence.sum_logprobs_all == cur.sequence.sum_logprobs_all && i > 0) {
-                            ++cur_c;
-                        }
+    std::vector<whisper_kv_seq>     kv_bufs(n_decoders);
+    std::vector<std::vector<float>> logits(n_decoders);
+    std::vector<std::vector<float>> logits_ref(n_decoders);
 
-                        decoder.sequence   = cur.sequence;
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
+    // the decoder that each decoder continues and its next token, for each step
+    // chosen when decoding one decoder at a time, and repeated when decoding them in batches
+    std::vector<int>           src   (n_tokens*n_decoders);
+    std::vector<whisper_token> tokens(n_tokens*n_decoders);
 
-                        memcpy(decoder.kv_self.k->data, kv_bufs[cur.decoder_idx].k.data(), kv_bufs[cur.decoder_idx].k.size());
-                        memcpy(decoder.kv_self.v->data, kv_bufs[cur.decoder_idx].v.data(), kv_bufs[cur.decoder_idx].v.size());
+    std::vector<std::pair<float, whisper_token>> logits_id(n_vocab);
 
-                        WHISPER_PRINT_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
-                                __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
-                    }
-                }
+    // the k-th most likely token of a decoder
+    auto token_kth = [&](const std::vector<float> & l, int k) {
+        for (int t = 0; t < n_vocab; ++t) {
+            logits_id[t] = { l[t], t };
+        }
 
-                // update the decoder state
-                // - check if the sequence is completed
-                // - check if the sequence is failed
-                // - update sliding window based on timestamp tokens
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+        std::nth_element(logits_id.begin(), logits_id.begin() + k, logits_id.end(), std::greater<std::pair<float, whisper_token>>());
 
-                    if (decoder.completed || decoder.failed) {
-                        continue;
-                    }
+        return logits_id[k].second;
+    };
 
-                    auto & has_ts     = decoder.has_ts;
-                    auto & failed     = decoder.failed;
-                    auto & completed  = decoder.completed;
-                    auto & seek_delta = decoder.seek_delta;
-                    auto & result_len = decoder.sequence.result_len;
+    for (int beam = 0; beam < 2; ++beam) {
+        double t_ms[2] = { 0.0, 0.0 };
 
-                    {
-                        const auto & token = decoder.sequence.tokens.back();
+        for (int batched = 0; batched < 2; ++batched) {
+            for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+                kv_seq_release(state->kv_pages, state->decoders[j].kv_self);
+            }
 
-                        // timestamp token - update sliding window
-                        if (token.id > whisper_token_beg(ctx)) {
-                            const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+            // the prompt is decoded once and shared by all decoders
+            whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, n_threads);
+            state->decoders[0].kv_self.n = prompt.size();
 
-                            // do not allow to go back in time
-                            if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                                failed = true; // TODO: maybe this is not a failure ?
-                                continue;
-                            }
+            for (int j = 0; j < n_decoders; ++j) {
+                kv_seq_share(state->kv_pages, state->decoders[j].kv_self, state->decoders[0].kv_self);
 
-                            seek_delta = seek_delta_new;
-                            result_len = i + 1;
-                            has_ts = true;
-                        }
+                logits[j] = state->logits;
+            }
 
-#ifdef WHISPER_DEBUG
-                        {
-                            const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token.at(token.tid) : "[?]";
-                            WHISPER_PRINT_DEBUG("%s: id = %3d, decoder = %d, token = %6d, p = %6.3f, ts = %10s, %6.3f, result_len = %4d '%s'\n",
-                                    __func__, i, j, token.id, token.p, tt.c_str(), token.pt, result_len, ctx->vocab.id_to_token.at(token.id).c_str());
-                        }
-#endif
+            for (int i = 0; i < n_tokens; ++i) {
+                int           * src_cur    = src.data()    + i*n_decoders;
+                whisper_token * tokens_cur = tokens.data() + i*n_decoders;
 
-                        // end of segment
-                        if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                           (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + 100 >= seek_end)      // end of audio reached
-                           ) {
-                            if (result_len == 0) {
-                                if (seek + seek_delta + 100 >= seek_end) {
-                                    result_len = i + 1;
-                                } else {
-                                    failed = true;
-                                    continue;
-                                }
-                            }
+                if (!batched) {
+                    // best_of: each decoder continues its own sequence, starting with a different token
+                    // beam search: each beam continues one of the best half of the previous beams, with the next best token
+                    // of that beam
+                    const int n_src = beam ? (n_decoders + 1)/2 : n_decoders;
 
-                            if (params.single_segment) {
-                                result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            }
+                    for (int j = 0; j < n_decoders; ++j) {
+                        src_cur[j] = beam ? (i + j) % n_src : j;
 
-                            completed = true;
-                            continue;
-                        }
+                        tokens_cur[j] = token_kth(logits[src_cur[j]], beam ? j/n_src : (i == 0 ? j : 0));
+                    }
+                }
 
-                        // TESTS: if no tensors are loaded, it means we are running tests
-                        if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
-                            completed = true;
-                            continue;
-                        }
+                if (beam) {
+                    for (int j = 0; j < n_decoders; ++j) {
+                        kv_seq_share(state->kv_pages, kv_bufs[j], decoders[j]->kv_self);
                     }
 
-                    // sometimes, the decoding can get stuck in a repetition loop
-                    // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                        failed = true;
-                        continue;
+                    for (int j = 0; j < n_decoders; ++j) {
+                        kv_seq_share(state->kv_pages, decoders[j]->kv_self, kv_bufs[src_cur[j]]);
+                    }
+
+                    for (int j = 0; j < n_decoders; ++j) {
+                        kv_seq_release(state->kv_pages, kv_bufs[j]);
                     }
                 }
 
-                // check if all decoders have finished (i.e. completed or failed)
-                {
-                    bool completed_all = true;
+                const int n_past = decoders[0]->kv_self.n;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                const int64_t t0 = ggml_time_us();
 
-                        if (decoder.completed || decoder.failed) {
-                            continue;
+                if (batched) {
+                    for (int j0 = 0; j0 < n_decoders; ) {
+                        const int n_batch = std::min(n_decoders - j0, whisper_decode_batch_max(*ctx, 1));
+
+                        whisper_decode_batch_internal(*ctx, *state, decoders.data() + j0, tokens_cur + j0, 1, n_past, n_batch, n_threads);
+
+                        for (int ib = 0; ib < n_batch; ++ib) {
+                            logits[j0 + ib].assign(state->logits.begin() + ib*n_vocab, state->logits.begin() + (ib + 1)*n_vocab);
                         }
 
-                        completed_all = false;
+                        j0 += n_batch;
                     }
+                } else {
+                    for (int j = 0; j < n_decoders; ++j) {
+                        whisper_decode_internal(*ctx, *state, *decoders[j], tokens_cur + j, 1, n_past, n_threads);
 
-                    if (completed_all) {
-                        break;
+                        logits[j] = state->logits;
                     }
                 }
 
-                state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                t_ms[batched] += (ggml_time_us() - t0)*1e-3;
 
-                // obtain logits for the next token
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+                for (int j = 0; j < n_decoders; ++j) {
+                    decoders[j]->kv_self.n++;
+                }
+            }
 
-                    if (decoder.failed || decoder.completed) {
-                        continue;
-                    }
+            if (!batched) {
+                logits_ref.swap(logits);
+            }
+        }
 
-                    decoder.tokens_tmp.resize(1);
-                    decoder.tokens_tmp[0] = decoder.sequence.tokens.back().id;
+        double max_diff = 0.0;
+        for (int j = 0; j < n_decoders; ++j) {
+            for (int k = 0; k < n_vocab; ++k) {
+                max_diff = std::max(max_diff, (double) fabs(logits[j][k] - logits_ref[j][k]));
+            }
+        }
 
-                    //WHISPER_PRINT_DEBUG("%s: decoder %d: token %d, kv_self.n %d, seek_delta %d\n", __func__, j, decoder.tokens_tmp[0], decoder.kv_self.n, decoder.seek_delta);
+        const double n_decoded = (double) n_tokens*n_decoders;
 
-                    if (!whisper_decode_internal(*ctx, *state, decoder, decoder.tokens_tmp.data(), decoder.tokens_tmp.size(), decoder.kv_self.n, params.n_threads)) {
-                        fprintf(stderr, "%s: failed to decode\n", __func__);
-                        return -8;
-                    }
+        snprintf(strbuf, sizeof(strbuf), "decoder batch: %-11s %2d decoders, %2d threads: %8.1f tokens/s one by one, %8.1f tokens/s batched, %5.2fx, max diff %.3e: %s\n",
+                beam ? "beam search" : "best_of", n_decoders, n_threads, 1e3*n_decoded/t_ms[0], 1e3*n_decoded/t_ms[1], t_ms[0]/t_ms[1], max_diff, max_diff <= 1e-3 ? "ok" : "FAILED");
+        s += strbuf;
+    }
 
-                    {
-                        const int64_t t_start_sample_us = ggml_time_us();
+    whisper_free_state(state);
 
-                        whisper_process_logits(*ctx, *state, params, decoder, t_cur);
+    return s.c_str();
+}
 
-                        ++decoder.kv_self.n;
+int whisper_bench_decoder_graph(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens) {
+    const char * str = whisper_bench_decoder_graph_str(ctx, n_threads, n_decoders, n_tokens);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-                        state->t_sample_us += ggml_time_us() - t_start_sample_us;
-                    }
-                }
-            }
+WHISPER_API const char * whisper_bench_decoder_graph_str(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-            // rank the resulting sequences and select the best one
-            {
-                double best_score = -INFINITY;
+    ggml_time_init();
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
-                    auto & decoder = state->decoders[j];
+    const auto & hparams = ctx->model.hparams;
+
+    const int n_vocab = hparams.n_vocab;
+
+    n_decoders = std::max(1, std::min(n_decoders, WHISPER_MAX_DECODERS));
+    n_tokens   = std::max(1, std::min(n_tokens, hparams.n_text_ctx/2));
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return s.c_str();
+    }
+
+    if (!whisper_state_reserve_decoders(*ctx, *state, n_decoders)) {
+        whisper_free_state(state);
+        return s.c_str();
+    }
+
+    // 30 s chirp
+    {
+        const int n_samples = 30*WHISPER_SAMPLE_RATE;
+
+        std::vector<float> pcm(n_samples);
+        for (int i = 0; i < n_samples; i++) {
+            const double t = (double) i/WHISPER_SAMPLE_RATE;
+            const double f = 100.0 + 50.0*t;
+
+            pcm[i] = 0.2*sin(2.0*M_PI*f*t);
+        }
+
+        whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), n_samples, n_threads);
+        whisper_encode_internal(*ctx, *state, 0, n_threads);
+    }
 
-                    if (decoder.failed) {
-                        continue;
-                    }
+    const std::vector<whisper_token> prompt = { whisper_token_sot(ctx), whisper_token_beg(ctx) };
 
-                    decoder.sequence.tokens.resize(decoder.sequence.result_len);
-                    whisper_sequence_score(params, decoder.sequence);
+    std::vector<whisper_decoder *> decoders(n_decoders);
+    for (int j = 0; j < n_decoders; ++j) {
+        decoders[j] = &state->decoders[j];
+    }
 
-                    WHISPER_PRINT_DEBUG("%s: decoder %2d: score = %8.5f, result_len = %3d, avg_logprobs = %8.5f, entropy = %8.5f\n",
-                            __func__, j, decoder.sequence.score, decoder.sequence.result_len, decoder.sequence.avg_logprobs, decoder.sequence.entropy);
+    // the tokens of the decoders, the greedy choice of each decoder when the graphs are built for each step, and
+    // repeated with the kept graphs
+    std::vector<whisper_token> tokens(n_tokens*n_decoders);
 
-                    if (decoder.sequence.result_len > 32 && decoder.sequence.entropy < params.entropy_thold) {
-                        WHISPER_PRINT_DEBUG("%s: decoder %2d: failed due to entropy %8.5f < %8.5f\n",
-                                __func__, j, decoder.sequence.entropy, params.entropy_thold);
+    std::vector<float> logits_ref;
 
-                        decoder.failed = true;
-                        state->n_fail_h++;
+    for (int keep = 0; keep < 2; ++keep) {
+        state->keep_decode_graphs = keep;
 
-                        continue;
-                    }
+        for (int j = 0; j < WHISPER_MAX_DECODERS; ++j) {
+            kv_seq_release(state->kv_pages, state->decoders[j].kv_self);
+        }
 
-                    if (best_score < decoder.sequence.score) {
-                        best_score = decoder.sequence.score;
-                        best_decoder_id = j;
-                    }
-                }
+        // the prompt is decoded once and shared by all decoders
+        whisper_decode_internal(*ctx, *state, state->decoders[0], prompt.data(), prompt.size(), 0, n_threads);
+        state->decoders[0].kv_self.n = prompt.size();
 
-                WHISPER_PRINT_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
-            }
+        for (int j = 1; j < n_decoders; ++j) {
+            kv_seq_share(state->kv_pages, state->decoders[j].kv_self, state->decoders[0].kv_self);
+        }
 
-            // was the decoding successful for the current temperature?
-            {
-                bool success = true;
+        std::vector<float> logits(n_decoders*n_vocab);
+        for (int j = 0; j < n_decoders; ++j) {
+            std::copy(state->logits.begin(), state->logits.end(), logits.begin() + j*n_vocab);
+        }
 
-                const auto & decoder = state->decoders[best_decoder_id];
+        const int64_t t_decode_us  = state->t_decode_us;
+        const int64_t t_build_us   = state->t_decode_build_us;
+        const int64_t t_compute_us = state->t_decode_compute_us;
+        const int32_t n_build      = state->n_decode_build;
 
-                if (decoder.failed || decoder.sequence.avg_logprobs < params.logprob_thold) {
-                    success = false;
-                    state->n_fail_p++;
-                }
+        for (int i = 0; i < n_tokens; ++i) {
+            whisper_token * tokens_cur = tokens.data() + i*n_decoders;
 
-                if (success) {
-                    //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
-                    //    WHISPER_PRINT_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
-                    //}
+            if (!keep) {
+                // the decoders start with a different token and continue greedily
+                for (int j = 0; j < n_decoders; ++j) {
+                    const float * l = logits.data() + j*n_vocab;
 
-                    break;
+                    tokens_cur[j] = i == 0 ? j : std::max_element(l, l + n_vocab) - l;
                 }
             }
 
-            WHISPER_PRINT_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
-        }
-
-        // output results through a user-provided callback
-        {
-            const auto & best_decoder = state->decoders[best_decoder_id];
+            const int n_past = decoders[0]->kv_self.n;
 
-            const auto seek_delta = best_decoder.seek_delta;
-            const auto result_len = best_decoder.sequence.result_len;
+            for (int j0 = 0; j0 < n_decoders; ) {
+                const int n_batch = std::min(n_decoders - j0, whisper_decode_batch_max(*ctx, 1));
 
-            const auto & tokens_cur = best_decoder.sequence.tokens;
+                whisper_decode_batch_internal(*ctx, *state, decoders.data() + j0, tokens_cur + j0, 1, n_past, n_batch, n_threads);
 
-            //WHISPER_PRINT_DEBUG("prompt_init.size() = %d, prompt.size() = %d, result_len = %d, seek_delta = %d\n", prompt_init.size(), prompt.size(), result_len, seek_delta);
+                std::copy(state->logits.begin(), state->logits.begin() + n_batch*n_vocab, logits.begin() + j0*n_vocab);
 
-            // update prompt_past
-            prompt_past.clear();
-            if (prompt.front() == whisper_token_prev(ctx)) {
-                prompt_past.insert(prompt_past.end(), prompt.begin() + 1, prompt.end() - prompt_init.size());
+                j0 += n_batch;
             }
 
-            for (int i = 0; i < result_len; ++i) {
-                prompt_past.push_back(tokens_cur[i].id);
+            for (int j = 0; j < n_decoders; ++j) {
+                decoders[j]->kv_self.n++;
             }
+        }
 
-            // store the text from this iteration
-            if (!tokens_cur.empty() && ctx->model.n_loaded > 0) {
-                int  i0 = 0;
-                auto t0 = seek + 2*(tokens_cur.front().tid - whisper_token_beg(ctx));
+        const double n_steps = n_tokens;
+
+        const double t_total   = 1e-3*(state->t_decode_us         - t_decode_us)/n_steps;
+        const double t_build   = 1e-3*(state->t_decode_build_us   - t_build_us)/n_steps;
+        const double t_compute = 1e-3*(state->t_decode_compute_us - t_compute_us)/n_steps;
+
+        // with several threads the rounding of the self-attention depends on how its tokens are split between the
+        // threads, so the padded tokens of a kept graph change the logits a little - less than changing the number of
+        // threads does
+        double max_diff = 0.0;
+        double max_abs  = 0.0;
+        if (keep) {
+            for (int k = 0; k < n_decoders*n_vocab; ++k) {
+                max_diff = std::max(max_diff, (double) fabs(logits[k] - logits_ref[k]));
+                max_abs  = std::max(max_abs,  (double) fabs(logits_ref[k]));
+            }
+        } else {
+            logits_ref.swap(logits);
+        }
 
-                std::string text;
+        snprintf(strbuf, sizeof(strbuf), "decoder graph: %-5s %2d decoders, %2d threads: %4d graphs, per step %7.3f ms build, %7.3f ms compute, %7.3f ms other",
+                keep ? "kept" : "built", n_decoders, n_threads, state->n_decode_build - n_build, t_build, t_compute, t_total - t_build - t_compute);
+        s += strbuf;
 
-                for (int i = 0; i < (int) tokens_cur.size(); i++) {
-                    //printf("%s: %18s %6.3f %18s %6.3f\n", __func__,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].p,
-                    //        ctx->vocab.id_to_token[tokens_cur[i].tid].c_str(), tokens_cur[i].pt);
+        if (keep) {
+            snprintf(strbuf, sizeof(strbuf), ", max diff %.3e of %.1f: %s", max_diff, max_abs, max_diff <= 1e-3*max_abs ? "ok" : "FAILED");
+            s += strbuf;
+        }
 
-                    if (params.print_special == false && tokens_cur[i].id >= whisper_token_eot(ctx)) {
-                    } else {
-                        text += whisper_token_to_str(ctx, tokens_cur[i].id);
-                    }
+        s += "\n";
+    }
 
-                    if (tokens_cur[i].id > whisper_token_beg(ctx) && !params.single_segment) {
-                        const auto t1 = seek + 2*(tokens_cur[i].tid - whisper_token_beg(ctx));
+    whisper_free_state(state);
 
-                        if (!text.empty()) {
-                            const auto tt0 = params.speed_up ? 2*t0 : t0;
-                            const auto tt1 = params.speed_up ? 2*t1 : t1;
+    return s.c_str();
+}
 
-                            if (params.print_realtime) {
-                                if (params.print_timestamps) {
-                                    printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                                } else {
-                                    printf("%s", text.c_str());
-                                    fflush(stdout);
-                                }
-                            }
+int whisper_bench_speculative(struct whisper_context * ctx, struct whisper_context * draft_ctx, const float * samples, int n_samples, int n_threads) {
+    const char * str = whisper_bench_speculative_str(ctx, draft_ctx, samples, n_samples, n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-                            //printf("tt0 = %d, tt1 = %d, text = %s, token = %s, token_id = %d, tid = %d\n", tt0, tt1, text.c_str(), ctx->vocab.id_to_token[tokens_cur[i].id].c_str(), tokens_cur[i].id, tokens_cur[i].tid);
+WHISPER_API const char * whisper_bench_speculative_str(struct whisper_context * ctx, struct whisper_context * draft_ctx, const float * samples, int n_samples, int n_threads) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                            result_all.push_back({ tt0, tt1, text, {} });
-                            for (int j = i0; j <= i; j++) {
-                                result_all.back().tokens.push_back(tokens_cur[j]);
-                            }
+    ggml_time_init();
 
-                            int n_new = 1;
+    whisper_state * state       = whisper_init_state(ctx);
+    whisper_state * draft_state = whisper_init_state(draft_ctx);
+    if (state == nullptr || draft_state == nullptr) {
+        whisper_free_state(state);
+        whisper_free_state(draft_state);
+        return s.c_str();
+    }
 
-                            if (params.token_timestamps) {
-                                whisper_exp_compute_token_level_timestamps(
-                                        *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+    std::vector<whisper_token> tokens_ref;
+    double t_ref_ms = 0.0;
 
-                                if (params.max_len > 0) {
-                                    n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                                }
-                            }
-                            if (params.new_segment_callback) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                            }
-                        }
-                        text = "";
-                        while (i < (int) tokens_cur.size() && tokens_cur[i].id > whisper_token_beg(ctx)) {
-                            i++;
-                        }
-                        i--;
-                        t0 = t1;
-                        i0 = i + 1;
-                    }
-                }
+    const int n_draft_tokens[] = { 0, 2, 4, 8 };
 
-                if (!text.empty()) {
-                    const auto t1 = seek + seek_delta;
+    for (const int n_tokens : n_draft_tokens) {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-                    const auto tt0 = params.speed_up ? 2*t0 : t0;
-                    const auto tt1 = params.speed_up ? 2*t1 : t1;
+        params.n_threads      = n_threads;
+        params.print_progress = false;
 
-                    if (params.print_realtime) {
-                        if (params.print_timestamps) {
-                            printf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
-                        } else {
-                            printf("%s", text.c_str());
-                            fflush(stdout);
-                        }
-                    }
+        // no temperature fallback - the draft model is used only at t = 0
+        params.temperature_inc = 0.0f;
 
-                    result_all.push_back({ tt0, tt1, text, {} });
-                    for (int j = i0; j < (int) tokens_cur.size(); j++) {
-                        result_all.back().tokens.push_back(tokens_cur[j]);
-                    }
+        params.draft.ctx      = n_tokens > 0 ? draft_ctx : nullptr;
+        params.draft.state    = draft_state;
+        params.draft.n_tokens = n_tokens;
 
-                    int n_new = 1;
+        // heat-up
+        whisper_full_with_state(ctx, state, params, samples, n_samples);
 
-                    if (params.token_timestamps) {
-                        whisper_exp_compute_token_level_timestamps(
-                                *ctx, *state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+        state->n_draft          = 0;
+        state->n_draft_accepted = 0;
+        state->t_draft_us       = 0;
 
-                        if (params.max_len > 0) {
-                            n_new = whisper_wrap_segment(*ctx, *state, params.max_len, params.split_on_word);
-                        }
-                    }
-                    if (params.new_segment_callback) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
-                    }
-                }
-            }
+        const int n_runs = 3;
 
-            // update audio window
-            seek += seek_delta;
+        const int64_t t0 = ggml_time_us();
 
-            WHISPER_PRINT_DEBUG("seek = %d, seek_delta = %d\n", seek, seek_delta);
+        for (int i = 0; i < n_runs; ++i) {
+            if (whisper_full_with_state(ctx, state, params, samples, n_samples) != 0) {
+                fprintf(stderr, "%s: failed to process audio\n", __func__);
+                break;
+            }
         }
-    }
-
-    return 0;
-}
 
+        const int64_t t1 = ggml_time_us();
 
-int whisper_full(
-        struct whisper_context * ctx,
-    struct whisper_full_params   params,
-                   const float * samples,
-                           int   n_samples) {
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
-}
+        const double t_ms = (t1 - t0)*1e-3/n_runs;
 
-int whisper_full_parallel(
-        struct whisper_context * ctx,
-        struct whisper_full_params params,
-        const float * samples,
-        int n_samples,
-        int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
-    }
-    int ret = 0;
+        std::vector<whisper_token> tokens;
+        for (const auto & segment : state->result_all) {
+            for (const auto & token : segment.tokens) {
+                tokens.push_back(token.id);
+            }
+        }
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+        if (n_tokens == 0) {
+            tokens_ref = tokens;
+            t_ref_ms   = t_ms;
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+            snprintf(strbuf, sizeof(strbuf), "speculative: no draft:  %8.1f ms, %4d tokens\n", t_ms, (int) tokens.size());
+            s += strbuf;
+            continue;
+        }
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+        snprintf(strbuf, sizeof(strbuf), "speculative: %d tokens: %8.1f ms, speed-up %5.2fx, accepted %5.1f%% of %5d, draft %8.1f ms, tokens %s\n",
+                n_tokens, t_ms, t_ref_ms/t_ms, 100.0*state->n_draft_accepted/std::max(1, state->n_draft), state->n_draft/n_runs,
+                1e-3*state->t_draft_us/n_runs, tokens == tokens_ref ? "match" : "differ - FAILED");
+        s += strbuf;
+    }
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+    whisper_free_state(draft_state);
+    whisper_free_state(state);
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+    return s.c_str();
+}
 
-        auto params_cur = params;
+int whisper_bench_sample(struct whisper_context * ctx, int n_tokens) {
+    const char * str = whisper_bench_sample_str(ctx, n_tokens);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
+}
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+WHISPER_API const char * whisper_bench_sample_str(struct whisper_context * ctx, int n_tokens) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+    ggml_time_init();
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+    whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        return s.c_str();
     }
 
-    {
-        auto params_cur = params;
-
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    const int n_vocab    = ctx->vocab.n_vocab;
+    const int n_decoders = 5;
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    if (!whisper_state_reserve_decoders(*ctx, *state, n_decoders)) {
+        whisper_free_state(state);
+        return s.c_str();
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+    for (int j = 1; j < n_decoders; ++j) {
+        state->decoders[j].probs.resize   (n_vocab);
+        state->decoders[j].logits.resize  (n_vocab);
+        state->decoders[j].logprobs.resize(n_vocab);
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
-
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
-
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-
+    // logits like those of the model: a few likely tokens over a wide tail
+    state->logits.resize(n_decoders*n_vocab);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> tail(-5.0f, 3.0f);
+        std::uniform_int_distribution<int> peak(0, n_vocab - 1);
 
-            // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+        for (int i = 0; i < n_decoders*n_vocab; ++i) {
+            state->logits[i] = tail(rng);
+        }
+        for (int j = 0; j < n_decoders; ++j) {
+            for (int i = 0; i < 8; ++i) {
+                state->logits[j*n_vocab + peak(rng)] = 10.0f - i;
             }
+        }
+    }
 
-            ctx->state->result_all.push_back(std::move(result));
+    // log-softmax against a double precision reference
+    {
+        const float * x = state->logits.data();
+        auto & decoder = state->decoders[0];
 
-            // call the new_segment_callback for each segment
-            if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+        double lse = 0.0;
+        {
+            const double max = *std::max_element(x, x + n_vocab);
+            for (int i = 0; i < n_vocab; ++i) {
+                lse += exp(x[i] - max);
             }
+            lse = log(lse) + max;
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
+        const int n_runs = 1000;
 
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
+        const int64_t t0 = ggml_time_us();
 
-        whisper_free_state(states[i]);
-    }
+        for (int i = 0; i < n_runs; ++i) {
+            ggml_log_soft_max_f32(n_vocab, decoder.logprobs.data(), decoder.probs.data(), x);
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        double max_diff = 0.0;
+        double sum      = 0.0;
+        for (int i = 0; i < n_vocab; ++i) {
+            // relative to the magnitude of the log-probability, with float rounding of the logits
+            max_diff = std::max(max_diff, fabs(decoder.logprobs[i] - (x[i] - lse))/(1.0 + fabs(x[i] - lse)));
+            max_diff = std::max(max_diff, fabs(decoder.probs[i] - exp(x[i] - lse)));
+            sum += decoder.probs[i];
+        }
 
-    // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+        const bool ok = max_diff < 1e-5 && fabs(sum - 1.0) < 1e-4;
 
-    // print information about the audio boundaries
-    fprintf(stderr, "\n");
-    fprintf(stderr, "%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        fprintf(stderr, "%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+        snprintf(strbuf, sizeof(strbuf), "sample: log_softmax %6d logits: %7.2f us, max diff %.2e, sum of probs %.6f: %s\n",
+                n_vocab, (double) (t1 - t0)/n_runs, max_diff, sum, ok ? "ok" : "FAILED");
+        s += strbuf;
     }
-    fprintf(stderr, "%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
-    return ret;
-}
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-int whisper_full_n_segments_from_state(struct whisper_state * state) {
-    return state->result_all.size();
-}
+    params.suppress_non_speech_tokens = true;
 
-int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->state->result_all.size();
-}
+    const char * names[] = { "greedy", "t = 0.4", "beam 5" };
 
-int whisper_full_lang_id_from_state(struct whisper_state * state) {
-    return state->lang_id;
-}
+    for (int mode = 0; mode < 3; ++mode) {
+        const int n_dec = mode == 2 ? n_decoders : 1;
 
-int whisper_full_lang_id(struct whisper_context * ctx) {
-    return ctx->state->lang_id;
-}
+        for (int j = 0; j < n_dec; ++j) {
+            auto & decoder = state->decoders[j];
 
-int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t0;
-}
+            decoder.sequence.tokens.clear();
+            decoder.has_ts     = false;
+            decoder.seek_delta = 0;
+        }
 
-int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t0;
-}
+        state->t_sample_us = 0;
+        state->n_sample    = 0;
 
-int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].t1;
-}
+        for (int i = 0; i < n_tokens; ++i) {
+            const int64_t t_start_sample_us = ggml_time_us();
 
-int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].t1;
-}
+            for (int j = 0; j < n_dec; ++j) {
+                auto & decoder = state->decoders[j];
 
-const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].text.c_str();
-}
+                // start over from time to time - the timestamp rules depend on the sequence
+                if (decoder.sequence.tokens.size() >= 64) {
+                    decoder.sequence.tokens.clear();
+                    decoder.has_ts = false;
+                }
 
-const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].text.c_str();
-}
+                whisper_process_logits(*ctx, *state, params, decoder, mode == 1 ? 0.4f : 0.0f, j);
 
-int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
-    return state->result_all[i_segment].tokens.size();
-}
+                whisper_token_data token;
+                if (mode == 2) {
+                    whisper_sample_token_topk(*ctx, *state, decoder, n_decoders, state->tokens_topk);
+                    token = state->tokens_topk[j];
+                } else {
+                    token = whisper_sample_token(*ctx, *state, decoder, mode == 0);
+                }
 
-int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->state->result_all[i_segment].tokens.size();
-}
+                decoder.sequence.tokens.push_back(token);
+                if (token.id > ctx->vocab.token_beg) {
+                    decoder.has_ts = true;
+                }
+            }
 
-const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+            state->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
 
-const char* whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->state->result_all[i_segment].tokens[i_token].id].c_str();
-}
+        snprintf(strbuf, sizeof(strbuf), "sample: %-8s %2d decoders: %7.2f us per token (t_sample_us)\n",
+                names[mode], n_dec, (double) state->t_sample_us/(n_tokens*n_dec));
+        s += strbuf;
+    }
 
-whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].id;
-}
+    whisper_free_state(state);
 
-whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].id;
+    return s.c_str();
 }
 
-struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token];
-}
+// the std::regex tokenizer that tokenize() replaced - a reference for whisper_bench_tokenize()
+static std::vector<whisper_vocab::id> whisper_tokenize_ref(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::string> words;
 
-struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token];
-}
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
 
-float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
-    return state->result_all[i_segment].tokens[i_token].p;
-}
+        std::regex re(pat);
+        std::smatch m;
 
-float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->state->result_all[i_segment].tokens[i_token].p;
-}
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
 
-// =================================================================================================
+    // find the longest tokens that form the words:
+    // (unlike the original loop, which also took the byte after each match as a token of its own)
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : words) {
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            while (j > i && vocab.token_to_id.find(word.substr(i, j-i)) == vocab.token_to_id.end()) {
+                --j;
+            }
+            if (j > i) {
+                tokens.push_back(vocab.token_to_id.at(word.substr(i, j-i)));
+                i = j;
+            } else {
+                ++i;
+            }
+        }
+    }
 
-//
-// Temporary interface needed for exposing ggml interface
-// Will be removed in the future when ggml becomes a separate library
-//
+    return tokens;
+}
 
-WHISPER_API int whisper_bench_memcpy(int n_threads) {
-    fputs(whisper_bench_memcpy_str(n_threads), stderr);
-    return 0;
+int whisper_bench_tokenize(struct whisper_context * ctx, const char * text) {
+    const char * str = whisper_bench_tokenize_str(ctx, text);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
 }
 
-WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
+WHISPER_API const char * whisper_bench_tokenize_str(struct whisper_context * ctx, const char * text) {
     static std::string s;
     s = "";
     char strbuf[256];
 
     ggml_time_init();
 
-    size_t n    = 50;
-    size_t arr  = n_threads > 0 ? 1024 : n_threads; // trick to avoid compiler optimizations
+    const auto & vocab = ctx->vocab;
 
-    // 1 GB array
-    const size_t size = arr*1024llu*1024llu;
+    // a few sentences with contractions, numbers, punctuation, runs of whitespace and UTF-8
+    std::string sample = text ? text :
+        "And so, my fellow Americans: ask not what your country can do for you - ask what you can do for your country. "
+        "We'll meet at 10:30 on the 3rd of May, 2023 (that's 1,234 days from now), won't we?  I'd say   it's \"fine\"...\n"
+        "Le café coûte 2,50 € ; ça va ?\tJa, natürlich!  Ты знаешь, что это такое?\r\n"
+        "She said: 'I've got it', and they'd already left; you're right, I'm sure. \n\n";
 
-    char * src = (char *) malloc(size);
-    char * dst = (char *) malloc(size);
+    // the initial prompt of a turn (a few hundred bytes) and a long text
+    std::string texts[2] = { sample, sample };
+    while (texts[1].size() < 16*1024) {
+        texts[1] += sample;
+    }
 
-    for (size_t i = 0; i < size; i++) src[i] = i;
+    std::vector<whisper_token> tokens(texts[1].size() + 1);
 
-    memcpy(dst, src, size); // heat-up
+    for (int k = 0; k < 2; ++k) {
+        const std::string & cur = texts[k];
 
-    double tsum = 0.0;
+        const int n_runs = k == 0 ? 1000 : 10;
+
+        // trie
+        int n_tokens = 0;
 
-    for (size_t i = 0; i < n; i++) {
         const int64_t t0 = ggml_time_us();
 
-        memcpy(dst, src, size);
+        for (int i = 0; i < n_runs; ++i) {
+            n_tokens = tokenize(vocab, cur.c_str(), tokens.data(), tokens.size());
+        }
 
         const int64_t t1 = ggml_time_us();
 
-        tsum += (t1 - t0)*1e-6;
+        // std::regex reference
+        std::vector<whisper_vocab::id> tokens_ref;
 
-        src[0] = rand();
-    }
+        const int n_runs_ref = std::max(1, n_runs/10);
 
-    snprintf(strbuf, sizeof(strbuf), "memcpy: %.2f GB/s\n", (double) (n*size)/(tsum*1024llu*1024llu*1024llu));
-    s += strbuf;
+        for (int i = 0; i < n_runs_ref; ++i) {
+            tokens_ref = whisper_tokenize_ref(vocab, cur);
+        }
 
-    // needed to prevent the compile from optimizing the memcpy away
-    {
-        double sum = 0.0;
+        const int64_t t2 = ggml_time_us();
 
-        for (size_t i = 0; i < size; i++) sum += dst[i];
+        const bool ok = n_tokens == (int) tokens_ref.size() && std::equal(tokens_ref.begin(), tokens_ref.end(), tokens.begin());
 
-        snprintf(strbuf, sizeof(strbuf), "sum:    %s %f\n", sum == -536870910.00 ? "ok" : "error", sum);
+        const double mbs     = 1e-6*cur.size()*n_runs/(1e-6*(t1 - t0));
+        const double mbs_ref = 1e-6*cur.size()*n_runs_ref/(1e-6*(t2 - t1));
+
+        snprintf(strbuf, sizeof(strbuf), "tokenize: %6d bytes, %5d tokens: %8.2f MB/s (%8.2f us), std::regex %8.2f MB/s, speed-up %6.1fx, tokens %s\n",
+                (int) cur.size(), n_tokens, mbs, (double) (t1 - t0)/n_runs, mbs_ref, mbs/mbs_ref, ok ? "match" : "differ - FAILED");
         s += strbuf;
     }
 
-    free(src);
-    free(dst);
-
     return s.c_str();
 }
 
-WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads) {
-    fputs(whisper_bench_ggml_mul_mat_str(n_threads), stderr);
-    return 0;
+int whisper_bench_prompt_cache(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    const char * str = whisper_bench_prompt_cache_str(ctx, samples, n_samples, n_threads);
+    fputs(str, stderr);
+    return strstr(str, "FAILED") != nullptr ? 1 : 0;
 }
 
-WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
+WHISPER_API const char * whisper_bench_prompt_cache_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
     static std::string s;
     s = "";
     char strbuf[256];
 
     ggml_time_init();
 
-    const int n_max = 128;
+    // the text tokens of a previous turn
+    std::vector<whisper_token> prompt(200);
+    {
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<int> dist(0, ctx->vocab.token_eot - 1);
 
-    const std::vector<size_t> sizes = {
-        64, 128, 256, 512, 1024, 2048, 4096,
-    };
+        for (auto & token : prompt) {
+            token = dist(rng);
+        }
+    }
 
-    const size_t N_max = sizes.back();
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
 
-    // a: N*N*sizeof(float)
-    // b: N*N*sizeof(float)
-    // c: N*N*sizeof(float)
-    // when F16 is used, there is an extra work buffer of size N*N*sizeof(float)
-    std::vector<char> buf(4llu*N_max*N_max*sizeof(float) + 4*256);
+    params.n_threads      = n_threads;
+    params.print_progress = false;
+    params.no_context     = true;
 
-    for (size_t i = 0; i < buf.size(); i++) buf[i] = i;
+    params.prompt_tokens   = prompt.data();
+    params.prompt_n_tokens = prompt.size();
 
-    for (int j = 0; j < (int) sizes.size(); j++) {
-        int n_fp16 = 0;
-        int n_fp32 = 0;
+    // every pass fails, so that each window is decoded at all temperatures
+    params.temperature_inc = 0.2f;
+    params.logprob_thold   = 0.0f;
 
-        // GFLOPS/s
-        double s_fp16 = 0.0;
-        double s_fp32 = 0.0;
+    std::vector<whisper_token> tokens_ref;
+    double t_ref_ms = 0.0;
 
-        const size_t N = sizes[j];
+    for (const bool keep : { false, true }) {
+        // a new state for each, so that both sample with the same random numbers
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            break;
+        }
 
-        for (int k = 0; k < 2; ++k) {
-            const ggml_type wtype = k == 0 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+        state->keep_prompt = keep;
 
-            double & s = k == 0 ? s_fp16 : s_fp32;
-            int    & n = k == 0 ? n_fp16   : n_fp32;
+        const int64_t t0 = ggml_time_us();
 
-            struct ggml_init_params gparams = {
-                /*.mem_size   =*/ buf.size(),
-                /*.mem_buffer =*/ buf.data(),
-            };
+        if (whisper_full_with_state(ctx, state, params, samples, n_samples) != 0) {
+            fprintf(stderr, "%s: failed to process audio\n", __func__);
+        }
 
-            struct ggml_context * ctx0 = ggml_init(gparams);
+        const int64_t t1 = ggml_time_us();
 
-            struct ggml_tensor * a = ggml_new_tensor_2d(ctx0, wtype,         N, N);
-            struct ggml_tensor * b = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, N, N);
+        const double t_ms = (t1 - t0)*1e-3;
 
-            struct ggml_tensor * c = ggml_mul_mat(ctx0, a, b);
+        std::vector<whisper_token> tokens;
+        for (const auto & segment : state->result_all) {
+            for (const auto & token : segment.tokens) {
+                tokens.push_back(token.id);
+            }
+        }
 
-            struct ggml_cgraph gf = ggml_build_forward(c);
+        snprintf(strbuf, sizeof(strbuf), "prompt cache: %-8s %8.1f ms, prompts %8.1f ms, %6d tokens decoded, %6d reused, %4d fallbacks",
+                keep ? "kept" : "decoded", t_ms, 1e-3*state->t_prompt_us, state->n_prompt_decoded, state->n_prompt_reused, state->n_fail_p + state->n_fail_h);
+        s += strbuf;
 
-            gf.n_threads = n_threads;
+        if (keep) {
+            snprintf(strbuf, sizeof(strbuf), ", speed-up %5.2fx, tokens %s", t_ref_ms/t_ms, tokens == tokens_ref ? "match" : "differ - FAILED");
+            s += strbuf;
+        } else {
+            tokens_ref = tokens;
+            t_ref_ms   = t_ms;
+        }
 
-            double tsum = 0.0;
+        s += "\n";
 
-            // heat-up
-            ggml_graph_compute(ctx0, &gf);
+        whisper_free_state(state);
+    }
 
-            for (int i = 0; i < n_max; ++i) {
-                const int64_t t0 = ggml_time_us();
+    return s.c_str();
+}
 
-                ggml_graph_compute(ctx0, &gf);
+int whisper_bench_sessions(struct whisper_context * ctx, const float * samples, int n_samples, int n_sessions_max, int latency_slo_ms) {
+    fputs(whisper_bench_sessions_str(ctx, samples, n_samples, n_sessions_max, latency_slo_ms), stderr);
+    return 0;
+}
 
-                const int64_t t1 = ggml_time_us();
+WHISPER_API const char * whisper_bench_sessions_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_sessions_max, int latency_slo_ms) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
 
-                tsum += (t1 - t0)*1e-6;
-                n++;
+    ggml_time_init();
 
-                if (tsum > 1.0 && n >= 3) {
-                    break;
-                }
+    const int n_requests = 4; // per session
+
+    double best_rate = 0.0;
+    int    best_n    = 0;
+
+    for (int n_sessions = 1; n_sessions_max > 0; n_sessions = std::min(2*n_sessions, n_sessions_max)) {
+        whisper_session_params sparams = whisper_session_default_params();
+        sparams.max_sessions = n_sessions;
+
+        whisper_session_manager * manager = whisper_session_manager_init(ctx, sparams);
+        if (manager == nullptr) {
+            break;
+        }
+
+        std::vector<whisper_state *> states;
+        for (int i = 0; i < n_sessions; i++) {
+            whisper_state * state = whisper_session_open(manager);
+            if (state == nullptr) {
+                break;
             }
+            states.push_back(state);
+        }
 
-            ggml_free(ctx0);
+        if ((int) states.size() != n_sessions) {
+            fprintf(stderr, "%s: failed to open %d sessions\n", __func__, n_sessions);
+            whisper_session_manager_free(manager);
+            break;
+        }
+
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+        params.print_progress = false;
 
-            s = ((2.0*N*N*N*n)/tsum)*1e-9;
+        // heat-up
+        whisper_session_full(manager, states[0], params, samples, n_samples);
+
+        std::vector<std::vector<double>> latency_ms(n_sessions);
+        std::atomic<int> n_failed(0);
+
+        const int64_t t0 = ggml_time_us();
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n_sessions; i++) {
+            workers.emplace_back([&, i]() {
+                for (int r = 0; r < n_requests; r++) {
+                    const int64_t t_beg = ggml_time_us();
+                    if (whisper_session_full(manager, states[i], params, samples, n_samples) != 0) {
+                        n_failed++;
+                    }
+                    latency_ms[i].push_back((ggml_time_us() - t_beg)*1e-3);
+                }
+            });
+        }
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        const int64_t t1 = ggml_time_us();
+
+        std::vector<double> latency_all;
+        for (const auto & l : latency_ms) {
+            latency_all.insert(latency_all.end(), l.begin(), l.end());
+        }
+        std::sort(latency_all.begin(), latency_all.end());
+
+        const double p50  = latency_all[(latency_all.size() - 1)/2];
+        const double p95  = latency_all[((latency_all.size() - 1)*95)/100];
+        const double rate = latency_all.size()/((t1 - t0)*1e-6);
+
+        const bool ok = n_failed == 0 && p95 <= latency_slo_ms;
+        if (ok && rate > best_rate) {
+            best_rate = rate;
+            best_n    = n_sessions;
         }
 
-        snprintf(strbuf, sizeof(strbuf), "ggml_mul_mat: %5zu x %5zu: F16 %8.1f GFLOPS (%3d runs) / F32 %8.1f GFLOPS (%3d runs)\n",
-            N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        snprintf(strbuf, sizeof(strbuf), "sessions: %2d, %7.2f transcriptions/s (%7.2f s of audio/s), latency p50 %8.1f ms, p95 %8.1f ms%s\n",
+                n_sessions, rate, rate*n_samples/WHISPER_SAMPLE_RATE, p50, p95,
+                n_failed > 0 ? ", FAILED" : ok ? "" : ", over the SLO");
         s += strbuf;
+
+        whisper_session_manager_free(manager);
+
+        if (n_sessions == n_sessions_max) {
+            break;
+        }
     }
 
+    if (best_n > 0) {
+        snprintf(strbuf, sizeof(strbuf), "sessions: best within the %d ms SLO: %.2f transcriptions/s with %d sessions\n", latency_slo_ms, best_rate, best_n);
+    } else {
+        snprintf(strbuf, sizeof(strbuf), "sessions: no number of sessions meets the %d ms SLO\n", latency_slo_ms);
+    }
+    s += strbuf;
+
     return s.c_str();
 }
 
@@ -4816,6 +9759,16 @@ static float voice_length(const std::string & text) {
     return res;
 }
 
+// sum of the fabs of the signal
+static float get_signal_abs_sum(const float * signal, int n_samples) {
+    float sum = 0;
+    for (int i = 0; i < n_samples; i++) {
+        sum += fabs(signal[i]);
+    }
+
+    return sum;
+}
+
 // average the fabs of the signal
 static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window) {
     const int hw = n_samples_per_half_window;
@@ -4823,13 +9776,10 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
     std::vector<float> result(n_samples);
 
     for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
-            }
-        }
-        result[i] = sum/(2*hw + 1);
+        const int beg = std::max(0, i - hw);
+        const int end = std::min(n_samples, i + hw + 1);
+
+        result[i] = get_signal_abs_sum(signal + beg, end - beg)/(2*hw + 1);
     }
 
     return result;
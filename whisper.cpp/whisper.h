@@ -87,6 +87,19 @@ extern "C" {
         float vlen;        // voice length of the token
     } whisper_token_data;
 
+    // Type of the weight matrices of a model, as stored in the "ftype" field of the model file.
+    // The values match the ones used by the upstream whisper.cpp quantize tool, so that its models can be loaded.
+    // The conv weights are kept in F16 in all but the F32 models, and the biases, norms and positional embeddings in F32.
+    enum whisper_ftype {
+        WHISPER_FTYPE_ALL_F32     = 0,
+        WHISPER_FTYPE_MOSTLY_F16  = 1,
+        WHISPER_FTYPE_MOSTLY_Q4_0 = 2,
+        WHISPER_FTYPE_MOSTLY_Q4_1 = 3,
+        WHISPER_FTYPE_MOSTLY_Q8_0 = 7,
+        WHISPER_FTYPE_MOSTLY_Q5_0 = 8,
+        WHISPER_FTYPE_MOSTLY_Q5_1 = 9,
+    };
+
     typedef struct whisper_model_loader {
         void * context;
 
@@ -102,11 +115,18 @@ extern "C" {
     WHISPER_API struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init(struct whisper_model_loader * loader);
 
+    // Load a model from a file that is already in memory, usually a read-only memory mapping of the model file.
+    // If the file has aligned tensor data (see whisper_model_align()), the weights are used in place instead of being
+    // copied, so loading is almost instant and the pages are shared with other processes that map the same file.
+    // The memory is never written, and must stay valid until whisper_free() is called.
+    WHISPER_API struct whisper_context * whisper_init_from_mapped_buffer(const void * data, size_t size);
+
     // These are the same as the above, but the internal state of the context is not allocated automatically
     // It is the responsibility of the caller to allocate the state using whisper_init_state() (#523)
     WHISPER_API struct whisper_context * whisper_init_from_file_no_state(const char * path_model);
     WHISPER_API struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size);
     WHISPER_API struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader);
+    WHISPER_API struct whisper_context * whisper_init_from_mapped_buffer_no_state(const void * data, size_t size);
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
@@ -114,6 +134,18 @@ extern "C" {
     WHISPER_API void whisper_free      (struct whisper_context * ctx);
     WHISPER_API void whisper_free_state(struct whisper_state * state);
 
+    // Convert a F32 or F16 model file to one with block-quantized weight matrices.
+    // Only the 2D weights are quantized - the conv weights are stored as F16, everything else is copied unchanged.
+    // Prints the size of the model before and after, and the RMS quantization error of the weights.
+    // The output has aligned tensor data, see whisper_model_align().
+    // Returns 0 on success.
+    WHISPER_API int whisper_model_quantize(const char * fname_inp, const char * fname_out, enum whisper_ftype ftype);
+
+    // Rewrite a model file with the data of each tensor aligned in the file, so that whisper_init_from_mapped_buffer()
+    // can use the weights in place. The weights are unchanged. Models written by older versions must be aligned once.
+    // Returns 0 on success.
+    WHISPER_API int whisper_model_align(const char * fname_inp, const char * fname_out);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -178,6 +210,36 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Batched encoder
+    //
+    // Runs the encoder on the log mel spectrograms of several states in one graph, so that the weights are read once
+    // per batch rather than once per utterance. Each state gets its own encoded features, as with whisper_encode_with_state().
+    // All states of a batch must use the same audio context.
+    //
+    // The batcher owns the compute buffers, which grow to the largest batch that it has encoded.
+    // whisper_encoder_batcher_encode() collects the requests of concurrent callers into batches: a batch is encoded
+    // once it is full, or max_wait_ms after its first request arrived.
+
+    struct whisper_encoder_batcher;
+
+    WHISPER_API struct whisper_encoder_batcher * whisper_encoder_batcher_init(struct whisper_context * ctx, int max_batch, int max_wait_ms, int n_threads);
+    WHISPER_API void whisper_encoder_batcher_free(struct whisper_encoder_batcher * batcher);
+
+    // Encode the given states right away, on the calling thread. n_batch must be at most max_batch.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_encoder_batcher * batcher,
+              struct whisper_state * const * states,
+                               const int   * offsets,
+                                       int   n_batch);
+
+    // Queue the state for the next batch and wait until it has been encoded. Thread safe.
+    // Returns 0 on success
+    WHISPER_API int whisper_encoder_batcher_encode(
+            struct whisper_encoder_batcher * batcher,
+                      struct whisper_state * state,
+                                       int   offset);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -258,7 +320,8 @@ extern "C" {
     WHISPER_API int whisper_model_n_text_head  (struct whisper_context * ctx);
     WHISPER_API int whisper_model_n_text_layer (struct whisper_context * ctx);
     WHISPER_API int whisper_model_n_mels       (struct whisper_context * ctx);
-    WHISPER_API int whisper_model_f16          (struct whisper_context * ctx);
+    WHISPER_API int whisper_model_f16          (struct whisper_context * ctx); // true if the weights are F16
+    WHISPER_API int whisper_model_ftype        (struct whisper_context * ctx); // enum whisper_ftype
     WHISPER_API int whisper_model_type         (struct whisper_context * ctx);
 
     // Token logits obtained from the last call to whisper_decode()
@@ -328,7 +391,7 @@ extern "C" {
     struct whisper_full_params {
         enum whisper_sampling_strategy strategy;
 
-        int n_threads;
+        int n_threads;          // 0 = choose automatically from the number of processors
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -353,6 +416,7 @@ extern "C" {
         // note: these can significantly reduce the quality of the output
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        bool audio_ctx_auto;    // size the audio context to the length of the input (overrides audio_ctx)
 
         // tokens to provide to the whisper decoder as initial prompt
         // these are prepended to any existing text context from a previous call
@@ -387,6 +451,15 @@ extern "C" {
             float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
+        // speculative decoding with a smaller draft model that has the same vocabulary (e.g. tiny.en for base.en)
+        // used for greedy decoding at temperature 0: the draft model proposes n_tokens tokens, that the model checks in
+        // one pass instead of one pass per token - the tokens are the same as without the draft model
+        struct {
+            struct whisper_context * ctx;   // the draft model, nullptr - no speculative decoding
+            struct whisper_state   * state; // the state of the draft model, nullptr - the default state of ctx
+            int n_tokens;                   // number of tokens proposed at a time
+        } draft;
+
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
@@ -435,6 +508,14 @@ extern "C" {
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
     WHISPER_API int whisper_full_n_segments_from_state(struct whisper_state * state);
 
+    // The accumulated text context (prompt_past) of the state, used to condition the next whisper_full_with_state()
+    // call when params.no_context is false.
+    // Getting and setting it allows a streaming client to only advance the context when a window of audio is committed,
+    // rather than after every partial transcription of that window.
+    // whisper_full_get_prompt_past_from_state() returns the number of tokens in the context and copies at most n_max of the most recent.
+    WHISPER_API int  whisper_full_get_prompt_past_from_state(struct whisper_state * state, whisper_token * tokens, int n_max);
+    WHISPER_API void whisper_full_set_prompt_past_from_state(struct whisper_state * state, const whisper_token * tokens, int n_tokens);
+
     // Language id associated with the context's default state
     WHISPER_API int whisper_full_lang_id(struct whisper_context * ctx);
 
@@ -474,6 +555,99 @@ extern "C" {
 
     ////////////////////////////////////////////////////////////////////////////
 
+    // Sessions
+    //
+    // Many concurrent transcriptions (e.g. one per audio stream or user) on one loaded model.
+    // Each session is a whisper_state of its own; the model in the context is only read.
+    // The encoder / decoder graphs of all sessions run on a fixed set of shared worker threads: a graph waits for a free
+    // thread pool rather than starting threads of its own, so the machine is not oversubscribed however many sessions run.
+
+    struct whisper_session_manager;
+
+    struct whisper_session_params {
+        int max_sessions;        // maximum number of open sessions
+
+        int n_threads;           // compute threads shared by all sessions, 0 - about the number of physical cores
+        int n_threads_per_graph; // threads used by one encoder / decoder graph, 0 - n_threads split between up to 4 graphs
+
+        size_t mem_budget;       // maximum memory of a session in bytes, 0 - unlimited
+                                 // limits the number of decoders (best_of, beam_size) a session can use
+
+        int encode_max_batch;    // encode the audio of up to this many sessions in one graph, 0 or 1 - no batching
+        int encode_max_wait_ms;  // how long an encoder batch waits for more sessions before it runs
+    };
+
+    WHISPER_API struct whisper_session_params whisper_session_default_params(void);
+
+    // The context must outlive the manager. Returns NULL on failure.
+    WHISPER_API struct whisper_session_manager * whisper_session_manager_init(struct whisper_context * ctx, struct whisper_session_params params);
+    // Closes the sessions that are still open
+    WHISPER_API void whisper_session_manager_free(struct whisper_session_manager * manager);
+
+    // Returns NULL if max_sessions are open already, or if a session does not fit in mem_budget.
+    // Thread safe.
+    WHISPER_API struct whisper_state * whisper_session_open (struct whisper_session_manager * manager);
+    WHISPER_API void                   whisper_session_close(struct whisper_session_manager * manager, struct whisper_state * state);
+
+    // whisper_full_with_state() on a session. Different sessions can run at the same time on different threads.
+    // params.n_threads is ignored, and best_of / beam_size are reduced if needed to stay within mem_budget.
+    // The results are read with the whisper_full_*_from_state() functions.
+    WHISPER_API int whisper_session_full(
+        struct whisper_session_manager * manager,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    // Voice activity detection
+    //
+    // Incremental energy and spectral-flux based endpointing, intended to be run on the capture stream
+    // while recording. Feed it the newly captured samples with whisper_vad_process() and stop recording once
+    // it returns WHISPER_VAD_END_OF_SPEECH or WHISPER_VAD_MAX_LENGTH.
+    //
+    // The state does not reference a whisper_context and does not allocate after whisper_vad_init().
+
+    enum whisper_vad_event {
+        WHISPER_VAD_WAITING,       // no speech detected yet
+        WHISPER_VAD_SPEECH,        // speech in progress
+        WHISPER_VAD_END_OF_SPEECH, // speech followed by at least hangover_ms of silence
+        WHISPER_VAD_MAX_LENGTH,    // max_length_ms of audio has been processed
+    };
+
+    struct whisper_vad_params {
+        int sample_rate;
+
+        int   frame_ms;       // analysis frame length
+        int   calib_ms;       // initial audio used to estimate the noise floor (the quietest frame before speech starts)
+        float energy_thold;   // a frame is speech if its energy is above energy_thold*noise floor
+        float flux_thold;     // ... or if its normalised spectral flux is above flux_thold (and energy is above the floor)
+
+        int min_speech_ms;    // speech must last at least this long before an endpoint can be detected
+        int hangover_ms;      // trailing silence required to end the utterance
+        int max_length_ms;    // hard limit on the utterance length, including any leading silence
+    };
+
+    struct whisper_vad_state;
+
+    WHISPER_API struct whisper_vad_params whisper_vad_default_params(void);
+
+    WHISPER_API struct whisper_vad_state * whisper_vad_init(struct whisper_vad_params params);
+    WHISPER_API void whisper_vad_free (struct whisper_vad_state * state);
+    WHISPER_API void whisper_vad_reset(struct whisper_vad_state * state);
+
+    // Process the next n_samples samples of the stream.
+    // Returns the current whisper_vad_event. Once an end event has been returned, it is returned again until reset.
+    WHISPER_API int whisper_vad_process(struct whisper_vad_state * state, const float * samples, int n_samples);
+
+    // Sample offsets (from the start of the stream) of the first and last speech frames detected so far.
+    // Both are -1 if no speech has been detected.
+    WHISPER_API int64_t whisper_vad_speech_beg(struct whisper_vad_state * state);
+    WHISPER_API int64_t whisper_vad_speech_end(struct whisper_vad_state * state);
+
+    ////////////////////////////////////////////////////////////////////////////
+
     // Temporary helpers needed for exposing ggml interface
 
     WHISPER_API int whisper_bench_memcpy(int n_threads);
@@ -481,6 +655,97 @@ extern "C" {
     WHISPER_API int whisper_bench_ggml_mul_mat(int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
 
+    // Time the two convolutions of the encoder of each model over a 30 s window, with the kernel in rows and packed, and
+    // check them and the short-input path against a double precision convolution
+    WHISPER_API int whisper_bench_ggml_conv_1d(int n_threads);
+    WHISPER_API const char * whisper_bench_ggml_conv_1d_str(int n_threads);
+
+    // Time the fused attention kernel against the unfused matrix multiplications and softmax, for the encoder
+    // self-attention and the beam search cross-attention of each model over the full and shortened audio contexts, and
+    // check it against a double precision softmax
+    WHISPER_API int whisper_bench_ggml_flash_attn(int n_threads);
+    WHISPER_API const char * whisper_bench_ggml_flash_attn_str(int n_threads);
+
+    // Time encoder- and decoder-shaped matrix multiplications with 1 to n_threads_max threads, optionally while
+    // other threads keep all the processors busy, to check how the ggml thread synchronization scales
+    WHISPER_API int whisper_bench_ggml_threads(int n_threads_max, bool with_cpu_hog);
+    WHISPER_API const char * whisper_bench_ggml_threads_str(int n_threads_max, bool with_cpu_hog);
+
+    // Time the elementwise ops of the encoder (bias repeat, add, mul, copies, ...) with base model sizes, with 1 and n_threads threads
+    WHISPER_API int whisper_bench_ggml_elementwise(int n_threads);
+    WHISPER_API const char * whisper_bench_ggml_elementwise_str(int n_threads);
+
+    // Measure the compute buffer of a state for each model size, from tiny to large, with the graphs built from the
+    // hparams of the model without loading its weights, and compare it with the scratch buffers used before
+    WHISPER_API int whisper_bench_memory(int n_threads);
+    WHISPER_API const char * whisper_bench_memory_str(int n_threads);
+
+    // Transcribe the given audio with the full audio context and with audio_ctx_auto, and report the time and text of both
+    WHISPER_API int whisper_bench_audio_ctx(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+    WHISPER_API const char * whisper_bench_audio_ctx_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+
+    // Time whisper_pcm_to_mel() on 30 s of synthetic audio with 1 and n_threads threads, and check the result against a
+    // double precision DFT reference. Returns non-zero if the difference is above the tolerance.
+    WHISPER_API int whisper_bench_pcm_to_mel(struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_pcm_to_mel_str(struct whisper_context * ctx, int n_threads);
+
+    // Time the batched encoder with batches of 1, 2, 4, ... max_batch utterances, report the aggregate throughput and
+    // check the encoded features against encoding each utterance on its own. Returns non-zero if they differ.
+    // audio_ctx is the audio context of the utterances, 0 - the full 30 s window. Short utterances gain the most.
+    WHISPER_API int whisper_bench_encoder_batch(struct whisper_context * ctx, int n_threads, int max_batch, int audio_ctx);
+    WHISPER_API const char * whisper_bench_encoder_batch_str(struct whisper_context * ctx, int n_threads, int max_batch, int audio_ctx);
+
+    // Decode n_tokens tokens with 1 to 8 beams that are reordered after every token like in a beam search, and report
+    // the time per token and the KV cache memory copied per token. The last logits of each beam are checked against
+    // decoding its tokens from scratch. Returns non-zero if they differ.
+    WHISPER_API int whisper_bench_beam_search(struct whisper_context * ctx, int n_threads, int n_tokens);
+    WHISPER_API const char * whisper_bench_beam_search_str(struct whisper_context * ctx, int n_threads, int n_tokens);
+
+    // Decode n_tokens tokens with n_decoders decoders, once one decoder at a time and once with the decoders evaluated
+    // together in batches, and report the tokens/s of both. This is done for sequences that diverge like the candidates
+    // of best_of, and for beams that are reordered after every token like in a beam search. The logits of the two are
+    // checked against each other. Returns non-zero if they differ.
+    WHISPER_API int whisper_bench_decoder_batch(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens);
+    WHISPER_API const char * whisper_bench_decoder_batch_str(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens);
+
+    // Decode n_tokens tokens with n_decoders decoders one token at a time, once building the graph of every step and
+    // once with the graphs that the state keeps for the next steps, and report the time per step spent building graphs,
+    // computing them and elsewhere in the decoder. The logits of the two are checked against each other. Returns non-zero
+    // if they differ.
+    WHISPER_API int whisper_bench_decoder_graph(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens);
+    WHISPER_API const char * whisper_bench_decoder_graph_str(struct whisper_context * ctx, int n_threads, int n_decoders, int n_tokens);
+
+    // Transcribe the given audio with greedy decoding, once without a draft model and once with draft_ctx proposing 2, 4
+    // and 8 tokens at a time (see whisper_full_params.draft), and report the time, the speed-up and the share of the
+    // proposed tokens that were accepted. Returns non-zero if the tokens differ from those decoded without the draft.
+    WHISPER_API int whisper_bench_speculative(struct whisper_context * ctx, struct whisper_context * draft_ctx, const float * samples, int n_samples, int n_threads);
+    WHISPER_API const char * whisper_bench_speculative_str(struct whisper_context * ctx, struct whisper_context * draft_ctx, const float * samples, int n_samples, int n_threads);
+
+    // Process synthetic logits and sample n_tokens tokens with greedy decoding, sampling at t = 0.4 and a beam search
+    // with 5 beams, and report the sample time per token (t_sample_us). The log-softmax is checked against a double
+    // precision reference. Returns non-zero if it differs.
+    WHISPER_API int whisper_bench_sample(struct whisper_context * ctx, int n_tokens);
+    WHISPER_API const char * whisper_bench_sample_str(struct whisper_context * ctx, int n_tokens);
+
+    // Tokenize text (a built-in sample with contractions, numbers and UTF-8 if NULL) as is and repeated to 16 KB, and
+    // report the throughput in MB/s, against the std::regex tokenizer that whisper_tokenize() used to be. Returns
+    // non-zero if the tokens differ.
+    WHISPER_API int whisper_bench_tokenize(struct whisper_context * ctx, const char * text);
+    WHISPER_API const char * whisper_bench_tokenize_str(struct whisper_context * ctx, const char * text);
+
+    // Transcribe the given audio with a prompt of 200 tokens and a logprob threshold that makes every window fall back
+    // to all temperatures, once decoding the prompt in every pass and once taking it from the prompt cache of the state,
+    // and report the time, the part of it spent on the prompts and the prompt tokens decoded and reused. Returns non-zero
+    // if the tokens of the two differ.
+    WHISPER_API int whisper_bench_prompt_cache(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+    WHISPER_API const char * whisper_bench_prompt_cache_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads);
+
+    // Transcribe the given audio over and over with 1, 2, 4, ... n_sessions_max concurrent sessions (greedy decoding,
+    // default session parameters), and report the throughput in transcriptions per second and the latency percentiles.
+    // The best throughput whose p95 latency is within latency_slo_ms is reported at the end.
+    WHISPER_API int whisper_bench_sessions(struct whisper_context * ctx, const float * samples, int n_samples, int n_sessions_max, int latency_slo_ms);
+    WHISPER_API const char * whisper_bench_sessions_str(struct whisper_context * ctx, const float * samples, int n_samples, int n_sessions_max, int latency_slo_ms);
+
 #ifdef __cplusplus
 }
 #endif